@@ -17,8 +17,15 @@ layout(binding = 0) uniform UniformBufferObject {
   mat4 proj;
   mat4 view;
   vec4 lightPos;  // only xyz used, w ignored
+  uvec4 cull;  // Unused. Keeps the same layout as 13inst-ubo.vert.
 } ubo;
 
+// CullOut is unused. It is declared so both pipelines have the same
+// descriptor set layout as 13inst-ubo.vert.
+layout(binding = 1) readonly buffer CullOut {
+  uint word[];
+} cullOut;
+
 // Specify inputs that vary per vertex (read from the vertex buffer).
 // gl_VertexIndex is still defined as the vertex index (0 .. N).
 layout(location = 0) in vec3 inPosition;
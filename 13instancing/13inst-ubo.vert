@@ -24,11 +24,20 @@ layout(location = 3) out vec3 fragLightVec;
 layout(binding = 0) uniform UniformBufferObject {
   mat4 proj;
   mat4 view;
-  vec4 lightPos;  // only xyz used, w is instanceCount
+  vec4 lightPos;  // only xyz used, w ignored
+  // cull.x is where the visible list starts in cullOut.word.
+  // cull.y is the number of instances in each UniformBufferObject.
+  uvec4 cull;
 
   perInst inst[2043];
 } ubo;
 
+// CullOut is written by asset::CullGPU. It holds the draw commands, then the
+// visible list: which instance each gl_InstanceIndex draws.
+layout(binding = 1) readonly buffer CullOut {
+  uint word[];
+} cullOut;
+
 // Specify inputs that vary per vertex (read from the vertex buffer).
 // gl_VertexIndex is still defined as the vertex index (0 .. N).
 layout(location = 0) in vec3 inPosition;
@@ -47,8 +56,7 @@ mat3 q_to_mat3(vec4 rot) {
 }
 
 void main() {
-  uint instCount = uint(ubo.lightPos.w);
-  uint inst = gl_InstanceIndex % instCount;
+  uint inst = cullOut.word[ubo.cull.x + gl_InstanceIndex] % ubo.cull.y;
   mat3 modelview = q_to_mat3(ubo.inst[inst].rot);
   vec3 pos = modelview * inPosition + ubo.inst[inst].loc.xyz;
   gl_Position = ubo.proj * ubo.view * vec4(pos, 1.0);
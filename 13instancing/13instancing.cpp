@@ -17,6 +17,7 @@
 #include <glm/vec4.hpp>
 
 #include "../src/asset/asset.h"
+#include "../src/asset/cullgpu.h"
 #include "13instancing/13inst-buf.vert.h"
 #include "13instancing/13inst-ubo.vert.h"
 #include "13instancing/13instancing.frag.h"
@@ -151,6 +152,18 @@ class Example13 : public BaseApplication {
 
   asset::Library assetLib;
 
+  // cullGPU culls the instances for the UBO method and writes its draw
+  // commands, one per dynamic UBO. There is one for each framebuf.
+  std::vector<std::shared_ptr<asset::CullGPU>> cullGPU;
+  // cullLayout counts the changes to cullDraw and cullCmd. cullLayoutOf is
+  // the cullLayout each cullGPU last got from setInstances.
+  size_t cullLayout{0};
+  std::vector<size_t> cullLayoutOf;
+  VkDrawIndexedIndirectCommand cullTemplate{0, 0, 0, 0, 0};
+  asset::SphereSoA cullSphere;
+  std::vector<uint32_t> cullDraw, cullVisible;
+  std::vector<VkDrawIndexedIndirectCommand> cullCmd;
+
   typedef struct InstanceData {
     glm::vec4 loc;
     glm::vec4 vel;  // velocity
@@ -175,6 +188,8 @@ class Example13 : public BaseApplication {
   size_t activePipe{0};
 
   bool drawWire{false};
+  // guiFramesInFlight starts at 1, like UniformGlue::framesInFlight.
+  int guiFramesInFlight{1};
 
   // instRand returns a random value [0, 1.]
 #ifdef _WIN32
@@ -313,6 +328,9 @@ class Example13 : public BaseApplication {
     //
     // The VkDrawIndexedIndirectCommand is aliased to the same buffer so
     // they are both updated with the same memory::Flight in redraw().
+    //
+    // Only the Buf method draws from these. The UBO method draws from the
+    // commands written by cullGPU.
     uglue.uniformUsageBits |= VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
 
     while (uglue.stage.sources.size() < 3) {
@@ -344,6 +362,8 @@ class Example13 : public BaseApplication {
       logE("buildPass: assetLib.ctorError or instBuf failed\n");
       return 1;
     }
+    logI("assetLib: %s\n", assetLib.isDirect() ? "writing directly to pages"
+                                               : "copying through upload");
     void* voidMmap;
     if (instBuf.mem.mmap(&voidMmap)) {
       logE("buildPass: instBuf.mem.mmap failed\n");
@@ -515,9 +535,30 @@ class Example13 : public BaseApplication {
       return 1;
     }
 
+    if (cullGPU.size() <= framebuf_i) {
+      auto cull = std::make_shared<asset::CullGPU>(
+          cpool.vk.dev, maxInstPerUBO * maxIndirs, maxIndirs);
+      if (cull->ctorError()) {
+        logE("buildFramebuf(%zu): cullGPU.ctorError failed\n", framebuf_i);
+        return 1;
+      }
+      VkDescriptorBufferInfo dsBuf;
+      memset(&dsBuf, 0, sizeof(dsBuf));
+      dsBuf.buffer = cull->indirect.vk;
+      dsBuf.range = cull->indirect.info.size;
+      if (uglue.descriptorSet.at(framebuf_i)->write(
+              vert_ubo::bindingIndexOfCullOut(), {dsBuf})) {
+        logE("buildFramebuf(%zu): write(CullOut) failed\n", framebuf_i);
+        return 1;
+      }
+      cullGPU.emplace_back(cull);
+      cullLayoutOf.emplace_back(~size_t(0));
+    }
+
     auto& cmdBuffer = uglue.cmdBuffers.at(framebuf_i);
-    if (cmdBuffer.beginSimultaneousUse()) {
-      logE("buildFramebuf(%zu): beginSimultaneousUse failed\n", framebuf_i);
+    if (cmdBuffer.beginSimultaneousUse() ||
+        (instMethod == UBO && cullGPU.at(framebuf_i)->record(cmdBuffer))) {
+      logE("buildFramebuf(%zu): begin or cullGPU.record failed\n", framebuf_i);
       return 1;
     }
 
@@ -539,7 +580,7 @@ class Example13 : public BaseApplication {
         cmdBuffer.setScissor(0, 1, &scis) ||
         // call setLineWidth only if enabled.
         (drawWire && enabledFeats.wideLines && cmdBuffer.setLineWidth(2.0f)) ||
-        assetLib.bind(cmdBuffer) ||
+        assetLib.bind(cmdBuffer, test1->page()) ||
         (instMethod == Buf &&
          assetLib.bindInstBuf(cmdBuffer, instBuf.vk, 0))) {
       logE("buildFramebuf(%zu): assetLib.bind failed\n", framebuf_i);
@@ -554,9 +595,15 @@ class Example13 : public BaseApplication {
              gpuUboSize * i);
         return 1;
       }
+      // The UBO method draws with the command cullGPU wrote for UBO i.
+      VkBuffer indirBuf = uglue.uniform.at(framebuf_i).vk;
+      VkDeviceSize indirOfs = maxUBOs * gpuUboSize + sizeofOneIndir * i;
+      if (instMethod == UBO) {
+        indirBuf = cullGPU.at(framebuf_i)->indirect.vk;
+        indirOfs = sizeof(VkDrawIndexedIndirectCommand) * i;
+      }
       if (cmdBuffer.drawIndexedIndirect(
-              uglue.uniform.at(framebuf_i).vk,
-              maxUBOs * gpuUboSize + sizeofOneIndir * i /*offset*/,
+              indirBuf, indirOfs /*offset*/,
               1 /* drawCount: (cannot be >1 without multiDrawIndirect) */)) {
         logE("buildFramebuf(%zu): drawIndexedIndirect[%zu] failed\n",
              framebuf_i, i);
@@ -570,13 +617,15 @@ class Example13 : public BaseApplication {
     onModelRotate(uglue.curJoyX, uglue.curJoyY);
     ImGui::NewFrame();
     ImGui::SetNextWindowPos(ImVec2(64, 64));
-    ImGui::SetNextWindowSize(ImVec2(196, 115));
+    ImGui::SetNextWindowSize(ImVec2(196, 155));
     static constexpr int NonWindow =
         ImGuiWindowFlags_NoTitleBar | ImGuiWindowFlags_NoResize |
         ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoSavedSettings |
         ImGuiWindowFlags_NoBackground;
     ImGui::Begin("FPS", NULL, NonWindow);
     ImGui::Text("%.0ffps", ImGui::GetIO().Framerate);
+    ImGui::Text("%.2fms (%.2fms GPU wait)", uglue.frameTimeAvg * 1e3,
+                uglue.waitTime * 1e3);
     ImGui::Text("%zu inst %.1fMvert", instance.size(),
                 float(instance.size()) * test1->verts() / 1e6);
     float sliderWidth = ImGui::GetWindowWidth() - ImGui::GetFontSize();
@@ -584,6 +633,12 @@ class Example13 : public BaseApplication {
     ImGui::PushItemWidth(sliderWidth);
     ImGui::SliderInt("", &guiInstCount, 1024, maxInstPerUBO * maxIndirs);
     ImGui::PopItemWidth();
+    ImGui::PushItemWidth(sliderWidth * .5f);
+    ImGui::SliderInt("in flight", &guiFramesInFlight, 1, 3);
+    ImGui::PopItemWidth();
+    // instBuf is written directly by updateInstBuf(), not through the flight,
+    // so the Buf method must wait for the GPU each frame.
+    uglue.framesInFlight = (instMethod == Buf) ? 1 : guiFramesInFlight;
     if ((size_t)guiInstCount < instance.size()) {
       instance.resize(guiInstCount);
     } else
@@ -627,10 +682,67 @@ class Example13 : public BaseApplication {
     char dbg[256];
     snprintf(dbg, sizeof(dbg), "%zu:", instance.size());
 
-    // Write per-instance data to each dynamic UBO. Once all the per-instance
-    // data is consumed, write instanceCount = 0 to the rest of the
-    // VkDrawIndexedIndirectCommand.
-    size_t instDone = 0;
+    glm::mat4 view = glm::mat4_cast(orient) *
+                     glm::lookAt(cam + glm::vec3(0.0f, 0.0f, -1.0f),  // At.
+                                 cam,                         // Camera pose.
+                                 glm::vec3(0.0f, 1.0f, 0.0f));  // Up vector.
+    glm::mat4 proj = glm::perspective(glm::radians(45.0f),
+                                      cpool.vk.dev.aspectRatio(), 0.1f, 100.0f);
+    proj[1][1] *= -1;  // Convert from OpenGL to Vulkan by flipping Y.
+
+    // For the UBO method, cullGPU decides which instances are drawn. The CPU
+    // only uploads where they are. The draws are laid out again only when
+    // the instance count changes or test1 moves.
+    auto& cull = *cullGPU.at(uglue.getImage());
+    command::SubmitInfo info;
+    size_t cullCount = 0;
+    if (instMethod == UBO && test1->state() == asset::READY) {
+      cullCount = std::min(instance.size(), maxInstPerUBO * maxIndirs);
+    }
+    if (instMethod == UBO) {
+      if (cullCmd.empty() || cullCount != cullDraw.size() ||
+          memcmp(&cullTemplate, &test1->inst.cmd, sizeof(cullTemplate))) {
+        cullTemplate = test1->inst.cmd;
+        cullDraw.resize(cullCount);
+        for (size_t j = 0; j < cullCount; j++) {
+          cullDraw.at(j) = j / maxInstPerUBO;
+        }
+        cullCmd.assign(maxIndirs, cullTemplate);
+        if (asset::layoutIndirect(cullDraw, cullCmd, cullVisible)) {
+          logE("layoutIndirect failed\n");
+          return 1;
+        }
+        cullLayout++;
+      }
+      auto& b = test1->bounds;
+      float radius = glm::length(glm::max(glm::abs(b.min), glm::abs(b.max)));
+      cullSphere.resize(cullCount);
+      for (size_t j = 0; j < cullCount; j++) {
+        cullSphere.set(j, glm::vec3(instance.at(j).loc), radius);
+      }
+      auto& layout = cullLayoutOf.at(uglue.getImage());
+      if (layout == cullLayout
+              ? cull.moveInstances(cullSphere)
+              : cull.setInstances(cullSphere, cullDraw, cullCmd)) {
+        logE("cullGPU setInstances or moveInstances failed\n");
+        return 1;
+      }
+      layout = cullLayout;
+      // The frame waits on the GPU for the cull. The CPU does not wait.
+      if (cull.cull(asset::Frustum(proj * view), info)) {
+        logE("cullGPU.cull failed\n");
+        return 1;
+      }
+      if (cullCount % maxInstPerUBO) {
+        int l = strlen(dbg);
+        snprintf(dbg + l, sizeof(dbg) - l, " %zu batches + %zu in final batch",
+                 cullCount / maxInstPerUBO, cullCount % maxInstPerUBO);
+      }
+    }
+
+    // Write per-instance data to each dynamic UBO. The Buf method only uses
+    // the first VkDrawIndexedIndirectCommand. Write instanceCount = 0 to the
+    // rest.
     char* uboPtr = reinterpret_cast<char*>(flight->mmap());
     char* indirPtr = uboPtr + maxUBOs * gpuUboSize;
     for (size_t i = 0; i < maxIndirs; i++,
@@ -638,53 +750,26 @@ class Example13 : public BaseApplication {
       // Write to ubo for each i - each dynamic UBO offset will need a copy
       // of these inputs:
       auto& ubo = *reinterpret_cast<vert_ubo::UniformBufferObject*>(uboPtr);
-      ubo.view = glm::mat4_cast(orient) *
-                 glm::lookAt(cam + glm::vec3(0.0f, 0.0f, -1.0f),  // Look at.
-                             cam,                           // Camera pose.
-                             glm::vec3(0.0f, 1.0f, 0.0f));  // Up vector.
-
-      ubo.lightPos = glm::vec4(0, 2, 1, maxInstPerUBO);
-
-      ubo.proj = glm::perspective(glm::radians(45.0f),
-                                  cpool.vk.dev.aspectRatio(), 0.1f, 100.0f);
-      ubo.proj[1][1] *= -1;  // Convert from OpenGL to Vulkan by flipping Y.
+      ubo.view = view;
+      ubo.lightPos = glm::vec4(0, 2, 1, 0);
+      ubo.cull = glm::uvec4(cull.visibleOffset() / sizeof(uint32_t),
+                            maxInstPerUBO, 0, 0);
+      ubo.proj = proj;
 
       auto& indir = *reinterpret_cast<VkDrawIndexedIndirectCommand*>(indirPtr);
       indir = test1->inst.cmd;
       indir.instanceCount = 0;
       indir.firstInstance = 0;
-      if (test1->state() != asset::READY || instDone >= instance.size()) {
-        continue;
-      }
       if (instMethod == UBO) {
-        // Each indir gets up to maxInstPerUBO instances
-        indir.instanceCount = instance.size() - instDone;
-        if (indir.instanceCount > maxInstPerUBO) {
-          indir.instanceCount = maxInstPerUBO;
-        }
-
         // Write per-instance data to UBO
-        for (size_t j = instDone, k = 0; k < indir.instanceCount; j++, k++) {
+        for (size_t j = i * maxInstPerUBO, k = 0;
+             k < maxInstPerUBO && j < cullCount; j++, k++) {
           ubo.inst[k].loc = instance.at(j).loc;
           auto rot = instance.at(j).rot;
           ubo.inst[k].rot = glm::vec4{rot.x, rot.y, rot.z, rot.w};
         }
-        instDone += indir.instanceCount;
-        if (indir.instanceCount && indir.instanceCount != maxInstPerUBO) {
-          int l = strlen(dbg);
-          snprintf(dbg + l, sizeof(dbg) - l,
-                   " %zu batches + %zu in final batch", i,
-                   (size_t)indir.instanceCount);
-        }
-      } else {
+      } else if (i == 0 && test1->state() == asset::READY) {
         // instMethod == Buf.
-        if (i != 0) {
-          // Only the first indir is needed. The rest have instanceCount = 0,
-          // and are not needed at all.
-          indir.instanceCount = 0;
-          continue;
-        }
-
         indir.instanceCount = instance.size();
       }
     }
@@ -699,7 +784,6 @@ class Example13 : public BaseApplication {
     }
     strcpy(prevdbg, dbg);
 
-    command::SubmitInfo info;
     if (assetLib.write<Example13, st_13inst_ubo_vert>(info,
             [](Example13* self, const asset::Vertex& vert,
                st_13inst_ubo_vert* dst) -> int {
@@ -1,7 +1,11 @@
 /* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
  */
 
+#include <chrono>
+
 #include "../src/asset/asset.h"
+#include "../src/asset/cullgpu.h"
+#include "../src/asset/physics.h"
 #include "../src/uniformglue/uniformglue.h"
 
 // uniform_glue.h has already #included some glm headers.
@@ -30,12 +34,28 @@ namespace frag {
 #include "21physics/struct_21scene.frag.h"
 }
 
-static const size_t numUBOBatches = 32;
 #define maxUBOsize (65536)
 #define maxInstPerUBO \
   (sizeof(UniformBufferObject::inst) / sizeof(UniformBufferObject::inst[0]))
+// maxBodies is how many bodies the UBO batches are sized for.
+static constexpr size_t maxBodies = 100000;
+
+static size_t getMmapMaxUsingTemporaryVariable(command::CommandPool& cpool) {
+  // This does not reflect the value in uglue.stage, below, but since
+  // uglue is not constructed yet, this at least uses the same initializer.
+  memory::Stage stage{cpool, memory::ASSUME_POOL_QINDEX};
+  return stage.mmapMax();
+}
+
+// calcUBOBatches returns enough UBO batches for maxBodies, unless they do not
+// all fit in one Stage::mmap.
+static size_t calcUBOBatches(size_t mmapMax) {
+  size_t want = (maxBodies + maxInstPerUBO - 1) / maxInstPerUBO;
+  size_t fit = (mmapMax - sizeof(UniformBufferObject)) / maxUBOsize + 1;
+  return std::min(want, fit);
+}
 
-size_t calcUniformSize() {
+size_t calcUniformSize(size_t numUBOBatches) {
   return maxUBOsize * (numUBOBatches - 1) + sizeof(UniformBufferObject);
 }
 
@@ -43,8 +63,10 @@ class Example21 : public BaseApplication {
  public:
   Example21(language::Instance& instance, GLFWwindow* window)
       : BaseApplication{instance},
+        numUBOBatches{calcUBOBatches(getMmapMaxUsingTemporaryVariable(cpool))},
         uglue{*this, window, 0 /*maxLayoutIndex*/,
-              bindingIndexOfUniformBufferObject(), calcUniformSize()},
+              bindingIndexOfUniformBufferObject(),
+              calcUniformSize(numUBOBatches)},
         assetLib{uglue} {
     resizeFramebufListeners.emplace_back(std::make_pair(
         [](void* self, language::Framebuf& framebuf, size_t fbi,
@@ -81,26 +103,34 @@ class Example21 : public BaseApplication {
   }
 
  protected:
+  const size_t numUBOBatches;
   UniformGlue uglue;
   // orient represents rotation of the view matrix as a rotation quaternion.
   glm::quat orient = glm::angleAxis(0.f, glm::vec3(0, 1, 0));
   static constexpr float deadzone = 0.1;
   static constexpr size_t maxIndices = 1024u * 1024u;
-#define sizeofOneIndir ((sizeof(VkDrawIndexedIndirectCommand) + 3) & (~3))
 
   asset::Library assetLib;
 
-  typedef struct InstanceData {
-    glm::vec4 loc;
-    glm::vec4 vel;  // velocity
-    glm::quat rot;
-    glm::quat dr;  // angular velocity
-  } InstanceData;
-
-  std::vector<InstanceData> instance;
+  // cullGPU culls the bodies and writes the draw commands, one per UBO batch.
+  // There is one for each framebuf, like uglue.uniform.
+  std::vector<std::shared_ptr<asset::CullGPU>> cullGPU;
+  // cullLayout counts the changes to cullDraw and cullCmd. cullLayoutOf is
+  // the cullLayout each cullGPU last got from setInstances.
+  size_t cullLayout{0};
+  std::vector<size_t> cullLayoutOf;
+  VkDrawIndexedIndirectCommand cullTemplate{0, 0, 0, 0, 0};
+  asset::SphereSoA cullSphere;
+  std::vector<uint32_t> cullDraw, cullVisible;
+  std::vector<VkDrawIndexedIndirectCommand> cullCmd;
+
+  // physics moves every instance. The shape of test1 is close to a cube.
+  asset::Physics physics;
+  static constexpr float bodyHalf = 0.1f;
+  static constexpr float simDt = 1.f / 60.f;
+  double physicsMs{0};
 
   static constexpr float maxLoc = 20;
-  const float simSpeed = 1.f / 32.f;
 
   glm::vec3 cam{0.f, 0.f, -maxLoc};
 
@@ -111,30 +141,29 @@ class Example21 : public BaseApplication {
     return float(rand_r(&instRandSeed)) * invMax;
   }
 
+  // randomInstance drops a new body somewhere in the room.
   void randomInstance() {
-    instance.emplace_back();
-    auto& i = instance.back();
-    i.loc = glm::vec4(instRand(), instRand(), instRand(), 1.f) * (maxLoc * 2) +
-            glm::vec4(-maxLoc, -maxLoc, -maxLoc, 0.f);
-    i.vel = glm::normalize(glm::vec4(instRand(), instRand(), instRand(), 0.f)) *
-            simSpeed;
-    i.rot = glm::angleAxis(0.f, glm::vec3(0, 0, 1));
-    i.dr = glm::angleAxis(instRand() * simSpeed,
-                          glm::vec3(instRand(), instRand(), instRand()));
+    glm::vec3 loc = glm::vec3(instRand(), instRand(), instRand()) *
+                        (maxLoc * 2 - bodyHalf * 2) +
+                    glm::vec3(-maxLoc + bodyHalf);
+    glm::quat rot = glm::normalize(glm::quat(instRand(), instRand() - .5f,
+                                             instRand() - .5f,
+                                             instRand() - .5f));
+    uint32_t i = physics.addBox(loc, glm::vec3(bodyHalf), 1.f, rot);
+    physics.body.at(i).angVel =
+        glm::vec3(instRand(), instRand(), instRand()) - glm::vec3(.5f);
   }
 
-  void updateInstance(InstanceData& i) {
-    i.loc += i.vel;
-    for (size_t j = 0; j < 3; j++) {
-      if (i.loc[j] < -maxLoc) {
-        i.vel[j] = fabs(i.vel[j]);
-        i.loc[j] = -maxLoc;
-      } else if (i.loc[j] > maxLoc) {
-        i.vel[j] = -fabs(i.vel[j]);
-        i.loc[j] = maxLoc;
-      }
+  int updateInstances() {
+    auto t0 = std::chrono::steady_clock::now();
+    if (physics.step(simDt)) {
+      logE("physics.step failed\n");
+      return 1;
     }
-    i.rot = glm::normalize(i.dr * i.rot);
+    physicsMs = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - t0)
+                    .count();
+    return 0;
   }
 
   void onMove(float dx, float dy, float dz) {
@@ -211,15 +240,13 @@ class Example21 : public BaseApplication {
   }
 
   int buildPass() {
-    // Ask uglue to construct uniform buffers that also can be used for
-    // VkDrawIndexedIndirectCommand in redraw().
-    uglue.uniformUsageBits |= VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
-
     while (uglue.stage.sources.size() < 3) {
       uglue.stage.sources.emplace_back(cpool);
     }
 
-    while (instance.size() < 1024) {
+    physics.room.bound[0] = glm::vec3(-maxLoc);
+    physics.room.bound[1] = glm::vec3(maxLoc);
+    while (physics.body.size() < 1024) {
       randomInstance();
     }
 
@@ -231,7 +258,8 @@ class Example21 : public BaseApplication {
       logE("mesh or shader or texture load failed\n");
       return 1;
     }
-    if (assetLib.ctorError<st_21scene_vert>(1024 * 1024, maxIndices)) {
+    if (assetLib.ctorError(sizeof(st_21scene_vert), 0 /*instSize*/,
+                           maxIndices, 0 /*bindingIndexOfInstanceBuf*/)) {
       logE("buildPass: assetLib.ctorError failed\n");
       return 1;
     }
@@ -324,9 +352,30 @@ class Example21 : public BaseApplication {
       return 1;
     }
 
+    if (cullGPU.size() <= framebuf_i) {
+      auto cull = std::make_shared<asset::CullGPU>(
+          cpool.vk.dev, numUBOBatches * maxInstPerUBO, numUBOBatches);
+      if (cull->ctorError()) {
+        logE("buildFramebuf(%zu): cullGPU.ctorError failed\n", framebuf_i);
+        return 1;
+      }
+      VkDescriptorBufferInfo dsBuf;
+      memset(&dsBuf, 0, sizeof(dsBuf));
+      dsBuf.buffer = cull->indirect.vk;
+      dsBuf.range = cull->indirect.info.size;
+      if (uglue.descriptorSet.at(framebuf_i)->write(bindingIndexOfCullOut(),
+                                                    {dsBuf})) {
+        logE("buildFramebuf(%zu): write(CullOut) failed\n", framebuf_i);
+        return 1;
+      }
+      cullGPU.emplace_back(cull);
+      cullLayoutOf.emplace_back(~size_t(0));
+    }
+
     auto& cmdBuffer = uglue.cmdBuffers.at(framebuf_i);
-    if (cmdBuffer.beginSimultaneousUse()) {
-      logE("buildFramebuf(%zu): beginSimultaneousUse failed\n", framebuf_i);
+    if (cmdBuffer.beginSimultaneousUse() ||
+        cullGPU.at(framebuf_i)->record(cmdBuffer)) {
+      logE("buildFramebuf(%zu): begin or cullGPU.record failed\n", framebuf_i);
       return 1;
     }
 
@@ -348,13 +397,15 @@ class Example21 : public BaseApplication {
         // call setLineWidth only if enabled and only for pipeline 2.
         (pipeI == 2 && enabledFeatures.wideLines &&
          cmdBuffer.setLineWidth(2.0f)) ||
-        assetLib.bind(cmdBuffer, framebuf_i)) {
+        assetLib.bind(cmdBuffer, test1 ? test1->page() : 0)) {
       logE("buildFramebuf(%zu): assetLib.bind failed\n", framebuf_i);
       return 1;
     }
+    // Draw batch i with the command cullGPU wrote for it.
+    auto& cullOut = cullGPU.at(framebuf_i)->indirect;
     for (size_t i = 0; i < numUBOBatches; i++) {
       if (cmdBuffer.drawIndexedIndirect(
-              uglue.uniform.at(framebuf_i).vk, maxUBOsize * i /*offset*/,
+              cullOut.vk, sizeof(VkDrawIndexedIndirectCommand) * i /*offset*/,
               1 /* drawCount: (cannot be >1 without multiDrawIndirect) */)) {
         logE("buildFramebuf(%zu): drawIndexedIndirect[%zu] failed\n",
              framebuf_i, i);
@@ -368,7 +419,7 @@ class Example21 : public BaseApplication {
     onModelRotate(uglue.curJoyX, uglue.curJoyY);
     ImGui::NewFrame();
     ImGui::SetNextWindowPos(ImVec2(64, 64));
-    ImGui::SetNextWindowSize(ImVec2(200, 80));
+    ImGui::SetNextWindowSize(ImVec2(200, 120));
     static constexpr int NonWindow =
         ImGuiWindowFlags_NoTitleBar | ImGuiWindowFlags_NoResize |
         ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoSavedSettings |
@@ -376,77 +427,123 @@ class Example21 : public BaseApplication {
     ImGui::Begin("FPS - also see VK_VERTEX_INPUT_RATE_INSTANCE", NULL,
                  NonWindow);
     ImGui::Text("%.0ffps", ImGui::GetIO().Framerate);
-    ImGui::Text("%zu inst %.1fMvert", instance.size(),
-                float(instance.size()) * test1->verts() / 1e6);
+    size_t n = physics.body.size();
+    ImGui::Text("%zu inst %.1fMvert", n, float(n) * test1->verts() / 1e6);
+    ImGui::Text("%zu awake %.1fms", physics.stats.awake, physicsMs);
     float sliderWidth = ImGui::GetWindowWidth() - ImGui::GetFontSize();
-    int guiInstCount = instance.size();
+    int guiInstCount = n;
     ImGui::PushItemWidth(sliderWidth);
     ImGui::SliderInt("", &guiInstCount, 1024, numUBOBatches * maxInstPerUBO);
     ImGui::PopItemWidth();
-    if ((size_t)guiInstCount < instance.size()) {
-      instance.resize(guiInstCount);
+    if ((size_t)guiInstCount < n) {
+      physics.body.resize(guiInstCount);
+      // A body that was holding something up may be gone.
+      for (size_t i = 0; i < physics.body.size(); i++) {
+        physics.wake(i);
+      }
     } else
-      while ((size_t)guiInstCount > instance.size()) {
+      while ((size_t)guiInstCount > physics.body.size()) {
         randomInstance();
       }
+    if (ImGui::Button("Throw")) {
+      for (size_t i = 0; i < physics.body.size(); i++) {
+        physics.wake(i);
+        physics.body.at(i).vel +=
+            glm::vec3(instRand() - .5f, instRand() + 1.f, instRand() - .5f) *
+            10.f;
+      }
+    }
     ImGui::End();
+    if (updateInstances()) {
+      return 1;
+    }
+
+    glm::mat4 view = glm::mat4_cast(orient) *
+                     glm::lookAt(cam + glm::vec3(0.0f, 0.0f, -1.0f),  // At.
+                                 cam,                         // Camera pose.
+                                 glm::vec3(0.0f, 1.0f, 0.0f));  // Up vector.
+    glm::mat4 proj = glm::perspective(glm::radians(45.0f),
+                                      cpool.vk.dev.aspectRatio(), 0.1f, 100.0f);
+    proj[1][1] *= -1;  // Convert from OpenGL to Vulkan by flipping Y.
+
+    // cullGPU, not the CPU, decides which bodies are drawn. The CPU only
+    // uploads where they are. The draws are laid out again only when bodies
+    // are added or test1 moves.
+    size_t bodies = 0;
+    if (test1->state() == asset::READY) {
+      bodies = std::min(physics.body.size(), numUBOBatches * maxInstPerUBO);
+    }
+    if (cullCmd.empty() || bodies != cullDraw.size() ||
+        memcmp(&cullTemplate, &test1->inst.cmd, sizeof(cullTemplate))) {
+      cullTemplate = test1->inst.cmd;
+      cullDraw.resize(bodies);
+      for (size_t j = 0; j < bodies; j++) {
+        cullDraw.at(j) = j / maxInstPerUBO;
+      }
+      cullCmd.assign(numUBOBatches, cullTemplate);
+      if (asset::layoutIndirect(cullDraw, cullCmd, cullVisible)) {
+        logE("layoutIndirect failed\n");
+        return 1;
+      }
+      cullLayout++;
+    }
+    auto& b = test1->bounds;
+    float radius = glm::length(glm::max(glm::abs(b.min), glm::abs(b.max)));
+    cullSphere.resize(bodies);
+    for (size_t j = 0; j < bodies; j++) {
+      cullSphere.set(j, physics.body.at(j).pos, radius);
+    }
+    auto& cull = *cullGPU.at(uglue.getImage());
+    auto& layout = cullLayoutOf.at(uglue.getImage());
+    command::SubmitInfo info;
+    if (layout == cullLayout
+            ? cull.moveInstances(cullSphere)
+            : cull.setInstances(cullSphere, cullDraw, cullCmd)) {
+      logE("cullGPU setInstances or moveInstances failed\n");
+      return 1;
+    }
+    layout = cullLayout;
+    // The frame waits on the GPU for the cull. The CPU does not wait.
+    if (cull.cull(asset::Frustum(proj * view), info)) {
+      logE("cullGPU.cull failed\n");
+      return 1;
+    }
+    static size_t prevBodies = ~size_t(0);
+    if (bodies != prevBodies) {
+      logI("draw %zu: %zu batches of up to %zu, culled by cullGPU\n", bodies,
+           (bodies + maxInstPerUBO - 1) / maxInstPerUBO, maxInstPerUBO);
+      prevBodies = bodies;
+    }
 
-    static char prevdbg[256];
-    char dbg[256];
-    snprintf(dbg, sizeof(dbg), "%zu:", instance.size());
-    size_t instDone = 0;
     char* mmap = reinterpret_cast<char*>(flight->mmap());
     for (size_t i = 0; i < numUBOBatches; i++, mmap += maxUBOsize) {
       auto& ubo = *reinterpret_cast<UniformBufferObject*>(mmap);
-      auto& indir = *reinterpret_cast<VkDrawIndexedIndirectCommand*>(&ubo);
-      indir.indexCount = assetLib.getIndicesUsed();
-      indir.instanceCount = 0;
-      if (test1->state() == asset::READY && instDone < instance.size()) {
-        indir.instanceCount = instance.size() - instDone;
-        if (indir.instanceCount > maxInstPerUBO) {
-          indir.instanceCount = maxInstPerUBO;
-        }
-      }
-      indir.firstIndex = 0;
-      indir.vertexOffset = 0;
-      indir.firstInstance = 0;
-
-      ubo.view = glm::mat4_cast(orient) *
-                 glm::lookAt(cam + glm::vec3(0.0f, 0.0f, -1.0f),  // Look at.
-                             cam,                           // Camera pose.
-                             glm::vec3(0.0f, 1.0f, 0.0f));  // Up vector.
-
+      ubo.cull = glm::uvec4(cull.visibleOffset() / sizeof(uint32_t),
+                            maxInstPerUBO, 0, 0);
+      ubo.view = view;
       ubo.lightPos = glm::vec4(0, 2, 1, 0);
-
-      ubo.proj = glm::perspective(glm::radians(45.0f),
-                                  cpool.vk.dev.aspectRatio(), 0.1f, 100.0f);
-      ubo.proj[1][1] *= -1;  // Convert from OpenGL to Vulkan by flipping Y.
-
-      for (size_t j = instDone, k = 0; j < indir.instanceCount; j++, k++) {
-        updateInstance(instance.at(j));
-        ubo.inst[k].loc = instance.at(j).loc;
-        auto rot = instance.at(j).rot;
-        ubo.inst[k].rot = glm::vec4{rot.x, rot.y, rot.z, rot.w};
-      }
-      instDone += indir.instanceCount;
-      if (indir.instanceCount && indir.instanceCount != maxInstPerUBO) {
-        int l = strlen(dbg);
-        snprintf(dbg + l, sizeof(dbg) - l, " %zu batches + %zu in final batch",
-                 i, (size_t)indir.instanceCount);
-      }
-    }
-    if (strcmp(prevdbg, dbg)) {
-      if (instance.size() == maxInstPerUBO * numUBOBatches) {
-        // dbg ends up pretty bare, fill it in a little
-        logI("draw %s (limited by Stage::mmapMax) %zu full batches\n", dbg,
-             numUBOBatches);
-      } else {
-        logI("draw %s\n", dbg);
+      ubo.proj = proj;
+      for (size_t j = i * maxInstPerUBO, k = 0;
+           k < maxInstPerUBO && j < bodies; j++, k++) {
+        auto& b = physics.body.at(j);
+        ubo.inst[k].loc = glm::vec4(b.pos, 1.f);
+        ubo.inst[k].rot = glm::vec4{b.rot.x, b.rot.y, b.rot.z, b.rot.w};
       }
-      strcpy(prevdbg, dbg);
     }
 
-    command::SubmitInfo info;
+    if (assetLib.write<Example21, st_21scene_vert>(info,
+            [](Example21* self, const asset::Vertex& vert,
+               st_21scene_vert* dst) -> int {
+              (void)self;
+              dst->inPosition = vert.P;
+              dst->inNormal = vert.N;
+              dst->inColor = glm::vec3(vert.color);
+              return 0;
+            },
+            this)) {
+      logE("assetLib.write failed\n");
+      return 1;
+    }
     if (uglue.submit(flight, info)) {
       logE("uglue.submit failed\n");
       return 1;
@@ -509,19 +606,6 @@ class Example21 : public BaseApplication {
       // Non-Android requires joystick polling.
       onInputEvent(NULL, 0, 0, GLFW_TRUE);
 #endif /*_ANDROID__*/
-      if (assetLib.write<Example21, st_21scene_vert>(
-              [](Example21* self, const asset::Vertex& vert,
-                 st_21scene_vert* dst) -> int {
-                (void)self;
-                dst->inPosition = vert.P;
-                dst->inNormal = vert.N;
-                dst->inColor = glm::vec3(vert.color);
-                return 0;
-              },
-              this)) {
-        logE("assetLib.write failed\n");
-        return 1;
-      }
     }
     return cpool.deviceWaitIdle();
   }
@@ -19,9 +19,9 @@ layout(location = 3) out vec3 fragLightVec;
 // Specify inputs that are constant ("uniform") for all vertices.
 // The uniform buffer is updated by the app once per frame.
 layout(binding = 0) uniform UniformBufferObject {
-  // indirCount and indirFirstInstance must match VkDrawIndexedIndirectCommand
-  uvec4 indirCount;
-  uvec4 indirFirstInstance;
+  // cull.x is where the visible list starts in cullOut.word. cull.y is how
+  // many instances fit in inst.
+  uvec4 cull;
 
   mat4 proj;
   mat4 view;
@@ -34,6 +34,12 @@ layout(binding = 0) uniform UniformBufferObject {
   perInst inst[2 * 1024 - 6];
 } ubo;
 
+// cullOut is what CullGPU wrote: one VkDrawIndexedIndirectCommand for each
+// batch, then the visible list. gl_InstanceIndex indexes the visible list.
+layout(binding = 1) readonly buffer CullOut {
+  uint word[];
+} cullOut;
+
 // Specify inputs that vary per vertex (read from the vertex buffer).
 // gl_VertexIndex is still defined as the vertex index (0 .. N).
 layout(location = 0) in vec3 inPosition;
@@ -52,8 +58,7 @@ mat3 q_to_mat3(vec4 rot) {
 }
 
 void main() {
-  uint instCount = ubo.indirCount.y;
-  uint inst = gl_InstanceIndex % instCount;
+  uint inst = cullOut.word[ubo.cull.x + gl_InstanceIndex] % ubo.cull.y;
   mat3 modelview = q_to_mat3(ubo.inst[inst].rot);
   vec3 pos = modelview * inPosition + ubo.inst[inst].loc.xyz;
   gl_Position = ubo.proj * ubo.view * vec4(pos, 1.0);
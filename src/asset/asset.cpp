@@ -5,13 +5,16 @@
 
 #define _USE_MATH_DEFINES /*Windows otherwise hides M_PI*/
 #include <math.h>
+#include <string.h>
 #include <src/core/VkPtr.h>
 
+#include <algorithm>
+
 namespace asset {
 
 int BaseAsset::doTri(indicesType i0, indicesType i1, indicesType i2,
-                     std::vector<Vertex>& raw, std::vector<indicesType>& shared,
-                     VertexIndex& out, uint32_t flags) {
+                     TriBuf& b, VertexIndex& out, uint32_t flags) {
+  auto& raw = b.raw;
   if (raw.size() <= i0 || raw.size() <= i1 || raw.size() <= i2) {
     logE("doTri: raw.size=%zu i0=%zu i1=%zu i2=%zu\n", raw.size(), (size_t)i0,
          (size_t)i1, (size_t)i2);
@@ -26,14 +29,14 @@ int BaseAsset::doTri(indicesType i0, indicesType i1, indicesType i2,
   }
   N /= len;
 
-  std::vector<Vertex> r;
-  r.reserve(3);
-  r.push_back(raw[i0]);
-  r.back().N = N;
-  r.push_back(raw[i1]);
-  r.back().N = N;
-  r.push_back(raw[i2]);
-  r.back().N = N;
+  auto& r = b.tri;
+  r.resize(3);  // eval may have resized it.
+  r[0] = raw[i0];
+  r[0].N = N;
+  r[1] = raw[i1];
+  r[1].N = N;
+  r[2] = raw[i2];
+  r[2].N = N;
   if (eval.first) {
     if (eval.first(eval.second, r, flags)) {
       return 1;
@@ -41,61 +44,75 @@ int BaseAsset::doTri(indicesType i0, indicesType i1, indicesType i2,
   }
   if (flags & VERT_PER_FACE) {
     // Emit the face now, do not average normals and colors.
-    out.order.emplace_back(out.vert.size());
-    out.vert.emplace_back(r[0]);
-    out.order.emplace_back(out.vert.size());
-    out.vert.emplace_back(r[1]);
-    out.order.emplace_back(out.vert.size());
-    out.vert.emplace_back(r[2]);
+    indicesType n = out.vert.size();
+    out.order.push_back(n);
+    out.order.push_back(n + 1);
+    out.order.push_back(n + 2);
+    out.vert.insert(out.vert.end(), r.begin(), r.begin() + 3);
     return 0;
   }
 
   raw[i0].add(r[0]);
   raw[i1].add(r[1]);
   raw[i2].add(r[2]);
-  shared.push_back(i0);
-  shared.push_back(i1);
-  shared.push_back(i2);
+  b.shared.push_back(i0);
+  b.shared.push_back(i1);
+  b.shared.push_back(i2);
   return 0;
 }
 
-int BaseAsset::doShared(std::vector<Vertex>& raw,
-                        std::vector<indicesType>& shared, VertexIndex& out) {
+int BaseAsset::doShared(TriBuf& b, VertexIndex& out) {
+  static constexpr indicesType unused = ~indicesType(0);
+  // Only the vertices used by a face are output. A vertex is not used if all
+  // faces on it set VERT_PER_FACE or were degenerate.
+  b.remap.assign(b.raw.size(), unused);
+  size_t n = 0;
+  for (auto i : b.shared) {
+    if (b.remap[i] == unused) {
+      b.remap[i] = 0;
+      n++;
+    }
+  }
   size_t indexBase = out.vert.size();  // The VERT_PER_FACE vertices are first.
-  for (size_t i = 0; i < raw.size(); i++) {
-    auto len = glm::length(raw.at(i).N);
-    if (len < glm::epsilon<decltype(len)>()) {
-      // delete raw.at(i) by decrementing each j in shared where j >= i
-      // This can happen if all faces on this vertex set VERT_PER_FACE.
-      for (size_t j = 0; j < shared.size(); j++) {
-        if (shared.at(j) >= i) {
-          shared.at(j)--;
-        }
-      }
-    } else {
-      raw.at(i).divideByScalar(len);
-      out.vert.push_back(raw.at(i));
+  out.vert.reserve(out.vert.size() + n);
+  for (size_t i = 0; i < b.raw.size(); i++) {
+    if (b.remap[i] == unused) {
+      continue;
+    }
+    b.remap[i] = out.vert.size() - indexBase;
+    out.vert.push_back(b.raw[i]);
+    auto len = glm::length(out.vert.back().N);
+    if (len >= glm::epsilon<decltype(len)>()) {
+      out.vert.back().divideByScalar(len);
     }
   }
-  out.order.reserve(out.order.size() + shared.size());
-  for (size_t i = 0; i < shared.size(); i++) {
-    out.order.emplace_back(shared.at(i) + indexBase);
+  out.order.reserve(out.order.size() + b.shared.size());
+  for (auto i : b.shared) {
+    out.order.push_back(b.remap[i] + indexBase);
   }
   return 0;
 }
 
-int Revolv::toVertices(VertexIndex& out) {
-  if (rots < 3 + rotStart || aspectZ < 0.f || pt.size() < 2) {
+int Revolv::toVertices(VertexIndex& out) { return sweep(rots, rotStart, out); }
+
+int Revolv::sweep(uint32_t n, uint32_t start, VertexIndex& out) {
+  if (n < 3 + start || aspectZ < 0.f || pt.size() < 2) {
     logE("invalid: rots=%zu rotStart=%zu aspectZ=%e pt.size=%zu\n",
-         (size_t)rots, (size_t)rotStart, aspectZ, pt.size());
+         (size_t)n, (size_t)start, aspectZ, pt.size());
     return 1;
   }
 
   // Compute the raw point cloud
-  std::vector<Vertex> raw;
-  const uint32_t angles = rots - rotStart;
+  TriBuf b;
+  auto& raw = b.raw;
+  const uint32_t angles = n - start;
+  // Each cap has angles - 2 tris. The sides have 2 tris per quad.
+  size_t tris = 2 * (angles - 2) + 2 * angles * (pt.size() - 1);
+  raw.reserve(angles * pt.size());
+  b.shared.reserve(3 * tris);
+  out.order.reserve(out.order.size() + 3 * tris);
   for (size_t i = 0; i < angles; i++) {
-    float a = (2 * M_PI * (i + rotStart)) / rots;
+    float a = (2 * M_PI * (i + start)) / n;
     for (size_t j = 0; j < pt.size(); j++) {
       raw.emplace_back();
       Vertex& v = raw.back();
@@ -115,12 +132,11 @@ int Revolv::toVertices(VertexIndex& out) {
   // vertices in the middle of the cylinder would only be used 2 times.
   //
   // Generate top and bottom caps
-  std::vector<indicesType> shared;
   size_t anglesXpts = angles * pt.size();
   if (!(flags & DELETE_CAP_B)) {
     size_t cap1 = pt.size();
     for (size_t i = pt.size() * 2; i < anglesXpts; cap1 = i, i += pt.size()) {
-      if (doTri(0, cap1, i, raw, shared, out, 0)) {
+      if (doTri(0, cap1, i, b, out, 0)) {
         logE("Revolv: eval cap[%zu+%d] failed\n", i, 0);
         return 1;
       }
@@ -131,7 +147,7 @@ int Revolv::toVertices(VertexIndex& out) {
     for (size_t i = cap1 + pt.size(); i < anglesXpts;
          cap1 = i, i += pt.size()) {
       // Top: reverse order of i, cap1 to remain counter-clockwise.
-      if (doTri(pt.size() - 1, i, cap1, raw, shared, out, 0)) {
+      if (doTri(pt.size() - 1, i, cap1, b, out, 0)) {
         logE("Revolv: eval cap[%zu+%d] failed\n", i, 1);
         return 1;
       }
@@ -144,17 +160,138 @@ int Revolv::toVertices(VertexIndex& out) {
     for (size_t j = 0; j < pt.size() - 1; j++) {
       indicesType p0 = i * pt.size() + j;
       indicesType p2 = ((i + 1) % angles) * pt.size() + j;
-      if (doTri(p0, p0 + 1, p2 + 1, raw, shared, out, 0)) {
+      if (doTri(p0, p0 + 1, p2 + 1, b, out, 0)) {
         logE("Revolv: eval face[%zu+%d] failed\n", i, 0);
         return 1;
       }
-      if (doTri(p0, p2 + 1, p2, raw, shared, out, 0)) {
+      if (doTri(p0, p2 + 1, p2, b, out, 0)) {
         logE("Revolv: eval face[%zu+%d] failed\n", i, 1);
         return 1;
       }
     }
   }
-  return doShared(raw, shared, out);
+  return doShared(b, out);
+}
+
+int BaseAsset::toLodVertices(uint32_t level, VertexIndex&, float&) {
+  logE("toLodVertices(%u): this asset has no LODs\n", level);
+  return 1;
+}
+
+uint32_t BaseAsset::selectLod(float dist, float projScale,
+                              float maxPixels) const {
+  for (size_t i = lod.size(); i > 1; i--) {
+    if (lod[i - 1].error * projScale <= maxPixels * dist) {
+      return i - 1;
+    }
+  }
+  return 0;
+}
+
+int BaseAsset::useLod(uint32_t level) {
+  if (state_ != READY || level >= lod.size()) {
+    logE("useLod(%u): state=%d lod.size=%zu\n", level, (int)state_,
+         lod.size());
+    return 1;
+  }
+  inst.cmd.firstIndex = oblk.base + lod[level].firstIndex;
+  inst.cmd.indexCount = lod[level].indexCount;
+  return 0;
+}
+
+int Revolv::toLodVertices(uint32_t level, VertexIndex& out, float& error) {
+  // Each level samples the sweep half as often.
+  level = std::min(level, 31u);
+  uint32_t start = rotStart >> level;
+  uint32_t n = std::max(rots >> level, start + 3);
+  float r = 0.f;
+  for (auto& p : pt) {
+    r = std::max(r, fabsf(p.x));
+  }
+  r *= std::max(1.f, aspectZ);
+  // A chord spanning 2*pi/n of a circle is r*(1 - cos(pi/n)) inside it.
+  error = std::max(0., r * (cos(M_PI / std::max(rots, 3u)) - cos(M_PI / n)));
+  return sweep(n, start, out);
+}
+
+int Extrud::toVertices(VertexIndex& out) { return extrude(pt, out); }
+
+int Extrud::extrude(const std::vector<glm::vec2>& curve, VertexIndex& out) {
+  auto dirLen = glm::length(dir);
+  if (curve.size() < 3 || aspect < 0.f ||
+      dirLen < glm::epsilon<decltype(dirLen)>()) {
+    logE("invalid: pt.size=%zu aspect=%e |dir|=%e\n", curve.size(), aspect,
+         dirLen);
+    return 1;
+  }
+
+  TriBuf b;
+  auto& raw = b.raw;
+  const size_t n = curve.size();
+  // Each cap has n - 2 tris. The sides have 2 tris per quad.
+  size_t tris = 2 * (n - 2) + 2 * n;
+  raw.reserve(2 * n);
+  b.shared.reserve(3 * tris);
+  out.order.reserve(out.order.size() + 3 * tris);
+  // raw[0] to raw[n - 1] are the curve at Z = 0. raw[n] to raw[2n - 1] are
+  // the curve scaled by aspect at the end of dir.
+  for (auto& p : curve) {
+    raw.emplace_back();
+    raw.back().P = glm::vec3(p.x, p.y, 0.f);
+  }
+  for (auto& p : curve) {
+    raw.emplace_back();
+    raw.back().P = glm::vec3(p.x * aspect, p.y * aspect, 0.f) + dir;
+  }
+
+  // If dir points to -Z, the curve is clockwise as seen from the end cap.
+  bool flip = dir.z < 0.f;
+  auto tri = [&](size_t i0, size_t i1, size_t i2) -> int {
+    return flip ? doTri(i0, i2, i1, b, out, 0) : doTri(i0, i1, i2, b, out, 0);
+  };
+  // Generate the caps as a triangle fan.
+  for (size_t i = 2; i < n; i++) {
+    if (tri(0, i, i - 1) || tri(n, n + i - 1, n + i)) {
+      logE("Extrud: eval cap[%zu] failed\n", i);
+      return 1;
+    }
+  }
+  // Generate sides
+  for (size_t j = 0; j < n; j++) {
+    size_t k = (j + 1) % n;
+    if (tri(j, k, n + k) || tri(j, n + k, n + j)) {
+      logE("Extrud: eval face[%zu] failed\n", j);
+      return 1;
+    }
+  }
+  return doShared(b, out);
+}
+
+// segmentDist returns the distance from p to the line segment a-b.
+static float segmentDist(glm::vec2 p, glm::vec2 a, glm::vec2 b) {
+  glm::vec2 ab = b - a;
+  float len2 = glm::dot(ab, ab);
+  float t = len2 > 0.f ? glm::clamp(glm::dot(p - a, ab) / len2, 0.f, 1.f) : 0;
+  return glm::length(p - (a + ab * t));
+}
+
+int Extrud::toLodVertices(uint32_t level, VertexIndex& out, float& error) {
+  // Each level keeps half as many points of pt, but at least 3.
+  size_t n = pt.size();
+  size_t step = std::min(size_t(1) << std::min(level, 31u), n / 3);
+  step = std::max(step, size_t(1));
+  std::vector<glm::vec2> curve;
+  curve.reserve(n / step + 1);
+  error = 0.f;
+  for (size_t i = 0; i < n; i += step) {
+    curve.push_back(pt[i]);
+    size_t next = std::min(i + step, n);
+    for (size_t j = i + 1; j < next; j++) {
+      error = std::max(error, segmentDist(pt[j], pt[i], pt[next % n]));
+    }
+  }
+  error *= std::max(1.f, aspect);
+  return extrude(curve, out);
 }
 
 static glm::vec3 heightMapVec3(HeightMapPoint& pt, size_t x, size_t z,
@@ -163,49 +300,300 @@ static glm::vec3 heightMapVec3(HeightMapPoint& pt, size_t x, size_t z,
   return glm::vec3(x * scaleX, pt.y, z * scaleX * aspect);
 }
 
-int HeightMap::toVertices(VertexIndex& out) {
+// gridSamples returns lo, lo + step, lo + 2 * step, ... and always ends with
+// hi.
+static std::vector<size_t> gridSamples(size_t lo, size_t hi, size_t step) {
+  std::vector<size_t> r;
+  r.reserve((hi - lo + step - 1) / step + 3);
+  for (size_t i = lo; i < hi; i += step) {
+    r.push_back(i);
+  }
+  r.push_back(hi);
+  return r;
+}
+
+int HeightMap::checkSize(size_t& height) const {
   if (!pt) {
     logE("invalid: HeightMap::pt is null\n");
     return 1;
   }
-  size_t height = pt->size() / width;
+  height = width ? pt->size() / width : 0;
   if (width < 2 || height < 2 || pt->size() % width) {
     logE("invalid: width=%zu height=%zu, pt->size mod width = %zu\n",
-         width, height, pt->size() % width);
+         width, height, width ? pt->size() % width : 0);
+    return 1;
+  }
+  return 0;
+}
+
+int HeightMap::toVertices(VertexIndex& out) {
+  size_t height;
+  if (checkSize(height)) {
     return 1;
   }
+  return grid(0, 0, width - 1, height - 1, 1, 0.f, out);
+}
+
+int HeightMap::grid(size_t x0, size_t z0, size_t x1, size_t z1, size_t step,
+                    float skirt, VertexIndex& out) {
+  size_t height;
+  if (checkSize(height)) {
+    return 1;
+  }
+  if (x0 >= x1 || x1 >= width || z0 >= z1 || z1 >= height || !step) {
+    logE("invalid: grid(%zu, %zu, %zu, %zu) step=%zu width=%zu height=%zu\n",
+         x0, z0, x1, z1, step, width, height);
+    return 1;
+  }
+
+  // Sample every step'th row and column. Add one more sample on each side
+  // that is not the edge of pt. The tris there (the apron) are only used to
+  // average the normals, so they match the normals of the neighbor.
+  auto xs = gridSamples(x0, x1, step);
+  auto zs = gridSamples(z0, z1, step);
+  size_t ja = 0, ia = 0;
+  if (x0) {
+    xs.insert(xs.begin(), x0 > step ? x0 - step : 0);
+    ja = 1;
+  }
+  if (z0) {
+    zs.insert(zs.begin(), z0 > step ? z0 - step : 0);
+    ia = 1;
+  }
+  size_t jb = xs.size() - 1, ib = zs.size() - 1;
+  if (x1 < width - 1) {
+    xs.push_back(std::min(x1 + step, width - 1));
+  }
+  if (z1 < height - 1) {
+    zs.push_back(std::min(z1 + step, height - 1));
+  }
 
   HeightMapPoint* data = pt->data();
-  std::vector<indicesType> shared;
-  std::vector<Vertex> raw;
-  raw.reserve(width * height);
-  // Write a row for Z = 0
-  for (size_t j = 0; j < width; j++, data++) {
+  TriBuf b;
+  auto& raw = b.raw;
+  raw.reserve(xs.size() * zs.size());
+  size_t tris = 2 * (xs.size() - 1) * (zs.size() - 1);
+  size_t perFace = 0;  // eval can change this, but it is a good guess.
+  for (size_t i = ia + 1; i <= ib; i++) {
+    HeightMapPoint* row = data + zs[i] * width;
+    for (size_t j = ja + 1; j <= jb; j++) {
+      perFace += (row[xs[j]].flags & VERT_PER_FACE) +
+                 (row[xs[j - 1]].flags & VERT_PER_FACE);
+    }
+  }
+  b.shared.reserve(3 * (tris - perFace));
+  out.vert.reserve(out.vert.size() + 3 * perFace);
+  out.order.reserve(out.order.size() + 3 * tris);
+  // face emits a tri, or if it is in the apron, only adds it to the normals.
+  auto face = [&](indicesType i0, indicesType i1, indicesType i2,
+                  uint32_t flags, bool apron) -> int {
+    if (!apron) {
+      return doTri(i0, i1, i2, b, out, flags);
+    }
+    if (flags) {
+      return 0;  // A VERT_PER_FACE tri does not change the normals.
+    }
+    // eval may still set VERT_PER_FACE. Then doTri writes the tri to out,
+    // which would draw it on top of the neighbor's, so undo that too.
+    size_t n = b.shared.size(), nv = out.vert.size(), no = out.order.size();
+    if (doTri(i0, i1, i2, b, out, 0)) {
+      return 1;
+    }
+    b.shared.resize(n);
+    out.vert.resize(nv);
+    out.order.resize(no);
+    return 0;
+  };
+  // Write a row for the first Z
+  HeightMapPoint* row = data + zs[0] * width;
+  for (auto x : xs) {
     raw.emplace_back();
-    raw.back().P = heightMapVec3(*data, j, 0, scaleX, aspect);
+    raw.back().P = heightMapVec3(row[x], x, zs[0], scaleX, aspect);
   }
-  for (size_t i = 1; i < height; i++) {
+  for (size_t i = 1; i < zs.size(); i++) {
+    row = data + zs[i] * width;
     raw.emplace_back();
-    raw.back().P = heightMapVec3(*data, 0, i, scaleX, aspect);
-    data++;
-    for (size_t j = 1; j < width; j++, data++) {
+    raw.back().P = heightMapVec3(row[xs[0]], xs[0], zs[i], scaleX, aspect);
+    for (size_t j = 1; j < xs.size(); j++) {
       indicesType p3 = raw.size();  // Grab raw.size() before emplace_back()
       raw.emplace_back();
-      raw.back().P = heightMapVec3(*data, j, i, scaleX, aspect);
-      indicesType p1 = p3 - width;
-      if (doTri(p1 - 1, p3, p1, raw, shared, out,
-                data[0].flags & VERT_PER_FACE)) {
+      raw.back().P = heightMapVec3(row[xs[j]], xs[j], zs[i], scaleX, aspect);
+      indicesType p1 = p3 - xs.size();
+      bool apron = i <= ia || i > ib || j <= ja || j > jb;
+      if (face(p1 - 1, p3, p1, row[xs[j]].flags & VERT_PER_FACE, apron)) {
         logE("HeightMap: eval [%zu,%zu,%d] failed\n", j, i, 0);
         return 1;
       }
-      if (doTri(p1 - 1, p3 - 1, p3, raw, shared, out,
-                data[-1].flags & VERT_PER_FACE)) {
+      if (face(p1 - 1, p3 - 1, p3, row[xs[j - 1]].flags & VERT_PER_FACE,
+               apron)) {
         logE("HeightMap: eval [%zu,%zu,%d] failed\n", j, i, 1);
         return 1;
       }
     }
   }
-  return doShared(raw, shared, out);
+  size_t base = out.vert.size();  // doShared puts the VERT_PER_FACE first.
+  if (doShared(b, out)) {
+    return 1;
+  }
+  if (skirt <= 0.f) {
+    return 0;
+  }
+
+  // Hang a skirt down from each edge. It hides the cracks to a neighbor
+  // with a different step.
+  static constexpr indicesType unused = ~indicesType(0);
+  size_t nx = xs.size();
+  struct {
+    size_t first, stride, n;
+    glm::vec3 outward;
+  } edge[4] = {
+      {ia * nx + ja, 1, jb - ja + 1, glm::vec3(0.f, 0.f, -1.f)},
+      {ib * nx + ja, 1, jb - ja + 1, glm::vec3(0.f, 0.f, 1.f)},
+      {ia * nx + ja, nx, ib - ia + 1, glm::vec3(-1.f, 0.f, 0.f)},
+      {ia * nx + jb, nx, ib - ia + 1, glm::vec3(1.f, 0.f, 0.f)},
+  };
+  for (auto& e : edge) {
+    indicesType prevTop = unused, prevLow = unused;
+    for (size_t k = 0; k < e.n; k++) {
+      indicesType r = b.remap[e.first + k * e.stride];
+      if (r == unused) {
+        prevTop = unused;  // This vertex is only used by VERT_PER_FACE tris.
+        continue;
+      }
+      indicesType top = r + base;
+      indicesType low = out.vert.size();
+      out.vert.push_back(out.vert[top]);
+      out.vert.back().P.y -= skirt;
+      if (prevTop != unused) {
+        auto& a = out.vert[prevTop].P;
+        auto& c = out.vert[top].P;
+        auto N = glm::cross(c - a, out.vert[low].P - c);
+        if (glm::dot(N, e.outward) >= 0.f) {
+          out.order.insert(out.order.end(), {prevTop, top, low});
+          out.order.insert(out.order.end(), {prevTop, low, prevLow});
+        } else {
+          out.order.insert(out.order.end(), {prevTop, low, top});
+          out.order.insert(out.order.end(), {prevTop, prevLow, low});
+        }
+      }
+      prevTop = top;
+      prevLow = low;
+    }
+  }
+  return 0;
+}
+
+// gridHeight interpolates the height at pt[z * width + x] from the corners
+// of the tris that cover it in a grid sampled at xs and zs.
+static float gridHeight(const HeightMapPoint* data, size_t width,
+                        const std::vector<size_t>& xs, size_t j,
+                        const std::vector<size_t>& zs, size_t i, size_t x,
+                        size_t z) {
+  float h00 = data[zs[i - 1] * width + xs[j - 1]].y;
+  float h10 = data[zs[i - 1] * width + xs[j]].y;
+  float h01 = data[zs[i] * width + xs[j - 1]].y;
+  float h11 = data[zs[i] * width + xs[j]].y;
+  float u = float(x - xs[j - 1]) / (xs[j] - xs[j - 1]);
+  float v = float(z - zs[i - 1]) / (zs[i] - zs[i - 1]);
+  // grid splits each quad from (j - 1, i - 1) to (j, i).
+  if (u >= v) {
+    return h00 + u * (h10 - h00) + v * (h11 - h10);
+  }
+  return h00 + v * (h01 - h00) + u * (h11 - h01);
+}
+
+float HeightMap::gridError(size_t x0, size_t z0, size_t x1, size_t z1,
+                           size_t step) const {
+  auto xs = gridSamples(x0, x1, step);
+  auto zs = gridSamples(z0, z1, step);
+  const HeightMapPoint* data = pt->data();
+  float error = 0.f;
+  for (size_t i = 1; i < zs.size(); i++) {
+    for (size_t z = zs[i - 1]; z <= zs[i]; z++) {
+      for (size_t j = 1; j < xs.size(); j++) {
+        for (size_t x = xs[j - 1]; x <= xs[j]; x++) {
+          float h = gridHeight(data, width, xs, j, zs, i, x, z);
+          error = std::max(error, fabsf(data[z * width + x].y - h));
+        }
+      }
+    }
+  }
+  return error;
+}
+
+int HeightMap::toLodVertices(uint32_t level, VertexIndex& out, float& error) {
+  size_t height;
+  if (checkSize(height)) {
+    return 1;
+  }
+  // Each level samples every other row and column of the previous level.
+  size_t step = size_t(1) << std::min(level, 31u);
+  if (grid(0, 0, width - 1, height - 1, step, 0.f, out)) {
+    return 1;
+  }
+  // error is the largest vertical distance from a point in pt to the LOD.
+  error = gridError(0, 0, width - 1, height - 1, step);
+  return 0;
+}
+
+void Hasher::add(const void* data, size_t n) {
+  static constexpr uint64_t prime = 0x100000001b3ull;
+  auto p = reinterpret_cast<const unsigned char*>(data);
+  for (; n >= sizeof(uint64_t); n -= sizeof(uint64_t)) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    h = (h ^ w) * prime;
+    p += sizeof(w);
+  }
+  for (; n; n--) {
+    h = (h ^ *p++) * prime;
+  }
+}
+
+int BaseAsset::hash(Hasher&) const { return 1; }
+
+int BaseAsset::hashBase(Hasher& h, const char* type) const {
+  if (eval.first && !evalKey) {
+    return 1;
+  }
+  h.add(type, strlen(type));
+  h.add(optimize);
+  h.add(lods);
+  h.add(evalKey);
+  return 0;
+}
+
+int Revolv::hash(Hasher& h) const {
+  if (hashBase(h, "Revolv")) {
+    return 1;
+  }
+  h.add(rots);
+  h.add(rotStart);
+  h.add(aspectZ);
+  h.add(flags);
+  h.add(pt);
+  return 0;
+}
+
+int Extrud::hash(Hasher& h) const {
+  if (hashBase(h, "Extrud")) {
+    return 1;
+  }
+  h.add(dir);
+  h.add(aspect);
+  h.add(pt);
+  return 0;
+}
+
+int HeightMap::hash(Hasher& h) const {
+  if (!pt || hashBase(h, "HeightMap")) {
+    return 1;
+  }
+  h.add(width);
+  h.add(scaleX);
+  h.add(aspect);
+  h.add(*pt);
+  return 0;
 }
 
 }  // namespace asset
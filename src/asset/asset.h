@@ -9,24 +9,26 @@
 #include <glm/gtc/quaternion.hpp>
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
-#include <forward_list>
+#include <algorithm>
+#include <deque>
+#include <map>
 #include <memory>
 #include <set>
 #include <vector>
 
 #include "../uniformglue/uniformglue.h"
+#include "scatter.h"
+#include "suballoc.h"
 
 #pragma once
 
 namespace asset {
 
-#if 1
+// indicesType is the index type used on the CPU. Library converts indices to
+// 16 bits for a page that only holds assets with up to maxVertices16
+// vertices. See PageHeap::indexType.
 typedef uint32_t indicesType;
-static constexpr VkIndexType indexBufVkIndexType = VK_INDEX_TYPE_UINT32;
-#else
-typedef uint16_t indicesType;
-static constexpr VkIndexType indexBufVkIndexType = VK_INDEX_TYPE_UINT16;
-#endif
+static constexpr size_t maxVertices16 = 0xffff;
 
 // Vertex defines the per-vertex data all assets must provide.
 typedef struct Vertex {
@@ -60,6 +62,10 @@ typedef struct VertexIndex {
 typedef struct FreeBlock {
   size_t base{0};
   size_t use{0};
+  // cap is the size of the block. use can be less after Library::update().
+  size_t cap{0};
+  // id is the Suballoc id of the block.
+  uint32_t id{Suballoc::none};
 } FreeBlock;
 
 enum {
@@ -91,6 +97,135 @@ typedef int (*VertexEvalFn)(void* userData, std::vector<Vertex>& vert,
 // be written - Library can do partial updates of vertexBuf.
 typedef int (*VertexWriteFn)(void* userData, const Vertex& vert, void* dst);
 
+// VertexBatchFn is like VertexWriteFn but converts n vertices per call.
+// Vertex i goes to dst + i * Library::vertexSize. Library::writeBatch calls
+// it once per asset (or per chunk of a streamed asset) instead of once per
+// vertex, and your conversion loop can be inlined and vectorized.
+typedef int (*VertexBatchFn)(void* userData, const Vertex* vert, size_t n,
+                             void* dst);
+
+// batchOf makes a VertexBatchFn out of a per-vertex conversion the compiler
+// can inline:
+//   static void toMyVert(const Vertex& v, MyVert& out) { ... }
+//   lib.writeBatch(info, asset::batchOf<MyVert, toMyVert>, (void*)nullptr);
+template <typename T, void (*F)(const Vertex&, T&)>
+int batchOf(void* /*userData*/, const Vertex* vert, size_t n, T* dst) {
+  for (size_t i = 0; i < n; i++) {
+    F(vert[i], dst[i]);
+  }
+  return 0;
+}
+
+// TriBuf holds the working buffers for BaseAsset::doTri and doShared. Reserve
+// raw and shared before calling doTri so toVertices does not allocate for
+// each triangle.
+typedef struct TriBuf {
+  TriBuf() : tri(3) {}
+  // raw holds the vertices shared between faces. doTri sums normals in raw.
+  std::vector<Vertex> raw;
+  // shared holds 3 indices into raw for each face that is not VERT_PER_FACE.
+  std::vector<indicesType> shared;
+  // tri is the 3 vertices passed to VertexEvalFn.
+  std::vector<Vertex> tri;
+  // remap is used by doShared to map from raw to the output.
+  std::vector<indicesType> remap;
+} TriBuf;
+
+// Bounds is an axis-aligned bounding box.
+typedef struct Bounds {
+  glm::vec3 min{0.f, 0.f, 0.f};
+  glm::vec3 max{0.f, 0.f, 0.f};
+
+  // set computes the Bounds of all the vertices in 'vert'.
+  void set(const std::vector<Vertex>& vert) {
+    if (vert.empty()) {
+      min = max = glm::vec3(0.f);
+      return;
+    }
+    min = max = vert[0].P;
+    for (auto& v : vert) {
+      min = glm::min(min, v.P);
+      max = glm::max(max, v.P);
+    }
+  }
+  glm::vec3 extent() const { return max - min; }
+} Bounds;
+
+// CacheStats measures how well a mesh uses the post-transform vertex cache.
+typedef struct CacheStats {
+  // size is the number of entries in the simulated FIFO cache.
+  static constexpr size_t size = 16;
+  size_t misses{0};
+  // acmr is the average cache miss ratio: misses per triangle. Lower is
+  // better. It is at most 3, and about 0.5 for a large regular grid.
+  float acmr{0};
+  // atvr is the average transform to vertex ratio: misses per vertex. 1 is
+  // ideal, each vertex is transformed only once.
+  float atvr{0};
+} CacheStats;
+
+typedef struct OptimizeStats {
+  CacheStats before, after;
+} OptimizeStats;
+
+// Meshlet is a cluster of triangles in an asset, small enough to be culled
+// as a unit. Its tris are order[firstIndex] to order[firstIndex + indexCount
+// - 1] of the asset. To draw only this meshlet, add firstIndex to the
+// asset's inst.cmd.firstIndex.
+typedef struct Meshlet {
+  uint32_t firstIndex{0};
+  uint32_t indexCount{0};
+  // vertexCount is the number of unique vertices used by the meshlet.
+  uint32_t vertexCount{0};
+  // center and radius are the bounding sphere.
+  glm::vec3 center{0.f, 0.f, 0.f};
+  float radius{0.f};
+  // coneAxis and coneCos are the normal cone: every tri's normal N has
+  // dot(N, coneAxis) >= coneCos. coneCos is -1 if the normals are too spread
+  // out to ever cull the meshlet by facing.
+  glm::vec3 coneAxis{0.f, 0.f, 1.f};
+  float coneCos{-1.f};
+
+  // backfacing returns true if all the tris face away from 'eye'.
+  bool backfacing(glm::vec3 eye) const;
+} Meshlet;
+
+// MeshletStats measures how full the meshlets are.
+typedef struct MeshletStats {
+  size_t meshlets{0};
+  // vertFill is the average vertexCount / maxVerts.
+  float vertFill{0};
+  // triFill is the average tris / maxTris.
+  float triFill{0};
+} MeshletStats;
+
+// Lod is one level of detail of an asset. Like a Meshlet, its tris are
+// order[firstIndex] to order[firstIndex + indexCount - 1] of the asset.
+typedef struct Lod {
+  uint32_t firstIndex{0};
+  uint32_t indexCount{0};
+  // error is how far this level's surface may be from the full detail
+  // surface, in the asset's units (before any instance transform).
+  float error{0};
+} Lod;
+
+// Hasher is a 64-bit FNV-1a hash, done 8 bytes at a time. BaseAsset::hash
+// uses it to identify everything that goes into an asset.
+typedef struct Hasher {
+  uint64_t h{0xcbf29ce484222325ull};
+
+  void add(const void* data, size_t n);
+  template <typename T>
+  void add(const T& v) {
+    add(&v, sizeof(v));
+  }
+  template <typename T>
+  void add(const std::vector<T>& v) {
+    add(v.size());
+    add(v.data(), sizeof(T) * v.size());
+  }
+} Hasher;
+
 // BaseAsset::state() values
 enum BaseAssetState {
   INVALID = 0,
@@ -107,6 +242,10 @@ typedef struct BaseAsset {
   science::InstanceBuf inst;
 
   std::pair<VertexEvalFn, void*> eval{nullptr, nullptr};
+  // evalKey identifies what eval does. If eval is not null, set evalKey to a
+  // value that changes whenever eval would write something different, or
+  // hash() fails.
+  uint64_t evalKey{0};
 
   // toVertices validates the asset, calls eval and writes the result to 'out'.
   // toVertices always draws from vertex 0 - the inst.cmd.vertexOffset is used
@@ -114,20 +253,81 @@ typedef struct BaseAsset {
   virtual int toVertices(VertexIndex& out) = 0;
 
   // doTri is a helper method for the shapes to call eval.
-  int doTri(indicesType i0, indicesType i1, indicesType i2,
-            std::vector<Vertex>& raw, std::vector<indicesType>& shared,
+  int doTri(indicesType i0, indicesType i1, indicesType i2, TriBuf& b,
             VertexIndex& out, uint32_t flags);
 
-  // doShared is a helper method for the shapes to average normals.
-  int doShared(std::vector<Vertex>& raw, std::vector<indicesType>& shared,
-               VertexIndex& out);
+  enum {
+    OPTIMIZE_CACHE = 1,     // Reorder tris for the post-transform cache.
+    OPTIMIZE_OVERDRAW = 2,  // Draw outward-facing tris first. Implies CACHE.
+    OPTIMIZE_FETCH = 4,     // Renumber vertices in the order they are used.
+    OPTIMIZE_MESHLETS = 8,  // Build meshlets (see buildMeshlets).
+    OPTIMIZE_ALL = 15,
+  };
+  // optimize selects which optimizations toOptimizedVertices runs on the
+  // output of toVertices.
+  uint32_t optimize{0};
+  // optStats is the ACMR and ATVR before and after the optimizations. It is
+  // updated by toOptimizedVertices if optimize != 0.
+  OptimizeStats optStats;
+  // meshlet is set by toOptimizedVertices if optimize has OPTIMIZE_MESHLETS.
+  std::vector<Meshlet> meshlet;
+  MeshletStats meshletStats;
+
+  // lods is the number of levels of detail toOptimizedVertices generates.
+  // Set it to more than 1 only for assets that implement toLodVertices.
+  uint32_t lods{1};
+  // lod is set by toOptimizedVertices. lod[0] is the full detail asset, and
+  // is what Library::write() sets inst.cmd to draw. lod.size() can be less
+  // than lods if the asset cannot get any coarser. Only lod[0] has meshlets.
+  std::vector<Lod> lod;
+
+  // toLodVertices writes level of detail 'level' (1 or more) to 'out' and
+  // sets 'error' (see Lod::error). Each level should have a half or a
+  // quarter of the tris of the level before it.
+  virtual int toLodVertices(uint32_t level, VertexIndex& out, float& error);
+
+  // selectLod returns the coarsest level with an error on screen of at most
+  // maxPixels. 'dist' is the distance from the camera to the asset and
+  // projScale is viewport height / (2 * tan(fovy / 2)) times the scale of
+  // the instance transform.
+  uint32_t selectLod(float dist, float projScale, float maxPixels = 1) const;
+  // useLod sets inst.cmd to draw lod[level]. The asset must be READY.
+  WARN_UNUSED_RESULT int useLod(uint32_t level);
+
+  // bounds is the bounding box of the asset's vertices (before any
+  // instance transform). It is set by toOptimizedVertices.
+  Bounds bounds;
+
+  // toOptimizedVertices calls toVertices, sets bounds, and then runs the
+  // optimizations in 'optimize'. Library::write() calls this.
+  int toOptimizedVertices(VertexIndex& out);
+
+  // hash adds everything that goes into toOptimizedVertices to h: the type of
+  // asset and all its parameters. It returns 1 if the asset can not be
+  // hashed, and then Library::cache is not used for it. A subclass that
+  // changes what toVertices writes must also override hash.
+  virtual int hash(Hasher& h) const;
+
+  // doShared is a helper method for the shapes to average normals. It
+  // appends the vertices in b.raw that are used by a face to out, and drops
+  // the rest.
+  int doShared(TriBuf& b, VertexIndex& out);
 
   BaseAssetState state() const { return state_; }
+  // updating is true from Library::update() until write() switches inst.cmd
+  // to the new vertices. The asset stays READY and can be drawn.
+  bool updating() const { return updQueued_ || updUploading_; }
   size_t verts() const { return vblk.use; }
   size_t indices() const { return oblk.use; }
+  // page is the Library page that holds this asset. Call
+  // Library::bind(cmdBuf, page()) before drawing it.
+  size_t page() const { return page_; }
 
  protected:
   friend class Library;
+  friend class AssetQueue;
+  // hashBase adds 'type' and the parameters of BaseAsset to h.
+  int hashBase(Hasher& h, const char* type) const;
   // state is used by the Library to handle in-flight assets after Library::del
   // and assets after Library::add. To know when your asset can actually
   // be drawn (when you can set inst.cmd.instanceCount > 0), wait until
@@ -136,14 +336,32 @@ typedef struct BaseAsset {
   // block tracks where this is in the vertex and index buffer, updated by
   // Library::write().
   FreeBlock vblk, oblk;
+  // page_ is the index in Library::page, updated by Library::write().
+  uint32_t page_{0};
   // frameNumber is used by Library.
   uint32_t frameNumber{0};
+  // vspare and ospare are where Library::update() writes new vertices and
+  // indices while vblk and oblk are drawn. Then they are swapped.
+  // spareFrame is the frameNumber when the spare was last drawn.
+  FreeBlock vspare, ospare;
+  uint32_t spareFrame{0};
+  // updQueued_ is set from Library::update() until write() regenerates the
+  // asset. updUploading_ is set until the spare is swapped in.
+  bool updQueued_{false}, updUploading_{false};
+  // nextBounds_, nextLod_ and nextMeshlet_ describe the spare until it is
+  // swapped in.
+  Bounds nextBounds_;
+  std::vector<Lod> nextLod_;
+  std::vector<Meshlet> nextMeshlet_;
+  // cacheKey_ is set by Library::add() if the asset should be stored in
+  // Library::cache. 0 means it is not.
+  uint64_t cacheKey_{0};
 } BaseAsset;
 
 // Revolv creates the volume by revolving the line segments in 'pt' around the
 // origin, starting at 0 deg and sampling 'rots' times total around the +Y axis
 // A single "slice" can be made by setting rotStart to something other than 0.
-// NOTE: This does not do auto LOD, bezier curves - meant to be self-contained.
+// NOTE: This does not do bezier curves - meant to be self-contained.
 // WARNING: 'pt' is not validated. Beware non-convex or self-intersecting lines
 typedef struct Revolv : public BaseAsset {
   // rots is the number of times the sweep is sampled. Minimum of 3.
@@ -167,11 +385,18 @@ typedef struct Revolv : public BaseAsset {
 
   // toVertices validates the asset, calls eval and writes the result to 'out'.
   virtual int toVertices(VertexIndex& out);
+  // toLodVertices halves rots (and rotStart) for each level.
+  virtual int toLodVertices(uint32_t level, VertexIndex& out, float& error);
+  virtual int hash(Hasher& h) const;
+
+ protected:
+  // sweep is toVertices with n and start instead of rots and rotStart.
+  int sweep(uint32_t n, uint32_t start, VertexIndex& out);
 } Revolv;
 
 // Extrud creates the volume by extruding the closed curve of line segments in
 // 'pt' along the line 'dir'. The Z value for all points in 'pt' is 0.
-// NOTE: This does not do auto LOD, bezier curves - meant to be self-contained.
+// NOTE: This does not do bezier curves - meant to be self-contained.
 // WARNING: 'pt' is not validated. Beware non-convex or self-intersecting lines
 typedef struct Extrud : public BaseAsset {
   // dir is the extruding direction.
@@ -179,9 +404,18 @@ typedef struct Extrud : public BaseAsset {
   // aspect linearly scales the curve at the end of 'dir'. Minimum of 0.
   float aspect{1.0f};
   // pt defines the 2D closed curve extruded along extent. Minimum of 3.
+  // In order to maintain counter-clockwise order, pt must be
+  // counter-clockwise when seen from +Z.
   std::vector<glm::vec2> pt;
   // toVertices validates the asset, calls eval and writes the result to 'out'.
   virtual int toVertices(VertexIndex& out);
+  // toLodVertices keeps every other point of pt for each level.
+  virtual int toLodVertices(uint32_t level, VertexIndex& out, float& error);
+  virtual int hash(Hasher& h) const;
+
+ protected:
+  // extrude is toVertices with 'curve' instead of pt.
+  int extrude(const std::vector<glm::vec2>& curve, VertexIndex& out);
 } Extrud;
 
 typedef struct HeightMapPoint {
@@ -203,13 +437,12 @@ typedef struct HeightMapPoint {
 } HeightMapPoint;
 
 // HeightMap creates a surface from a 2D array of height data.
-// NOTE: This does not do auto LOD, bezier curves - meant to be self-contained.
+// NOTE: This does not do bezier curves - meant to be self-contained.
 // WARNING: data is not validated. Beware non-convex or self-intersecting lines
 typedef struct HeightMap : public BaseAsset {
-  // pt is a shared_ptr because no BaseAsset can be updated in Library in-place.
-  // Any updating must be done by removing and adding a new HeightMap.
-  // This shared_ptr allows the new HeightMap to refrence the same vector, and
+  // pt is a shared_ptr so a new HeightMap can refrence the same vector, and
   // even mutate it (since it is only evaluated when toVertices is called).
+  // After changing pt, call Library::update() to upload the new heights.
   //
   // X and Z values start with (0, y, 0) and range to (width - 1, y, height - 1)
   // where height is pt->size() / width; pt is a linearized 2D array.
@@ -222,6 +455,26 @@ typedef struct HeightMap : public BaseAsset {
   float aspect{1.0f};
   // toVertices validates the asset, calls eval and writes the result to 'out'.
   virtual int toVertices(VertexIndex& out);
+  // toLodVertices samples every 2^level'th row and column of pt. The last
+  // row and column are always kept so the edges do not move.
+  virtual int toLodVertices(uint32_t level, VertexIndex& out, float& error);
+  // hash reads all of pt, which takes a few ms for a large HeightMap. That
+  // is still much faster than toVertices.
+  virtual int hash(Hasher& h) const;
+
+ protected:
+  // checkSize validates pt and width and computes the height.
+  int checkSize(size_t& height) const;
+  // grid writes the points from (x0, z0) to (x1, z1) inclusive to 'out',
+  // sampling every step'th row and column. The last row and column are
+  // always kept. If skirt > 0, each edge gets a skirt that hangs skirt
+  // units down.
+  int grid(size_t x0, size_t z0, size_t x1, size_t z1, size_t step,
+           float skirt, VertexIndex& out);
+  // gridError is the largest vertical distance from a point in pt to the
+  // surface made by grid().
+  float gridError(size_t x0, size_t z0, size_t x1, size_t z1,
+                  size_t step) const;
 } HeightMap;
 
 typedef struct AssetLocRot {
@@ -230,9 +483,21 @@ typedef struct AssetLocRot {
   glm::vec3 loc;
 } AssetLocRot;
 
+// CsgStats counts what CsgOR::toVertices did.
+typedef struct CsgStats {
+  // generated is the number of unique children. Each is generated once.
+  size_t generated{0};
+  // welded is the number of vertices merged into another vertex.
+  size_t welded{0};
+  // dropped is the number of tris removed.
+  size_t dropped{0};
+} CsgStats;
+
 // CsgOR creates the volume which is the logical OR of each of the child assets
 // Each child asset has a euclidean transform (loc+rot) before being ORed in.
-// NOTE: CsgOR does not *optimize* the geometry. It just draws all the children
+// A child asset that is in 'child' more than once is only generated once.
+// NOTE: CsgOR only optimizes the geometry if flags are set. Otherwise it just
+// draws all the children.
 // NOTE: This differs from a Scene, below, in the sense that the geometry of
 // this asset, like all assets, is designed to be *immutable* on the GPU, or
 // at least *cached*, and changing it will be expensive.
@@ -241,14 +506,296 @@ typedef struct AssetLocRot {
 // is fast because of the fast instancing of all the immutable assets.
 typedef struct CsgOR : public BaseAsset {
   std::vector<AssetLocRot> child;
-  // toVertices validates the asset, calls eval and writes the result to 'out'.
+
+  enum {
+    // WELD merges vertices that round to the same multiple of weldDist and
+    // have the same N, uv, color and custom.
+    WELD = 1,
+    // DROP_ENCLOSED drops the tris of a child that are inside another child,
+    // such as where two children touch. The children must be closed volumes.
+    // This tests each tri against every child it overlaps, so it is slow for
+    // large children.
+    DROP_ENCLOSED = 2,
+  };
+  uint32_t flags{0};
+  float weldDist{1e-5f};
+  // csgStats is set by toVertices.
+  CsgStats csgStats;
+
+  // toVertices validates the asset and writes the children to 'out'. Each
+  // child's own eval is called. CsgOR::eval is not used.
+  // WARNING: a child must not contain this CsgOR.
   virtual int toVertices(VertexIndex& out);
+  // hash fails if any child can not be hashed.
+  virtual int hash(Hasher& h) const;
 } CsgOR;
 
+struct GenPool;
+struct GeomCache;
+struct GeomEntry;
+
+// PageHeap is the CPU side of a LibraryPage: which vertices and indices are
+// in use, and the index buffer.
+typedef struct PageHeap {
+  // indexType is VK_INDEX_TYPE_UINT16 or VK_INDEX_TYPE_UINT32.
+  VkIndexType indexType{VK_INDEX_TYPE_UINT32};
+  size_t indexSize() const {
+    return indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t)
+                                             : sizeof(uint32_t);
+  }
+
+  // vAlloc tracks which vertices in vertexBuf are in use.
+  Suballoc vAlloc;
+  // oAlloc tracks which indices in indexBuf are in use.
+  Suballoc oAlloc;
+  // order is the index buffer (on the CPU).
+  std::vector<indicesType> order;
+
+  // holds returns true if indexType can index nVerts vertices.
+  bool holds(size_t nVerts) const {
+    return nVerts <= maxVertices16 || indexType == VK_INDEX_TYPE_UINT32;
+  }
+
+  // alloc allocates nVerts in vAlloc and nIndices in oAlloc, and sets v and o
+  // to the new blocks. It returns 1 without logging anything if the page is
+  // full.
+  WARN_UNUSED_RESULT int alloc(size_t nVerts, size_t nIndices, FreeBlock& v,
+                               FreeBlock& o);
+
+  // free frees v and o, if they are allocated.
+  WARN_UNUSED_RESULT int free(FreeBlock& v, FreeBlock& o);
+
+  // reuse makes v and o hold nVerts and nIndices. If they are not allocated
+  // or too small, it frees them and allocates new blocks. Otherwise it only
+  // changes v.use and o.use. It returns 1 without logging anything if the
+  // page is full.
+  WARN_UNUSED_RESULT int reuse(size_t nVerts, size_t nIndices, FreeBlock& v,
+                               FreeBlock& o);
+
+  // allocIn allocates nVerts and nIndices in the first page that holds
+  // nVerts and has room. It returns the page, or page.size() if none does.
+  template <typename P>
+  static size_t allocIn(std::vector<std::shared_ptr<P>>& page, size_t nVerts,
+                        size_t nIndices, FreeBlock& v, FreeBlock& o) {
+    for (size_t pi = 0; pi < page.size(); pi++) {
+      if (page[pi]->holds(nVerts) &&
+          !page[pi]->alloc(nVerts, nIndices, v, o)) {
+        return pi;
+      }
+    }
+    return page.size();
+  }
+
+  // setOrder copies n indices from src to order at base.
+  void setOrder(size_t base, const indicesType* src, size_t n);
+
+  // copyIndices converts n indices to indexType and writes them to dst.
+  void copyIndices(char* dst, const indicesType* src, size_t n) const;
+} PageHeap;
+
+// LibraryPage is one vertex buffer and one index buffer of a Library.
+typedef struct LibraryPage : public PageHeap {
+  LibraryPage(language::Device& dev) : vertexBuf{dev}, indexBuf{dev} {
+    vertexBuf.info.usage =
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    indexBuf.info.usage =
+        VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  }
+  ~LibraryPage() {
+    if (vertMmap) {
+      vertexBuf.mem.munmap();
+    }
+    if (indexMmap) {
+      indexBuf.mem.munmap();
+    }
+  }
+
+  memory::Buffer vertexBuf;
+  // indexBuf is a copy of 'order' in device-local memory, converted to
+  // indexType.
+  memory::Buffer indexBuf;
+  // vertMmap and indexMmap are where vertexBuf and indexBuf are mapped in
+  // host memory if Library::isDirect(). Otherwise they are null.
+  char* vertMmap{nullptr};
+  char* indexMmap{nullptr};
+} LibraryPage;
+
+// AssetQueue is the bookkeeping of a Library. It queues the assets that were
+// added, deleted or updated, so write() only looks at the ones that changed,
+// and holds a deleted asset until no frame in flight can draw it. It does not
+// use the device: write() passes in the steps that do.
+typedef struct AssetQueue {
+  // frameIsDone returns true if the GPU is done with everything frame 'then'
+  // drew or copied by the time frame 'now' is recorded. UniformGlue::submit
+  // waits for frame now - framesInFlight before frame now, and the image of
+  // frame 'then' is not drawn again until swapImages - 1 frames later.
+  // write() uses this one rule to reuse upload, free blocks and spares.
+  static bool frameIsDone(uint32_t now, uint32_t then, size_t swapImages,
+                          size_t framesInFlight) {
+    size_t wait = std::max(swapImages ? swapImages - 1 : 0, framesInFlight);
+    return now >= then + wait;
+  }
+
+  // now is the frame being recorded. swapImages and framesInFlight are
+  // passed to frameIsDone with it. Library sets them at the start of write().
+  uint32_t now{0};
+  size_t swapImages{0};
+  size_t framesInFlight{1};
+  bool isDone(uint32_t then) const {
+    return frameIsDone(now, then, swapImages, framesInFlight);
+  }
+
+  std::set<std::shared_ptr<BaseAsset>> child;
+
+  // addQ holds assets in state ADDED in the order they were add()ed. If gen
+  // is set, gen holds them instead.
+  std::deque<std::shared_ptr<BaseAsset>> addQ;
+  // uploading holds assets in state ADD_WAIT until vFence is done.
+  std::vector<BaseAsset*> uploading;
+  // delQ holds assets in state DELETED until the next write().
+  std::deque<std::shared_ptr<BaseAsset>> delQ;
+  // freeQ holds assets in state DEL_WAIT. They are appended in frameNumber
+  // order, so only the front needs to be checked to see if it can be freed.
+  std::deque<std::shared_ptr<BaseAsset>> freeQ;
+  // updQ holds assets waiting to be regenerated by update().
+  std::deque<std::shared_ptr<BaseAsset>> updQ;
+  // updating holds assets with a spare that is uploading until vFence is
+  // done.
+  std::vector<std::shared_ptr<BaseAsset>> updating;
+
+  // addChild puts asset in child in state ADDED. The caller then puts it in
+  // addQ (or somewhere that will put it in addQ).
+  WARN_UNUSED_RESULT int addChild(std::shared_ptr<BaseAsset> asset);
+  // del moves a READY asset to delQ. See Library::del.
+  WARN_UNUSED_RESULT int del(std::shared_ptr<BaseAsset> asset);
+  // update puts a READY asset in updQ. See Library::update.
+  WARN_UNUSED_RESULT int update(std::shared_ptr<BaseAsset> asset);
+
+  // uploadDone is called when everything in uploading and updating is on the
+  // GPU. Assets in uploading become READY, except 'streaming', which waits
+  // for more chunks. swapFn(a) switches each asset in updating to its spare,
+  // unless del() was called.
+  template <typename F>
+  void uploadDone(const BaseAsset* streaming, F swapFn) {
+    size_t keep = 0;
+    for (auto a : uploading) {
+      if (a == streaming) {
+        uploading.at(keep++) = a;
+      } else {
+        a->state_ = READY;
+      }
+    }
+    uploading.resize(keep);
+    for (auto& a : updating) {
+      a->updUploading_ = false;
+      if (a->state() == READY) {
+        swapFn(*a);
+      }
+    }
+    updating.clear();
+  }
+
+  // retire calls freeFn(a) for each asset in freeQ once isDone(), then makes
+  // it INVALID and drops it from child. Then it moves delQ to freeQ. The GPU
+  // stops drawing a deleted asset at once: its inst.cmd.indexCount is 0.
+  template <typename F>
+  WARN_UNUSED_RESULT int retire(F freeFn) {
+    for (; !freeQ.empty(); freeQ.pop_front()) {
+      auto& a = *freeQ.front();
+      if (!isDone(a.frameNumber)) {
+        // Some in-flight GPU frames may still be drawing it. Everything after
+        // it in freeQ was deleted later.
+        break;
+      }
+      if (freeFn(a)) {  // Now it is safe to free the vertices
+        logE("write: free failed\n");
+        return 1;
+      }
+      a.updUploading_ = false;
+      a.state_ = INVALID;
+      child.erase(freeQ.front());
+    }
+    for (; !delQ.empty(); delQ.pop_front()) {
+      auto& a = *delQ.front();
+      a.inst.cmd.indexCount = 0;  // First tell the GPU to stop drawing it.
+      a.state_ = DEL_WAIT;
+      a.frameNumber = now;
+      freeQ.emplace_back(delQ.front());
+    }
+    return 0;
+  }
+
+  // takeAdded calls allocFn(a) for each asset in addQ. allocFn moves 'a' to
+  // ADD_WAIT, or leaves it ADDED if upload is full. Then the rest of addQ
+  // waits for the next write().
+  template <typename F>
+  WARN_UNUSED_RESULT int takeAdded(F allocFn) {
+    for (; !addQ.empty(); addQ.pop_front()) {
+      auto& a = *addQ.front();
+      if (a.state() != ADDED) {
+        logE("BUG: write: addQ asset state=%d\n", (int)a.state());
+        return 1;
+      }
+      if (allocFn(a)) {
+        return 1;
+      }
+      if (a.state() == ADDED) {
+        break;  // upload is full.
+      }
+      uploading.emplace_back(&a);
+    }
+    return 0;
+  }
+
+  // takeUpdates calls writeFn(a) for each asset in updQ that is still READY
+  // and whose spare is not uploading or drawn. writeFn clears a.updQueued_
+  // and sets a.updUploading_, or leaves them if upload is full.
+  template <typename F>
+  WARN_UNUSED_RESULT int takeUpdates(F writeFn) {
+    for (size_t n = updQ.size(); n; n--) {
+      auto a = updQ.front();
+      updQ.pop_front();
+      if (a->state() != READY) {
+        a->updQueued_ = false;  // del() was called.
+        continue;
+      }
+      if (a->updUploading_ ||
+          (a->vspare.id != Suballoc::none && !isDone(a->spareFrame))) {
+        // The spare is still uploading or may still be drawn.
+        updQ.emplace_back(a);
+        continue;
+      }
+      if (writeFn(*a)) {
+        logE("write: update failed\n");
+        return 1;
+      }
+      if (a->updQueued_) {
+        updQ.emplace_back(a);  // upload is full.
+      } else {
+        updating.emplace_back(a);
+      }
+    }
+    return 0;
+  }
+
+  void clear() {
+    child.clear();
+    addQ.clear();
+    uploading.clear();
+    delQ.clear();
+    freeQ.clear();
+    updQ.clear();
+    updating.clear();
+  }
+} AssetQueue;
+
 // Library maintains the vertex and index buffers on the GPU (with help from
-// your app) for assets - shapes you can render. Library holds vertexBuf and
-// indexBuf inside it, in device-local memory.
-// TODO: add support for GPUs that prefer host-visible memory (mobile GPUs).
+// your app) for assets - shapes you can render. Library holds one or more
+// pages, each with a vertexBuf and indexBuf in device-local memory.
+//
+// On GPUs where device-local memory is also host-visible (most mobile and
+// integrated GPUs), Library writes straight into the pages instead of
+// copying through upload. See UniformGlue::directWrite.
 //
 // NOTE: This is not a Scene, this is a std::set of assets.
 // Your app can load and unload assets on the fly, but keep in mind the design
@@ -271,23 +818,37 @@ typedef struct CsgOR : public BaseAsset {
 // than you need, then dynamically set some number of them so that
 // instanceCount is not 0 any more, depending on how many are needed after you
 // add() or del())
-typedef struct Library {
+typedef struct Library : protected AssetQueue {
   Library(UniformGlue& uglue)
-      : uglue{uglue}, vertexBuf{uglue.shaders.dev},
-        indexBuf{uglue.shaders.dev} {
+      : uglue{uglue}, upload{uglue.shaders.dev}, uploadCmd{uglue.stage.pool} {
     uglue.setMoveVertexBuf("using asset::Library instead of UniformGlue!");
 
     // You must call ctorError to allocate the buffers.
-    vertexBuf.info.size = 0;
-    vertexBuf.info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-    indexBuf.info.size = 0;
-    indexBuf.info.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
+    upload.info.size = 0;
+    upload.info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  }
+  ~Library() {
+    if (uploadMmap) {
+      upload.mem.munmap();
+    }
   }
 
-  // ctorError allocates fixed-size vertex and index buffers. This puts your
-  // app in control of memory usage. If you are running out of space in the
-  // buffers and need to dynamically add more buffers, create a new Library
-  // or experiment with asset streaming (calling del() on some assets).
+  // ctorError allocates the first page of vertex and index buffers. This
+  // puts your app in control of memory usage. When no page has room for an
+  // asset, write() adds another page of pageVertices and pageIndices (or
+  // more, if the asset needs more). Set maxPages to limit the number of
+  // pages.
+  //
+  // Set maxVertices before calling ctorError to choose the size of the first
+  // vertexBuf. If maxVertices is 0, it is set to uglue.stage.mmapMax() /
+  // vertexSize. Set uploadSize to choose the size of upload. If uploadSize is
+  // 0, it is set to uglue.stage.mmapMax(). vertexBuf and indexBuf can be much
+  // larger than upload: an asset that does not fit is streamed through
+  // upload over several calls to write().
+  //
+  // ctorError also calls uglue.useDirectWrite(). If it returns true, the
+  // pages are allocated in host-visible memory and stay mapped, and upload
+  // is not allocated. uploadSize is then not used.
   WARN_UNUSED_RESULT int ctorError(size_t vertexSize, size_t instSize,
                                    size_t maxIndices,
                                    size_t bindingIndexOfInstanceBuf);
@@ -321,30 +882,98 @@ typedef struct Library {
   }
 
   UniformGlue& uglue;
-  // vertexBuf is the one vertex buffer for the Library.
-  memory::Buffer vertexBuf;
+  // page holds the vertex and index buffers. write() adds pages as needed
+  // and sets uglue.needRebuild so command buffers can bind the new page.
+  std::vector<std::shared_ptr<LibraryPage>> page;
 
-  // indexBuf is a copy of 'order' in device-local memory.
-  memory::Buffer indexBuf;
+  // upload is a host-visible staging buffer. write() packs all the assets it
+  // can fit into upload, then copies them to vertexBuf and indexBuf with a
+  // single command buffer (one VkBufferCopy region per asset).
+  // If isDirect(), upload is not used.
+  memory::Buffer upload;
+
+  // isDirect returns true if write() writes straight into the pages. Then
+  // write() does not add anything to the SubmitInfo: assets are READY and
+  // updates are switched in as soon as write() returns.
+  bool isDirect() const { return direct; }
+  // directCapacity is the capacity of pack if isDirect(): there is no upload
+  // to run out of, so no asset waits for the next write() or is streamed.
+  static constexpr VkDeviceSize directCapacity = ~VkDeviceSize(0) >> 1;
+
+  using AssetQueue::frameIsDone;
 
   size_t vertexSize{0};
   size_t instSize{0};
   size_t maxVertices{0};
   size_t maxIndices{0};
+  size_t uploadSize{0};
+  // pageVertices and pageIndices are the size of pages after the first page.
+  // If 0, maxVertices and maxIndices are used.
+  size_t pageVertices{0};
+  size_t pageIndices{0};
+  // maxPages limits the number of pages. If 0, there is no limit.
+  size_t maxPages{0};
+  // layout chooses how write() fills vertexBuf:
+  // * LAYOUT_APP: your VertexWriteFn writes each vertex.
+  // * LAYOUT_COMPACT: write() encodes each vertex as a CompactVertex (see
+  //   compact.h) using BaseAsset::bounds, a whole asset at a time. Then it
+  //   calls your VertexWriteFn or VertexBatchFn, if it is not null, which
+  //   may change the CompactVertex. The vertexSize passed to ctorError must
+  //   be sizeof(CompactVertex) plus instSize.
+  enum VertexLayout {
+    LAYOUT_APP = 0,
+    LAYOUT_COMPACT,
+  };
+  VertexLayout layout{LAYOUT_APP};
+  // index16 allows pages with 16-bit indices, which halves the size of
+  // indexBuf. An asset with more than maxVertices16 vertices is put in a page
+  // with 32-bit indices, which is added if needed. Set index16 to false
+  // before ctorError to use 32-bit indices everywhere.
+  bool index16{true};
+  // indexTypeFor is the indexType of a page added for an asset with nVerts
+  // vertices.
+  static VkIndexType indexTypeFor(size_t nVerts, bool index16) {
+    return (index16 && nVerts <= maxVertices16) ? VK_INDEX_TYPE_UINT16
+                                                : VK_INDEX_TYPE_UINT32;
+  }
+  // cache, if not null, is checked by add() for a copy of the asset that was
+  // written by an earlier run. On a hit, write() copies the asset from the
+  // cache to upload without calling toVertices or writeFn. On a miss, write()
+  // stores the asset in the cache. Assets that can not be hashed, assets
+  // streamed through upload and update() do not use the cache.
+  std::shared_ptr<GeomCache> cache;
+  // cacheLayout is part of the key of every asset in cache. Change it
+  // whenever writeFn would write something different.
+  uint64_t cacheLayout{0};
   size_t bindingIndexOfInstanceBuf{0};
-  size_t getIndicesUsed() const { return order.size(); }
-  const std::vector<indicesType>& getIndices() { return order; }
+  size_t getIndicesUsed(size_t p = 0) const { return page.at(p)->order.size(); }
+  // getVertStats and getIndexStats report how full and how fragmented the
+  // vertex and index buffers are.
+  void getVertStats(Suballoc::Stats& out, size_t p = 0) const {
+    page.at(p)->vAlloc.getStats(out);
+  }
+  void getIndexStats(Suballoc::Stats& out, size_t p = 0) const {
+    page.at(p)->oAlloc.getStats(out);
+  }
+  const std::vector<indicesType>& getIndices(size_t p = 0) {
+    return page.at(p)->order;
+  }
 
   // reset clears the entire Library, but does not destroy vertex and index
   // buffers on the GPU. Reduces CPU memory usage if you do not call add() or
   // del() after this point.
   int clear() {
-    if (vFlight || iFlight || vFence) {
+    if (vFence || stream.asset || genBusy()) {
       logE("clear: write is busy\n");
       return 1;
     }
-    child.clear();
-    order.clear();
+    AssetQueue::clear();
+    cached.clear();
+    for (auto& p : page) {
+      p->vAlloc.reset(p->vAlloc.getTotal());
+      p->oAlloc.reset(p->oAlloc.getTotal());
+      p->order.clear();
+    }
     return 0;
   }
 
@@ -358,16 +987,47 @@ typedef struct Library {
   // del removes an asset from the Library. Note that until all in-flight
   // GPU operations are complete, the GPU memory is still used. Call write()
   // each frame to let Library work on freeing up GPU memory.
-  int del(std::shared_ptr<BaseAsset> asset);
+  int del(std::shared_ptr<BaseAsset> asset) { return AssetQueue::del(asset); }
+
+  // update regenerates an asset that is READY and uploads it into the
+  // Library again without a del() and add(). The asset stays READY: the old
+  // vertices are drawn until write() switches inst.cmd to the new ones (it
+  // also resets inst.cmd to lod[0]). BaseAsset::updating() is true until
+  // then.
+  //
+  // The first update() allocates a spare block in the asset's page. After
+  // that, the asset swaps between its two blocks, so updates do not churn
+  // the allocator as long as the vertex and index counts do not grow. The
+  // spare is only written after all frames that drew it are done. Calling
+  // update() again before then is fine: the asset is regenerated once more.
+  //
+  // update() always calls toVertices() inside write(), even after
+  // setWorkers(n > 0).
+  int update(std::shared_ptr<BaseAsset> asset) {
+    return AssetQueue::update(asset);
+  }
+
+  // setWorkers moves toVertices() off the thread that calls write(). After
+  // setWorkers(n > 0), add() queues the asset for one of n worker threads,
+  // and write() picks up finished assets in the order they were add()ed.
+  // setWorkers(0) (the default) calls toVertices() inside write().
+  // It is an error to call setWorkers while any asset is in state ADDED.
+  //
+  // WARNING: toVertices and your VertexEvalFn then run on a worker thread.
+  // Do not modify an asset until it leaves the ADDED state.
+  WARN_UNUSED_RESULT int setWorkers(size_t n);
 
   // write calls toVertices() on assets in the Library to populate your vertex
   // and index buffers. Call write() even if nothing has been added or removed,
   // because this Library will track when in-flight GPU operations are
-  // complete and then do delayed cleanup.
+  // complete and then do delayed cleanup. write() only looks at assets that
+  // changed, so it costs almost nothing when there is nothing to do.
   //
   // Because write() does delayed operations, it can sometimes do *nothing*
   // at all. Always check BaseAsset::state(), for an add() wait until it is
   // READY; for a del() wait until it is INVALID.
+  //
+  // writeFn can only be null if layout is LAYOUT_COMPACT.
   WARN_UNUSED_RESULT int write(command::SubmitInfo& info, VertexWriteFn writeFn,
                                void* userData);
 
@@ -384,16 +1044,41 @@ typedef struct Library {
     return write(info, reinterpret_cast<VertexWriteFn>(writeFn), userData);
   }
 
-  // bind calls bind on the vertex and index buffers in the command buffer.
-  // NOTE: Your app must call bind, it allocates the per-framebuf index buffers
-  WARN_UNUSED_RESULT int bind(command::CommandBuffer& cmdBuf) {
-    VkBuffer vertexBuffers[] = {vertexBuf.vk};
+  // writeBatch is write() with a VertexBatchFn, which converts all the
+  // vertices of an asset in one call. batchFn can only be null if layout is
+  // LAYOUT_COMPACT.
+  WARN_UNUSED_RESULT int writeBatch(command::SubmitInfo& info,
+                                    VertexBatchFn batchFn, void* userData);
+
+  template <typename U, typename T>
+  WARN_UNUSED_RESULT int writeBatch(
+      command::SubmitInfo& info,
+      int (*batchFn)(U* userData, const Vertex* vert, size_t n, T* dst),
+      U* userData) {
+    if (sizeof(T) != vertexSize) {
+      logE("Library::writeBatch: %zu does not match ctorError(%zu)\n",
+           sizeof(T), (size_t)vertexSize);
+      return 1;
+    }
+    return writeBatch(info, reinterpret_cast<VertexBatchFn>(batchFn),
+                      userData);
+  }
+
+  // bind calls bind on the vertex and index buffers of page 'p' in the
+  // command buffer, using the page's indexType. Bind BaseAsset::page()
+  // before drawing an asset.
+  WARN_UNUSED_RESULT int bind(command::CommandBuffer& cmdBuf, size_t p = 0) {
+    if (p >= page.size()) {
+      logE("Library::bind(%zu): only %zu pages\n", p, page.size());
+      return 1;
+    }
+    VkBuffer vertexBuffers[] = {page.at(p)->vertexBuf.vk};
     size_t sizeOfVertexIn = sizeof(vertexBuffers) / sizeof(vertexBuffers[0]);
     VkDeviceSize offsets[] = {0};
     return cmdBuf.bindVertexBuffers(0, sizeOfVertexIn, vertexBuffers,
                                     offsets) ||
-           cmdBuf.bindIndexBuffer(indexBuf.vk, 0 /*indexBufOffset*/,
-                                  indexBufVkIndexType);
+           cmdBuf.bindIndexBuffer(page.at(p)->indexBuf.vk,
+                                  0 /*indexBufOffset*/, page.at(p)->indexType);
   }
 
   WARN_UNUSED_RESULT int bindInstBuf(
@@ -410,30 +1095,125 @@ typedef struct Library {
     return 0;
   }
 
+  // Writer is the VertexWriteFn or VertexBatchFn passed to write() or
+  // writeBatch(). At most one of fn and batch is set.
+  typedef struct Writer {
+    VertexWriteFn fn;
+    VertexBatchFn batch;
+    void* userData;
+  } Writer;
+
+  // writeVerts writes n vertices to dst in the format set by layout. bounds
+  // is the BaseAsset::bounds of the asset. Each write() calls it for every
+  // asset it uploads.
+  static int writeVerts(VertexLayout layout, size_t vertexSize,
+                        const Bounds& bounds, const Vertex* v, size_t n,
+                        char* dst, const Writer& w);
+
+  // hashFor computes the key of 'a' in cache for a Library with these
+  // settings. It returns 1 if 'a' can not be hashed.
+  static int hashFor(const BaseAsset& a, size_t vertexSize,
+                     VertexLayout layout, uint64_t cacheLayout, Hasher& h);
+
+  // Stream tracks an asset too big for upload. It is copied into page
+  // 'page' in chunks, one per write(): first all the vertices, then all the
+  // indices.
+  typedef struct Stream {
+    BaseAsset* asset{nullptr};
+    VertexIndex out;
+    size_t page{0};
+    // vbase and obase are where the asset starts in the page.
+    size_t vbase{0}, obase{0};
+    size_t vertexSize{0}, indexSize{0};
+    // v and o are how many vertices and indices have been copied.
+    size_t v{0}, o{0};
+
+    // Chunk is what next() added: vertices [v, v + nv) at vsrc in upload and
+    // indices [o, o + no) at osrc.
+    typedef struct Chunk {
+      size_t v, nv;
+      VkDeviceSize vsrc;
+      size_t o, no;
+      VkDeviceSize osrc;
+    } Chunk;
+
+    // next adds the next chunk to pack, as much as pack.avail() allows.
+    WARN_UNUSED_RESULT int next(Scatter& pack, Chunk& c);
+
+    bool done() const {
+      return v >= out.vert.size() && o >= out.order.size();
+    }
+  } Stream;
+
  protected:
-  std::set<std::shared_ptr<BaseAsset>> child;
+  // cached holds the cache entry of each asset in addQ that was found in
+  // cache.
+  std::map<BaseAsset*, std::shared_ptr<GeomEntry>> cached;
 
-  // freeV is the list of FreeBlock records for allocating vertices
-  std::forward_list<FreeBlock> freeV;
-  // freeO is the list of FreeBlock records for allocating indices
-  std::forward_list<FreeBlock> freeO;
-  size_t totalVertUse{0}, totalOrderUse{0};
+  // gen runs toVertices on worker threads, if setWorkers(n > 0).
+  std::shared_ptr<GenPool> gen;
+  bool genBusy();
 
-  // order is the index buffer (on the CPU).
-  std::vector<indicesType> order;
+  // addPage adds a page with room for nVerts and nIndices.
+  int addPage(size_t nVerts, size_t nIndices, VkIndexType indexType);
 
-  // vFlight is the write to the vertex buf.
-  std::shared_ptr<memory::Flight> vFlight;
-  // iFlight is the write to the index buf.
-  std::shared_ptr<memory::Flight> iFlight;
-  // vFence signals when the writes both are complete.
+  // direct is set by ctorError from uglue.useDirectWrite().
+  bool direct{false};
+  // uploadMmap is where upload is mapped in host memory.
+  char* uploadMmap{nullptr};
+  // uploadCmd copies from upload to vertexBuf and indexBuf.
+  command::CommandBuffer uploadCmd;
+  // pack tracks the regions in upload for the current write(). If direct,
+  // pack has no capacity limit and its regions are what was written to
+  // each page.
+  Scatter pack;
+  // dest adds 'size' bytes to pack for destination 'dst' (2 * page for
+  // vertexBuf, 2 * page + 1 for indexBuf) at dstOffset. It sets out to where
+  // the bytes should be written: in upload, or in the page if direct.
+  int dest(size_t dst, VkDeviceSize dstOffset, VkDeviceSize size, char*& out);
+  Stream stream;
+  // writeWith implements write() and writeBatch().
+  int writeWith(command::SubmitInfo& info, const Writer& w);
+  // writeVerts calls writeVerts, above, with this Library's layout.
+  int writeVerts(BaseAsset& a, const Vertex* v, size_t n, char* dst,
+                 const Writer& w) {
+    return writeVerts(layout, vertexSize, a.bounds, v, n, dst, w);
+  }
+  // streamChunk copies the next part of stream.asset into upload.
+  int streamChunk(const Writer& w);
+
+  // vFence signals when uploadCmd is complete.
   std::shared_ptr<command::Fence> vFence;
+  // flightFrameNumber is the uglue.frameNumber when uploadCmd was submitted.
+  uint32_t flightFrameNumber{0};
+  // alloc finds space for 'out' in a page and in upload, and writes 'out' to
+  // upload. It implements the heap in vertexBuf and indexBuf.
+  // It updates a.inst.cmd.vertexOffset and a.inst.cmd.firstIndex. If upload
+  // is full, a.state() stays ADDED.
+  int alloc(VertexIndex& out, BaseAsset& a, const Writer& w);
+  // allocAdded is what write() does for each asset in addQ: it copies a hit
+  // from cached, or calls toOptimizedVertices into 'out' and then alloc.
+  int allocAdded(VertexIndex& out, BaseAsset& a, const Writer& w);
+  // hashFor calls hashFor, above, with this Library's settings.
+  int hashFor(const BaseAsset& a, Hasher& h) const {
+    return hashFor(a, vertexSize, layout, cacheLayout, h);
+  }
+  // allocCached is alloc for an asset found in cache.
+  int allocCached(GeomEntry& e, BaseAsset& a);
+  // place finds space for nVerts and nIndices in a page and copies 'order'
+  // to the page. It sets a's blocks and a.inst.cmd.
+  int place(BaseAsset& a, size_t nVerts, const indicesType* order,
+            size_t nIndices);
+
+  // writeUpdate regenerates 'a' into its spare block and writes it to
+  // upload. If upload is full, a.updQueued_ stays set.
+  int writeUpdate(VertexIndex& out, BaseAsset& a, const Writer& w);
+  // swapSpare switches 'a' to its spare block after writeUpdate.
+  void swapSpare(BaseAsset& a);
 
-  // alloc copies 'out' into 'batch.' It assumes batch is relative to
-  // firstFreeVert, firstFreeOrder. It implements the heap in vertexBuf and
-  // indexBuf. It updates a.inst.cmd.vertexOffset and a.inst.cmd.firstIndex.
-  int alloc(size_t& firstV, size_t& firstO, VertexIndex& batch,
-            VertexIndex& out, BaseAsset& a);
+  // finishDirect flushes the pages write() wrote to if direct, then sets the
+  // assets in uploading to READY and swaps in the assets in updating.
+  int finishDirect();
 
   // free updates the heap in vertexBuf and indexBuf to free up the blocks used
   // by a.
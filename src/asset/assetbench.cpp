@@ -0,0 +1,1431 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ *
+ * Benchmarks for the CPU-only parts of asset.
+ *
+ * Usage: assetbench [--json results.json]
+ * --json also writes every result to a JSON file, one result per line, in
+ * the order they ran. Diff two of them to compare builds.
+ *
+ * writelib also needs a Vulkan device. It runs headless, so a software
+ * driver such as lavapipe works:
+ * VK_ICD_FILENAMES=.../lvp_icd.x86_64.json assetbench
+ * Without a device, writelib is skipped.
+ */
+
+#include <chrono>
+#include <deque>
+#include <forward_list>
+#include <random>
+#include <set>
+#include <string>
+
+#include "../base_application.h"
+#include "compact.h"
+#include "genpool.h"
+#include "geomcache.h"
+#include "meshlet.h"
+#include "meshopt.h"
+#include "occlusion.h"
+#include "physics.h"
+#include "scene.h"
+#include "suballoc.h"
+#include "terrain.h"
+
+namespace {  // An anonymous namespace keeps any definition local to this file.
+
+using asset::Suballoc;
+
+// Result is one number for the JSON output. name identifies the bench and
+// its parameters, such as "shape/revolv256".
+typedef struct Result {
+  std::string name;
+  const char* metric;
+  double value;
+} Result;
+static std::vector<Result> results;
+
+static void record(const std::string& name, const char* metric,
+                   double value) {
+  results.emplace_back(Result{name, metric, value});
+}
+
+// writeJson writes results to 'path'.
+static int writeJson(const char* path) {
+  FILE* f = fopen(path, "w");
+  if (!f) {
+    logE("writeJson: fopen(%s) failed\n", path);
+    return 1;
+  }
+  fprintf(f, "{\n  \"results\": [\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    auto& r = results[i];
+    fprintf(f,
+            "    {\"name\": \"%s\", \"metric\": \"%s\", \"value\": %.6g}"
+            "%s\n",
+            r.name.c_str(), r.metric, r.value,
+            i + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+  if (fclose(f)) {
+    logE("writeJson: write %s failed\n", path);
+    return 1;
+  }
+  return 0;
+}
+
+// FirstFit is the sorted first-fit free list Library used before Suballoc.
+// It is kept here only to compare against.
+typedef struct FirstFit {
+  typedef struct Block {
+    size_t base;
+    size_t use;
+  } Block;
+  std::forward_list<Block> freeList;
+
+  void reset(size_t size) {
+    freeList.clear();
+    freeList.push_front(Block{0, size});
+  }
+
+  int alloc(size_t size, size_t& base) {
+    auto prev = freeList.before_begin();
+    for (auto f = freeList.begin(); f != freeList.end(); prev = f++) {
+      if (f->use >= size) {
+        base = f->base;
+        f->base += size;
+        f->use -= size;
+        if (!f->use) {
+          freeList.erase_after(prev);
+        }
+        return 0;
+      }
+    }
+    return 1;
+  }
+
+  void free(size_t base, size_t size) {
+    auto prev = freeList.before_begin();
+    auto f = freeList.begin();
+    while (f != freeList.end() && f->base < base) {
+      prev = f++;
+    }
+    auto cur = freeList.insert_after(prev, Block{base, size});
+    if (prev != freeList.before_begin() && prev->base + prev->use == base) {
+      prev->use += size;
+      freeList.erase_after(prev);
+      cur = prev;
+    }
+    auto next = cur;
+    next++;
+    if (next != freeList.end() && cur->base + cur->use == next->base) {
+      cur->use += next->use;
+      freeList.erase_after(cur);
+    }
+  }
+} FirstFit;
+
+typedef struct ChurnResult {
+  double nsPerOp{0};
+  size_t fails{0};
+  float fragmentation{0};
+} ChurnResult;
+
+// churnSizes makes a repeatable list of sizes that looks like a mix of small
+// and large assets.
+static std::vector<size_t> churnSizes(size_t n) {
+  std::mt19937 rng(1);
+  std::vector<size_t> sizes(n);
+  for (auto& s : sizes) {
+    // Most assets are small, a few are large.
+    s = (rng() % 8) ? 24 + rng() % 1000 : 1000 + rng() % 50000;
+  }
+  return sizes;
+}
+
+static double nsSince(std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - t0)
+      .count();
+}
+
+// churn fills the buffer to about 'fill' and then frees one random block and
+// allocates one new block each step.
+template <typename T, typename AllocFn, typename FreeFn>
+static ChurnResult churn(T& a, size_t total, float fill, size_t steps,
+                         AllocFn allocFn, FreeFn freeFn) {
+  ChurnResult r;
+  std::vector<size_t> sizes = churnSizes(steps);
+  std::mt19937 rng(2);
+  std::vector<std::pair<size_t, size_t>> live;  // handle, size
+  a.reset(total);
+  size_t used = 0, next = 0;
+  while (used < total * fill) {
+    size_t s = sizes[next++ % sizes.size()], h;
+    if (allocFn(a, s, h)) {
+      break;
+    }
+    live.emplace_back(h, s);
+    used += s;
+  }
+
+  auto t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < steps && !live.empty(); i++) {
+    size_t k = rng() % live.size();
+    freeFn(a, live[k].first, live[k].second);
+    used -= live[k].second;
+    live[k] = live.back();
+    live.pop_back();
+    size_t s = sizes[i], h;
+    if (allocFn(a, s, h)) {
+      r.fails++;
+      continue;
+    }
+    live.emplace_back(h, s);
+    used += s;
+  }
+  r.nsPerOp = nsSince(t0) / (2 * steps);
+  return r;
+}
+
+static void benchChurn(size_t total, float fill, size_t steps) {
+  Suballoc tlsf;
+  ChurnResult t = churn(
+      tlsf, total, fill, steps,
+      [](Suballoc& a, size_t s, size_t& h) {
+        size_t base;
+        uint32_t id;
+        if (a.alloc(s, base, id)) {
+          return 1;
+        }
+        h = id;
+        return 0;
+      },
+      [](Suballoc& a, size_t h, size_t) {
+        if (a.free((uint32_t)h)) {
+          logF("Suballoc::free failed\n");
+        }
+      });
+  Suballoc::Stats st;
+  tlsf.getStats(st);
+  t.fragmentation = st.fragmentation();
+
+  FirstFit ff;
+  ChurnResult f = churn(
+      ff, total, fill, steps,
+      [](FirstFit& a, size_t s, size_t& h) { return a.alloc(s, h); },
+      [](FirstFit& a, size_t h, size_t s) { a.free(h, s); });
+  size_t largest = 0, freeSpace = 0;
+  for (auto& b : ff.freeList) {
+    largest = std::max(largest, b.use);
+    freeSpace += b.use;
+  }
+  f.fragmentation = freeSpace ? 1.f - float(largest) / float(freeSpace) : 0.f;
+
+  logI("churn total=%zu fill=%.0f%% steps=%zu\n", total, fill * 100.f, steps);
+  logI("  suballoc  %8.1f ns/op %5zu fails %4.1f%% frag\n", t.nsPerOp,
+       t.fails, t.fragmentation * 100.f);
+  logI("  firstfit  %8.1f ns/op %5zu fails %4.1f%% frag\n", f.nsPerOp,
+       f.fails, f.fragmentation * 100.f);
+  char name[64];
+  snprintf(name, sizeof(name), "churn/%zu/fill%.0f", total, fill * 100.f);
+  record(std::string(name) + "/suballoc", "ns/op", t.nsPerOp);
+  record(std::string(name) + "/suballoc", "fails", t.fails);
+  record(std::string(name) + "/suballoc", "frag", t.fragmentation);
+  record(std::string(name) + "/firstfit", "ns/op", f.nsPerOp);
+  record(std::string(name) + "/firstfit", "fails", f.fails);
+  record(std::string(name) + "/firstfit", "frag", f.fragmentation);
+}
+
+// genAssets makes a repeatable scene of Revolv and HeightMap assets.
+static std::vector<std::shared_ptr<asset::BaseAsset>> genAssets(size_t n) {
+  std::vector<std::shared_ptr<asset::BaseAsset>> all;
+  for (size_t i = 0; i < n; i++) {
+    if (i % 4) {
+      auto r = std::make_shared<asset::Revolv>();
+      r->rots = 16 + (i % 7) * 16;
+      for (int j = 0; j < 8; j++) {
+        r->pt.emplace_back(1.f + .1f * (j % 3), -1.f + j * .25f);
+      }
+      all.emplace_back(r);
+    } else {
+      auto h = std::make_shared<asset::HeightMap>();
+      h->width = 64;
+      h->pt = std::make_shared<std::vector<asset::HeightMapPoint>>(64 * 64);
+      for (size_t j = 0; j < h->pt->size(); j++) {
+        h->pt->at(j).y = float(j % 13) * .1f;
+        h->pt->at(j).flags = 0;
+      }
+      all.emplace_back(h);
+    }
+  }
+  return all;
+}
+
+// benchGen measures toVertices throughput with 'threads' workers. threads = 0
+// calls toVertices directly, like Library::write without setWorkers.
+static void benchGen(size_t nAssets, size_t threads) {
+  auto all = genAssets(nAssets);
+  size_t tris = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  if (!threads) {
+    asset::VertexIndex out;
+    for (auto& a : all) {
+      out.vert.clear();
+      out.order.clear();
+      if (a->toVertices(out)) {
+        logF("toVertices failed\n");
+      }
+      tris += out.order.size() / 3;
+    }
+  } else {
+    asset::GenPool pool;
+    if (pool.start(threads)) {
+      logF("pool.start failed\n");
+    }
+    for (auto& a : all) {
+      pool.push(a);
+    }
+    for (asset::GenPool::Job* j; (j = pool.wait()) != nullptr; pool.pop()) {
+      if (j->result) {
+        logF("toVertices failed\n");
+      }
+      tris += j->out.order.size() / 3;
+    }
+  }
+  double s = nsSince(t0) * 1e-9;
+  logI("gen assets=%zu threads=%zu %8.1f ms %8.0f assets/s %6.2f Mtri/s\n",
+       nAssets, threads, s * 1e3, nAssets / s, tris / s * 1e-6);
+  record("gen/threads" + std::to_string(threads), "Mtri/s", tris / s * 1e-6);
+}
+
+// makeRevolv makes a Revolv with 'rots' rotations and 'pts' points.
+static std::shared_ptr<asset::Revolv> makeRevolv(uint32_t rots, size_t pts) {
+  auto r = std::make_shared<asset::Revolv>();
+  r->rots = rots;
+  for (size_t j = 0; j < pts; j++) {
+    r->pt.emplace_back(1.f + .1f * (j % 3), -1.f + 2.f * j / (pts - 1));
+  }
+  return r;
+}
+
+// makeHeightMap makes a w x w HeightMap. If perFace, every face is
+// VERT_PER_FACE.
+static std::shared_ptr<asset::HeightMap> makeHeightMap(size_t w,
+                                                       bool perFace) {
+  auto h = std::make_shared<asset::HeightMap>();
+  h->width = w;
+  h->pt = std::make_shared<std::vector<asset::HeightMapPoint>>(w * w);
+  for (size_t j = 0; j < h->pt->size(); j++) {
+    h->pt->at(j).y = float((j * 7) % 13) * .1f;
+    h->pt->at(j).flags = perFace ? asset::VERT_PER_FACE : 0;
+  }
+  return h;
+}
+
+// benchShape measures toVertices for one asset. It repeats until at least
+// 'minTris' triangles have been generated.
+static void benchShape(const char* name, asset::BaseAsset& a, size_t minTris) {
+  asset::VertexIndex out;
+  size_t tris = 0, reps = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  while (tris < minTris) {
+    out.vert.clear();
+    out.order.clear();
+    if (a.toVertices(out)) {
+      logF("%s: toVertices failed\n", name);
+    }
+    tris += out.order.size() / 3;
+    reps++;
+  }
+  double ns = nsSince(t0);
+  logI("shape %-16s %8zu tris %8zu verts %8.1f ns/tri %7.2f Mtri/s\n", name,
+       tris / reps, out.vert.size(), ns / tris, tris / ns * 1e3);
+  record(std::string("shape/") + name, "Mtri/s", tris / ns * 1e3);
+}
+
+// makeExtrud makes an Extrud of a circle with 'pts' points.
+static std::shared_ptr<asset::Extrud> makeExtrud(size_t pts) {
+  auto e = std::make_shared<asset::Extrud>();
+  e->dir = glm::vec3(0.f, 0.f, 2.f);
+  e->aspect = .5f;
+  for (size_t j = 0; j < pts; j++) {
+    float a = float(j) * 6.2831853f / pts;
+    e->pt.emplace_back(cosf(a), sinf(a));
+  }
+  return e;
+}
+
+// makeCsg makes a CsgOR of n Revolv children, with every other child
+// shared.
+static std::shared_ptr<asset::CsgOR> makeCsg(size_t n, uint32_t rots) {
+  auto c = std::make_shared<asset::CsgOR>();
+  auto shared = makeRevolv(rots, 16);
+  c->child.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    auto& ch = c->child[i];
+    ch.asset = (i % 2) ? shared : makeRevolv(rots, 16);
+    ch.loc = glm::vec3(3.f * i, 0.f, 0.f);
+    ch.rot = glm::quat(1.f, 0.f, 0.f, 0.f);
+  }
+  return c;
+}
+
+// benchShapes runs benchShape for each shape at a few tessellation levels.
+static void benchShapes() {
+  char name[64];
+  for (uint32_t rots : {16, 256, 4096}) {
+    snprintf(name, sizeof(name), "revolv%u", rots);
+    benchShape(name, *makeRevolv(rots, 64), 1000000);
+  }
+  for (size_t w : {64, 256, 1024}) {
+    snprintf(name, sizeof(name), "heightmap%zu", w);
+    benchShape(name, *makeHeightMap(w, false), 1000000);
+    snprintf(name, sizeof(name), "heightmap%zu/face", w);
+    benchShape(name, *makeHeightMap(w, true), 1000000);
+  }
+  for (size_t pts : {16, 256, 4096}) {
+    snprintf(name, sizeof(name), "extrud%zu", pts);
+    benchShape(name, *makeExtrud(pts), 1000000);
+  }
+  for (size_t n : {4, 64}) {
+    snprintf(name, sizeof(name), "csg%zu/revolv64", n);
+    benchShape(name, *makeCsg(n, 64), 1000000);
+  }
+}
+
+// benchOptimize reports ACMR and ATVR before and after each optimization.
+static void benchOptimize(const char* name, asset::BaseAsset& a) {
+  static const struct {
+    const char* name;
+    uint32_t flags;
+  } stage[] = {
+      {"cache", asset::BaseAsset::OPTIMIZE_CACHE},
+      {"cache+overdraw", asset::BaseAsset::OPTIMIZE_OVERDRAW},
+      {"all", asset::BaseAsset::OPTIMIZE_ALL},
+  };
+  asset::VertexIndex gen;
+  if (a.toVertices(gen)) {
+    logF("%s: toVertices failed\n", name);
+  }
+  for (auto& st : stage) {
+    asset::VertexIndex out = gen;
+    asset::OptimizeStats os;
+    std::vector<asset::Meshlet> meshlet;
+    auto t0 = std::chrono::steady_clock::now();
+    if (asset::optimizeMesh(out, st.flags, &os, &meshlet)) {
+      logF("%s: optimizeMesh failed\n", name);
+    }
+    double ns = nsSince(t0);
+    logI("opt %-16s %-14s acmr %5.3f -> %5.3f atvr %5.3f -> %5.3f "
+         "%7.1f ns/tri\n",
+         name, st.name, os.before.acmr, os.after.acmr, os.before.atvr,
+         os.after.atvr, ns / (out.order.size() / 3));
+    std::string n = std::string("opt/") + name + "/" + st.name;
+    record(n, "acmr", os.after.acmr);
+    record(n, "atvr", os.after.atvr);
+    record(n, "ns/tri", ns / (out.order.size() / 3));
+  }
+}
+
+// benchMeshlets reports how full the meshlets are and how many are
+// backfacing from a few points around the asset.
+static void benchMeshlets(const char* name, asset::BaseAsset& a) {
+  asset::VertexIndex out;
+  if (a.toVertices(out) || asset::optimizeCache(out)) {
+    logF("%s: toVertices or optimizeCache failed\n", name);
+  }
+  std::vector<asset::Meshlet> meshlet;
+  asset::MeshletStats ms;
+  auto t0 = std::chrono::steady_clock::now();
+  if (asset::buildMeshlets(out, meshlet, 64, 124, &ms)) {
+    logF("%s: buildMeshlets failed\n", name);
+  }
+  double ns = nsSince(t0);
+  asset::Bounds b;
+  b.set(out.vert);
+  glm::vec3 c = (b.min + b.max) * .5f;
+  float far = glm::length(b.extent()) * 2.f;
+  static const glm::vec3 dir[] = {
+      glm::vec3(0, 1, 0), glm::vec3(0, -1, 0), glm::vec3(1, 0, 0),
+      glm::vec3(0, 0, -1),
+  };
+  size_t culled = 0;
+  for (auto& d : dir) {
+    for (auto& m : meshlet) {
+      culled += m.backfacing(c + d * far);
+    }
+  }
+  logI("meshlet %-16s %6zu meshlets vert fill %4.1f%% tri fill %4.1f%% "
+       "backfacing %4.1f%% %6.1f ns/tri\n",
+       name, ms.meshlets, ms.vertFill * 100.f, ms.triFill * 100.f,
+       culled * 100.f / (meshlet.size() * 4), ns / (out.order.size() / 3));
+  record(std::string("meshlet/") + name, "triFill", ms.triFill);
+  record(std::string("meshlet/") + name, "ns/tri",
+         ns / (out.order.size() / 3));
+}
+
+// benchLods reports the tris and error of each level of detail, and how
+// long toOptimizedVertices takes to build the whole chain.
+static void benchLods(const char* name, asset::BaseAsset& a) {
+  a.lods = 5;
+  asset::VertexIndex out;
+  auto t0 = std::chrono::steady_clock::now();
+  if (a.toOptimizedVertices(out)) {
+    logF("%s: toOptimizedVertices failed\n", name);
+  }
+  double ns = nsSince(t0);
+  logI("lod %-16s %5.1f ms for %zu levels\n", name, ns * 1e-6, a.lod.size());
+  record(std::string("lod/") + name, "ms", ns * 1e-6);
+  for (size_t i = 0; i < a.lod.size(); i++) {
+    logI("  lod[%zu] %8u tris (%5.1f%%) error %g\n", i,
+         a.lod[i].indexCount / 3,
+         a.lod[i].indexCount * 100. / a.lod[0].indexCount, a.lod[i].error);
+  }
+}
+
+static void benchOptimizeShapes() {
+  benchOptimize("revolv256", *makeRevolv(256, 64));
+  benchOptimize("heightmap256", *makeHeightMap(256, false));
+  benchOptimize("heightmap1024", *makeHeightMap(1024, false));
+  benchMeshlets("revolv256", *makeRevolv(256, 64));
+  benchMeshlets("heightmap256", *makeHeightMap(256, false));
+  benchMeshlets("heightmap1024", *makeHeightMap(1024, false));
+  benchLods("revolv256", *makeRevolv(256, 64));
+  benchLods("heightmap1024", *makeHeightMap(1024, false));
+}
+
+// benchTerrain compares the cost of changing one height in a w x w
+// HeightMap with changing it in HeightMapTiles.
+static void benchTerrain(size_t w, size_t tileSize) {
+  auto h = makeHeightMap(w, false);
+  asset::VertexIndex out;
+  auto t0 = std::chrono::steady_clock::now();
+  if (h->toVertices(out)) {
+    logF("terrain: toVertices failed\n");
+  }
+  double whole = nsSince(t0);
+
+  asset::HeightMapTiles t;
+  t.pt = h->pt;
+  t.width = w;
+  t.tileSize = tileSize;
+  t.lodDist = float(tileSize * 2);
+  std::vector<std::shared_ptr<asset::BaseAsset>> added, deleted;
+  if (t.ctorError() || t.update(glm::vec3(0.f), added, deleted)) {
+    logF("terrain: HeightMapTiles failed\n");
+  }
+  std::mt19937 rng(1);
+  static constexpr size_t edits = 100;
+  size_t tris = 0, regen = 0;
+  t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < edits; i++) {
+    size_t x = rng() % w, z = rng() % w;
+    t.pt->at(z * w + x).y += 1.f;
+    t.setDirty(x, z);
+    added.clear();
+    if (t.update(glm::vec3(0.f), added, deleted)) {
+      logF("terrain: update failed\n");
+    }
+    for (auto& a : added) {
+      asset::VertexIndex tv;
+      if (a->toVertices(tv)) {
+        logF("terrain: tile toVertices failed\n");
+      }
+      tris += tv.order.size() / 3;
+      regen++;
+    }
+  }
+  double tiled = nsSince(t0) / edits;
+  logI("terrain %4zu tile %3zu: whole %7.2f ms %8zu tris, edit %6.3f ms "
+       "%6zu tris in %3.1f tiles\n",
+       w, tileSize, whole * 1e-6, out.order.size() / 3, tiled * 1e-6,
+       tris / edits, float(regen) / edits);
+  std::string name = "terrain/" + std::to_string(w) + "/tile" +
+                     std::to_string(tileSize);
+  record(name, "wholeMs", whole * 1e-6);
+  record(name, "editMs", tiled * 1e-6);
+}
+
+// benchCsg compares a CsgOR of n copies of one child with n separate
+// children, then measures DROP_ENCLOSED on a row of n touching boxes.
+static void benchCsg(size_t n) {
+  std::vector<asset::AssetLocRot> child(n);
+  for (size_t i = 0; i < n; i++) {
+    child[i].rot = glm::quat(1.f, 0.f, 0.f, 0.f);
+    child[i].loc = glm::vec3(3.f * (i % 32), 0.f, 3.f * (i / 32));
+  }
+  asset::CsgOR csg;
+  csg.child = child;
+  auto one = makeRevolv(64, 16);
+  for (size_t i = 0; i < n; i++) {
+    csg.child[i].asset = one;
+  }
+  asset::VertexIndex out;
+  auto t0 = std::chrono::steady_clock::now();
+  if (csg.toVertices(out)) {
+    logF("csg: toVertices failed\n");
+  }
+  double shared = nsSince(t0);
+  for (size_t i = 0; i < n; i++) {
+    csg.child[i].asset = makeRevolv(64, 16);
+  }
+  out = asset::VertexIndex();
+  t0 = std::chrono::steady_clock::now();
+  if (csg.toVertices(out)) {
+    logF("csg: toVertices failed\n");
+  }
+  double unique = nsSince(t0);
+  logI("csg %5zu revolv64: %7.2f ms shared, %7.2f ms unique, %zu tris\n", n,
+       shared * 1e-6, unique * 1e-6, out.order.size() / 3);
+  std::string name = "csg/" + std::to_string(n);
+  record(name, "sharedMs", shared * 1e-6);
+  record(name, "uniqueMs", unique * 1e-6);
+
+  auto box = std::make_shared<asset::Extrud>();
+  box->pt = {{0.f, 0.f}, {1.f, 0.f}, {1.f, 1.f}, {0.f, 1.f}};
+  box->dir = glm::vec3(0.f, 0.f, 1.f);
+  csg.child.resize(std::min(n, size_t(256)));
+  for (size_t i = 0; i < csg.child.size(); i++) {
+    csg.child[i].asset = box;
+    csg.child[i].loc = glm::vec3(float(i), 0.f, 0.f);
+  }
+  csg.flags = asset::CsgOR::DROP_ENCLOSED | asset::CsgOR::WELD;
+  out = asset::VertexIndex();
+  t0 = std::chrono::steady_clock::now();
+  if (csg.toVertices(out)) {
+    logF("csg: toVertices failed\n");
+  }
+  double ns = nsSince(t0);
+  logI("csg %5zu boxes: %7.2f ms, %zu tris (%zu dropped)\n",
+       csg.child.size(), ns * 1e-6, out.order.size() / 3,
+       csg.csgStats.dropped);
+  record("csg/boxes" + std::to_string(csg.child.size()), "ms", ns * 1e-6);
+}
+
+// benchGeomCache compares loading a w x w HeightMap cold (hash,
+// toOptimizedVertices, encode each CompactVertex and store it in the cache)
+// with loading it warm (hash, find and copy from the mapped file). dst
+// stands in for Library::upload.
+static void benchGeomCache(size_t w) {
+  asset::GeomCache cache;
+  if (cache.ctorError("assetbench.cache")) {
+    logF("geomcache: ctorError failed\n");
+  }
+  auto h = makeHeightMap(w, false);
+  h->optimize = asset::BaseAsset::OPTIMIZE_ALL;
+  std::vector<char> dst;
+  auto t0 = std::chrono::steady_clock::now();
+  asset::Hasher key;
+  if (h->hash(key)) {
+    logF("geomcache: hash failed\n");
+  }
+  double hashNs = nsSince(t0);
+  asset::VertexIndex out;
+  if (h->toOptimizedVertices(out)) {
+    logF("geomcache: toOptimizedVertices failed\n");
+  }
+  size_t vBytes = sizeof(asset::CompactVertex) * out.vert.size();
+  size_t oBytes = sizeof(asset::indicesType) * out.order.size();
+  dst.resize(vBytes + oBytes);
+  auto* cv = reinterpret_cast<asset::CompactVertex*>(dst.data());
+  for (size_t i = 0; i < out.vert.size(); i++) {
+    asset::encodeCompact(h->bounds, out.vert[i], cv[i]);
+  }
+  memcpy(&dst[vBytes], out.order.data(), oBytes);
+  if (cache.store(key.h, *h, sizeof(asset::CompactVertex), dst.data(),
+                  out.vert.size(), out.order.data(), out.order.size())) {
+    logF("geomcache: store failed\n");
+  }
+  double cold = nsSince(t0);
+
+  std::vector<char> warmDst(dst.size());
+  t0 = std::chrono::steady_clock::now();
+  asset::Hasher key2;
+  if (h->hash(key2)) {
+    logF("geomcache: hash failed\n");
+  }
+  auto e = cache.find(key2.h, sizeof(asset::CompactVertex));
+  if (!e) {
+    logF("geomcache: find failed\n");
+  }
+  memcpy(warmDst.data(), e->vert, e->vertBytes());
+  memcpy(&warmDst[e->vertBytes()], e->order, oBytes);
+  double warm = nsSince(t0);
+  if (warmDst != dst) {
+    logF("geomcache: warm load does not match\n");
+  }
+  logI("geomcache heightmap%-5zu cold %8.2f ms, warm %6.2f ms (hash %5.2f "
+       "ms) %6zu KB\n",
+       w, cold * 1e-6, warm * 1e-6, hashNs * 1e-6, (vBytes + oBytes) >> 10);
+  record("geomcache/heightmap" + std::to_string(w), "coldMs", cold * 1e-6);
+  record("geomcache/heightmap" + std::to_string(w), "warmMs", warm * 1e-6);
+  char name[64];
+  snprintf(name, sizeof(name), "/%016llx.geo", (unsigned long long)key.h);
+  remove((cache.getDir() + name).c_str());
+}
+
+// AppVert is a typical LAYOUT_APP vertex.
+typedef struct AppVert {
+  float P[3];
+  float N[3];
+  float uv[2];
+} AppVert;
+
+static void toAppVert(const asset::Vertex& v, AppVert& out) {
+  memcpy(out.P, &v.P, sizeof(out.P));
+  memcpy(out.N, &v.N, sizeof(out.N));
+  memcpy(out.uv, &v.uv, sizeof(out.uv));
+}
+
+static int writeAppVert(void*, const asset::Vertex& v, void* dst) {
+  toAppVert(v, *reinterpret_cast<AppVert*>(dst));
+  return 0;
+}
+
+static int writeCompact(void* bounds, const asset::Vertex& v, void* dst) {
+  asset::encodeCompact(*reinterpret_cast<asset::Bounds*>(bounds), v,
+                       *reinterpret_cast<asset::CompactVertex*>(dst));
+  return 0;
+}
+
+static int batchCompact(void* bounds, const asset::Vertex* v, size_t n,
+                        void* dst) {
+  asset::encodeCompact(*reinterpret_cast<asset::Bounds*>(bounds), v, n,
+                       reinterpret_cast<asset::CompactVertex*>(dst));
+  return 0;
+}
+
+// benchVertexWriteFn times the loop Library::writeVerts runs for a
+// VertexWriteFn: one indirect call per vertex. fn is volatile so the call is
+// not inlined, as in Library.
+static double benchVertexWriteFn(asset::VertexWriteFn fn, void* userData,
+                                 const std::vector<asset::Vertex>& vert,
+                                 std::vector<char>& dst, size_t size) {
+  asset::VertexWriteFn volatile vfn = fn;
+  auto t0 = std::chrono::steady_clock::now();
+  char* d = dst.data();
+  for (size_t i = 0; i < vert.size(); i++, d += size) {
+    if (vfn(userData, vert[i], d)) {
+      logF("vertexwrite: writeFn failed\n");
+    }
+  }
+  return nsSince(t0) / vert.size();
+}
+
+// benchVertexBatchFn times one VertexBatchFn call for all the vertices.
+static double benchVertexBatchFn(asset::VertexBatchFn fn, void* userData,
+                                 const std::vector<asset::Vertex>& vert,
+                                 std::vector<char>& dst) {
+  asset::VertexBatchFn volatile vfn = fn;
+  auto t0 = std::chrono::steady_clock::now();
+  if (vfn(userData, vert.data(), vert.size(), dst.data())) {
+    logF("vertexwrite: batchFn failed\n");
+  }
+  return nsSince(t0) / vert.size();
+}
+
+// benchVertexWrite compares the per-vertex cost of a VertexWriteFn with a
+// VertexBatchFn for the vertices of a w x w HeightMap, for an app layout and
+// for CompactVertex. Each is the best of a few runs.
+static void benchVertexWrite(size_t w) {
+  static constexpr int runs = 5;
+  auto h = makeHeightMap(w, false);
+  asset::VertexIndex out;
+  if (h->toVertices(out)) {
+    logF("vertexwrite: toVertices failed\n");
+  }
+  h->bounds.set(out.vert);
+  std::vector<char> dst(sizeof(AppVert) * out.vert.size());
+  std::vector<char> want, got;
+  double fn = 1e30, batch = 1e30;
+  for (int r = 0; r < runs; r++) {
+    fn = std::min(fn, benchVertexWriteFn(writeAppVert, nullptr, out.vert, dst,
+                                         sizeof(AppVert)));
+  }
+  want = dst;
+  auto appBatch = reinterpret_cast<asset::VertexBatchFn>(
+      asset::batchOf<AppVert, toAppVert>);
+  for (int r = 0; r < runs; r++) {
+    batch = std::min(batch, benchVertexBatchFn(appBatch, nullptr, out.vert,
+                                               dst));
+  }
+  if (dst != want) {
+    logF("vertexwrite: batchOf does not match\n");
+  }
+  logI("vertexwrite %7zu verts app     fn %6.2f ns/vert, batch %6.2f "
+       "ns/vert\n", out.vert.size(), fn, batch);
+  std::string name = "vertexwrite/" + std::to_string(out.vert.size());
+  record(name + "/app/fn", "ns/vert", fn);
+  record(name + "/app/batch", "ns/vert", batch);
+
+  fn = batch = 1e30;
+  dst.resize(sizeof(asset::CompactVertex) * out.vert.size());
+  for (int r = 0; r < runs; r++) {
+    fn = std::min(fn, benchVertexWriteFn(writeCompact, &h->bounds, out.vert,
+                                         dst, sizeof(asset::CompactVertex)));
+  }
+  want = dst;
+  for (int r = 0; r < runs; r++) {
+    batch = std::min(batch, benchVertexBatchFn(batchCompact, &h->bounds,
+                                               out.vert, dst));
+  }
+  if (dst != want) {
+    logF("vertexwrite: compact batch does not match\n");
+  }
+  logI("vertexwrite %7zu verts compact fn %6.2f ns/vert, batch %6.2f "
+       "ns/vert\n", out.vert.size(), fn, batch);
+  record(name + "/compact/fn", "ns/vert", fn);
+  record(name + "/compact/batch", "ns/vert", batch);
+}
+
+// benchCull compares Frustum::isVisible on each of n boxes with
+// Frustum::cull on a BoxSoA and a SphereSoA of the same objects. The objects
+// fill a cube 1000 units across around the camera. Each is the best of a few
+// frames; the first frame is reported separately because BoxSoA::plane has
+// not learned which planes reject which boxes yet.
+static void benchCull(size_t n) {
+  static constexpr int runs = 10;
+  glm::mat4 proj = glm::perspective(glm::radians(60.f), 1.5f, 1.f, 400.f);
+  asset::Frustum f(proj * glm::lookAt(glm::vec3(0.f), glm::vec3(0.f, 0.f, -1.f),
+                                      glm::vec3(0.f, 1.f, 0.f)));
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<float> pos(-500.f, 500.f), ext(.5f, 4.f);
+  std::vector<asset::AABB> box(n);
+  asset::BoxSoA boxSoA;
+  asset::SphereSoA sphereSoA;
+  for (auto& b : box) {
+    b.bound[0] = glm::vec3(pos(rng), pos(rng), pos(rng));
+    b.bound[1] = b.bound[0] + glm::vec3(ext(rng), ext(rng), ext(rng));
+    boxSoA.push_back(b);
+    glm::vec3 half = (b.bound[1] - b.bound[0]) * .5f;
+    sphereSoA.push_back(b.bound[0] + half, glm::length(half));
+  }
+
+  std::vector<uint32_t> want, got;
+  double scalar = 1e30, cold, warm = 1e30, sphere = 1e30;
+  for (int r = 0; r < runs; r++) {
+    want.clear();
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; i++) {
+      if (f.isVisible(box[i])) {
+        want.push_back(i);
+      }
+    }
+    scalar = std::min(scalar, nsSince(t0));
+  }
+  auto t0 = std::chrono::steady_clock::now();
+  if (f.cull(boxSoA, got)) {
+    logF("cull: cull failed\n");
+  }
+  cold = nsSince(t0);
+  for (int r = 0; r < runs; r++) {
+    t0 = std::chrono::steady_clock::now();
+    if (f.cull(boxSoA, got)) {
+      logF("cull: cull failed\n");
+    }
+    warm = std::min(warm, nsSince(t0));
+  }
+  if (got != want) {
+    logF("cull: cull does not match isVisible\n");
+  }
+  size_t visible = got.size();
+  for (int r = 0; r < runs; r++) {
+    t0 = std::chrono::steady_clock::now();
+    if (f.cull(sphereSoA, got)) {
+      logF("cull: cull failed\n");
+    }
+    sphere = std::min(sphere, nsSince(t0));
+  }
+  logI("cull %7zu boxes (%zu visible): isVisible %6.3f ms, cull %6.3f ms "
+       "cold %6.3f ms, spheres %6.3f ms\n",
+       n, visible, scalar * 1e-6, warm * 1e-6, cold * 1e-6, sphere * 1e-6);
+  std::string name = "cull/" + std::to_string(n);
+  record(name + "/isVisible", "ms", scalar * 1e-6);
+  record(name + "/box", "ms", warm * 1e-6);
+  record(name + "/boxCold", "ms", cold * 1e-6);
+  record(name + "/sphere", "ms", sphere * 1e-6);
+}
+
+// benchBvh builds a Bvh over n boxes spread through a city-sized scene,
+// then compares frustum, overlap and pick queries with a linear scan. Then
+// the boxes move for a number of frames, comparing Bvh::update (refit, and
+// rebuild only when sah grows too much) with a build every frame.
+static void benchBvh(size_t n) {
+  static constexpr int frames = 60;
+  std::mt19937 rng(11);
+  std::uniform_real_distribution<float> pos(-2000.f, 2000.f), ext(.5f, 8.f);
+  std::uniform_real_distribution<float> u(-1.f, 1.f);
+  std::vector<asset::AABB> box(n);
+  for (auto& b : box) {
+    b.bound[0] = glm::vec3(pos(rng), pos(rng) * .05f, pos(rng));
+    b.bound[1] = b.bound[0] + glm::vec3(ext(rng), ext(rng), ext(rng));
+  }
+  asset::Bvh bvh;
+  auto t0 = std::chrono::steady_clock::now();
+  if (bvh.build(box)) {
+    logF("bvh: build failed\n");
+  }
+  double buildNs = nsSince(t0);
+  auto st = bvh.stats();
+
+  glm::mat4 proj = glm::perspective(glm::radians(60.f), 1.5f, 1.f, 400.f);
+  asset::Frustum f(proj * glm::lookAt(glm::vec3(0.f, 20.f, 0.f),
+                                      glm::vec3(1.f, 20.f, 1.f),
+                                      glm::vec3(0.f, 1.f, 0.f)));
+  std::vector<uint32_t> got;
+  t0 = std::chrono::steady_clock::now();
+  size_t linearVisible = 0;
+  for (size_t i = 0; i < n; i++) {
+    linearVisible += f.isVisible(box[i]);
+  }
+  double linearNs = nsSince(t0);
+  t0 = std::chrono::steady_clock::now();
+  bvh.query(f, box, got);
+  double queryNs = nsSince(t0);
+  if (got.size() != linearVisible) {
+    logF("bvh: query found %zu, want %zu\n", got.size(), linearVisible);
+  }
+
+  asset::AABB near;
+  near.bound[0] = glm::vec3(-50.f, -50.f, -50.f);
+  near.bound[1] = glm::vec3(50.f, 50.f, 50.f);
+  t0 = std::chrono::steady_clock::now();
+  bvh.query(near, box, got);
+  double overlapNs = nsSince(t0);
+
+  static constexpr int picks = 1000;
+  t0 = std::chrono::steady_clock::now();
+  size_t hits = 0;
+  for (int r = 0; r < picks; r++) {
+    uint32_t hit;
+    float t;
+    glm::vec3 dir(u(rng), u(rng) * .1f, u(rng));
+    hits += bvh.pick(glm::vec3(0.f, 20.f, 0.f), dir, box, hit, t);
+  }
+  double pickNs = nsSince(t0) / picks;
+  logI("bvh %7zu boxes: build %7.2f ms, %zu nodes depth %zu sah %.1f\n", n,
+       buildNs * 1e-6, st.nodes, st.depth, st.sah);
+  logI("  frustum %6.3f ms (linear %6.3f ms, %zu visible) overlap %6.3f ms "
+       "pick %6.2f us (%zu/%d hit)\n", queryNs * 1e-6, linearNs * 1e-6,
+       linearVisible, overlapNs * 1e-6, pickNs * 1e-3, hits, picks);
+  std::string name = "bvh/" + std::to_string(n);
+  record(name + "/build", "ms", buildNs * 1e-6);
+  record(name + "/build", "sah", st.sah);
+  record(name + "/build", "depth", st.depth);
+  record(name + "/frustum", "ms", queryNs * 1e-6);
+  record(name + "/frustumLinear", "ms", linearNs * 1e-6);
+  record(name + "/overlap", "ms", overlapNs * 1e-6);
+  record(name + "/pick", "us", pickNs * 1e-3);
+
+  // Every box moves at its own speed, so the tree slowly gets worse.
+  std::vector<glm::vec3> vel(n);
+  for (auto& v : vel) {
+    v = glm::vec3(u(rng), 0.f, u(rng)) * 4.f;
+  }
+  asset::Bvh rebuilt;
+  double updateNs = 0, rebuildNs = 0, updateQueryNs = 0, rebuildQueryNs = 0;
+  for (int frame = 0; frame < frames; frame++) {
+    for (size_t i = 0; i < n; i++) {
+      box[i].bound[0] += vel[i];
+      box[i].bound[1] += vel[i];
+    }
+    t0 = std::chrono::steady_clock::now();
+    if (bvh.update(box)) {
+      logF("bvh: update failed\n");
+    }
+    updateNs += nsSince(t0);
+    t0 = std::chrono::steady_clock::now();
+    bvh.query(f, box, got);
+    updateQueryNs += nsSince(t0);
+    t0 = std::chrono::steady_clock::now();
+    if (rebuilt.build(box)) {
+      logF("bvh: build failed\n");
+    }
+    rebuildNs += nsSince(t0);
+    t0 = std::chrono::steady_clock::now();
+    rebuilt.query(f, box, got);
+    rebuildQueryNs += nsSince(t0);
+  }
+  logI("  %d frames moving: update %6.3f ms/frame (%zu builds, sah %.1f), "
+       "build %6.3f ms/frame (sah %.1f)\n", frames,
+       updateNs * 1e-6 / frames, bvh.builds - 1, bvh.stats().sah,
+       rebuildNs * 1e-6 / frames, rebuilt.stats().sah);
+  logI("  query after update %6.3f ms/frame, after build %6.3f ms/frame\n",
+       updateQueryNs * 1e-6 / frames, rebuildQueryNs * 1e-6 / frames);
+  record(name + "/update", "ms", updateNs * 1e-6 / frames);
+  record(name + "/update", "sah", bvh.stats().sah);
+  record(name + "/update", "builds", bvh.builds - 1);
+  record(name + "/update", "queryMs", updateQueryNs * 1e-6 / frames);
+  record(name + "/rebuild", "ms", rebuildNs * 1e-6 / frames);
+  record(name + "/rebuild", "sah", rebuilt.stats().sah);
+  record(name + "/rebuild", "queryMs", rebuildQueryNs * 1e-6 / frames);
+}
+
+// benchOcclusion builds a city: a grid of blocks, each with a building that
+// is also an occluder, and n small objects scattered on the streets and
+// behind the buildings. It times Occlusion::render with 0 worker threads and
+// with 'threads', and Occlusion::cull on what Frustum::cull leaves.
+static void benchOcclusion(size_t n, size_t threads) {
+  static constexpr int blocks = 20;
+  static constexpr float block = 40.f, street = 12.f;
+  static constexpr int runs = 5;
+  std::mt19937 rng(14);
+  std::uniform_real_distribution<float> u(0.f, 1.f);
+  asset::Occlusion occ;
+  if (occ.ctorError(256, 128, threads)) {
+    logF("occlusion: ctorError failed\n");
+  }
+  for (int bz = 0; bz < blocks; bz++) {
+    for (int bx = 0; bx < blocks; bx++) {
+      glm::vec3 lo((bx - blocks / 2) * (block + street), 0.f,
+                   -bz * (block + street) - street);
+      asset::AABB b;
+      b.bound[0] = lo;
+      b.bound[1] = lo + glm::vec3(block, 20.f + 60.f * u(rng), block);
+      asset::VertexIndex m;
+      m.vert.resize(8);
+      for (int i = 0; i < 8; i++) {
+        m.vert[i].P = glm::vec3(b.bound[i & 1].x, b.bound[(i >> 1) & 1].y,
+                                b.bound[i >> 2].z);
+      }
+      m.order = {0, 1, 3, 0, 3, 2, 4, 6, 7, 4, 7, 5, 0, 4, 5, 0, 5, 1,
+                 2, 3, 7, 2, 7, 6, 0, 2, 6, 0, 6, 4, 1, 5, 7, 1, 7, 3};
+      if (occ.add(m, glm::mat4(1.f))) {
+        logF("occlusion: add failed\n");
+      }
+    }
+  }
+  float extent = blocks * (block + street);
+  asset::BoxSoA soa;
+  std::vector<asset::AABB> box(n);
+  for (auto& b : box) {
+    b.bound[0] = glm::vec3((u(rng) - .5f) * extent, 0.f, -u(rng) * extent);
+    b.bound[1] = b.bound[0] + glm::vec3(2.f, 2.f + 3.f * u(rng), 2.f);
+    soa.push_back(b);
+  }
+  // Stand in the middle of a street, looking down it.
+  glm::vec3 eye(street * -.5f, 2.f, 0.f);
+  glm::mat4 vp = glm::perspective(glm::radians(60.f), 2.f, 1.f, 2000.f) *
+                 glm::lookAt(eye, eye + glm::vec3(.3f, 0.f, -1.f),
+                             glm::vec3(0.f, 1.f, 0.f));
+  asset::Frustum f(vp);
+
+  double renderNs = 1e30, cullNs = 1e30;
+  std::vector<uint32_t> visible, inFrustum;
+  for (int r = 0; r < runs; r++) {
+    auto t0 = std::chrono::steady_clock::now();
+    if (occ.render(vp)) {
+      logF("occlusion: render failed\n");
+    }
+    renderNs = std::min(renderNs, nsSince(t0));
+    if (f.cull(soa, inFrustum)) {
+      logF("occlusion: frustum cull failed\n");
+    }
+    visible = inFrustum;
+    t0 = std::chrono::steady_clock::now();
+    occ.cull(box, visible);
+    cullNs = std::min(cullNs, nsSince(t0));
+  }
+  logI("occlusion %zu objects threads=%zu: render %6.3f ms (%zu tris, %zu "
+       "binned), cull %6.3f ms: %zu in frustum, %zu visible\n",
+       n, threads, renderNs * 1e-6, occ.stats.drawn, occ.stats.binned,
+       cullNs * 1e-6, inFrustum.size(), visible.size());
+  std::string name = "occlusion/" + std::to_string(n) + "/threads" +
+                     std::to_string(threads);
+  record(name, "renderMs", renderNs * 1e-6);
+  record(name, "cullMs", cullNs * 1e-6);
+  record(name, "inFrustum", inFrustum.size());
+  record(name, "visible", visible.size());
+}
+
+// benchPhysics drops n spheres and boxes into a room that grows with n, as
+// in 21physics, and times Physics::step. The first steps are skipped: the
+// bodies are still falling and nothing touches yet.
+static void benchPhysics(size_t n, int steps) {
+  static constexpr int fall = 30;
+  static constexpr float dt = 1.f / 60;
+  std::mt19937 rng(16);
+  std::uniform_real_distribution<float> u(0.f, 1.f);
+  asset::Physics p;
+  float side = cbrtf(float(n)) * 1.2f;
+  p.room.bound[0] = glm::vec3(-side * .5f, 0.f, -side * .5f);
+  p.room.bound[1] = glm::vec3(side * .5f, side * 2.f, side * .5f);
+  for (size_t i = 0; i < n; i++) {
+    glm::vec3 at = glm::vec3(u(rng) - .5f, u(rng) * 2.f, u(rng) - .5f) *
+                   (side - 1.f);
+    at.y += .5f;
+    if (i & 1) {
+      p.addSphere(at, .2f + .2f * u(rng), 1.f);
+    } else {
+      glm::quat rot = glm::normalize(glm::quat(u(rng), u(rng) - .5f,
+                                               u(rng) - .5f, u(rng) - .5f));
+      p.addBox(at, glm::vec3(.2f) + glm::vec3(u(rng), u(rng), u(rng)) * .2f,
+               1.f, rot);
+    }
+  }
+  for (int i = 0; i < fall; i++) {
+    if (p.step(dt)) {
+      logF("physics: step failed\n");
+    }
+  }
+  auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < steps; i++) {
+    if (p.step(dt)) {
+      logF("physics: step failed\n");
+    }
+  }
+  double ns = nsSince(t0) / steps;
+  logI("physics %6zu bodies: %8.3f ms/step %7.1f steps/s, %zu pairs %zu "
+       "contacts (%zu warm) %zu awake\n",
+       n, ns * 1e-6, 1e9 / ns, p.stats.pairs, p.stats.contacts,
+       p.stats.warm, p.stats.awake);
+  std::string name = "physics/" + std::to_string(n);
+  record(name, "ms/step", ns * 1e-6);
+  record(name, "steps/s", 1e9 / ns);
+  record(name, "contacts", p.stats.contacts);
+}
+
+// BenchAsset lets the bench set the state of an asset the way Library does.
+typedef struct BenchAsset : public asset::BaseAsset {
+  int toVertices(asset::VertexIndex&) override { return 0; }
+  void setState(asset::BaseAssetState s) { state_ = s; }
+  asset::BaseAssetState get() const { return state_; }
+  uint32_t& frame() { return frameNumber; }
+} BenchAsset;
+
+// swapImages and framesInFlight are the frames benchWrite waits for.
+static constexpr size_t benchSwapImages = 3;
+static constexpr size_t benchFramesInFlight = 1;
+
+// ScanModel is the bookkeeping Library::write did before it had queues: it
+// looked at every asset to find the ones that changed.
+typedef struct ScanModel {
+  std::set<std::shared_ptr<BenchAsset>> child;
+
+  void add(std::shared_ptr<BenchAsset> a) {
+    a->setState(asset::ADDED);
+    child.insert(a);
+  }
+  void del(std::shared_ptr<BenchAsset> a) { a->setState(asset::DELETED); }
+
+  void write(uint32_t frameNumber) {
+    for (auto i = child.begin(); i != child.end();) {
+      auto& a = **i;
+      if (a.get() == asset::ADDED) {
+        a.setState(asset::READY);
+      } else if (a.get() == asset::DELETED) {
+        a.setState(asset::DEL_WAIT);
+        a.frame() = frameNumber;
+      } else if (a.get() == asset::DEL_WAIT &&
+                 asset::AssetQueue::frameIsDone(frameNumber, a.frame(),
+                                                benchSwapImages,
+                                                benchFramesInFlight)) {
+        a.setState(asset::INVALID);
+        i = child.erase(i);
+        continue;
+      }
+      i++;
+    }
+  }
+} ScanModel;
+
+// BenchQueue runs the AssetQueue of Library::write(). Only the steps that
+// need a device are left out: an added asset goes to ADD_WAIT as if alloc
+// copied it to upload, the upload is done once its frame is done, and
+// freeing and swapping blocks does nothing.
+typedef struct BenchQueue : public asset::AssetQueue {
+  BenchQueue() {
+    swapImages = benchSwapImages;
+    framesInFlight = benchFramesInFlight;
+  }
+  bool inFlight{false};
+  uint32_t flightFrameNumber{0};
+
+  void add(std::shared_ptr<BenchAsset> a) {
+    if (addChild(a)) {
+      logF("BenchQueue: addChild failed\n");
+    }
+    addQ.emplace_back(a);
+  }
+  void del(std::shared_ptr<BenchAsset> a) {
+    if (AssetQueue::del(a)) {
+      logF("BenchQueue: del failed\n");
+    }
+  }
+
+  void write(uint32_t frameNumber) {
+    now = frameNumber;
+    if (inFlight) {
+      if (!isDone(flightFrameNumber)) {
+        return;
+      }
+      inFlight = false;
+      uploadDone(nullptr, [](asset::BaseAsset&) {});
+    }
+    if (retire([](asset::BaseAsset&) { return 0; }) ||
+        takeAdded([](asset::BaseAsset& a) {
+          static_cast<BenchAsset&>(a).setState(asset::ADD_WAIT);
+          return 0;
+        })) {
+      logF("BenchQueue: write failed\n");
+    }
+    if (!uploading.empty()) {
+      inFlight = true;
+      flightFrameNumber = frameNumber;
+    }
+  }
+} BenchQueue;
+
+// churnWrite adds n assets, then each frame deletes 'changes' READY assets
+// and adds 'changes' new ones. It returns the ns per write().
+template <typename T>
+static double churnWrite(size_t n, size_t changes, uint32_t frames) {
+  T m;
+  std::vector<std::shared_ptr<BenchAsset>> live(n);
+  for (auto& a : live) {
+    a = std::make_shared<BenchAsset>();
+    m.add(a);
+  }
+  m.write(0);
+  std::mt19937 rng(3);
+  double ns = 0;
+  for (uint32_t f = 1; f <= frames; f++) {
+    for (size_t i = 0; i < changes; i++) {
+      auto& a = live.at(rng() % n);
+      if (a->get() != asset::READY) {
+        continue;
+      }
+      m.del(a);
+      a = std::make_shared<BenchAsset>();
+      m.add(a);
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    m.write(f);
+    ns += nsSince(t0);
+  }
+  return ns / frames;
+}
+
+// benchWrite compares the per-frame cost of finding changed assets.
+static void benchWrite(size_t n, size_t changes) {
+  static constexpr uint32_t frames = 200;
+  double scan = churnWrite<ScanModel>(n, changes, frames);
+  double queue = churnWrite<BenchQueue>(n, changes, frames);
+  logI("write assets=%zu changes/frame=%zu\n", n, changes);
+  logI("  scan   %10.1f ns/write\n", scan);
+  logI("  queue  %10.1f ns/write\n", queue);
+  std::string name = "write/" + std::to_string(n) + "/changes" +
+                     std::to_string(changes);
+  record(name + "/scan", "ns/write", scan);
+  record(name + "/queue", "ns/write", queue);
+}
+
+// WriteBench drives the real Library::write() with LAYOUT_COMPACT on a
+// headless device, such as lavapipe (see cullgpucheck). Each frame it calls
+// write(), submits the SubmitInfo and waits for it. Only write() is timed.
+struct WriteBench : public BaseApplication {
+  WriteBench(language::Instance& inst) : BaseApplication(inst) {}
+
+  // settle runs frames until done() returns true. It adds the time spent in
+  // write() to ns and counts the frames.
+  template <typename Done>
+  int settle(UniformGlue& uglue, asset::Library& lib, Done done, double& ns,
+             size_t& frames) {
+    for (size_t limit = 100000; !done(); limit--) {
+      if (!limit) {
+        logE("writelib: assets did not settle\n");
+        return 1;
+      }
+      command::SubmitInfo info;
+      auto t0 = std::chrono::steady_clock::now();
+      if (lib.write(info, nullptr, nullptr)) {
+        logE("writelib: write failed\n");
+        return 1;
+      }
+      ns += nsSince(t0);
+      frames++;
+      auto& pool = uglue.stage.pool;
+      std::shared_ptr<command::Fence> fence{pool.borrowFence()};
+      if (!fence) {
+        logE("writelib: borrowFence failed\n");
+        return 1;
+      }
+      {
+        command::CommandPool::lock_guard_t lock(pool.lockmutex);
+        if (pool.submit(lock, uglue.stage.poolQindex, {info}, fence->vk)) {
+          logE("writelib: submit failed\n");
+          (void)pool.unborrowFence(fence);
+          return 1;
+        }
+      }
+      VkResult v = fence->waitMs(1000);
+      if (v != VK_SUCCESS) {
+        return explainVkResult("writelib: fence->waitMs", v);
+      }
+      if (pool.unborrowFence(fence)) {
+        logE("writelib: unborrowFence failed\n");
+        return 1;
+      }
+      // The frame is done, as UniformGlue::submit would report it.
+      uglue.frameNumber++;
+    }
+    return 0;
+  }
+
+  // run adds nAssets assets and writes them until all are READY. Then it
+  // calls update() on every other asset and writes until they are switched
+  // in. mode chooses between copying through upload and writing directly.
+  int run(size_t nAssets, size_t uploadSize, UniformGlue::DirectWrite mode,
+          const char* modeName) {
+    UniformGlue uglue{*this, nullptr /*window*/, 0, 0, 0};
+    uglue.directWrite = mode;
+    asset::Library lib{uglue};
+    lib.layout = asset::Library::LAYOUT_COMPACT;
+    lib.uploadSize = uploadSize;
+    lib.maxVertices = size_t(1) << 21;
+    if (lib.ctorError(sizeof(asset::CompactVertex), 0 /*instSize*/,
+                      size_t(1) << 22 /*maxIndices*/, 0)) {
+      logE("writelib: Library::ctorError failed\n");
+      return 1;
+    }
+    auto all = genAssets(nAssets);
+    for (auto& a : all) {
+      if (lib.add(a)) {
+        logE("writelib: add failed\n");
+        return 1;
+      }
+    }
+    double addNs = 0;
+    size_t addFrames = 0;
+    if (settle(uglue, lib,
+               [&all]() -> bool {
+                 for (auto& a : all) {
+                   if (a->state() != asset::READY) {
+                     return false;
+                   }
+                 }
+                 return true;
+               },
+               addNs, addFrames)) {
+      return 1;
+    }
+    size_t bytes = 0;
+    for (size_t p = 0; p < lib.page.size(); p++) {
+      asset::Suballoc::Stats v, o;
+      lib.getVertStats(v, p);
+      lib.getIndexStats(o, p);
+      bytes += v.used * lib.vertexSize + o.used * lib.page[p]->indexSize();
+    }
+
+    for (size_t i = 0; i < all.size(); i += 2) {
+      if (lib.update(all[i])) {
+        logE("writelib: update failed\n");
+        return 1;
+      }
+    }
+    double updNs = 0;
+    size_t updFrames = 0;
+    if (settle(uglue, lib,
+               [&all]() -> bool {
+                 for (auto& a : all) {
+                   if (a->updating()) {
+                     return false;
+                   }
+                 }
+                 return true;
+               },
+               updNs, updFrames)) {
+      return 1;
+    }
+
+    logI("writelib assets=%zu %s%s\n", nAssets, modeName,
+         lib.isDirect() ? "" : " (upload)");
+    logI("  add    %8.1f ms %6zu frames %7.1f MB/s\n", addNs * 1e-6,
+         addFrames, bytes / addNs * 1e3);
+    logI("  update %8.1f ms %6zu frames\n", updNs * 1e-6, updFrames);
+    std::string name =
+        "writelib/" + std::to_string(nAssets) + "/" + modeName;
+    record(name + "/add", "ms", addNs * 1e-6);
+    record(name + "/add", "MB/s", bytes / addNs * 1e3);
+    record(name + "/update", "ms", updNs * 1e-6);
+    return 0;
+  }
+};
+
+// benchWriteLib runs WriteBench if a Vulkan device can be opened without a
+// window. Without one, it is skipped and the other benches still run.
+static void benchWriteLib(size_t nAssets, size_t uploadSize) {
+  language::Instance instance;
+  if (!instance.minSurfaceSupport.erase(language::PRESENT)) {
+    logF("writelib: removing PRESENT from minSurfaceSupport: not found\n");
+  }
+  if (instance.ctorError(
+          [](language::Instance&, void*) -> VkResult { return VK_SUCCESS; },
+          nullptr) ||
+      instance.open({64, 64}) || !instance.devs.size()) {
+    logI("writelib: no Vulkan device, skipped\n");
+    return;
+  }
+  // Remove auto-selected presentModes to prevent VK_KHR_swapchain being used
+  // and device framebuffers being auto-created.
+  instance.devs.at(0)->presentModes.clear();
+
+  auto app = std::make_shared<WriteBench>(instance);
+  if (app->cpool.ctorError() ||
+      app->run(nAssets, uploadSize, UniformGlue::DIRECT_NEVER, "staged") ||
+      app->run(nAssets, uploadSize, UniformGlue::DIRECT_AUTO, "auto")) {
+    logF("writelib failed\n");
+  }
+}
+
+}  // End of anonymous namespace
+
+int main(int argc, char** argv) {
+  const char* json = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--json") && i + 1 < argc) {
+      json = argv[++i];
+    } else {
+      logE("Usage: %s [--json results.json]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  benchShapes();
+  benchOptimizeShapes();
+  benchTerrain(1024, 32);
+  benchTerrain(1024, 64);
+  benchCsg(1024);
+  benchGeomCache(256);
+  benchGeomCache(1024);
+  benchVertexWrite(256);
+  benchVertexWrite(1024);
+  benchCull(100000);
+  benchBvh(10000);
+  benchBvh(100000);
+
+  benchChurn(size_t(1) << 24, .5f, 100000);
+  benchChurn(size_t(1) << 24, .9f, 100000);
+  benchChurn(size_t(1) << 27, .9f, 100000);
+
+  size_t hw = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t threads = 0; threads <= hw; threads = threads ? threads * 2 : 1) {
+    benchGen(400, threads);
+  }
+
+  benchOcclusion(100000, 0);
+  benchOcclusion(100000, hw);
+
+  benchPhysics(1000, 60);
+  benchPhysics(10000, 20);
+  benchPhysics(100000, 5);
+
+  benchWrite(1000, 0);
+  benchWrite(50000, 0);
+  benchWrite(50000, 100);
+  benchWriteLib(400, size_t(4) << 20);
+  if (json && writeJson(json)) {
+    return 1;
+  }
+  return 0;
+}
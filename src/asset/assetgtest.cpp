@@ -0,0 +1,2041 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ *
+ * Unit tests for the CPU-only parts of asset.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <random>
+#include <set>
+
+#include "compact.h"
+#include "genpool.h"
+#include "geomcache.h"
+#include "gtest/gtest.h"
+#include "meshlet.h"
+#include "meshopt.h"
+#include "occlusion.h"
+#include "physics.h"
+#include "scatter.h"
+#include "scene.h"
+#include "suballoc.h"
+#include "terrain.h"
+
+namespace {  // An anonymous namespace keeps any definition local to this file.
+
+using asset::Suballoc;
+
+// SuballocTest wraps Suballoc to check its internal consistency.
+class SuballocTest : public ::testing::Test, public Suballoc {
+ protected:
+  void SetUp() override { reset(1024); }
+
+  // check walks the blocks in buffer order and confirms they tile the buffer
+  // with no two free blocks side by side.
+  void check() {
+    size_t pos = 0, sumUsed = 0, nFree = 0, nUsed = 0;
+    bool prevFree = false;
+    uint32_t prev = none;
+    for (uint32_t i = 0; i < node.size(); i++) {
+      if (node[i].size && node[i].prevPhys == none) {
+        ASSERT_EQ(prev, none) << "two first blocks";
+        prev = i;
+      }
+    }
+    for (uint32_t i = prev; i != none; i = node[i].nextPhys) {
+      ASSERT_EQ(node[i].base, pos);
+      ASSERT_GT(node[i].size, 0u);
+      if (node[i].isFree) {
+        ASSERT_FALSE(prevFree) << "free blocks were not coalesced";
+        nFree++;
+      } else {
+        sumUsed += node[i].size;
+        nUsed++;
+      }
+      prevFree = node[i].isFree;
+      pos += node[i].size;
+    }
+    ASSERT_EQ(pos, getTotal());
+    ASSERT_EQ(sumUsed, getUsed());
+    Stats st;
+    getStats(st);
+    ASSERT_EQ(st.freeBlocks, nFree);
+    ASSERT_EQ(st.usedBlocks, nUsed);
+  }
+};
+
+TEST_F(SuballocTest, allocAll) {
+  size_t base;
+  uint32_t id;
+  ASSERT_EQ(alloc(1024, base, id), 0);
+  ASSERT_EQ(base, 0u);
+  ASSERT_EQ(getUsed(), 1024u);
+  uint32_t id2;
+  ASSERT_EQ(alloc(1, base, id2), 1);
+  ASSERT_NO_FATAL_FAILURE(check());
+  ASSERT_EQ(free(id), 0);
+  ASSERT_EQ(getUsed(), 0u);
+  ASSERT_NO_FATAL_FAILURE(check());
+}
+
+TEST_F(SuballocTest, zeroSizeFails) {
+  size_t base;
+  uint32_t id;
+  ASSERT_EQ(alloc(0, base, id), 1);
+  ASSERT_EQ(getUsed(), 0u);
+}
+
+TEST_F(SuballocTest, doubleFreeFails) {
+  size_t base;
+  uint32_t id;
+  ASSERT_EQ(alloc(10, base, id), 0);
+  ASSERT_EQ(free(id), 0);
+  ASSERT_EQ(free(id), 1);
+  ASSERT_EQ(free(12345), 1);
+  ASSERT_NO_FATAL_FAILURE(check());
+}
+
+TEST_F(SuballocTest, coalesceBothSides) {
+  size_t base[3];
+  uint32_t id[3];
+  for (int i = 0; i < 3; i++) {
+    ASSERT_EQ(alloc(100, base[i], id[i]), 0);
+  }
+  ASSERT_EQ(free(id[0]), 0);
+  ASSERT_EQ(free(id[2]), 0);
+  Stats st;
+  getStats(st);
+  // [free 100] [used 100] [free 824]
+  ASSERT_EQ(st.freeBlocks, 2u);
+  ASSERT_EQ(st.largestFree, 824u);
+  ASSERT_GT(st.fragmentation(), 0.f);
+  ASSERT_NO_FATAL_FAILURE(check());
+
+  ASSERT_EQ(free(id[1]), 0);
+  getStats(st);
+  ASSERT_EQ(st.freeBlocks, 1u);
+  ASSERT_EQ(st.largestFree, 1024u);
+  ASSERT_EQ(st.fragmentation(), 0.f);
+  ASSERT_NO_FATAL_FAILURE(check());
+}
+
+TEST_F(SuballocTest, fillsExactHole) {
+  // A hole that is exactly the right size must be found even though alloc
+  // rounds the request up to the next bin.
+  reset(1000);
+  size_t base;
+  uint32_t a, b;
+  ASSERT_EQ(alloc(900, base, a), 0);
+  ASSERT_EQ(alloc(100, base, b), 0);
+  ASSERT_EQ(free(b), 0);
+  ASSERT_EQ(alloc(100, base, b), 0);
+  ASSERT_EQ(base, 900u);
+  ASSERT_NO_FATAL_FAILURE(check());
+}
+
+TEST_F(SuballocTest, randomChurn) {
+  reset(1 << 20);
+  std::mt19937 rng(1);
+  std::vector<std::pair<uint32_t, size_t>> live;
+  std::vector<char> owner(getTotal(), 0);
+  for (int step = 0; step < 20000; step++) {
+    if (live.empty() || rng() % 3) {
+      size_t want = 1 + rng() % 2000;
+      size_t base;
+      uint32_t id;
+      if (alloc(want, base, id)) {
+        continue;
+      }
+      ASSERT_LE(base + want, getTotal());
+      for (size_t i = base; i < base + want; i++) {
+        ASSERT_EQ(owner[i], 0) << "overlapping blocks at " << i;
+        owner[i] = 1;
+      }
+      live.emplace_back(id, want);
+    } else {
+      size_t k = rng() % live.size();
+      size_t base = node[live[k].first].base;
+      for (size_t i = base; i < base + live[k].second; i++) {
+        owner[i] = 0;
+      }
+      ASSERT_EQ(free(live[k].first), 0);
+      live[k] = live.back();
+      live.pop_back();
+    }
+    if (step % 1000 == 0) {
+      ASSERT_NO_FATAL_FAILURE(check());
+    }
+  }
+  for (auto& b : live) {
+    ASSERT_EQ(free(b.first), 0);
+  }
+  Stats st;
+  getStats(st);
+  ASSERT_EQ(st.used, 0u);
+  ASSERT_EQ(st.freeBlocks, 1u);
+  ASSERT_EQ(st.largestFree, getTotal());
+  ASSERT_NO_FATAL_FAILURE(check());
+}
+
+// makeRevolv makes a Revolv with 'rots' rotations, so that each asset has a
+// different number of vertices.
+static std::shared_ptr<asset::Revolv> makeRevolv(uint32_t rots) {
+  auto r = std::make_shared<asset::Revolv>();
+  r->rots = rots;
+  r->pt.emplace_back(1.f, -1.f);
+  r->pt.emplace_back(.7f, -.7f);
+  r->pt.emplace_back(.7f, .7f);
+  r->pt.emplace_back(1.f, 1.f);
+  return r;
+}
+
+TEST(GenPoolTest, resultsInPushOrder) {
+  std::vector<std::shared_ptr<asset::Revolv>> all;
+  for (uint32_t i = 0; i < 64; i++) {
+    // Make early assets slow so later ones tend to finish first.
+    all.emplace_back(makeRevolv(i < 8 ? 2048 - i : 3 + i));
+  }
+  asset::GenPool pool;
+  ASSERT_EQ(pool.start(4), 0);
+  for (auto& a : all) {
+    pool.push(a);
+  }
+  ASSERT_EQ(pool.start(2), 1);  // start while busy is an error.
+  for (auto& a : all) {
+    asset::GenPool::Job* j = pool.wait();
+    ASSERT_NE(j, nullptr);
+    ASSERT_EQ(j->asset, a);
+    ASSERT_EQ(j->result, 0);
+
+    asset::VertexIndex want;
+    ASSERT_EQ(a->toVertices(want), 0);
+    ASSERT_EQ(j->out.vert.size(), want.vert.size());
+    ASSERT_EQ(j->out.order, want.order);
+    pool.pop();
+  }
+  ASSERT_EQ(pool.wait(), nullptr);
+  ASSERT_FALSE(pool.busy());
+}
+
+TEST(GenPoolTest, stopDiscardsJobs) {
+  asset::GenPool pool;
+  ASSERT_EQ(pool.start(1), 0);
+  for (uint32_t i = 0; i < 16; i++) {
+    pool.push(makeRevolv(512));
+  }
+  pool.stop();
+  ASSERT_FALSE(pool.busy());
+  ASSERT_EQ(pool.peek(), nullptr);
+}
+
+// checkMesh confirms every index is valid, every vertex is used, and every
+// normal is normalized.
+static void checkMesh(const asset::VertexIndex& out) {
+  ASSERT_EQ(out.order.size() % 3, 0u);
+  std::vector<char> used(out.vert.size(), 0);
+  for (auto i : out.order) {
+    ASSERT_LT(i, out.vert.size());
+    used.at(i) = 1;
+  }
+  for (size_t i = 0; i < out.vert.size(); i++) {
+    ASSERT_TRUE(used.at(i)) << "vertex " << i << " is not used";
+    ASSERT_NEAR(glm::length(out.vert.at(i).N), 1.f, 1e-4f);
+  }
+}
+
+TEST(ShapeTest, revolv) {
+  asset::VertexIndex out;
+  auto r = makeRevolv(32);
+  ASSERT_EQ(r->toVertices(out), 0);
+  ASSERT_NO_FATAL_FAILURE(checkMesh(out));
+  // 2 caps of 30 tris, 3 sides of 32 quads.
+  ASSERT_EQ(out.order.size(), 3u * (2 * 30 + 2 * 3 * 32));
+  ASSERT_EQ(out.vert.size(), 32u * 4);
+}
+
+TEST(ShapeTest, heightMapMixedPerFace) {
+  // Some rows are VERT_PER_FACE. Vertices only used by VERT_PER_FACE faces
+  // must be dropped from the shared vertices, and the shared indices moved.
+  static constexpr size_t w = 16;
+  asset::HeightMap h;
+  h.width = w;
+  h.pt = std::make_shared<std::vector<asset::HeightMapPoint>>(w * w);
+  for (size_t j = 0; j < h.pt->size(); j++) {
+    h.pt->at(j).y = float((j * 7) % 13) * .1f;
+    h.pt->at(j).flags = ((j / w) % 4 < 2) ? asset::VERT_PER_FACE : 0;
+  }
+  asset::VertexIndex out;
+  ASSERT_EQ(h.toVertices(out), 0);
+  ASSERT_NO_FATAL_FAILURE(checkMesh(out));
+  ASSERT_EQ(out.order.size(), 3u * 2 * (w - 1) * (w - 1));
+  for (size_t i = 0; i < out.order.size(); i++) {
+    // Each vertex must still be at its grid point.
+    auto& P = out.vert.at(out.order.at(i)).P;
+    size_t x = size_t(P.x + .5f), z = size_t(P.z + .5f);
+    ASSERT_LT(x, w);
+    ASSERT_LT(z, w);
+    ASSERT_EQ(P.y, h.pt->at(z * w + x).y) << "at " << i;
+  }
+}
+
+TEST(ShapeTest, extrudFacesOut) {
+  asset::Extrud e;
+  e.dir = glm::vec3(0.f, 0.f, 2.f);
+  for (int i = 0; i < 8; i++) {
+    float a = float(i) * 3.14159265f / 4;
+    e.pt.emplace_back(cosf(a), sinf(a));
+  }
+  for (float z : {2.f, -2.f}) {
+    e.dir.z = z;
+    asset::VertexIndex out;
+    ASSERT_EQ(e.toVertices(out), 0);
+    ASSERT_NO_FATAL_FAILURE(checkMesh(out));
+    // 2 caps of 6 tris, 8 quads.
+    ASSERT_EQ(out.order.size(), 3u * (2 * 6 + 2 * 8));
+    glm::vec3 center(0.f, 0.f, z * .5f);
+    for (size_t i = 0; i < out.order.size(); i += 3) {
+      auto& a = out.vert.at(out.order.at(i)).P;
+      auto& b = out.vert.at(out.order.at(i + 1)).P;
+      auto& c = out.vert.at(out.order.at(i + 2)).P;
+      auto N = glm::cross(b - a, c - b);
+      ASSERT_GT(glm::dot(N, (a + b + c) * (1.f / 3) - center), 0.f)
+          << "dir.z=" << z << " tri " << i / 3;
+    }
+  }
+}
+
+TEST(LodTest, revolvChain) {
+  auto r = makeRevolv(64);
+  r->lods = 4;
+  r->optimize = asset::BaseAsset::OPTIMIZE_ALL;
+  asset::VertexIndex out;
+  ASSERT_EQ(r->toOptimizedVertices(out), 0);
+  ASSERT_NO_FATAL_FAILURE(checkMesh(out));
+  ASSERT_EQ(r->lod.size(), 4u);
+  ASSERT_EQ(r->lod.at(0).error, 0.f);
+  size_t next = 0;
+  for (size_t i = 0; i < r->lod.size(); i++) {
+    auto& l = r->lod.at(i);
+    ASSERT_EQ(l.firstIndex, next);
+    next += l.indexCount;
+    if (i) {
+      ASSERT_LT(l.indexCount, r->lod.at(i - 1).indexCount);
+      ASSERT_GT(l.error, r->lod.at(i - 1).error);
+    }
+  }
+  ASSERT_EQ(next, out.order.size());
+  // Meshlets are only built for lod[0].
+  auto& m = r->meshlet.back();
+  ASSERT_EQ(m.firstIndex + m.indexCount, r->lod.at(0).indexCount);
+
+  // rots = 3 cannot get any coarser.
+  r = makeRevolv(3);
+  r->lods = 4;
+  out = asset::VertexIndex();
+  ASSERT_EQ(r->toOptimizedVertices(out), 0);
+  ASSERT_EQ(r->lod.size(), 1u);
+}
+
+TEST(LodTest, heightMapError) {
+  // An odd width keeps the last column, which is not on the step.
+  static constexpr size_t w = 10;
+  asset::HeightMap h;
+  h.width = w;
+  h.pt = std::make_shared<std::vector<asset::HeightMapPoint>>(w * w);
+  for (auto& p : *h.pt) {
+    p.y = 0.f;
+    p.flags = 0;
+  }
+  h.pt->at(3 * w + 5).y = 2.f;  // A spike removed by level 1.
+  h.lods = 3;
+  asset::VertexIndex out;
+  ASSERT_EQ(h.toOptimizedVertices(out), 0);
+  ASSERT_NO_FATAL_FAILURE(checkMesh(out));
+  ASSERT_EQ(h.lod.size(), 3u);
+  ASSERT_FLOAT_EQ(h.lod.at(1).error, 2.f);
+  ASSERT_EQ(h.lod.at(1).indexCount, 3u * 2 * 5 * 5);
+  float maxX = 0.f;
+  for (size_t i = 0; i < h.lod.at(2).indexCount; i++) {
+    auto& P = out.vert.at(out.order.at(h.lod.at(2).firstIndex + i)).P;
+    maxX = std::max(maxX, P.x);
+  }
+  ASSERT_EQ(maxX, float(w - 1));
+
+  // A plane has no error at any level.
+  for (size_t j = 0; j < h.pt->size(); j++) {
+    h.pt->at(j).y = float(j % w) * .5f + float(j / w) * .25f;
+  }
+  out = asset::VertexIndex();
+  ASSERT_EQ(h.toOptimizedVertices(out), 0);
+  for (auto& l : h.lod) {
+    ASSERT_NEAR(l.error, 0.f, 1e-5f);
+  }
+}
+
+TEST(LodTest, selectLod) {
+  asset::HeightMap h;
+  h.lod.resize(3);
+  h.lod.at(1).error = .01f;
+  h.lod.at(2).error = .1f;
+  ASSERT_EQ(h.selectLod(200.f, 1000.f), 2u);
+  ASSERT_EQ(h.selectLod(20.f, 1000.f), 1u);
+  ASSERT_EQ(h.selectLod(5.f, 1000.f), 0u);
+  ASSERT_EQ(h.selectLod(5.f, 1000.f, 10.f), 1u);
+  // useLod only works on an asset in a Library.
+  ASSERT_EQ(h.useLod(1), 1);
+}
+
+// CountExtrud counts the calls to toVertices.
+typedef struct CountExtrud : public asset::Extrud {
+  size_t calls{0};
+  int toVertices(asset::VertexIndex& out) override {
+    calls++;
+    return asset::Extrud::toVertices(out);
+  }
+} CountExtrud;
+
+// makeBox makes a cube from (0, 0, 0) to (s, s, s).
+static std::shared_ptr<CountExtrud> makeBox(float s) {
+  auto e = std::make_shared<CountExtrud>();
+  e->pt.emplace_back(0.f, 0.f);
+  e->pt.emplace_back(s, 0.f);
+  e->pt.emplace_back(s, s);
+  e->pt.emplace_back(0.f, s);
+  e->dir = glm::vec3(0.f, 0.f, s);
+  return e;
+}
+
+static asset::AssetLocRot placeAt(std::shared_ptr<asset::BaseAsset> a,
+                                  glm::vec3 loc) {
+  asset::AssetLocRot c;
+  c.asset = a;
+  c.rot = glm::quat(1.f, 0.f, 0.f, 0.f);
+  c.loc = loc;
+  return c;
+}
+
+TEST(CsgTest, childGeneratedOnce) {
+  auto box = makeBox(1.f);
+  asset::CsgOR csg;
+  for (int i = 0; i < 10; i++) {
+    csg.child.emplace_back(placeAt(box, glm::vec3(2.f * i, 0.f, 0.f)));
+  }
+  asset::VertexIndex out;
+  ASSERT_EQ(csg.toVertices(out), 0);
+  ASSERT_NO_FATAL_FAILURE(checkMesh(out));
+  ASSERT_EQ(box->calls, 1u);
+  ASSERT_EQ(csg.csgStats.generated, 1u);
+  ASSERT_EQ(out.order.size(), 10u * 3 * 12);
+  asset::Bounds b;
+  b.set(out.vert);
+  ASSERT_NEAR(b.max.x, 19.f, 1e-5f);
+
+  // Turn the box 90 degrees around +Y: +X goes to -Z.
+  csg.child.resize(1);
+  csg.child.at(0).rot =
+      glm::angleAxis(3.14159265f / 2, glm::vec3(0.f, 1.f, 0.f));
+  out = asset::VertexIndex();
+  ASSERT_EQ(csg.toVertices(out), 0);
+  b.set(out.vert);
+  ASSERT_NEAR(b.min.z, -1.f, 1e-5f);
+  ASSERT_NEAR(b.max.z, 0.f, 1e-5f);
+  ASSERT_NEAR(b.min.x, 0.f, 1e-5f);
+  ASSERT_NEAR(b.max.x, 1.f, 1e-5f);
+
+  csg.child.at(0).asset.reset();
+  ASSERT_EQ(csg.toVertices(out), 1);
+}
+
+TEST(CsgTest, dropEnclosed) {
+  auto box = makeBox(1.f);
+  asset::CsgOR csg;
+  csg.child.emplace_back(placeAt(box, glm::vec3(0.f)));
+  csg.child.emplace_back(placeAt(box, glm::vec3(1.f, 0.f, 0.f)));
+  asset::VertexIndex out;
+  ASSERT_EQ(csg.toVertices(out), 0);
+  ASSERT_EQ(out.order.size(), 3u * 24);
+
+  // The 2 tris on each side of x = 1 are inside the other box.
+  csg.flags = asset::CsgOR::DROP_ENCLOSED;
+  out = asset::VertexIndex();
+  ASSERT_EQ(csg.toVertices(out), 0);
+  ASSERT_NO_FATAL_FAILURE(checkMesh(out));
+  ASSERT_EQ(csg.csgStats.dropped, 4u);
+  ASSERT_EQ(out.order.size(), 3u * 20);
+
+  // A box inside a bigger box is dropped completely.
+  csg.child.at(1) = placeAt(makeBox(4.f), glm::vec3(-1.f));
+  out = asset::VertexIndex();
+  ASSERT_EQ(csg.toVertices(out), 0);
+  ASSERT_NO_FATAL_FAILURE(checkMesh(out));
+  ASSERT_EQ(csg.csgStats.dropped, 12u);
+  ASSERT_EQ(out.order.size(), 3u * 12);
+  ASSERT_EQ(out.vert.size(), 8u);
+  for (auto& v : out.vert) {
+    ASSERT_TRUE(fabsf(v.P.x) == 1.f || v.P.x == 3.f) << v.P.x;
+  }
+}
+
+TEST(CsgTest, weld) {
+  auto h = std::make_shared<asset::HeightMap>();
+  h->width = 3;
+  h->pt = std::make_shared<std::vector<asset::HeightMapPoint>>(9);
+  for (auto& p : *h->pt) {
+    p.y = 0.f;
+    p.flags = 0;
+  }
+  asset::CsgOR csg;
+  csg.child.emplace_back(placeAt(h, glm::vec3(0.f)));
+  csg.child.emplace_back(placeAt(h, glm::vec3(2.f, 0.f, 0.f)));
+  csg.flags = asset::CsgOR::WELD;
+  asset::VertexIndex out;
+  ASSERT_EQ(csg.toVertices(out), 0);
+  ASSERT_NO_FATAL_FAILURE(checkMesh(out));
+  // The 3 vertices at x = 2 are shared.
+  ASSERT_EQ(csg.csgStats.welded, 3u);
+  ASSERT_EQ(out.vert.size(), 15u);
+  ASSERT_EQ(out.order.size(), 3u * 16);
+
+  // Vertices with different normals are not welded.
+  auto box = makeBox(1.f);
+  csg.child.at(0) = placeAt(box, glm::vec3(0.f));
+  csg.child.at(1) = placeAt(box, glm::vec3(1.f, 0.f, 0.f));
+  out = asset::VertexIndex();
+  ASSERT_EQ(csg.toVertices(out), 0);
+  ASSERT_EQ(csg.csgStats.welded, 0u);
+  ASSERT_EQ(out.vert.size(), 16u);
+
+  csg.weldDist = 0.f;
+  ASSERT_EQ(csg.toVertices(out), 1);
+}
+
+// triSet makes a sorted list of the tris in 'out' by their positions, with
+// each tri rotated so it starts with its lowest vertex. The winding is kept.
+static std::vector<std::vector<float>> triSet(const asset::VertexIndex& out) {
+  std::vector<std::vector<float>> r;
+  for (size_t i = 0; i < out.order.size(); i += 3) {
+    std::vector<std::vector<float>> v;
+    for (size_t j = 0; j < 3; j++) {
+      auto& P = out.vert.at(out.order.at(i + j)).P;
+      v.push_back({P.x, P.y, P.z});
+    }
+    auto lo = std::min_element(v.begin(), v.end()) - v.begin();
+    std::rotate(v.begin(), v.begin() + lo, v.end());
+    r.emplace_back();
+    for (auto& p : v) {
+      r.back().insert(r.back().end(), p.begin(), p.end());
+    }
+  }
+  std::sort(r.begin(), r.end());
+  return r;
+}
+
+static asset::VertexIndex makeGrid(size_t w) {
+  asset::HeightMap h;
+  h.width = w;
+  h.pt = std::make_shared<std::vector<asset::HeightMapPoint>>(w * w);
+  for (size_t j = 0; j < h.pt->size(); j++) {
+    h.pt->at(j).y = float((j * 7) % 13) * .1f;
+    h.pt->at(j).flags = 0;
+  }
+  asset::VertexIndex out;
+  EXPECT_EQ(h.toVertices(out), 0);
+  return out;
+}
+
+TEST(MeshOptTest, analyzeCache) {
+  asset::CacheStats st;
+  asset::analyzeCache({0, 1, 2, 2, 1, 3}, 4, st, 16);
+  ASSERT_EQ(st.misses, 4u);
+  ASSERT_FLOAT_EQ(st.acmr, 2.f);
+  ASSERT_FLOAT_EQ(st.atvr, 1.f);
+  // A cache of 2 evicts 0 before it is used again.
+  asset::analyzeCache({0, 1, 2, 0, 1, 2}, 3, st, 2);
+  ASSERT_EQ(st.misses, 6u);
+}
+
+TEST(MeshOptTest, cacheKeepsTris) {
+  auto out = makeGrid(64);
+  auto want = triSet(out);
+  asset::CacheStats before, after;
+  asset::analyzeCache(out.order, out.vert.size(), before);
+  std::vector<size_t> cluster;
+  ASSERT_EQ(asset::optimizeCache(out, &cluster), 0);
+  asset::analyzeCache(out.order, out.vert.size(), after);
+  ASSERT_EQ(triSet(out), want);
+  ASSERT_LT(after.acmr, before.acmr);
+  ASSERT_FALSE(cluster.empty());
+  ASSERT_EQ(cluster.at(0), 0u);
+  for (size_t i = 1; i < cluster.size(); i++) {
+    ASSERT_GT(cluster.at(i), cluster.at(i - 1));
+    ASSERT_EQ(cluster.at(i) % 3, 0u);
+  }
+
+  ASSERT_EQ(asset::optimizeOverdraw(out, cluster), 0);
+  ASSERT_EQ(triSet(out), want);
+  asset::CacheStats od;
+  asset::analyzeCache(out.order, out.vert.size(), od);
+  ASSERT_LE(od.acmr, after.acmr * 1.05f);
+}
+
+TEST(MeshOptTest, fetchInFirstUseOrder) {
+  auto out = makeGrid(16);
+  auto want = triSet(out);
+  ASSERT_EQ(asset::optimizeCache(out), 0);
+  ASSERT_EQ(asset::optimizeFetch(out), 0);
+  ASSERT_EQ(triSet(out), want);
+  size_t next = 0;
+  for (auto i : out.order) {
+    ASSERT_LE(i, next);
+    if (i == next) {
+      next++;
+    }
+  }
+  ASSERT_EQ(next, out.vert.size());
+}
+
+TEST(MeshOptTest, optimizeAllStats) {
+  auto r = makeRevolv(64);
+  r->optimize = asset::BaseAsset::OPTIMIZE_ALL;
+  asset::VertexIndex out;
+  ASSERT_EQ(r->toOptimizedVertices(out), 0);
+  ASSERT_NO_FATAL_FAILURE(checkMesh(out));
+  ASSERT_LT(r->optStats.after.acmr, r->optStats.before.acmr);
+  ASSERT_LT(r->optStats.after.atvr, r->optStats.before.atvr);
+}
+
+TEST(MeshOptTest, rejectsBadIndex) {
+  asset::VertexIndex out;
+  out.vert.resize(2);
+  out.order = {0, 1, 2};
+  ASSERT_EQ(asset::optimizeCache(out), 1);
+  ASSERT_EQ(asset::optimizeFetch(out), 1);
+}
+
+TEST(MeshletTest, limitsAndCoverage) {
+  auto out = makeGrid(64);
+  auto want = triSet(out);
+  ASSERT_EQ(asset::optimizeCache(out), 0);
+  std::vector<asset::Meshlet> meshlet;
+  asset::MeshletStats st;
+  ASSERT_EQ(asset::buildMeshlets(out, meshlet, 64, 124, &st), 0);
+  ASSERT_EQ(triSet(out), want);
+  ASSERT_EQ(st.meshlets, meshlet.size());
+  size_t next = 0;
+  for (auto& m : meshlet) {
+    ASSERT_EQ(m.firstIndex, next);
+    ASSERT_GT(m.indexCount, 0u);
+    ASSERT_LE(m.indexCount, 124u * 3);
+    ASSERT_LE(m.vertexCount, 64u);
+    next += m.indexCount;
+    std::set<asset::indicesType> used(
+        out.order.begin() + m.firstIndex,
+        out.order.begin() + m.firstIndex + m.indexCount);
+    ASSERT_EQ(used.size(), m.vertexCount);
+    for (auto v : used) {
+      float d = glm::length(out.vert.at(v).P - m.center);
+      ASSERT_LE(d, m.radius * 1.0001f + 1e-6f);
+    }
+    if (m.coneCos <= 0.f) {
+      continue;
+    }
+    for (size_t i = m.firstIndex; i < next; i += 3) {
+      auto& a = out.vert.at(out.order.at(i)).P;
+      auto& b = out.vert.at(out.order.at(i + 1)).P;
+      auto& c = out.vert.at(out.order.at(i + 2)).P;
+      auto N = glm::normalize(glm::cross(b - a, c - b));
+      ASSERT_GE(glm::dot(N, m.coneAxis), m.coneCos - 1e-5f);
+    }
+  }
+  ASSERT_EQ(next, out.order.size());
+  // A 64x64 grid has 2 tris per vertex, so meshlets should be mostly full.
+  ASSERT_GT(st.vertFill, .8f);
+  ASSERT_GT(st.triFill, .7f);
+}
+
+TEST(MeshletTest, backfacing) {
+  asset::HeightMap h;
+  h.width = 16;
+  h.pt = std::make_shared<std::vector<asset::HeightMapPoint>>(16 * 16);
+  for (auto& p : *h.pt) {
+    p.y = 0.f;
+    p.flags = 0;
+  }
+  h.optimize = asset::BaseAsset::OPTIMIZE_MESHLETS;
+  asset::VertexIndex out;
+  ASSERT_EQ(h.toOptimizedVertices(out), 0);
+  ASSERT_FALSE(h.meshlet.empty());
+  ASSERT_EQ(h.meshletStats.meshlets, h.meshlet.size());
+  // Find which side of the flat heightmap is the front.
+  auto& m0 = h.meshlet.at(0);
+  ASSERT_GT(m0.coneCos, .99f);
+  ASSERT_GT(fabsf(m0.coneAxis.y), .99f);
+  float up = m0.coneAxis.y;
+  for (auto& m : h.meshlet) {
+    ASSERT_FLOAT_EQ(m.coneAxis.y, up);
+    ASSERT_FALSE(m.backfacing(glm::vec3(8.f, up * 100.f, 8.f)));
+    ASSERT_TRUE(m.backfacing(glm::vec3(8.f, -up * 100.f, 8.f)));
+    // Inside the bounding sphere nothing can be culled.
+    ASSERT_FALSE(m.backfacing(m.center));
+  }
+}
+
+TEST(MeshletTest, rejectsBadInput) {
+  asset::VertexIndex out;
+  out.vert.resize(3);
+  out.order = {0, 1};
+  std::vector<asset::Meshlet> meshlet;
+  ASSERT_EQ(asset::buildMeshlets(out, meshlet), 1);
+  out.order = {0, 1, 2};
+  ASSERT_EQ(asset::buildMeshlets(out, meshlet, 2, 124), 1);
+  ASSERT_EQ(asset::buildMeshlets(out, meshlet), 0);
+  ASSERT_EQ(meshlet.size(), 1u);
+  ASSERT_EQ(meshlet.at(0).vertexCount, 3u);
+}
+
+// makeTiles makes a w x w HeightMapTiles with bumpy heights.
+static asset::HeightMapTiles makeTiles(size_t w, size_t tileSize) {
+  asset::HeightMapTiles t;
+  t.width = w;
+  t.tileSize = tileSize;
+  t.skirt = 0.f;
+  t.pt = std::make_shared<std::vector<asset::HeightMapPoint>>(w * w);
+  for (size_t j = 0; j < t.pt->size(); j++) {
+    t.pt->at(j).y = float((j * 7) % 13) * .1f;
+    t.pt->at(j).flags = 0;
+  }
+  EXPECT_EQ(t.ctorError(), 0);
+  return t;
+}
+
+TEST(TerrainTest, tilesMatchHeightMap) {
+  auto t = makeTiles(35, 8);
+  ASSERT_EQ(t.tilesX, 5u);
+  ASSERT_EQ(t.tilesZ, 5u);
+  std::vector<std::shared_ptr<asset::BaseAsset>> added, deleted;
+  ASSERT_EQ(t.update(glm::vec3(0.f), added, deleted), 0);
+  ASSERT_EQ(added.size(), 25u);
+  ASSERT_TRUE(deleted.empty());
+
+  asset::HeightMap h;
+  h.width = t.width;
+  h.pt = t.pt;
+  asset::VertexIndex whole;
+  ASSERT_EQ(h.toVertices(whole), 0);
+  std::map<std::vector<float>, glm::vec3> normal;
+  for (auto& v : whole.vert) {
+    normal[{v.P.x, v.P.y, v.P.z}] = v.N;
+  }
+  asset::VertexIndex all;
+  for (auto& a : added) {
+    asset::VertexIndex out;
+    ASSERT_EQ(a->toVertices(out), 0);
+    ASSERT_NO_FATAL_FAILURE(checkMesh(out));
+    // Vertices on the edges must have the same normal in every tile.
+    for (auto& v : out.vert) {
+      auto& N = normal.at({v.P.x, v.P.y, v.P.z});
+      ASSERT_NEAR(glm::length(v.N - N), 0.f, 1e-5f);
+    }
+    for (auto i : out.order) {
+      all.order.push_back(i + all.vert.size());
+    }
+    all.vert.insert(all.vert.end(), out.vert.begin(), out.vert.end());
+  }
+  ASSERT_EQ(triSet(all), triSet(whole));
+}
+
+TEST(TerrainTest, editOnlyUpdatesNeighbors) {
+  auto t = makeTiles(33, 8);
+  std::vector<std::shared_ptr<asset::BaseAsset>> added, deleted;
+  ASSERT_EQ(t.update(glm::vec3(0.f), added, deleted), 0);
+  added.clear();
+  ASSERT_EQ(t.update(glm::vec3(0.f), added, deleted), 0);
+  ASSERT_TRUE(added.empty());
+
+  // The corner of 4 tiles.
+  t.pt->at(8 * 33 + 8).y = 5.f;
+  t.setDirty(8, 8);
+  ASSERT_EQ(t.update(glm::vec3(0.f), added, deleted), 0);
+  ASSERT_EQ(added.size(), 4u);
+  ASSERT_EQ(deleted.size(), 4u);
+
+  // Next to the edge of tile 1: tile 0 uses it for its normals.
+  added.clear();
+  deleted.clear();
+  t.setDirty(9, 3);
+  ASSERT_EQ(t.update(glm::vec3(0.f), added, deleted), 0);
+  ASSERT_EQ(added.size(), 2u);
+  ASSERT_EQ(added.at(0), t.tile.at(0));
+  ASSERT_EQ(added.at(1), t.tile.at(1));
+}
+
+TEST(TerrainTest, perFaceEvalSkipsApron) {
+  auto t = makeTiles(33, 8);
+  t.eval = std::make_pair(
+      [](void*, std::vector<asset::Vertex>&, uint32_t& flags) -> int {
+        flags |= asset::VERT_PER_FACE;
+        return 0;
+      },
+      nullptr);
+  std::vector<std::shared_ptr<asset::BaseAsset>> added, deleted;
+  ASSERT_EQ(t.update(glm::vec3(0.f), added, deleted), 0);
+  ASSERT_EQ(added.size(), 16u);
+  // Tile 5 is interior, so it has an apron on all 4 sides. Only its own
+  // 8 x 8 quads are drawn.
+  asset::VertexIndex out;
+  ASSERT_EQ(t.tile.at(5)->toVertices(out), 0);
+  ASSERT_NO_FATAL_FAILURE(checkMesh(out));
+  ASSERT_EQ(out.order.size(), 3u * 128);
+  ASSERT_EQ(out.vert.size(), 3u * 128);
+
+  asset::HeightMap h;
+  h.width = t.width;
+  h.pt = t.pt;
+  h.eval = t.eval;
+  asset::VertexIndex whole;
+  ASSERT_EQ(h.toVertices(whole), 0);
+  asset::VertexIndex all;
+  for (auto& a : added) {
+    out.vert.clear();
+    out.order.clear();
+    ASSERT_EQ(a->toVertices(out), 0);
+    for (auto i : out.order) {
+      all.order.push_back(i + all.vert.size());
+    }
+    all.vert.insert(all.vert.end(), out.vert.begin(), out.vert.end());
+  }
+  ASSERT_EQ(triSet(all), triSet(whole));
+}
+
+TEST(TerrainTest, farTilesAndSkirts) {
+  auto t = makeTiles(65, 8);
+  t.lodDist = 10.f;
+  t.skirt = .5f;
+  std::vector<std::shared_ptr<asset::BaseAsset>> added, deleted;
+  ASSERT_EQ(t.update(glm::vec3(0.f), added, deleted), 0);
+  ASSERT_EQ(t.tile.at(0)->step, 1u);
+  ASSERT_EQ(t.tile.back()->step, 8u);
+  for (size_t i = 1; i < t.tilesX; i++) {
+    ASSERT_GE(t.tile.at(i)->step, t.tile.at(i - 1)->step);
+  }
+  // An 8 x 8 tile has 128 tris plus 2 tris per quad on each skirt.
+  asset::VertexIndex out;
+  ASSERT_EQ(t.tile.at(0)->toVertices(out), 0);
+  ASSERT_NO_FATAL_FAILURE(checkMesh(out));
+  ASSERT_EQ(out.order.size(), 3u * (128 + 4 * 8 * 2));
+  for (size_t i = 3 * 128; i < out.order.size(); i += 3) {
+    auto& a = out.vert.at(out.order.at(i)).P;
+    auto& b = out.vert.at(out.order.at(i + 1)).P;
+    auto& c = out.vert.at(out.order.at(i + 2)).P;
+    // Skirts face out from the center of the tile.
+    auto N = glm::cross(b - a, c - b);
+    auto mid = (a + b + c) * (1.f / 3) - glm::vec3(4.f, 0.f, 4.f);
+    mid.y = 0.f;
+    ASSERT_GT(glm::dot(N, mid), 0.f) << "skirt tri " << i / 3;
+  }
+
+  // Moving the eye only replaces the tiles whose step changes.
+  added.clear();
+  deleted.clear();
+  ASSERT_EQ(t.update(glm::vec3(64.f, 0.f, 64.f), added, deleted), 0);
+  ASSERT_EQ(t.tile.at(0)->step, 8u);
+  ASSERT_EQ(t.tile.back()->step, 1u);
+  ASSERT_EQ(added.size(), deleted.size());
+  ASSERT_LT(added.size(), t.tile.size());
+}
+
+TEST(HashTest, paramsChangeHash) {
+  auto r = makeRevolv(32);
+  asset::Hasher a, b;
+  ASSERT_EQ(r->hash(a), 0);
+  ASSERT_EQ(r->hash(b), 0);
+  ASSERT_EQ(a.h, b.h);
+  r->pt.at(1).x += .01f;
+  b = asset::Hasher();
+  ASSERT_EQ(r->hash(b), 0);
+  ASSERT_NE(a.h, b.h);
+
+  // A tile only hashes the points near it.
+  auto t = makeTiles(35, 8);
+  std::vector<std::shared_ptr<asset::BaseAsset>> added, deleted;
+  ASSERT_EQ(t.update(glm::vec3(0.f), added, deleted), 0);
+  std::vector<uint64_t> before;
+  for (auto& tile : t.tile) {
+    asset::Hasher h;
+    ASSERT_EQ(tile->hash(h), 0);
+    before.emplace_back(h.h);
+  }
+  t.pt->at(16 * 35 + 16).y += 1.f;
+  size_t changed = 0;
+  for (size_t i = 0; i < t.tile.size(); i++) {
+    asset::Hasher h;
+    ASSERT_EQ(t.tile.at(i)->hash(h), 0);
+    changed += h.h != before.at(i);
+  }
+  ASSERT_EQ(changed, 4u);  // (16, 16) is on the corner of 4 tiles.
+
+  // An eval without an evalKey can not be hashed.
+  r->eval.first = [](void*, std::vector<asset::Vertex>&, uint32_t&) -> int {
+    return 0;
+  };
+  ASSERT_EQ(r->hash(b), 1);
+  r->evalKey = 1;
+  ASSERT_EQ(r->hash(b), 0);
+  asset::CsgOR csg;
+  csg.child.emplace_back(placeAt(makeRevolv(8), glm::vec3(0.f)));
+  ASSERT_EQ(csg.hash(b), 0);
+  csg.child.at(0).asset->eval.first = r->eval.first;
+  ASSERT_EQ(csg.hash(b), 1);
+}
+
+TEST(GeomCacheTest, storeAndFind) {
+  asset::GeomCache cache;
+  ASSERT_EQ(cache.ctorError(::testing::TempDir() + "geomcachetest"), 0);
+  auto r = makeRevolv(32);
+  r->lods = 3;
+  r->optimize = asset::BaseAsset::OPTIMIZE_ALL;
+  asset::VertexIndex out;
+  ASSERT_EQ(r->toOptimizedVertices(out), 0);
+  std::vector<char> vert(out.vert.size() * 8);
+  for (size_t i = 0; i < vert.size(); i++) {
+    vert.at(i) = char(i * 31);
+  }
+  asset::Hasher h;
+  ASSERT_EQ(r->hash(h), 0);
+  ASSERT_EQ(cache.store(h.h, *r, 8, vert.data(), out.vert.size(),
+                        out.order.data(), out.order.size()),
+            0);
+  ASSERT_EQ(cache.find(h.h + 1, 8), nullptr);
+  ASSERT_EQ(cache.find(h.h, 12), nullptr);
+  auto e = cache.find(h.h, 8);
+  ASSERT_NE(e, nullptr);
+  ASSERT_EQ(e->head->verts, out.vert.size());
+  ASSERT_EQ(e->head->indices, out.order.size());
+  ASSERT_EQ(e->vertBytes(), vert.size());
+  ASSERT_EQ(memcmp(e->vert, vert.data(), vert.size()), 0);
+  ASSERT_EQ(memcmp(e->order, out.order.data(),
+                   sizeof(asset::indicesType) * out.order.size()),
+            0);
+  ASSERT_EQ(e->head->lods, r->lod.size());
+  ASSERT_EQ(e->lod[1].indexCount, r->lod.at(1).indexCount);
+  ASSERT_EQ(e->head->meshlets, r->meshlet.size());
+  ASSERT_EQ(e->meshlet[0].radius, r->meshlet.at(0).radius);
+  ASSERT_EQ(e->head->bounds.max.y, r->bounds.max.y);
+  ASSERT_EQ(cache.hits, 1u);
+  ASSERT_EQ(cache.misses, 2u);
+
+  // A file that was cut short is ignored.
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.geo", (unsigned long long)h.h);
+  std::string path = cache.getDir() + name;
+  std::vector<char> part(100);
+  FILE* f = fopen(path.c_str(), "rb");
+  ASSERT_NE(f, nullptr);
+  ASSERT_EQ(fread(part.data(), 1, part.size(), f), part.size());
+  fclose(f);
+  f = fopen(path.c_str(), "wb");
+  ASSERT_NE(f, nullptr);
+  ASSERT_EQ(fwrite(part.data(), 1, part.size(), f), part.size());
+  fclose(f);
+  ASSERT_EQ(cache.find(h.h, 8), nullptr);
+  remove(path.c_str());
+}
+
+TEST(CompactTest, size) { ASSERT_EQ(sizeof(asset::CompactVertex), 20u); }
+
+TEST(CompactTest, octRoundTrip) {
+  std::mt19937 rng(4);
+  std::uniform_real_distribution<float> u(-1.f, 1.f);
+  double worst = 0;  // The largest error in radians.
+  for (int i = 0; i < 100000; i++) {
+    glm::vec3 n(u(rng), u(rng), u(rng));
+    if (glm::length(n) < 1e-3f) {
+      continue;
+    }
+    n = glm::normalize(n);
+    asset::Vertex v, d;
+    v.N = n;
+    asset::CompactVertex c;
+    asset::encodeCompact(asset::Bounds(), v, c);
+    asset::decodeCompact(asset::Bounds(), c, d);
+    // Use double: the error is too small for acos of a float dot product.
+    double dot = double(n.x) * d.N.x + double(n.y) * d.N.y +
+                 double(n.z) * d.N.z;
+    double len = sqrt(double(d.N.x) * d.N.x + double(d.N.y) * d.N.y +
+                      double(d.N.z) * d.N.z) *
+                 sqrt(double(n.x) * n.x + double(n.y) * n.y +
+                      double(n.z) * n.z);
+    worst = std::max(worst, acos(std::min(dot / len, 1.)));
+  }
+  // 16-bit octahedral normals are accurate to about 0.01 degrees.
+  ASSERT_LT(worst * 180. / M_PI, .01);
+
+  // The axes and the folded edges encode exactly.
+  for (auto n : {glm::vec3(0, 0, 1), glm::vec3(0, 0, -1), glm::vec3(1, 0, 0),
+                 glm::vec3(0, -1, 0)}) {
+    auto d = asset::decodeOct(asset::encodeOct(n));
+    ASSERT_NEAR(glm::dot(n, d), 1.f, 1e-6f);
+  }
+}
+
+TEST(CompactTest, vertexRoundTrip) {
+  auto r = makeRevolv(64);
+  asset::VertexIndex out;
+  ASSERT_EQ(r->toOptimizedVertices(out), 0);
+  auto& b = r->bounds;
+  glm::vec3 ext = b.extent();
+  ASSERT_GT(ext.x, 0.f);
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<float> u(0.f, 1.f);
+  for (auto& v : out.vert) {
+    v.uv = glm::vec2(u(rng) * 4.f, u(rng));
+    v.color = glm::vec4(u(rng), u(rng), u(rng), 1.f);
+    asset::CompactVertex c;
+    asset::Vertex d;
+    asset::encodeCompact(b, v, c);
+    asset::decodeCompact(b, c, d);
+    for (int i = 0; i < 3; i++) {
+      // Half of one step of 16-bit UNORM, plus float rounding.
+      ASSERT_NEAR(d.P[i], v.P[i], ext[i] / 65535.f * .5f + 1e-6f);
+      ASSERT_NEAR(d.color[i], v.color[i], .5f / 255.f + 1e-6f);
+    }
+    ASSERT_EQ(d.color.w, 1.f);
+    for (int i = 0; i < 2; i++) {
+      // Half floats have 11 bits of precision.
+      ASSERT_NEAR(d.uv[i], v.uv[i], fabsf(v.uv[i]) / 2048.f + 1e-7f);
+    }
+    ASSERT_GT(glm::dot(d.N, v.N), .9999f);
+  }
+}
+
+TEST(CompactTest, halfSpecialValues) {
+  asset::Vertex v, d;
+  asset::CompactVertex c;
+  const float in[] = {0.f,     -0.f,    1.f,   -2.5f, 65504.f, 1e6f,
+                      -1e6f,   6.1035156e-05f /*smallest normal*/,
+                      5.9604645e-08f /*smallest denormal*/, 1e-9f};
+  const float want[] = {0.f,      -0.f,     1.f,   -2.5f, 65504.f, INFINITY,
+                        -INFINITY, 6.1035156e-05f, 5.9604645e-08f, 0.f};
+  for (size_t i = 0; i < sizeof(in) / sizeof(in[0]); i++) {
+    v.uv = glm::vec2(in[i], 0.f);
+    asset::encodeCompact(asset::Bounds(), v, c);
+    asset::decodeCompact(asset::Bounds(), c, d);
+    ASSERT_EQ(d.uv.x, want[i]) << "in[" << i << "] = " << in[i];
+    ASSERT_EQ(std::signbit(d.uv.x), std::signbit(want[i]));
+  }
+  v.uv = glm::vec2(NAN, 0.f);
+  asset::encodeCompact(asset::Bounds(), v, c);
+  asset::decodeCompact(asset::Bounds(), c, d);
+  ASSERT_TRUE(std::isnan(d.uv.x));
+}
+
+TEST(CompactTest, batchMatchesOneAtATime) {
+  std::mt19937 rng(6);
+  std::uniform_real_distribution<float> u(-.25f, 1.25f);
+  asset::Bounds b;
+  b.min = glm::vec3(-1.f, 2.f, 5.f);
+  b.max = glm::vec3(3.f, 2.f, 5.5f);  // y has no extent.
+  std::vector<asset::Vertex> vert(1000);
+  for (auto& v : vert) {
+    // Some vertices are outside b and some colors are outside [0, 1].
+    v.P = b.min + glm::vec3(u(rng), u(rng), u(rng)) * (b.max - b.min);
+    v.N = glm::vec3(u(rng), u(rng), -u(rng));
+    v.uv = glm::vec2(u(rng) * 8.f, u(rng));
+    v.color = glm::vec4(u(rng), u(rng), u(rng), u(rng));
+  }
+  // Exactly representable halfway values round to even.
+  vert[0].P = b.min + glm::vec3(.5f / 65535.f, 0.f, 0.f) * b.extent();
+  vert[0].color = glm::vec4(.5f / 255.f, 1.5f / 255.f, 0.f, 1.f);
+  std::vector<asset::CompactVertex> batch(vert.size()), one(vert.size());
+  asset::encodeCompact(b, vert.data(), vert.size(), batch.data());
+  for (size_t i = 0; i < vert.size(); i++) {
+    asset::encodeCompact(b, vert[i], one[i]);
+    ASSERT_EQ(memcmp(&batch[i], &one[i], sizeof(one[i])), 0) << "vert " << i;
+  }
+}
+
+TEST(ScatterTest, mergesAdjacentWrites) {
+  asset::Scatter pack;
+  pack.reset(1024, 1);
+  VkDeviceSize src;
+  ASSERT_EQ(pack.add(0, 100, 10, src), 0);
+  ASSERT_EQ(src, 0u);
+  ASSERT_EQ(pack.add(0, 110, 20, src), 0);
+  ASSERT_EQ(src, 10u);
+  ASSERT_EQ(pack.regionCount(), 1u);
+  ASSERT_EQ(pack.region.at(0).at(0).size, 30u);
+  ASSERT_EQ(pack.getUsed(), 30u);
+}
+
+TEST(ScatterTest, scatteredWritesAreAligned) {
+  asset::Scatter pack;
+  pack.reset(1024, 2);
+  VkDeviceSize src;
+  ASSERT_EQ(pack.add(0, 500, 10, src), 0);
+  ASSERT_EQ(pack.add(1, 0, 6, src), 0);
+  ASSERT_EQ(src, asset::Scatter::align);
+  // Adjacent in dst 0, but not in the staging buffer: a new region.
+  ASSERT_EQ(pack.add(0, 510, 10, src), 0);
+  ASSERT_EQ(src, 2 * asset::Scatter::align);
+  ASSERT_EQ(pack.add(0, 0, 4, src), 0);
+  ASSERT_EQ(pack.region.at(0).size(), 3u);
+  ASSERT_EQ(pack.region.at(1).size(), 1u);
+  ASSERT_EQ(pack.regionCount(), 4u);
+
+  // Regions never overlap in the staging buffer.
+  std::vector<char> owner(pack.getCapacity(), 0);
+  for (auto& dst : pack.region) {
+    for (auto& r : dst) {
+      for (VkDeviceSize i = r.srcOffset; i < r.srcOffset + r.size; i++) {
+        ASSERT_EQ(owner.at(i), 0);
+        owner.at(i) = 1;
+      }
+      ASSERT_EQ(r.srcOffset % asset::Scatter::align, 0u);
+    }
+  }
+}
+
+TEST(ScatterTest, full) {
+  asset::Scatter pack;
+  pack.reset(64, 1);
+  VkDeviceSize src;
+  ASSERT_EQ(pack.add(0, 0, 60, src), 0);
+  ASSERT_EQ(pack.avail(), 0u);
+  ASSERT_EQ(pack.add(0, 1000, 1, src), 1);
+  ASSERT_EQ(pack.add(0, 60, 4, src), 0);  // Merging needs no alignment.
+  ASSERT_EQ(pack.add(0, 64, 1, src), 1);
+  ASSERT_EQ(pack.add(1, 0, 1, src), 1);  // No such dst.
+
+  pack.reset(64, 1);
+  ASSERT_TRUE(pack.empty());
+  ASSERT_EQ(pack.regionCount(), 0u);
+  ASSERT_EQ(pack.add(0, 0, 65, src), 1);
+}
+
+TEST(LibraryTest, frameIsDone) {
+  // UniformGlue::submit waits for frame n - framesInFlight before frame n is
+  // recorded, so at frame n the GPU may still be using frame n - 1 down to
+  // frame n - framesInFlight + 1.
+  for (size_t images = 1; images <= 4; images++) {
+    for (size_t inFlight = 1; inFlight <= 4; inFlight++) {
+      size_t wait = std::max(images - 1, inFlight);
+      for (uint32_t then = 0; then < 8; then++) {
+        for (uint32_t now = then; now < then + 8; now++) {
+          bool done = asset::Library::frameIsDone(now, then, images, inFlight);
+          if (done) {
+            ASSERT_GE(now - then, inFlight)
+                << images << " images, " << inFlight << " in flight";
+          }
+          ASSERT_EQ(done, now >= then + wait)
+              << images << " images, " << inFlight << " in flight";
+        }
+      }
+    }
+  }
+  // framesInFlight == framebufs.size(): 2 frames later, the GPU may still
+  // be drawing 'then'.
+  ASSERT_FALSE(asset::Library::frameIsDone(12, 10, 3, 3));
+  ASSERT_TRUE(asset::Library::frameIsDone(13, 10, 3, 3));
+  // A headless device has no framebufs.
+  ASSERT_FALSE(asset::Library::frameIsDone(10, 10, 0, 1));
+  ASSERT_TRUE(asset::Library::frameIsDone(11, 10, 0, 1));
+}
+
+TEST(LibraryTest, streamInChunks) {
+  // An asset 7x bigger than upload, in page 1 of 2.
+  static constexpr VkDeviceSize uploadSize = 4096;
+  asset::Library::Stream s;
+  s.out.vert.resize(1000);
+  s.out.order.resize(3000);
+  s.page = 1;
+  s.vbase = 100;
+  s.obase = 50;
+  s.vertexSize = 24;
+  s.indexSize = sizeof(uint16_t);
+  asset::Scatter pack;
+  size_t writes = 0;
+  for (; !s.done(); writes++) {
+    ASSERT_LT(writes, 100u) << "stream is stuck";
+    // Each write() starts with an empty upload and streams first.
+    pack.reset(uploadSize, 4);
+    asset::Library::Stream::Chunk c;
+    size_t v = s.v, o = s.o;
+    ASSERT_EQ(s.next(pack, c), 0);
+    ASSERT_GT(c.nv + c.no, 0u) << "write " << writes;
+    // Chunks are contiguous, and indices only start after the vertices.
+    ASSERT_EQ(c.v, v);
+    ASSERT_EQ(c.o, o);
+    ASSERT_EQ(s.v, v + c.nv);
+    ASSERT_EQ(s.o, o + c.no);
+    if (c.no) {
+      ASSERT_EQ(s.v, s.out.vert.size());
+    }
+    ASSERT_TRUE(pack.region.at(0).empty());
+    ASSERT_TRUE(pack.region.at(1).empty());
+    ASSERT_EQ(pack.region.at(2).size(), c.nv ? 1u : 0u);
+    ASSERT_EQ(pack.region.at(3).size(), c.no ? 1u : 0u);
+    if (c.nv) {
+      auto& r = pack.region.at(2).at(0);
+      ASSERT_EQ(r.srcOffset, c.vsrc);
+      ASSERT_EQ(r.dstOffset, s.vertexSize * (s.vbase + c.v));
+      ASSERT_EQ(r.size, s.vertexSize * c.nv);
+      ASSERT_LE(r.srcOffset + r.size, uploadSize);
+    }
+    if (c.no) {
+      auto& r = pack.region.at(3).at(0);
+      ASSERT_EQ(r.srcOffset, c.osrc);
+      ASSERT_EQ(r.dstOffset, s.indexSize * (s.obase + c.o));
+      ASSERT_EQ(r.size, s.indexSize * c.no);
+      ASSERT_LE(r.srcOffset + r.size, uploadSize);
+      if (c.nv) {
+        ASSERT_GE(c.osrc, c.vsrc + s.vertexSize * c.nv);
+      }
+    }
+    // A chunk fills upload unless it is the last.
+    if (!s.done()) {
+      ASSERT_LT(pack.avail(), c.nv ? s.vertexSize : s.indexSize);
+    }
+  }
+  ASSERT_EQ(s.v, 1000u);
+  ASSERT_EQ(s.o, 3000u);
+  size_t bytes = 1000 * 24 + 3000 * sizeof(uint16_t);
+  ASSERT_GE(writes, (bytes + uploadSize - 1) / uploadSize);
+  ASSERT_LE(writes, (bytes + uploadSize - 1) / uploadSize + 1);
+}
+
+TEST(LibraryTest, directPack) {
+  // If direct, write() packs into a Scatter with directCapacity. Each region
+  // is what was written to a page, and only pages with regions are flushed.
+  asset::Scatter pack;
+  pack.reset(asset::Library::directCapacity, 2 * 3 /*pages*/);
+  static constexpr VkDeviceSize vsize = 20, big = VkDeviceSize(1) << 28;
+  VkDeviceSize src;
+  for (size_t i = 0; i < 64; i++) {
+    // Assets much bigger than any upload, in page 0 and page 2.
+    size_t pi = (i & 1) * 2;
+    ASSERT_EQ(pack.add(2 * pi, vsize * big * i, vsize * big, src), 0);
+    ASSERT_EQ(pack.add(2 * pi + 1, 2 * big * i, 2 * big, src), 0);
+  }
+  // An asset always fits, so nothing is streamed or waits for a write().
+  ASSERT_GE(pack.avail(), VkDeviceSize(1) << 60);
+  ASSERT_EQ(pack.region.at(0).size(), 32u);
+  ASSERT_EQ(pack.region.at(1).size(), 32u);
+  ASSERT_TRUE(pack.region.at(2).empty());
+  ASSERT_TRUE(pack.region.at(3).empty());
+  ASSERT_EQ(pack.region.at(4).size(), 32u);
+  ASSERT_EQ(pack.region.at(5).at(31).dstOffset, 2 * big * 63);
+}
+
+// PageHeapTest is the CPU side of a Library page with room for 1000
+// vertices and 3000 indices.
+class PageHeapTest : public ::testing::Test, public asset::PageHeap {
+ protected:
+  void SetUp() override {
+    vAlloc.reset(1000);
+    oAlloc.reset(3000);
+  }
+};
+
+TEST_F(PageHeapTest, indexWidth) {
+  using asset::Library;
+  ASSERT_EQ(Library::indexTypeFor(0, true), VK_INDEX_TYPE_UINT16);
+  ASSERT_EQ(Library::indexTypeFor(asset::maxVertices16, true),
+            VK_INDEX_TYPE_UINT16);
+  ASSERT_EQ(Library::indexTypeFor(asset::maxVertices16 + 1, true),
+            VK_INDEX_TYPE_UINT32);
+  ASSERT_EQ(Library::indexTypeFor(0, false), VK_INDEX_TYPE_UINT32);
+
+  indexType = VK_INDEX_TYPE_UINT16;
+  ASSERT_EQ(indexSize(), sizeof(uint16_t));
+  ASSERT_TRUE(holds(asset::maxVertices16));
+  ASSERT_FALSE(holds(asset::maxVertices16 + 1));
+  std::vector<asset::indicesType> src{0, 1, 65535, 7};
+  std::vector<uint16_t> dst16(src.size());
+  copyIndices(reinterpret_cast<char*>(dst16.data()), src.data(), src.size());
+  for (size_t i = 0; i < src.size(); i++) {
+    ASSERT_EQ(dst16[i], src[i]);
+  }
+
+  indexType = VK_INDEX_TYPE_UINT32;
+  ASSERT_EQ(indexSize(), sizeof(uint32_t));
+  ASSERT_TRUE(holds(asset::maxVertices16 + 1));
+  src.push_back(70000);
+  std::vector<uint32_t> dst32(src.size());
+  copyIndices(reinterpret_cast<char*>(dst32.data()), src.data(), src.size());
+  ASSERT_EQ(dst32, src);
+}
+
+TEST(LibraryTest, pageChoice) {
+  // A 16-bit page, then a 32-bit page.
+  std::vector<std::shared_ptr<asset::PageHeap>> page;
+  for (auto t : {VK_INDEX_TYPE_UINT16, VK_INDEX_TYPE_UINT32}) {
+    page.emplace_back(std::make_shared<asset::PageHeap>());
+    page.back()->indexType = t;
+    page.back()->vAlloc.reset(asset::maxVertices16 * 2);
+    page.back()->oAlloc.reset(300000);
+  }
+  asset::FreeBlock v, o;
+  // An asset that needs 32-bit indices skips page 0, even though it has room.
+  size_t big = asset::maxVertices16 + 1;
+  ASSERT_EQ(asset::PageHeap::allocIn(page, big, 100, v, o), 1u);
+  ASSERT_EQ(page[0]->vAlloc.getUsed(), 0u);
+  // Small assets fill page 0 first.
+  ASSERT_EQ(asset::PageHeap::allocIn(page, asset::maxVertices16, 100, v, o),
+            0u);
+  ASSERT_EQ(asset::PageHeap::allocIn(page, asset::maxVertices16, 100, v, o),
+            0u);
+  // Then page 1, which still has room after the big asset.
+  ASSERT_EQ(asset::PageHeap::allocIn(page, 1000, 100, v, o), 1u);
+  // No page has room. Library::write() then adds a page.
+  ASSERT_EQ(asset::PageHeap::allocIn(page, asset::maxVertices16, 100, v, o),
+            page.size());
+}
+
+TEST_F(PageHeapTest, allocAndFree) {
+  asset::FreeBlock v, o, v2, o2;
+  ASSERT_EQ(alloc(600, 2000, v, o), 0);
+  ASSERT_EQ(v.use, 600u);
+  ASSERT_EQ(o.cap, 2000u);
+  std::vector<asset::indicesType> src{3, 2, 1};
+  setOrder(o.base + 1, src.data(), src.size());
+  ASSERT_GE(order.size(), o.base + 4);
+  ASSERT_EQ(order.at(o.base + 3), 1u);
+
+  // The vertices fit but the indices do not: nothing is allocated.
+  ASSERT_EQ(alloc(300, 1500, v2, o2), 1);
+  ASSERT_EQ(vAlloc.getUsed(), 600u);
+  ASSERT_EQ(oAlloc.getUsed(), 2000u);
+  ASSERT_EQ(v2.id, Suballoc::none);
+
+  ASSERT_EQ(free(v, o), 0);
+  ASSERT_EQ(v.id, Suballoc::none);
+  ASSERT_EQ(o.id, Suballoc::none);
+  ASSERT_EQ(vAlloc.getUsed(), 0u);
+  ASSERT_EQ(oAlloc.getUsed(), 0u);
+  // Freeing blocks that are not allocated does nothing.
+  ASSERT_EQ(free(v, o), 0);
+}
+
+TEST_F(PageHeapTest, updateReusesSpare) {
+  // Library::update switches an asset between its block and a spare. The
+  // page usage must not grow as long as the asset does not.
+  asset::FreeBlock v, o, vspare, ospare;
+  ASSERT_EQ(alloc(32, 180, v, o), 0);
+  size_t vUsed = 0, oUsed = 0;
+  for (int i = 0; i < 20; i++) {
+    size_t nv = i % 2 ? 32 : 24, no = i % 2 ? 180 : 132;
+    ASSERT_EQ(reuse(nv, no, vspare, ospare), 0) << "update " << i;
+    ASSERT_EQ(vspare.use, nv);
+    ASSERT_EQ(ospare.use, no);
+    std::swap(v, vspare);
+    std::swap(o, ospare);
+    if (i == 0) {
+      vUsed = vAlloc.getUsed();
+      oUsed = oAlloc.getUsed();
+      ASSERT_EQ(vUsed, 32u + 24u);
+    }
+    ASSERT_EQ(vAlloc.getUsed(), vUsed) << "update " << i;
+    ASSERT_EQ(oAlloc.getUsed(), oUsed) << "update " << i;
+  }
+
+  // The asset grew: the too-small spare is replaced.
+  ASSERT_EQ(reuse(100, 400, vspare, ospare), 0);
+  ASSERT_EQ(vspare.cap, 100u);
+  ASSERT_EQ(vAlloc.getUsed(), v.cap + 100u);
+  ASSERT_EQ(oAlloc.getUsed(), o.cap + 400u);
+
+  // A spare that does not fit fails, and the old spare is freed.
+  ASSERT_EQ(reuse(2000, 400, vspare, ospare), 1);
+  ASSERT_EQ(vAlloc.getUsed(), v.cap);
+  ASSERT_EQ(free(v, o), 0);
+  ASSERT_EQ(free(vspare, ospare), 0);
+  ASSERT_EQ(vAlloc.getUsed(), 0u);
+}
+
+// QueuedAsset lets a test move an asset to ADD_WAIT, as Library::alloc does.
+class QueuedAsset : public asset::BaseAsset {
+ public:
+  int toVertices(asset::VertexIndex&) override { return 0; }
+  void setState(asset::BaseAssetState s) { state_ = s; }
+};
+
+// AssetQueueTest is the bookkeeping of a Library with 3 swapchain images and
+// 1 frame in flight.
+class AssetQueueTest : public ::testing::Test, public asset::AssetQueue {
+ protected:
+  void SetUp() override {
+    swapImages = 3;
+    framesInFlight = 1;
+  }
+
+  std::shared_ptr<QueuedAsset> addOne() {
+    auto a = std::make_shared<QueuedAsset>();
+    if (!addChild(a)) {
+      addQ.emplace_back(a);
+    }
+    return a;
+  }
+
+  static int toAddWait(asset::BaseAsset& a) {
+    static_cast<QueuedAsset&>(a).setState(asset::ADD_WAIT);
+    return 0;
+  }
+  static void noSwap(asset::BaseAsset&) {}
+};
+
+TEST_F(AssetQueueTest, delWaitsForFrames) {
+  now = 10;
+  auto a = addOne();
+  ASSERT_EQ(a->state(), asset::ADDED);
+  ASSERT_EQ(addChild(a), 1);  // Duplicate.
+  ASSERT_EQ(takeAdded(toAddWait), 0);
+  ASSERT_EQ(a->state(), asset::ADD_WAIT);
+  ASSERT_EQ(del(a), 1);  // Not READY yet.
+  uploadDone(nullptr, noSwap);
+  ASSERT_EQ(a->state(), asset::READY);
+  ASSERT_TRUE(uploading.empty());
+
+  a->inst.cmd.indexCount = 36;
+  ASSERT_EQ(del(a), 0);
+  ASSERT_EQ(a->state(), asset::DELETED);
+  size_t freed = 0;
+  auto countFree = [&freed](asset::BaseAsset&) {
+    freed++;
+    return 0;
+  };
+  ASSERT_EQ(retire(countFree), 0);
+  ASSERT_EQ(a->state(), asset::DEL_WAIT);
+  ASSERT_EQ(a->inst.cmd.indexCount, 0u);
+  // Frame 10 may still be drawn in frame 11.
+  now = 11;
+  ASSERT_EQ(retire(countFree), 0);
+  ASSERT_EQ(freed, 0u);
+  ASSERT_EQ(a->state(), asset::DEL_WAIT);
+  now = 12;
+  ASSERT_EQ(retire(countFree), 0);
+  ASSERT_EQ(freed, 1u);
+  ASSERT_EQ(a->state(), asset::INVALID);
+  ASSERT_TRUE(child.empty());
+  ASSERT_TRUE(freeQ.empty());
+}
+
+TEST_F(AssetQueueTest, addStopsWhenFull) {
+  auto a = addOne();
+  auto b = addOne();
+  auto c = addOne();
+  // Upload is full after 'a': 'b' stays ADDED and 'c' is not looked at.
+  size_t calls = 0;
+  auto fitOne = [&calls](asset::BaseAsset& x) {
+    return calls++ ? 0 : toAddWait(x);
+  };
+  ASSERT_EQ(takeAdded(fitOne), 0);
+  ASSERT_EQ(calls, 2u);
+  ASSERT_EQ(a->state(), asset::ADD_WAIT);
+  ASSERT_EQ(b->state(), asset::ADDED);
+  ASSERT_EQ(addQ.size(), 2u);
+
+  // 'b' is still uploading when the upload of 'a' is done.
+  ASSERT_EQ(takeAdded(toAddWait), 0);
+  ASSERT_EQ(uploading.size(), 3u);
+  uploadDone(b.get(), noSwap);
+  ASSERT_EQ(a->state(), asset::READY);
+  ASSERT_EQ(b->state(), asset::ADD_WAIT);
+  ASSERT_EQ(c->state(), asset::READY);
+  ASSERT_EQ(uploading.size(), 1u);
+
+  // A failed alloc stops write().
+  addOne();
+  ASSERT_EQ(takeAdded([](asset::BaseAsset&) { return 1; }), 1);
+}
+
+// countWrites counts calls to a VertexWriteFn and sets P[3], which
+// encodeCompact leaves 0, in each CompactVertex.
+static int countWrites(void* userData, const asset::Vertex& v, void* dst) {
+  (*reinterpret_cast<size_t*>(userData))++;
+  reinterpret_cast<asset::CompactVertex*>(dst)->P[3] = 7;
+  return 0;
+}
+
+static int failWrite(void*, const asset::Vertex&, void*) { return 1; }
+
+// countBatches counts calls to a VertexBatchFn.
+static int countBatches(void* userData, const asset::Vertex*, size_t n,
+                        void*) {
+  (*reinterpret_cast<size_t*>(userData)) += n << 16 | 1;
+  return 0;
+}
+
+TEST(LibraryTest, writeVertsCompact) {
+  using asset::Library;
+  asset::VertexIndex out;
+  auto r = makeRevolv(16);
+  ASSERT_EQ(r->toOptimizedVertices(out), 0);
+  size_t n = out.vert.size();
+  std::vector<asset::CompactVertex> want(n), got(n);
+  asset::encodeCompact(r->bounds, out.vert.data(), n, want.data());
+  char* dst = reinterpret_cast<char*>(got.data());
+  static constexpr size_t vsize = sizeof(asset::CompactVertex);
+
+  // LAYOUT_COMPACT needs no writeFn.
+  Library::Writer w{nullptr, nullptr, nullptr};
+  ASSERT_EQ(Library::writeVerts(Library::LAYOUT_COMPACT, vsize, r->bounds,
+                                out.vert.data(), n, dst, w),
+            0);
+  ASSERT_EQ(memcmp(got.data(), want.data(), vsize * n), 0);
+
+  // A writeFn is called once per vertex, after the vertex is encoded.
+  size_t calls = 0;
+  memset(dst, 0, vsize * n);
+  w = Library::Writer{countWrites, nullptr, &calls};
+  ASSERT_EQ(Library::writeVerts(Library::LAYOUT_COMPACT, vsize, r->bounds,
+                                out.vert.data(), n, dst, w),
+            0);
+  ASSERT_EQ(calls, n);
+  for (size_t i = 0; i < n; i++) {
+    ASSERT_EQ(got[i].P[3], 7u) << "vert " << i;
+    got[i].P[3] = want[i].P[3];
+    ASSERT_EQ(memcmp(&got[i], &want[i], vsize), 0) << "vert " << i;
+  }
+
+  // A VertexBatchFn is called once for all the vertices.
+  calls = 0;
+  w = Library::Writer{nullptr, countBatches, &calls};
+  ASSERT_EQ(Library::writeVerts(Library::LAYOUT_APP, vsize, r->bounds,
+                                out.vert.data(), n, dst, w),
+            0);
+  ASSERT_EQ(calls, n << 16 | 1);
+
+  w = Library::Writer{failWrite, nullptr, nullptr};
+  ASSERT_EQ(Library::writeVerts(Library::LAYOUT_APP, vsize, r->bounds,
+                                out.vert.data(), n, dst, w),
+            1);
+}
+
+TEST(LibraryTest, cacheKey) {
+  using asset::Library;
+  auto r = makeRevolv(16);
+  auto key = [&](size_t vertexSize, Library::VertexLayout layout,
+                 uint64_t cacheLayout) {
+    asset::Hasher h;
+    EXPECT_EQ(Library::hashFor(*r, vertexSize, layout, cacheLayout, h), 0);
+    return h.h;
+  };
+  // A second Library with the same settings finds what the first stored.
+  uint64_t k = key(20, Library::LAYOUT_COMPACT, 0);
+  ASSERT_EQ(key(20, Library::LAYOUT_COMPACT, 0), k);
+  // Anything that changes what write() puts in vertexBuf changes the key.
+  ASSERT_NE(key(24, Library::LAYOUT_COMPACT, 0), k);
+  ASSERT_NE(key(20, Library::LAYOUT_APP, 0), k);
+  ASSERT_NE(key(20, Library::LAYOUT_COMPACT, 1), k);
+  r->rots++;
+  ASSERT_NE(key(20, Library::LAYOUT_COMPACT, 0), k);
+
+  // An eval without an evalKey can not be cached.
+  r->eval.first = [](void*, std::vector<asset::Vertex>&, uint32_t&) {
+    return 0;
+  };
+  asset::Hasher h;
+  ASSERT_EQ(Library::hashFor(*r, 20, Library::LAYOUT_COMPACT, 0, h), 1);
+}
+
+}  // End of anonymous namespace
+
+// cullFrustum looks down -z with objects from -100 to 100 on every axis, so
+// cull sees a mix of visible, rejected and partly visible objects.
+static asset::Frustum cullFrustum() {
+  glm::mat4 proj = glm::perspective(glm::radians(60.f), 1.5f, 1.f, 80.f);
+  return asset::Frustum(proj * glm::lookAt(glm::vec3(0.f, 0.f, 10.f),
+                                           glm::vec3(0.f), glm::vec3(0, 1, 0)));
+}
+
+TEST(CullTest, boxesMatchIsVisible) {
+  asset::Frustum f = cullFrustum();
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> pos(-100.f, 100.f), ext(0.f, 8.f);
+  asset::BoxSoA soa;
+  std::vector<asset::AABB> box(1003);  // Not a multiple of BoxSoA::pad.
+  for (auto& b : box) {
+    b.bound[0] = glm::vec3(pos(rng), pos(rng), pos(rng));
+    b.bound[1] = b.bound[0] + glm::vec3(ext(rng), ext(rng), ext(rng));
+    soa.push_back(b);
+  }
+  std::vector<uint32_t> want;
+  for (size_t i = 0; i < box.size(); i++) {
+    if (f.isVisible(box[i])) {
+      want.push_back(i);
+    }
+  }
+  ASSERT_GT(want.size(), 0u);
+  ASSERT_LT(want.size(), box.size());
+  std::vector<uint32_t> got;
+  // The second cull starts with the planes cached by the first.
+  for (int frame = 0; frame < 2; frame++) {
+    ASSERT_EQ(f.cull(soa, got), 0);
+    ASSERT_EQ(got, want) << "frame " << frame;
+  }
+  // A new frustum must not be fooled by the old cached planes.
+  asset::Frustum g(glm::perspective(glm::radians(60.f), 1.5f, 1.f, 80.f) *
+                   glm::lookAt(glm::vec3(0.f), glm::vec3(0.f, 0.f, 10.f),
+                               glm::vec3(0, 1, 0)));
+  want.clear();
+  for (size_t i = 0; i < box.size(); i++) {
+    if (g.isVisible(box[i])) {
+      want.push_back(i);
+    }
+  }
+  ASSERT_EQ(g.cull(soa, got), 0);
+  ASSERT_EQ(got, want);
+}
+
+TEST(CullTest, spheresMatchIsVisible) {
+  asset::Frustum f = cullFrustum();
+  std::mt19937 rng(8);
+  std::uniform_real_distribution<float> pos(-100.f, 100.f), rad(0.f, 8.f);
+  asset::SphereSoA soa;
+  std::vector<uint32_t> want;
+  for (uint32_t i = 0; i < 1003; i++) {
+    glm::vec3 c(pos(rng), pos(rng), pos(rng));
+    float r = rad(rng);
+    soa.push_back(c, r);
+    if (f.isVisible(c, r)) {
+      want.push_back(i);
+    }
+  }
+  ASSERT_GT(want.size(), 0u);
+  ASSERT_LT(want.size(), soa.size());
+  std::vector<uint32_t> got;
+  for (int frame = 0; frame < 2; frame++) {
+    ASSERT_EQ(f.cull(soa, got), 0);
+    ASSERT_EQ(got, want) << "frame " << frame;
+  }
+  // A sphere is visible if any part of it is: the near plane is at z=9.
+  ASSERT_TRUE(f.isVisible(glm::vec3(0.f, 0.f, 9.5f), 1.f));
+  ASSERT_FALSE(f.isVisible(glm::vec3(0.f, 0.f, 9.5f), .25f));
+}
+
+TEST(CullTest, indirectMatchesCull) {
+  asset::Frustum f = cullFrustum();
+  std::mt19937 rng(9);
+  std::uniform_real_distribution<float> pos(-100.f, 100.f), rad(0.f, 8.f);
+  asset::SphereSoA soa;
+  std::vector<uint32_t> draw;
+  std::vector<VkDrawIndexedIndirectCommand> cmd(7);
+  for (uint32_t d = 0; d < cmd.size(); d++) {
+    cmd[d] = VkDrawIndexedIndirectCommand{36, 0, d * 36, int32_t(d), 0};
+  }
+  for (uint32_t i = 0; i < 1003; i++) {
+    soa.push_back(glm::vec3(pos(rng), pos(rng), pos(rng)), rad(rng));
+    // cmd[6] draws nothing.
+    draw.push_back(rng() % (cmd.size() - 1));
+  }
+  std::vector<uint32_t> visible, want;
+  ASSERT_EQ(asset::layoutIndirect(draw, cmd, visible), 0);
+  ASSERT_EQ(visible.size(), soa.size());
+  ASSERT_EQ(f.cull(soa, want), 0);
+  ASSERT_EQ(f.cullIndirect(soa, draw, cmd, visible), 0);
+
+  size_t total = 0;
+  for (uint32_t d = 0; d < cmd.size(); d++) {
+    // Only instanceCount changes.
+    EXPECT_EQ(cmd[d].indexCount, 36u);
+    EXPECT_EQ(cmd[d].firstIndex, d * 36);
+    EXPECT_EQ(cmd[d].vertexOffset, int32_t(d));
+    std::vector<uint32_t> wantD;
+    for (uint32_t j : want) {
+      if (draw[j] == d) {
+        wantD.push_back(j);
+      }
+    }
+    auto first = visible.begin() + cmd[d].firstInstance;
+    ASSERT_EQ(std::vector<uint32_t>(first, first + cmd[d].instanceCount),
+              wantD)
+        << "cmd " << d;
+    total += cmd[d].instanceCount;
+  }
+  ASSERT_EQ(total, want.size());
+  ASSERT_EQ(cmd.back().instanceCount, 0u);
+
+  draw[0] = cmd.size();
+  ASSERT_NE(asset::layoutIndirect(draw, cmd, visible), 0);
+}
+
+// bvhBoxes returns n random boxes in a cube 200 units across.
+static std::vector<asset::AABB> bvhBoxes(size_t n, std::mt19937& rng) {
+  std::uniform_real_distribution<float> pos(-100.f, 100.f), ext(0.f, 8.f);
+  std::vector<asset::AABB> box(n);
+  for (auto& b : box) {
+    b.bound[0] = glm::vec3(pos(rng), pos(rng), pos(rng));
+    b.bound[1] = b.bound[0] + glm::vec3(ext(rng), ext(rng), ext(rng));
+  }
+  return box;
+}
+
+// checkBvh compares each kind of Bvh query with a linear scan.
+static void checkBvh(const asset::Bvh& bvh,
+                     const std::vector<asset::AABB>& box, std::mt19937& rng) {
+  asset::Frustum f = cullFrustum();
+  std::vector<uint32_t> want, got;
+  for (uint32_t i = 0; i < box.size(); i++) {
+    if (f.isVisible(box[i])) {
+      want.push_back(i);
+    }
+  }
+  bvh.query(f, box, got);
+  std::sort(got.begin(), got.end());
+  ASSERT_EQ(got, want);
+
+  auto q = bvhBoxes(20, rng);
+  for (auto& b : q) {
+    want.clear();
+    for (uint32_t i = 0; i < box.size(); i++) {
+      bool overlap = true;
+      for (int a = 0; a < 3; a++) {
+        overlap &= b.bound[0][a] <= box[i].bound[1][a] &&
+                   box[i].bound[0][a] <= b.bound[1][a];
+      }
+      if (overlap) {
+        want.push_back(i);
+      }
+    }
+    bvh.query(b, box, got);
+    std::sort(got.begin(), got.end());
+    ASSERT_EQ(got, want);
+  }
+
+  std::uniform_real_distribution<float> u(-1.f, 1.f);
+  for (int r = 0; r < 50; r++) {
+    glm::vec3 orig(u(rng) * 150.f, u(rng) * 150.f, u(rng) * 150.f);
+    glm::vec3 dir = glm::vec3(u(rng), u(rng), u(rng)) * 100.f - orig;
+    // Find the nearest box the slow way.
+    float wantT = std::numeric_limits<float>::infinity();
+    for (auto& b : box) {
+      float t0 = 0.f, t1 = wantT;
+      for (int a = 0; a < 3; a++) {
+        float tA = (b.bound[0][a] - orig[a]) / dir[a];
+        float tB = (b.bound[1][a] - orig[a]) / dir[a];
+        t0 = std::max(t0, std::min(tA, tB));
+        t1 = std::min(t1, std::max(tA, tB));
+      }
+      if (t0 <= t1 && t0 < wantT) {
+        wantT = t0;
+      }
+    }
+    uint32_t hit;
+    float t;
+    bool found = bvh.pick(orig, dir, box, hit, t);
+    ASSERT_EQ(found, wantT < std::numeric_limits<float>::infinity());
+    if (found) {
+      ASSERT_NEAR(t, wantT, 1e-4f * std::max(1.f, wantT));
+      ASSERT_LT(hit, box.size());
+    }
+  }
+}
+
+TEST(BvhTest, queriesMatchLinearScan) {
+  std::mt19937 rng(9);
+  auto box = bvhBoxes(2000, rng);
+  asset::Bvh bvh;
+  ASSERT_EQ(bvh.build(box), 0);
+  auto s = bvh.stats();
+  ASSERT_EQ(s.nodes, s.leaves * 2 - 1);
+  ASSERT_LT(s.depth, 40u);
+  for (auto& n : bvh.node) {
+    ASSERT_LE(n.count, bvh.maxLeaf);
+  }
+  std::vector<uint32_t> all(bvh.obj);
+  std::sort(all.begin(), all.end());
+  for (uint32_t i = 0; i < all.size(); i++) {
+    ASSERT_EQ(all[i], i);
+  }
+  checkBvh(bvh, box, rng);
+
+  // Move every box a little. refit must keep the queries exact.
+  std::uniform_real_distribution<float> move(-5.f, 5.f);
+  for (auto& b : box) {
+    glm::vec3 d(move(rng), move(rng), move(rng));
+    b.bound[0] += d;
+    b.bound[1] += d;
+  }
+  ASSERT_EQ(bvh.refit(box), 0);
+  checkBvh(bvh, box, rng);
+  ASSERT_NE(bvh.refit(bvhBoxes(3, rng)), 0);
+
+  asset::Bvh empty;
+  ASSERT_EQ(empty.build(std::vector<asset::AABB>()), 0);
+  checkBvh(empty, std::vector<asset::AABB>(), rng);
+}
+
+TEST(BvhTest, updateRebuildsWhenRefitIsPoor) {
+  std::mt19937 rng(10);
+  auto box = bvhBoxes(1000, rng);
+  asset::Bvh bvh;
+  ASSERT_EQ(bvh.build(box), 0);
+  float built = bvh.stats().sah;
+  // Small moves only refit.
+  for (auto& b : box) {
+    b.bound[0].x += .01f;
+    b.bound[1].x += .01f;
+  }
+  ASSERT_EQ(bvh.update(box), 0);
+  ASSERT_EQ(bvh.builds, 1u);
+  ASSERT_EQ(bvh.refits, 1u);
+  // Shuffling the boxes makes the old tree useless.
+  std::shuffle(box.begin(), box.end(), rng);
+  ASSERT_EQ(bvh.refit(box), 0);
+  ASSERT_GT(bvh.stats().sah, built * bvh.rebuildRatio);
+  ASSERT_EQ(bvh.update(box), 0);
+  ASSERT_EQ(bvh.builds, 2u);
+  ASSERT_LT(bvh.stats().sah, built * bvh.rebuildRatio);
+  checkBvh(bvh, box, rng);
+}
+
+// boxMesh returns the 12 tris of b.
+static asset::VertexIndex boxMesh(const asset::AABB& b) {
+  asset::VertexIndex m;
+  m.vert.resize(8);
+  for (int i = 0; i < 8; i++) {
+    m.vert[i].P = glm::vec3(b.bound[i & 1].x, b.bound[(i >> 1) & 1].y,
+                            b.bound[i >> 2].z);
+  }
+  m.order = {0, 1, 3, 0, 3, 2, 4, 6, 7, 4, 7, 5, 0, 4, 5, 0, 5, 1,
+             2, 3, 7, 2, 7, 6, 0, 2, 6, 0, 6, 4, 1, 5, 7, 1, 7, 3};
+  return m;
+}
+
+static asset::AABB makeBox(glm::vec3 lo, glm::vec3 hi) {
+  asset::AABB b;
+  b.bound[0] = lo;
+  b.bound[1] = hi;
+  return b;
+}
+
+// occlusionViewProj looks down -z from the origin.
+static glm::mat4 occlusionViewProj() {
+  return glm::perspective(glm::radians(60.f), 2.f, 1.f, 200.f) *
+         glm::lookAt(glm::vec3(0.f), glm::vec3(0.f, 0.f, -1.f),
+                     glm::vec3(0.f, 1.f, 0.f));
+}
+
+TEST(OcclusionTest, wallHidesWhatIsBehindIt) {
+  asset::Occlusion occ;
+  ASSERT_EQ(occ.ctorError(128, 64, 0), 0);
+  auto wall = makeBox(glm::vec3(-2.f, -2.f, -11.f), glm::vec3(2.f, 2.f, -10.f));
+  ASSERT_EQ(occ.add(boxMesh(wall), glm::mat4(1.f)), 0);
+  ASSERT_EQ(occ.render(occlusionViewProj()), 0);
+  ASSERT_EQ(occ.stats.tris, 12u);
+  ASSERT_GT(occ.stats.drawn, 0u);
+
+  // Behind the wall.
+  ASSERT_FALSE(occ.isVisible(
+      makeBox(glm::vec3(-.5f, -.5f, -31.f), glm::vec3(.5f, .5f, -30.f))));
+  // In front of the wall.
+  ASSERT_TRUE(occ.isVisible(
+      makeBox(glm::vec3(-.5f, -.5f, -6.f), glm::vec3(.5f, .5f, -5.f))));
+  // Beside the wall.
+  ASSERT_TRUE(occ.isVisible(
+      makeBox(glm::vec3(9.5f, -.5f, -31.f), glm::vec3(10.5f, .5f, -30.f))));
+  // Behind the wall, but big enough to be seen around it.
+  ASSERT_TRUE(occ.isVisible(
+      makeBox(glm::vec3(-10.f, -.5f, -31.f), glm::vec3(10.f, .5f, -30.f))));
+  // Crossing the near plane.
+  ASSERT_TRUE(occ.isVisible(
+      makeBox(glm::vec3(-.5f, -.5f, -30.f), glm::vec3(.5f, .5f, 1.f))));
+
+  std::vector<asset::AABB> box{
+      makeBox(glm::vec3(-.5f, -.5f, -31.f), glm::vec3(.5f, .5f, -30.f)),
+      makeBox(glm::vec3(-.5f, -.5f, -6.f), glm::vec3(.5f, .5f, -5.f))};
+  std::vector<uint32_t> visible{0, 1};
+  occ.cull(box, visible);
+  ASSERT_EQ(visible, std::vector<uint32_t>{1});
+
+  // Once the wall is gone nothing is hidden.
+  occ.clear();
+  ASSERT_EQ(occ.render(occlusionViewProj()), 0);
+  ASSERT_TRUE(occ.isVisible(box[0]));
+  asset::VertexIndex bad = boxMesh(wall);
+  bad.order.pop_back();
+  ASSERT_NE(occ.add(bad, glm::mat4(1.f)), 0);
+}
+
+// cityOcclusion adds n random buildings as occluders.
+static void cityOcclusion(asset::Occlusion& occ, size_t n, std::mt19937& rng) {
+  std::uniform_real_distribution<float> pos(-60.f, 60.f), ext(1.f, 10.f);
+  for (size_t i = 0; i < n; i++) {
+    glm::vec3 lo(pos(rng), -10.f, -pos(rng) * .5f - 40.f);
+    auto b = makeBox(lo, lo + glm::vec3(ext(rng), ext(rng) * 2.f, ext(rng)));
+    ASSERT_EQ(occ.add(boxMesh(b), glm::mat4(1.f)), 0);
+  }
+}
+
+TEST(OcclusionTest, threadsGiveTheSameDepth) {
+  std::mt19937 rng(12);
+  asset::Occlusion one, many;
+  ASSERT_EQ(one.ctorError(256, 128, 0), 0);
+  ASSERT_EQ(many.ctorError(256, 128, 3), 0);
+  std::mt19937 rng2 = rng;
+  cityOcclusion(one, 200, rng);
+  cityOcclusion(many, 200, rng2);
+  for (int frame = 0; frame < 3; frame++) {
+    glm::mat4 vp = occlusionViewProj() *
+                   glm::translate(glm::mat4(1.f),
+                                  glm::vec3(frame * 3.f, 0.f, frame * 2.f));
+    ASSERT_EQ(one.render(vp), 0);
+    ASSERT_EQ(many.render(vp), 0);
+    ASSERT_EQ(one.hiz, many.hiz) << "frame " << frame;
+  }
+  ASSERT_GT(one.stats.binned, one.stats.drawn);
+  ASSERT_NE(one.ctorError(100, 64, 0), 0);
+}
+
+TEST(OcclusionTest, culledIsReallyHidden) {
+  std::mt19937 rng(13);
+  asset::Occlusion occ;
+  ASSERT_EQ(occ.ctorError(256, 128, 2), 0);
+  cityOcclusion(occ, 200, rng);
+  glm::mat4 vp = occlusionViewProj();
+  ASSERT_EQ(occ.render(vp), 0);
+
+  // Every hiz texel is the farthest depth of the level 0 texels under it.
+  uint32_t w = occ.width(), h = occ.height();
+  for (size_t lv = 1; lv < occ.hiz.size(); lv++) {
+    uint32_t lw = ((w - 1) >> lv) + 1;
+    for (uint32_t y = 0; y < h; y++) {
+      for (uint32_t x = 0; x < w; x++) {
+        ASSERT_LE(occ.hiz[0][y * w + x], occ.hiz[lv][(y >> lv) * lw +
+                                                      (x >> lv)]);
+      }
+    }
+  }
+  ASSERT_EQ(occ.hiz.back().size(), 1u);
+
+  // Sample points on each culled box. No sample may be nearer than the
+  // depth buffer.
+  std::uniform_real_distribution<float> pos(-80.f, 80.f), u(0.f, 1.f);
+  size_t culled = 0;
+  for (int i = 0; i < 2000; i++) {
+    glm::vec3 lo(pos(rng), pos(rng) * .1f, -pos(rng) - 90.f);
+    auto b = makeBox(lo, lo + glm::vec3(u(rng), u(rng), u(rng)) * 3.f);
+    if (occ.isVisible(b)) {
+      continue;
+    }
+    culled++;
+    for (int k = 0; k < 20; k++) {
+      glm::vec3 p = b.bound[0] + glm::vec3(u(rng), u(rng), u(rng)) *
+                                     (b.bound[1] - b.bound[0]);
+      glm::vec4 c = vp * glm::vec4(p, 1.f);
+      int x = int((c.x / c.w * .5f + .5f) * w);
+      int y = int((c.y / c.w * .5f + .5f) * h);
+      if (x >= 0 && y >= 0 && x < int(w) && y < int(h)) {
+        ASSERT_LE(occ.hiz[0][y * w + x], c.z / c.w);
+      }
+    }
+  }
+  ASSERT_GT(culled, 0u);
+}
+
+// physicsRoom returns a Physics with a 20 x 20 x 20 room, the floor at y=0.
+static asset::Physics physicsRoom() {
+  asset::Physics p;
+  p.room.bound[0] = glm::vec3(-10.f, 0.f, -10.f);
+  p.room.bound[1] = glm::vec3(10.f, 20.f, 10.f);
+  return p;
+}
+
+TEST(PhysicsTest, sphereRestsAndSleeps) {
+  asset::Physics p = physicsRoom();
+  uint32_t s = p.addSphere(glm::vec3(0.f, 3.f, 0.f), .5f, 1.f);
+  int steps = 0;
+  for (; p.body[s].awake && steps < 600; steps++) {
+    ASSERT_EQ(p.step(1.f / 60), 0);
+  }
+  ASSERT_FALSE(p.body[s].awake) << "still awake after " << steps;
+  EXPECT_NEAR(p.body[s].pos.y, .5f, .02f);
+  EXPECT_NEAR(p.body[s].pos.x, 0.f, 1e-4f);
+  EXPECT_EQ(p.stats.awake, 0u);
+
+  // A falling box hits the sphere and wakes it.
+  p.addBox(glm::vec3(0.f, 3.f, 0.f), glm::vec3(.5f), 1.f);
+  for (int i = 0; i < 60 && !p.body[s].awake; i++) {
+    ASSERT_EQ(p.step(1.f / 60), 0);
+  }
+  EXPECT_TRUE(p.body[s].awake);
+  ASSERT_NE(p.step(0.f), 0);
+}
+
+TEST(PhysicsTest, boxStack) {
+  asset::Physics p = physicsRoom();
+  // A box dropped on a corner topples and lands flat.
+  glm::quat tilt = glm::angleAxis(.6f, glm::normalize(glm::vec3(1.f, 0.f,
+                                                                1.f)));
+  uint32_t tipped = p.addBox(glm::vec3(-5.f, 2.f, 0.f), glm::vec3(.5f), 1.f,
+                             tilt);
+  // A stack of boxes on a box that never moves.
+  uint32_t base = p.addBox(glm::vec3(3.f, .5f, 0.f), glm::vec3(1.f, .5f, 1.f),
+                           0.f);
+  std::vector<uint32_t> stack;
+  for (int i = 0; i < 4; i++) {
+    stack.push_back(p.addBox(glm::vec3(3.f, 1.5f + i * 1.01f, 0.f),
+                             glm::vec3(.5f), 1.f));
+  }
+  for (int i = 0; i < 900 && (!i || p.stats.awake); i++) {
+    ASSERT_EQ(p.step(1.f / 60), 0);
+    ASSERT_EQ(p.body[base].pos, glm::vec3(3.f, .5f, 0.f));
+  }
+  ASSERT_EQ(p.stats.awake, 0u);
+  EXPECT_GT(p.stats.warm, 0u);
+  // Flat means one face points straight up.
+  glm::mat3 R = glm::mat3_cast(p.body[tipped].rot);
+  float up = 0.f;
+  for (int k = 0; k < 3; k++) {
+    up = std::max(up, fabsf(R[k].y));
+  }
+  EXPECT_GT(up, .99f);
+  EXPECT_NEAR(p.body[tipped].pos.y, .5f, .02f);
+  for (size_t i = 0; i < stack.size(); i++) {
+    auto& b = p.body[stack[i]];
+    EXPECT_NEAR(b.pos.y, 1.5f + i, .05f) << "stack " << i;
+    EXPECT_NEAR(b.pos.x, 3.f, .05f) << "stack " << i;
+    EXPECT_NEAR(b.pos.z, 0.f, .05f) << "stack " << i;
+  }
+}
+
+TEST(PhysicsTest, findPairsMatchesBruteForce) {
+  asset::Physics p = physicsRoom();
+  std::mt19937 rng(15);
+  std::uniform_real_distribution<float> pos(-10.f, 10.f), size(.05f, .6f);
+  for (int i = 0; i < 2000; i++) {
+    glm::vec3 at(pos(rng), pos(rng), pos(rng));
+    if (i & 1) {
+      p.addSphere(at, size(rng), 1.f);
+    } else {
+      p.addBox(at, glm::vec3(size(rng), size(rng), size(rng)),
+               i % 5 ? 1.f : 0.f);
+    }
+  }
+  // Some sleep. Pairs of sleeping bodies are skipped.
+  for (size_t i = 0; i < p.body.size(); i += 3) {
+    p.body[i].awake = false;
+  }
+  std::vector<asset::BodyPair> want, got;
+  for (uint32_t i = 0; i < p.body.size(); i++) {
+    for (uint32_t j = i + 1; j < p.body.size(); j++) {
+      auto& a = p.body[i];
+      auto& b = p.body[j];
+      glm::vec3 d = b.pos - a.pos;
+      float r = a.radius() + b.radius();
+      if ((a.awake || b.awake) && glm::dot(d, d) < r * r) {
+        want.push_back(asset::BodyPair{i, j});
+      }
+    }
+  }
+  p.findPairs(got);
+  ASSERT_GT(want.size(), 100u);
+  ASSERT_EQ(got, want);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,394 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#endif
+#include <algorithm>
+#include <limits>
+
+#include "scene.h"
+
+namespace asset {
+
+static constexpr int dbg = 0;
+static constexpr size_t bins = 16;
+
+// emptyBox returns a box that grow() replaces with the first box it gets.
+static AABB emptyBox() {
+  AABB r;
+  r.bound[0] = glm::vec3(std::numeric_limits<float>::infinity());
+  r.bound[1] = -r.bound[0];
+  return r;
+}
+
+static void grow(AABB& a, const AABB& b) {
+  a.extend(b.bound[0]);
+  a.extend(b.bound[1]);
+}
+
+// area returns half the surface area of b, which is all SAH needs.
+static float area(const AABB& b) {
+  glm::vec3 e = b.bound[1] - b.bound[0];
+  return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+static bool overlaps(const AABB& a, const AABB& b) {
+  return a.bound[0].x <= b.bound[1].x && b.bound[0].x <= a.bound[1].x &&
+         a.bound[0].y <= b.bound[1].y && b.bound[0].y <= a.bound[1].y &&
+         a.bound[0].z <= b.bound[1].z && b.bound[0].z <= a.bound[1].z;
+}
+
+// hitBox clips the ray to b. inv is 1 / dir. It returns false if the ray
+// misses b before tMax, or sets tNear to where it enters b.
+static bool hitBox(const AABB& b, glm::vec3 orig, glm::vec3 inv, float tMax,
+                   float& tNear) {
+  float t0 = 0.f, t1 = tMax;
+  for (int a = 0; a < 3; a++) {
+    float tA = (b.bound[0][a] - orig[a]) * inv[a];
+    float tB = (b.bound[1][a] - orig[a]) * inv[a];
+    if (tA > tB) {
+      std::swap(tA, tB);
+    }
+    t0 = std::max(t0, tA);
+    t1 = std::min(t1, tB);
+  }
+  tNear = t0;
+  return t0 <= t1;
+}
+
+// Bin is one slice of the centers of a node's objects along one axis.
+typedef struct Bin {
+  AABB box{emptyBox()};
+  uint32_t count{0};
+} Bin;
+
+uint32_t Bvh::split(const std::vector<AABB>& box,
+                    const std::vector<glm::vec3>& center, Node& n) {
+  uint32_t* o = &obj[n.first];
+  AABB cb = emptyBox();
+  n.box = emptyBox();
+  for (uint32_t i = 0; i < n.count; i++) {
+    cb.extend(center[o[i]]);
+    grow(n.box, box[o[i]]);
+  }
+  if (n.count < 2) {
+    return 0;
+  }
+  // Bin the objects along all 3 axes in one pass, since each object is a
+  // cache miss.
+  glm::vec3 lo = cb.bound[0], scale;
+  for (int a = 0; a < 3; a++) {
+    float ext = cb.bound[1][a] - lo[a];
+    scale[a] = (ext > 0.f) ? bins / ext : 0.f;
+  }
+  Bin bin[3][bins];
+  for (uint32_t i = 0; i < n.count; i++) {
+    const glm::vec3& c = center[o[i]];
+    for (int a = 0; a < 3; a++) {
+      size_t k = std::min(size_t((c[a] - lo[a]) * scale[a]), bins - 1);
+      bin[a][k].count++;
+      grow(bin[a][k].box, box[o[i]]);
+    }
+  }
+
+  // Splitting costs one more node test (1) and then the objects in each
+  // child are tested as often as a ray would hit the child (its area).
+  float leafCost = area(n.box) * n.count;
+  float bestCost = std::numeric_limits<float>::infinity();
+  int bestAxis = -1;
+  size_t bestBin = 0;
+  for (int a = 0; a < 3; a++) {
+    if (!(scale[a] > 0.f)) {
+      continue;
+    }
+    // rightCost[k] is the cost of bins k + 1 to the end.
+    float rightCost[bins];
+    AABB acc = emptyBox();
+    uint32_t count = 0;
+    for (size_t k = bins - 1; k > 0; k--) {
+      grow(acc, bin[a][k].box);
+      count += bin[a][k].count;
+      rightCost[k - 1] = count ? area(acc) * count : 0.f;
+    }
+    acc = emptyBox();
+    count = 0;
+    for (size_t k = 0; k < bins - 1; k++) {
+      grow(acc, bin[a][k].box);
+      count += bin[a][k].count;
+      float cost = area(n.box) + (count ? area(acc) * count : 0.f) +
+                   rightCost[k];
+      if (count && count < n.count && cost < bestCost) {
+        bestCost = cost;
+        bestAxis = a;
+        bestBin = k;
+      }
+    }
+  }
+
+  if (bestAxis < 0) {
+    // All the centers are in the same place.
+    return (n.count > maxLeaf) ? n.count / 2 : 0;
+  }
+  if (n.count <= maxLeaf && bestCost >= leafCost) {
+    return 0;
+  }
+  uint32_t* mid = std::partition(o, o + n.count, [&](uint32_t i) {
+    float c = center[i][bestAxis] - lo[bestAxis];
+    return std::min(size_t(c * scale[bestAxis]), bins - 1) <= bestBin;
+  });
+  return uint32_t(mid - o);
+}
+
+int Bvh::build(const std::vector<AABB>& box) {
+  if (box.size() > (size_t(1) << 31)) {
+    logE("Bvh::build: %zu boxes is too many\n", box.size());
+    return 1;
+  }
+  builds++;
+  node.clear();
+  obj.resize(box.size());
+  if (box.empty()) {
+    builtSah = sah = 0.f;
+    return 0;
+  }
+  std::vector<glm::vec3> center(box.size());
+  for (uint32_t i = 0; i < box.size(); i++) {
+    obj[i] = i;
+    center[i] = (box[i].bound[0] + box[i].bound[1]) * .5f;
+  }
+  // A tree with n leaves has 2n - 1 nodes, so node never reallocates.
+  node.reserve(box.size() * 2 - 1);
+  node.emplace_back();
+  node[0].count = box.size();
+  std::vector<uint32_t> todo{0};
+  while (!todo.empty()) {
+    uint32_t i = todo.back();
+    todo.pop_back();
+    Node& n = node[i];
+    uint32_t left = split(box, center, n);
+    if (!left) {
+      continue;
+    }
+    uint32_t c = node.size();
+    node.resize(c + 2);
+    node[c].first = n.first;
+    node[c].count = left;
+    node[c + 1].first = n.first + left;
+    node[c + 1].count = n.count - left;
+    n.first = c;
+    n.count = 0;
+    todo.push_back(c + 1);
+    todo.push_back(c);
+  }
+  sah = builtSah = fit(box);
+  if (dbg) logI("Bvh::build: %zu objects %zu nodes sah=%f\n", box.size(),
+                node.size(), sah);
+  return 0;
+}
+
+float Bvh::fit(const std::vector<AABB>& box) {
+  // Children are always after their parent in node.
+  double sum = 0;
+  for (size_t i = node.size(); i-- > 0;) {
+    Node& n = node[i];
+    if (n.count) {
+      n.box = box[obj[n.first]];
+      for (uint32_t j = 1; j < n.count; j++) {
+        grow(n.box, box[obj[n.first + j]]);
+      }
+      sum += double(area(n.box)) * n.count;
+    } else {
+      n.box = node[n.first].box;
+      grow(n.box, node[n.first + 1].box);
+      sum += area(n.box);
+    }
+  }
+  if (node.empty()) {
+    return 0.f;
+  }
+  float root = area(node[0].box);
+  return float(root > 0.f ? sum / root : sum);
+}
+
+int Bvh::refit(const std::vector<AABB>& box) {
+  if (box.size() != obj.size()) {
+    logE("Bvh::refit: %zu boxes, but built with %zu\n", box.size(),
+         obj.size());
+    return 1;
+  }
+  refits++;
+  sah = fit(box);
+  return 0;
+}
+
+int Bvh::update(const std::vector<AABB>& box) {
+  if (refit(box)) {
+    return 1;
+  }
+  if (sah > builtSah * rebuildRatio) {
+    if (dbg) logI("Bvh::update: sah %f was %f, rebuilding\n", sah, builtSah);
+    return build(box);
+  }
+  return 0;
+}
+
+BvhStats Bvh::stats() const {
+  BvhStats r;
+  r.nodes = node.size();
+  r.sah = sah;
+  if (node.empty()) {
+    return r;
+  }
+  std::vector<std::pair<uint32_t, size_t>> todo{{0, 1}};
+  while (!todo.empty()) {
+    auto t = todo.back();
+    todo.pop_back();
+    r.depth = std::max(r.depth, t.second);
+    const Node& n = node[t.first];
+    if (n.count) {
+      r.leaves++;
+    } else {
+      todo.emplace_back(n.first, t.second + 1);
+      todo.emplace_back(n.first + 1, t.second + 1);
+    }
+  }
+  return r;
+}
+
+// clip tests b against the planes of f in mask. It returns false if a plane
+// rejects b, and clears the bit of each plane that b is entirely inside, so
+// nothing inside b needs to be tested against it. This is exactly
+// Frustum::isVisible because Frustum::dist never goes down as a point moves
+// toward the far corner.
+static bool clip(const Frustum& f, const AABB& b, uint32_t& mask) {
+  for (size_t i = 0; i < f.plane.size(); i++) {
+    if (!(mask & (1u << i))) {
+      continue;
+    }
+    const glm::vec4& p = f.plane[i];
+    int x = p.x > 0.f, y = p.y > 0.f, z = p.z > 0.f;
+    if (f.dist(i, b.bound[x].x, b.bound[y].y, b.bound[z].z) < 0.f) {
+      return false;
+    }
+    if (f.dist(i, b.bound[1 - x].x, b.bound[1 - y].y, b.bound[1 - z].z) >=
+        0.f) {
+      mask &= ~(1u << i);
+    }
+  }
+  return true;
+}
+
+void Bvh::query(const Frustum& f, const std::vector<AABB>& box,
+                std::vector<uint32_t>& out) const {
+  out.clear();
+  if (node.empty()) {
+    return;
+  }
+  // Each entry is a node and the planes its parent is not entirely inside.
+  std::vector<std::pair<uint32_t, uint32_t>> todo;
+  todo.reserve(64);
+  todo.emplace_back(0, (1u << f.plane.size()) - 1);
+  while (!todo.empty()) {
+    const Node& n = node[todo.back().first];
+    uint32_t mask = todo.back().second;
+    todo.pop_back();
+    if (!clip(f, n.box, mask)) {
+      continue;
+    }
+    if (!n.count) {
+      todo.emplace_back(n.first, mask);
+      todo.emplace_back(n.first + 1, mask);
+      continue;
+    }
+    for (uint32_t j = n.first; j < n.first + n.count; j++) {
+      uint32_t m = mask;
+      if (!m || clip(f, box[obj[j]], m)) {
+        out.push_back(obj[j]);
+      }
+    }
+  }
+}
+
+void Bvh::query(const AABB& b, const std::vector<AABB>& box,
+                std::vector<uint32_t>& out) const {
+  out.clear();
+  if (node.empty()) {
+    return;
+  }
+  std::vector<uint32_t> todo;
+  todo.reserve(64);
+  todo.push_back(0);
+  while (!todo.empty()) {
+    const Node& n = node[todo.back()];
+    todo.pop_back();
+    if (!overlaps(n.box, b)) {
+      continue;
+    }
+    if (!n.count) {
+      todo.push_back(n.first);
+      todo.push_back(n.first + 1);
+      continue;
+    }
+    for (uint32_t j = n.first; j < n.first + n.count; j++) {
+      if (overlaps(box[obj[j]], b)) {
+        out.push_back(obj[j]);
+      }
+    }
+  }
+}
+
+bool Bvh::pick(glm::vec3 orig, glm::vec3 dir, const std::vector<AABB>& box,
+               uint32_t& hit, float& t) const {
+  t = std::numeric_limits<float>::infinity();
+  if (node.empty()) {
+    return false;
+  }
+  glm::vec3 inv(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+  bool found = false;
+  float tNear;
+  // Each entry is a node and where the ray enters it.
+  std::vector<std::pair<uint32_t, float>> todo;
+  todo.reserve(64);
+  if (hitBox(node[0].box, orig, inv, t, tNear)) {
+    todo.emplace_back(0, tNear);
+  }
+  while (!todo.empty()) {
+    auto e = todo.back();
+    todo.pop_back();
+    if (e.second > t) {
+      continue;  // Something nearer was already hit.
+    }
+    const Node& n = node[e.first];
+    if (n.count) {
+      for (uint32_t j = n.first; j < n.first + n.count; j++) {
+        if (hitBox(box[obj[j]], orig, inv, t, tNear) && tNear < t) {
+          t = tNear;
+          hit = obj[j];
+          found = true;
+        }
+      }
+      continue;
+    }
+    // Push the nearer child last so it is visited first.
+    float tA, tB;
+    bool a = hitBox(node[n.first].box, orig, inv, t, tA);
+    bool b = hitBox(node[n.first + 1].box, orig, inv, t, tB);
+    if (a && b && tA < tB) {
+      todo.emplace_back(n.first + 1, tB);
+      todo.emplace_back(n.first, tA);
+    } else {
+      if (a) {
+        todo.emplace_back(n.first, tA);
+      }
+      if (b) {
+        todo.emplace_back(n.first + 1, tB);
+      }
+    }
+  }
+  return found;
+}
+
+}  // namespace asset
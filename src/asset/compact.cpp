@@ -0,0 +1,218 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#endif
+#include "compact.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define COMPACT_SSE2
+#endif
+
+namespace asset {
+
+// floatToHalf converts to IEEE 754 half precision, rounding to nearest even.
+static uint16_t floatToHalf(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  uint16_t sign = (x >> 16) & 0x8000;
+  uint32_t exp = (x >> 23) & 0xff;
+  uint32_t man = x & 0x7fffff;
+  if (exp == 0xff) {
+    // Inf or NaN. Keep NaN a NaN.
+    return sign | 0x7c00 | (man ? 0x200 : 0);
+  }
+  int e = int(exp) - 127 + 15;
+  if (e >= 0x1f) {
+    return sign | 0x7c00;  // Too large: Inf.
+  }
+  if (e <= 0) {
+    if (e < -10) {
+      return sign;  // Too small: 0.
+    }
+    // Denormal half. Add the implicit 1 and shift it into place.
+    man |= 0x800000;
+    uint32_t shift = 14 - e;
+    uint32_t h = man >> shift;
+    uint32_t rem = man & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rem > halfway || (rem == halfway && (h & 1))) {
+      h++;
+    }
+    return sign | h;
+  }
+  uint32_t h = (uint32_t(e) << 10) | (man >> 13);
+  uint32_t rem = man & 0x1fff;
+  if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) {
+    h++;  // May carry into the exponent, which is still correct.
+  }
+  return sign | h;
+}
+
+static float halfToFloat(uint16_t h) {
+  uint32_t sign = uint32_t(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t man = h & 0x3ff;
+  uint32_t x;
+  if (exp == 0x1f) {
+    x = sign | 0x7f800000 | (man << 13);
+  } else if (exp) {
+    x = sign | ((exp - 15 + 127) << 23) | (man << 13);
+  } else if (!man) {
+    x = sign;
+  } else {
+    // Denormal half: normalize it.
+    int e = -1;
+    do {
+      e++;
+      man <<= 1;
+    } while (!(man & 0x400));
+    x = sign | (uint32_t(127 - 15 - e) << 23) | ((man & 0x3ff) << 13);
+  }
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+static inline float signNotZero(float v) { return v < 0.f ? -1.f : 1.f; }
+
+glm::vec2 encodeOct(glm::vec3 n) {
+  float sum = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+  if (sum <= 0.f) {
+    return glm::vec2(0.f, 0.f);
+  }
+  n /= sum;
+  if (n.z >= 0.f) {
+    return glm::vec2(n.x, n.y);
+  }
+  // Fold the lower hemisphere over the diagonals.
+  return glm::vec2((1.f - fabsf(n.y)) * signNotZero(n.x),
+                   (1.f - fabsf(n.x)) * signNotZero(n.y));
+}
+
+glm::vec3 decodeOct(glm::vec2 e) {
+  glm::vec3 n(e.x, e.y, 1.f - fabsf(e.x) - fabsf(e.y));
+  float t = n.z < 0.f ? -n.z : 0.f;
+  n.x += n.x >= 0.f ? -t : t;
+  n.y += n.y >= 0.f ? -t : t;
+  return glm::normalize(n);
+}
+
+static inline uint16_t toUnorm16(float v) {
+  return uint16_t(lrintf(glm::clamp(v, 0.f, 1.f) * 65535.f));
+}
+
+static inline int16_t toSnorm16(float v) {
+  return int16_t(lrintf(glm::clamp(v, -1.f, 1.f) * 32767.f));
+}
+
+static inline uint8_t toUnorm8(float v) {
+  return uint8_t(lrintf(glm::clamp(v, 0.f, 1.f) * 255.f));
+}
+
+// encodeNormalUV is the part of encodeCompact that is not vectorized.
+static inline void encodeNormalUV(const Vertex& v, CompactVertex& out) {
+  glm::vec2 oct = encodeOct(v.N);
+  out.N[0] = toSnorm16(oct.x);
+  out.N[1] = toSnorm16(oct.y);
+  out.uv[0] = floatToHalf(v.uv.x);
+  out.uv[1] = floatToHalf(v.uv.y);
+}
+
+void encodeCompact(const Bounds& b, const Vertex& v, CompactVertex& out) {
+  glm::vec3 ext = b.extent();
+  for (int i = 0; i < 3; i++) {
+    out.P[i] = ext[i] > 0.f ? toUnorm16((v.P[i] - b.min[i]) / ext[i]) : 0;
+  }
+  out.P[3] = 0;
+  encodeNormalUV(v, out);
+  for (int i = 0; i < 4; i++) {
+    out.color[i] = toUnorm8(v.color[i]);
+  }
+}
+
+void encodeCompact(const Bounds& b, const Vertex* v, size_t n,
+                   CompactVertex* out) {
+#ifdef COMPACT_SSE2
+  // This does the same float operations as encodeCompact, 4 lanes at a time.
+  // _mm_cvtps_epi32 rounds to nearest even, like lrintf.
+  glm::vec3 ext = b.extent();
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.f);
+  const __m128 pMin = _mm_setr_ps(b.min.x, b.min.y, b.min.z, 0.f);
+  const __m128 pExt = _mm_setr_ps(ext.x, ext.y, ext.z, 0.f);
+  // pUse is all ones in the lanes where ext > 0. The others write 0. Lane 3
+  // (which loads N.x) has ext = 0 so it writes P[3] = 0.
+  const __m128 pUse = _mm_cmpgt_ps(pExt, zero);
+  const __m128 pDiv = _mm_or_ps(_mm_and_ps(pUse, pExt),
+                                _mm_andnot_ps(pUse, one));
+  const __m128 k65535 = _mm_set1_ps(65535.f);
+  const __m128 k255 = _mm_set1_ps(255.f);
+  for (size_t i = 0; i < n; i++) {
+    const Vertex& src = v[i];
+    CompactVertex& dst = out[i];
+    __m128 p = _mm_div_ps(_mm_sub_ps(_mm_loadu_ps(&src.P.x), pMin), pDiv);
+    p = _mm_min_ps(_mm_max_ps(p, zero), one);
+    __m128i q = _mm_cvtps_epi32(_mm_and_ps(_mm_mul_ps(p, k65535), pUse));
+    // Subtract 32768 so packs_epi32 does not saturate, then add it back.
+    q = _mm_packs_epi32(_mm_sub_epi32(q, _mm_set1_epi32(32768)), q);
+    q = _mm_add_epi16(q, _mm_set1_epi16(-32768));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst.P), q);
+
+    __m128 c = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(&src.color.x), zero), one);
+    __m128i ci = _mm_cvtps_epi32(_mm_mul_ps(c, k255));
+    ci = _mm_packus_epi16(_mm_packs_epi32(ci, ci), ci);
+    int packed = _mm_cvtsi128_si32(ci);
+    memcpy(dst.color, &packed, sizeof(dst.color));
+
+    encodeNormalUV(src, dst);
+  }
+#else  /*COMPACT_SSE2*/
+  for (size_t i = 0; i < n; i++) {
+    encodeCompact(b, v[i], out[i]);
+  }
+#endif /*COMPACT_SSE2*/
+}
+
+void decodeCompact(const Bounds& b, const CompactVertex& in, Vertex& out) {
+  glm::vec3 ext = b.extent();
+  for (int i = 0; i < 3; i++) {
+    out.P[i] = b.min[i] + ext[i] * (in.P[i] / 65535.f);
+  }
+  // SNORM decoding clamps -32768 to -1.
+  out.N = decodeOct(glm::vec2(std::max(in.N[0] / 32767.f, -1.f),
+                              std::max(in.N[1] / 32767.f, -1.f)));
+  out.uv = glm::vec2(halfToFloat(in.uv[0]), halfToFloat(in.uv[1]));
+  for (int i = 0; i < 4; i++) {
+    out.color[i] = in.color[i] / 255.f;
+  }
+  out.custom = glm::vec4(0.f);
+}
+
+std::vector<VkVertexInputAttributeDescription> compactAttributes(
+    uint32_t binding) {
+  std::vector<VkVertexInputAttributeDescription> a(4);
+  a.at(0).format = VK_FORMAT_R16G16B16A16_UNORM;
+  a.at(0).offset = offsetof(CompactVertex, P);
+  a.at(1).format = VK_FORMAT_R16G16_SNORM;
+  a.at(1).offset = offsetof(CompactVertex, N);
+  a.at(2).format = VK_FORMAT_R16G16_SFLOAT;
+  a.at(2).offset = offsetof(CompactVertex, uv);
+  a.at(3).format = VK_FORMAT_R8G8B8A8_UNORM;
+  a.at(3).offset = offsetof(CompactVertex, color);
+  for (uint32_t i = 0; i < a.size(); i++) {
+    a.at(i).location = i;
+    a.at(i).binding = binding;
+  }
+  return a;
+}
+
+}  // namespace asset
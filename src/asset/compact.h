@@ -0,0 +1,44 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#include "asset.h"
+
+#pragma once
+
+namespace asset {
+
+// CompactVertex is a quantized Vertex, 20 bytes instead of 64:
+// * P is 16-bit UNORM relative to BaseAsset::bounds. Your vertex shader
+//   computes bounds.min + P.xyz * bounds.extent(). P[3] is always 0.
+// * N is an octahedral-encoded normal in 2 x 16-bit SNORM.
+// * uv is 2 x half float.
+// * color is 4 x 8-bit UNORM.
+// Vertex::custom is not stored.
+typedef struct CompactVertex {
+  uint16_t P[4];
+  int16_t N[2];
+  uint16_t uv[2];
+  uint8_t color[4];
+} CompactVertex;
+
+// encodeOct maps a unit vector to 2D octahedral coordinates in [-1, 1].
+glm::vec2 encodeOct(glm::vec3 n);
+// decodeOct reverses encodeOct and returns a unit vector.
+glm::vec3 decodeOct(glm::vec2 e);
+
+// encodeCompact quantizes 'v' into 'out'. 'b' is the bounds of the asset.
+void encodeCompact(const Bounds& b, const Vertex& v, CompactVertex& out);
+// encodeCompact quantizes n vertices. It writes the same bytes as calling
+// encodeCompact on each vertex, but P and color use SSE2 where available.
+void encodeCompact(const Bounds& b, const Vertex* v, size_t n,
+                   CompactVertex* out);
+// decodeCompact reverses encodeCompact. out.custom is set to 0.
+void decodeCompact(const Bounds& b, const CompactVertex& in, Vertex& out);
+
+// compactAttributes describes CompactVertex at locations 0 - 3 in 'binding'.
+// Declare the shader inputs as vec4 inPosition, vec2 inNormal (decode it
+// with decodeOct), vec2 inUV and vec4 inColor.
+std::vector<VkVertexInputAttributeDescription> compactAttributes(
+    uint32_t binding = 0);
+
+}  // namespace asset
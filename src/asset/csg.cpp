@@ -0,0 +1,290 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#endif
+#include "asset.h"
+
+#define _USE_MATH_DEFINES /*Windows otherwise hides M_PI*/
+#include <math.h>
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+namespace asset {
+
+static constexpr int dbg = 0;
+
+// Placed is one child after its transform: its tris are m.order[first] to
+// m.order[last - 1].
+typedef struct Placed {
+  size_t first, last;
+  Bounds bounds;
+} Placed;
+
+// windingNumber is the generalized winding number of the tris in 'p' at 'q':
+// about 1 inside a closed volume, about 0 outside. See "Robust
+// Inside-Outside Segmentation using Generalized Winding Numbers" (Jacobson,
+// Kavan, Sorkine-Hornung 2013). The solid angle of each tri is from Van
+// Oosterom and Strackee (1983).
+static float windingNumber(const VertexIndex& m, const Placed& p,
+                           glm::vec3 q) {
+  float sum = 0.f;
+  for (size_t i = p.first; i < p.last; i += 3) {
+    glm::vec3 a = m.vert[m.order[i]].P - q;
+    glm::vec3 b = m.vert[m.order[i + 1]].P - q;
+    glm::vec3 c = m.vert[m.order[i + 2]].P - q;
+    float la = glm::length(a), lb = glm::length(b), lc = glm::length(c);
+    float num = glm::dot(a, glm::cross(b, c));
+    float den = la * lb * lc + glm::dot(a, b) * lc + glm::dot(a, c) * lb +
+                glm::dot(b, c) * la;
+    sum += 2.f * atan2f(num, den);
+  }
+  return sum / float(4 * M_PI);
+}
+
+static bool inBounds(const Bounds& b, glm::vec3 q) {
+  return q.x >= b.min.x && q.y >= b.min.y && q.z >= b.min.z &&
+         q.x <= b.max.x && q.y <= b.max.y && q.z <= b.max.z;
+}
+
+// dropEnclosed removes the tris of each child in 'placed' that are inside
+// another child. A tri is inside if the points just in front of it (at its
+// center and near its corners) are all inside some other child.
+static void dropEnclosed(VertexIndex& m, const std::vector<Placed>& placed,
+                         float eps, CsgStats& stats) {
+  std::vector<indicesType> order;
+  order.reserve(m.order.size());
+  glm::vec3 q[4];
+  for (size_t i = 0; i < placed.size(); i++) {
+    for (size_t t = placed[i].first; t < placed[i].last; t += 3) {
+      auto& a = m.vert[m.order[t]].P;
+      auto& b = m.vert[m.order[t + 1]].P;
+      auto& c = m.vert[m.order[t + 2]].P;
+      glm::vec3 N = glm::cross(b - a, c - b);
+      float len = glm::length(N);
+      bool inside = len > 0.f;
+      if (inside) {
+        N *= eps / len;
+        glm::vec3 center = (a + b + c) * (1.f / 3);
+        q[0] = center + N;
+        q[1] = center + (a - center) * .9f + N;
+        q[2] = center + (b - center) * .9f + N;
+        q[3] = center + (c - center) * .9f + N;
+      }
+      for (size_t k = 0; k < 4 && inside; k++) {
+        inside = false;
+        for (size_t j = 0; j < placed.size() && !inside; j++) {
+          inside = j != i && inBounds(placed[j].bounds, q[k]) &&
+                   windingNumber(m, placed[j], q[k]) > .5f;
+        }
+      }
+      if (inside) {
+        stats.dropped++;
+        continue;
+      }
+      order.insert(order.end(), m.order.begin() + t, m.order.begin() + t + 3);
+    }
+  }
+  m.order.swap(order);
+}
+
+// sameAttributes is true if the vertices differ only in their position.
+static bool sameAttributes(const Vertex& a, const Vertex& b) {
+  static constexpr float tol = 1e-5f;
+  for (int k = 0; k < 3; k++) {
+    if (fabsf(a.N[k] - b.N[k]) > tol) {
+      return false;
+    }
+  }
+  for (int k = 0; k < 2; k++) {
+    if (fabsf(a.uv[k] - b.uv[k]) > tol) {
+      return false;
+    }
+  }
+  for (int k = 0; k < 4; k++) {
+    if (fabsf(a.color[k] - b.color[k]) > tol ||
+        fabsf(a.custom[k] - b.custom[k]) > tol) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// compact removes the vertices no tri uses. If dist > 0 it also welds
+// vertices that round to the same multiple of dist and have the same
+// attributes, then drops the tris that welding made degenerate.
+static void compact(VertexIndex& m, float dist, CsgStats& stats) {
+  static constexpr indicesType unused = ~indicesType(0);
+  std::vector<indicesType> remap(m.vert.size(), unused);
+  for (auto i : m.order) {
+    remap[i] = i;
+  }
+  if (dist > 0.f) {
+    typedef std::tuple<long long, long long, long long, indicesType> Key;
+    std::vector<Key> key;
+    key.reserve(m.vert.size());
+    for (size_t i = 0; i < m.vert.size(); i++) {
+      if (remap[i] == unused) {
+        continue;
+      }
+      auto& P = m.vert[i].P;
+      key.emplace_back(llroundf(P.x / dist), llroundf(P.y / dist),
+                       llroundf(P.z / dist), i);
+    }
+    std::sort(key.begin(), key.end());
+    for (size_t g = 0; g < key.size();) {
+      // Vertices g to end - 1 round to the same position.
+      size_t end = g + 1;
+      while (end < key.size() &&
+             std::get<0>(key[end]) == std::get<0>(key[g]) &&
+             std::get<1>(key[end]) == std::get<1>(key[g]) &&
+             std::get<2>(key[end]) == std::get<2>(key[g])) {
+        end++;
+      }
+      for (size_t k = g + 1; k < end; k++) {
+        indicesType v = std::get<3>(key[k]);
+        for (size_t r = g; r < k; r++) {
+          indicesType w = std::get<3>(key[r]);
+          if (remap[w] == w && sameAttributes(m.vert[v], m.vert[w])) {
+            remap[v] = w;
+            stats.welded++;
+            break;
+          }
+        }
+      }
+      g = end;
+    }
+  }
+
+  // Number the vertices that are left, keeping their order.
+  std::vector<indicesType> index(m.vert.size(), unused);
+  std::vector<Vertex> vert;
+  vert.reserve(m.vert.size() - stats.welded);
+  for (size_t i = 0; i < m.vert.size(); i++) {
+    if (remap[i] == i) {
+      index[i] = vert.size();
+      vert.emplace_back(m.vert[i]);
+    }
+  }
+  size_t n = 0;
+  for (size_t t = 0; t < m.order.size(); t += 3) {
+    indicesType a = index[remap[m.order[t]]];
+    indicesType b = index[remap[m.order[t + 1]]];
+    indicesType c = index[remap[m.order[t + 2]]];
+    if (a == b || b == c || c == a) {
+      stats.dropped++;
+      continue;
+    }
+    m.order[n++] = a;
+    m.order[n++] = b;
+    m.order[n++] = c;
+  }
+  m.order.resize(n);
+  m.vert.swap(vert);
+}
+
+int CsgOR::toVertices(VertexIndex& out) {
+  csgStats = CsgStats();
+  if (child.empty() || ((flags & WELD) && !(weldDist > 0.f))) {
+    logE("CsgOR: invalid: child.size=%zu weldDist=%e\n", child.size(),
+         weldDist);
+    return 1;
+  }
+
+  // Generate each unique child once.
+  std::map<BaseAsset*, VertexIndex> mesh;
+  size_t verts = 0, indices = 0;
+  for (size_t i = 0; i < child.size(); i++) {
+    BaseAsset* a = child[i].asset.get();
+    if (!a || a == this) {
+      logE("CsgOR: child[%zu] is %s\n", i, a ? "this CsgOR" : "null");
+      return 1;
+    }
+    auto r = mesh.emplace(a, VertexIndex());
+    if (r.second) {
+      if (a->toVertices(r.first->second)) {
+        logE("CsgOR: child[%zu] toVertices failed\n", i);
+        return 1;
+      }
+      csgStats.generated++;
+    }
+    verts += r.first->second.vert.size();
+    indices += r.first->second.order.size();
+  }
+
+  // Transform each child into m.
+  VertexIndex m;
+  m.vert.reserve(verts);
+  m.order.reserve(indices);
+  std::vector<Placed> placed(child.size(), Placed{0, 0, Bounds()});
+  for (size_t i = 0; i < child.size(); i++) {
+    auto& src = mesh[child[i].asset.get()];
+    if (src.vert.empty()) {
+      continue;
+    }
+    glm::quat rot = glm::normalize(child[i].rot);
+    indicesType base = m.vert.size();
+    auto& p = placed[i];
+    p.first = m.order.size();
+    p.bounds.min = p.bounds.max = rot * src.vert[0].P + child[i].loc;
+    for (auto v : src.vert) {
+      v.P = rot * v.P + child[i].loc;
+      v.N = rot * v.N;
+      p.bounds.min = glm::min(p.bounds.min, v.P);
+      p.bounds.max = glm::max(p.bounds.max, v.P);
+      m.vert.emplace_back(v);
+    }
+    for (auto j : src.order) {
+      m.order.emplace_back(j + base);
+    }
+    p.last = m.order.size();
+  }
+  if (flags & DROP_ENCLOSED) {
+    Bounds all;
+    all.set(m.vert);
+    float eps = std::max(glm::length(all.extent()) * 1e-4f, 1e-6f);
+    for (auto& p : placed) {
+      p.bounds.min -= glm::vec3(eps);
+      p.bounds.max += glm::vec3(eps);
+    }
+    dropEnclosed(m, placed, eps, csgStats);
+  }
+  if (flags) {
+    compact(m, (flags & WELD) ? weldDist : 0.f, csgStats);
+  }
+  if (dbg) logI("CsgOR: %zu children %zu generated %zu welded %zu dropped\n",
+                child.size(), csgStats.generated, csgStats.welded,
+                csgStats.dropped);
+
+  indicesType base = out.vert.size();
+  out.vert.insert(out.vert.end(), m.vert.begin(), m.vert.end());
+  out.order.reserve(out.order.size() + m.order.size());
+  for (auto i : m.order) {
+    out.order.push_back(i + base);
+  }
+  return 0;
+}
+
+int CsgOR::hash(Hasher& h) const {
+  if (hashBase(h, "CsgOR")) {
+    return 1;
+  }
+  h.add(flags);
+  h.add(weldDist);
+  h.add(child.size());
+  for (auto& c : child) {
+    if (!c.asset || c.asset.get() == this || c.asset->hash(h)) {
+      return 1;
+    }
+    h.add(c.loc);
+    h.add(c.rot);
+  }
+  return 0;
+}
+
+}  // namespace asset
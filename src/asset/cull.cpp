@@ -0,0 +1,265 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#endif
+#include "scene.h"
+#include "simd.h"
+
+namespace asset {
+
+using namespace simd;
+
+static_assert(BoxSoA::pad % lanes == 0, "pad must be a multiple of lanes");
+static constexpr unsigned allPad = (1u << BoxSoA::pad) - 1;
+static constexpr size_t frustumPlanes = 6;
+
+// emit appends to visible the index of each bit set in m.
+static void emit(unsigned m, size_t base, std::vector<uint32_t>& visible) {
+  for (uint32_t j = 0; m >> j; j++) {
+    if ((m >> j) & 1) {
+      visible.push_back(uint32_t(base) + j);
+    }
+  }
+}
+
+// padded returns the array size needed for n objects.
+static size_t padded(size_t n) {
+  return (n + BoxSoA::pad - 1) / BoxSoA::pad * BoxSoA::pad;
+}
+
+// unused returns a bit set for each lane past the end of a group.
+static unsigned unused(size_t base, size_t n) {
+  return (n - base >= BoxSoA::pad) ? 0 : allPad & ~((1u << (n - base)) - 1);
+}
+
+// CullPlane is one Frustum::plane prepared for cull: x, y, z and w are
+// splat across Lanes and pt points to the arrays to test.
+typedef struct CullPlane {
+  Lanes x, y, z, w;
+  Lanes negLen;  // Only for spheres: -planeLen.
+  const float* pt[3];
+
+  // dist is Frustum::dist for a whole Lanes. It must add in the same order.
+  Lanes dist(size_t j) const {
+    return add(add(mul(x, load(pt[0] + j)), mul(y, load(pt[1] + j))),
+               add(mul(z, load(pt[2] + j)), w));
+  }
+
+  // rejectBoxes returns a bit set for each of pad boxes starting at base
+  // that this plane rejects. pt must point to the corners farthest along
+  // the normal.
+  unsigned rejectBoxes(size_t base) const {
+    unsigned r = 0;
+    for (size_t j = 0; j < BoxSoA::pad; j += lanes) {
+      r |= bits(less(dist(base + j), splat(0.f))) << j;
+    }
+    return r;
+  }
+
+  // rejectSpheres is rejectBoxes for spheres. pt must point to the centers.
+  unsigned rejectSpheres(size_t base, const float* radius) const {
+    unsigned r = 0;
+    for (size_t j = 0; j < SphereSoA::pad; j += lanes) {
+      r |= bits(less(dist(base + j), mul(load(radius + base + j), negLen)))
+           << j;
+    }
+    return r;
+  }
+} CullPlane;
+
+// prepare fills in cp from f. It returns 1 if f is not a whole frustum.
+static int prepare(const Frustum& f, CullPlane* cp) {
+  if (f.plane.size() != frustumPlanes || f.planeLen.size() != frustumPlanes) {
+    logE("Frustum::cull: plane.size=%zu, want %zu\n", f.plane.size(),
+         frustumPlanes);
+    return 1;
+  }
+  for (size_t i = 0; i < frustumPlanes; i++) {
+    const glm::vec4& p = f.plane[i];
+    cp[i].x = splat(p.x);
+    cp[i].y = splat(p.y);
+    cp[i].z = splat(p.z);
+    cp[i].w = splat(p.w);
+    cp[i].negLen = splat(-f.planeLen[i]);
+  }
+  return 0;
+}
+
+// cullGroups runs reject on each group of pad objects, testing first the
+// plane that rejected the whole group last time (cache[g]). Only if that
+// plane misses some objects are all planes tested, without branches.
+template <typename F>
+static void cullGroups(size_t n, std::vector<uint8_t>& cache,
+                       std::vector<uint32_t>& visible, F reject) {
+  visible.clear();
+  visible.reserve(n);
+  for (size_t g = 0; g < cache.size(); g++) {
+    size_t base = g * BoxSoA::pad;
+    unsigned done = unused(base, n);
+    size_t first = cache[g] < frustumPlanes ? cache[g] : 0;
+    unsigned rejected = done | reject(first, base);
+    if (rejected != allPad) {
+      for (size_t i = 0; i < frustumPlanes; i++) {
+        unsigned r = done | reject(i, base);
+        if (r == allPad) {
+          cache[g] = uint8_t(i);
+        }
+        rejected |= r;
+      }
+    }
+    emit(~rejected & allPad, base, visible);
+  }
+}
+
+void BoxSoA::resize(size_t n_) {
+  n = n_;
+  for (size_t k = 0; k < 2; k++) {
+    for (size_t a = 0; a < 3; a++) {
+      bound[k][a].resize(padded(n), 0.f);
+    }
+  }
+  plane.resize(padded(n) / pad, 0);
+}
+
+void BoxSoA::set(size_t i, const AABB& box) {
+  if (i >= n) {
+    logF("BoxSoA::set(%zu) out of bounds (size %zu)\n", i, n);
+    return;
+  }
+  for (size_t k = 0; k < 2; k++) {
+    for (size_t a = 0; a < 3; a++) {
+      bound[k][a][i] = box.bound[k][a];
+    }
+  }
+}
+
+void SphereSoA::resize(size_t n_) {
+  n = n_;
+  for (size_t a = 0; a < 3; a++) {
+    center[a].resize(padded(n), 0.f);
+  }
+  radius.resize(padded(n), 0.f);
+  plane.resize(padded(n) / pad, 0);
+}
+
+void SphereSoA::set(size_t i, glm::vec3 c, float r) {
+  if (i >= n) {
+    logF("SphereSoA::set(%zu) out of bounds (size %zu)\n", i, n);
+    return;
+  }
+  for (size_t a = 0; a < 3; a++) {
+    center[a][i] = c[a];
+  }
+  radius[i] = r;
+}
+
+bool Frustum::isVisible(glm::vec3 c, float r) {
+  for (size_t i = 0; i < plane.size(); i++) {
+    if (dist(i, c.x, c.y, c.z) < r * -planeLen[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int Frustum::cull(BoxSoA& box, std::vector<uint32_t>& visible) {
+  CullPlane cp[frustumPlanes];
+  if (prepare(*this, cp)) {
+    visible.clear();
+    return 1;
+  }
+  for (size_t i = 0; i < frustumPlanes; i++) {
+    const glm::vec4& p = plane[i];
+    cp[i].pt[0] = box.bound[p.x > 0.f][0].data();
+    cp[i].pt[1] = box.bound[p.y > 0.f][1].data();
+    cp[i].pt[2] = box.bound[p.z > 0.f][2].data();
+  }
+  cullGroups(box.size(), box.plane, visible, [&cp](size_t i, size_t base) {
+    return cp[i].rejectBoxes(base);
+  });
+  return 0;
+}
+
+int Frustum::cull(SphereSoA& sphere, std::vector<uint32_t>& visible) {
+  CullPlane cp[frustumPlanes];
+  if (prepare(*this, cp)) {
+    visible.clear();
+    return 1;
+  }
+  for (size_t i = 0; i < frustumPlanes; i++) {
+    for (size_t a = 0; a < 3; a++) {
+      cp[i].pt[a] = sphere.center[a].data();
+    }
+  }
+  const float* radius = sphere.radius.data();
+  cullGroups(sphere.size(), sphere.plane, visible,
+             [&cp, radius](size_t i, size_t base) {
+               return cp[i].rejectSpheres(base, radius);
+             });
+  return 0;
+}
+
+int Frustum::cullIndirect(SphereSoA& sphere,
+                          const std::vector<uint32_t>& draw,
+                          std::vector<VkDrawIndexedIndirectCommand>& cmd,
+                          std::vector<uint32_t>& visible) {
+  if (draw.size() != sphere.size()) {
+    logE("cullIndirect: draw.size=%zu sphere.size=%zu\n", draw.size(),
+         sphere.size());
+    return 1;
+  }
+  std::vector<uint32_t> vis;
+  if (cull(sphere, vis)) {
+    logE("cullIndirect: cull failed\n");
+    return 1;
+  }
+  for (auto& c : cmd) {
+    c.instanceCount = 0;
+  }
+  for (uint32_t j : vis) {
+    if (draw[j] >= cmd.size()) {
+      logE("cullIndirect: draw[%u]=%u with only %zu cmd\n", j, draw[j],
+           cmd.size());
+      return 1;
+    }
+    auto& c = cmd[draw[j]];
+    size_t slot = size_t(c.firstInstance) + c.instanceCount;
+    if (slot >= visible.size()) {
+      logE("cullIndirect: cmd[%u] overflows visible. Call layoutIndirect.\n",
+           draw[j]);
+      return 1;
+    }
+    visible[slot] = j;
+    c.instanceCount++;
+  }
+  return 0;
+}
+
+int layoutIndirect(const std::vector<uint32_t>& draw,
+                   std::vector<VkDrawIndexedIndirectCommand>& cmd,
+                   std::vector<uint32_t>& visible) {
+  for (auto& c : cmd) {
+    c.firstInstance = 0;
+  }
+  for (uint32_t d : draw) {
+    if (d >= cmd.size()) {
+      logE("layoutIndirect: draw %u with only %zu cmd\n", d, cmd.size());
+      return 1;
+    }
+    cmd[d].firstInstance++;
+  }
+  uint32_t first = 0;
+  for (auto& c : cmd) {
+    uint32_t n = c.firstInstance;
+    c.firstInstance = first;
+    first += n;
+  }
+  visible.resize(first);
+  return 0;
+}
+
+}  // namespace asset
@@ -0,0 +1,419 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#endif
+#include "cullgpu.h"
+
+#include <string.h>
+
+// spv_cullgpu_comp (SPIR-V bytecode) from glslangValidator:
+#include "src/asset/cullgpu.comp.h"
+
+namespace comp {
+#include "src/asset/struct_cullgpu.comp.h"
+}  // namespace comp
+
+namespace asset {
+
+// localWorkSize is local_size_x in cullgpu.comp: each work group culls this
+// many instances.
+static constexpr uint32_t localWorkSize = comp::gl_WorkGroupSize_x *
+                                          comp::gl_WorkGroupSize_y *
+                                          comp::gl_WorkGroupSize_z;
+static constexpr size_t frustumPlanes = 6;
+static constexpr size_t maxWorkGroups = 65535;
+
+static_assert(sizeof(VkDrawIndexedIndirectCommand) == 5 * sizeof(uint32_t),
+              "cullgpu.comp assumes VkDrawIndexedIndirectCommand is 5 words");
+
+CullGPU::CullGPU(language::Device& dev, size_t maxInstances, size_t maxDraws)
+    : maxInstances{maxInstances},
+      maxDraws{maxDraws},
+      compute{dev, sizeof(comp::CullInstance) * maxInstances /*blockInSize*/,
+              sizeof(VkDrawIndexedIndirectCommand) * maxDraws +
+                  sizeof(uint32_t) * maxInstances /*blockOutSize*/,
+              comp::bindingIndexOfUBO(), sizeof(comp::UBO)},
+      stage{compute.cpool, memory::ASSUME_POOL_QINDEX},
+      indirect{dev},
+      done{dev} {
+  stage.sources.emplace_back(compute.cpool);
+}
+
+CullGPU::~CullGPU() {
+  if (!block) {
+    return;
+  }
+  if (running) {
+    bool timeout;
+    if (compute.wait(100u /*100ms*/ * 1000000lu, timeout) || timeout) {
+      logE("~CullGPU: compute.wait failed\n");
+    }
+    compute.doneBlocks.clear();
+  }
+  upload.clear();
+  science::ComputePipeline::BlockVec v{block};
+  if (compute.deleteBlocks(v)) {
+    logE("~CullGPU: compute.deleteBlocks failed\n");
+  }
+}
+
+int CullGPU::ctorError() {
+  if (maxInstances > size_t(localWorkSize) * maxWorkGroups) {
+    logE("CullGPU: maxInstances=%zu is more than one dispatch can do\n",
+         maxInstances);
+    return 1;
+  }
+  if (compute.shader->setName("CullGPU.compute.shader") ||
+      compute.shader->loadSPV(spv_cullgpu_comp, sizeof(spv_cullgpu_comp))) {
+    logE("CullGPU: compute.shader failed\n");
+    return 1;
+  }
+  compute.uniform.emplace_back(compute.cpool.vk.dev);
+  if (compute.ctorError()) {
+    logE("CullGPU: compute.ctorError failed\n");
+    return 1;
+  }
+  auto v = compute.newBlocks(1);
+  if (v.size() != 1) {
+    logE("CullGPU: newBlocks failed: size = %zu\n", v.size());
+    return 1;
+  }
+  block = v.at(0);
+
+  // Do not depend on how ComputePipeline creates block->o: draw from a copy
+  // whose usage is known.
+  indirect.info.size = compute.blockOutSize;
+  indirect.info.usage = VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                        VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  if (indirect.ctorAndBindDeviceLocal() ||
+      indirect.setName("CullGPU.indirect") || done.ctorError()) {
+    logE("CullGPU: indirect or done.ctorError failed\n");
+    return 1;
+  }
+  return 0;
+}
+
+int CullGPU::record(command::CommandBuffer& cmdBuffer) {
+  if (!block) {
+    logE("CullGPU::record: call ctorError first\n");
+    return 1;
+  }
+  std::vector<VkBufferCopy> region(1);
+  memset(&region.at(0), 0, sizeof(region.at(0)));
+  region.at(0).size = indirect.info.size;
+  if (cmdBuffer.copyBuffer(block->o.vk, indirect.vk, region)) {
+    logE("CullGPU::record: copyBuffer failed\n");
+    return 1;
+  }
+  VkMemoryBarrier VkInit(barrier);
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask =
+      VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(cmdBuffer.vk, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                           VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                       0 /*dependencyFlags*/, 1, &barrier, 0, nullptr, 0,
+                       nullptr);
+  return 0;
+}
+
+int CullGPU::retire() {
+  if (!block) {
+    logE("CullGPU: call ctorError first\n");
+    return 1;
+  }
+  if (running && wait()) {
+    logE("CullGPU: wait failed\n");
+    return 1;
+  }
+  return 0;
+}
+
+int CullGPU::enqueue(std::shared_ptr<memory::Flight>& f) {
+  if (stage.flushButNotSubmit(f)) {
+    logE("CullGPU: stage.flushButNotSubmit failed\n");
+    return 1;
+  }
+  science::ComputePipeline::lock_guard_t lock(compute.lockmutex);
+  if (f->canSubmit() && (f->end() || f->enqueue(lock, info))) {
+    logE("CullGPU: flight end or enqueue failed\n");
+    return 1;
+  }
+  upload.emplace_back(f);
+  return 0;
+}
+
+int CullGPU::setInstances(
+    const SphereSoA& sphere, const std::vector<uint32_t>& draw_,
+    const std::vector<VkDrawIndexedIndirectCommand>& cmd_) {
+  if (retire()) {
+    return 1;
+  }
+  if (sphere.size() > maxInstances || draw_.size() != sphere.size() ||
+      cmd_.size() > maxDraws) {
+    logE("CullGPU::setInstances: %zu spheres, %zu draw, %zu cmd\n",
+         sphere.size(), draw_.size(), cmd_.size());
+    return 1;
+  }
+  uint32_t end = 0;
+  for (auto& c : cmd_) {
+    end = std::max(end, c.firstInstance);
+  }
+  if (end > sphere.size()) {
+    logE("CullGPU::setInstances: firstInstance %u > %zu. layoutIndirect?\n",
+         end, sphere.size());
+    return 1;
+  }
+  for (uint32_t d : draw_) {
+    if (d >= cmd_.size()) {
+      logE("CullGPU::setInstances: draw %u with only %zu cmd\n", d,
+           cmd_.size());
+      return 1;
+    }
+  }
+
+  cmd = cmd_;
+  count = sphere.size();
+  draw = draw_;
+  return uploadInstances(sphere);
+}
+
+int CullGPU::moveInstances(const SphereSoA& sphere) {
+  if (retire()) {
+    return 1;
+  }
+  if (sphere.size() != count) {
+    logE("CullGPU::moveInstances: %zu spheres, want %zu\n", sphere.size(),
+         count);
+    return 1;
+  }
+  return uploadInstances(sphere);
+}
+
+int CullGPU::uploadInstances(const SphereSoA& sphere) {
+  // Upload sphere and draw in chunks that fit in stage.
+  size_t chunk = stage.mmapMax() / sizeof(comp::CullInstance);
+  for (size_t j = 0; j < sphere.size(); j += chunk) {
+    size_t n = std::min(chunk, sphere.size() - j);
+    std::shared_ptr<memory::Flight> f;
+    if (stage.mmap(block->i, j * sizeof(comp::CullInstance),
+                   n * sizeof(comp::CullInstance), f)) {
+      logE("CullGPU::uploadInstances: stage.mmap failed\n");
+      return 1;
+    }
+    auto* dst = reinterpret_cast<comp::CullInstance*>(f->mmap());
+    if (!dst) {
+      logE("CullGPU::uploadInstances: mmap failed\n");
+      return 1;
+    }
+    for (size_t k = 0; k < n; k++) {
+      auto& d = dst[k];
+      d.sphere = glm::vec4(sphere.center[0][j + k], sphere.center[1][j + k],
+                           sphere.center[2][j + k], sphere.radius[j + k]);
+      d.draw = draw[j + k];
+      d.pad0 = d.pad1 = d.pad2 = 0;
+    }
+    if (enqueue(f)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int CullGPU::cull(const Frustum& f, command::SubmitInfo& frame) {
+  if (retire()) {
+    return 1;
+  }
+  // Signal done when the cull is done. frame waits for it before record()
+  // copies block->o.
+  info.toSignal.emplace_back(done.vk);
+  if (cull(f)) {
+    return 1;
+  }
+  frame.waitFor.emplace_back(done, VK_PIPELINE_STAGE_TRANSFER_BIT);
+  return 0;
+}
+
+int CullGPU::cull(const Frustum& f) {
+  if (retire()) {
+    return 1;
+  }
+  if (f.plane.size() != frustumPlanes || f.planeLen.size() != frustumPlanes) {
+    logE("CullGPU::cull: plane.size=%zu, want %zu\n", f.plane.size(),
+         frustumPlanes);
+    return 1;
+  }
+
+  // Write the ubo.
+  std::shared_ptr<memory::Flight> uboflight;
+  if (stage.mmap(compute.uniform.at(0), 0, compute.uboSize, uboflight)) {
+    logE("CullGPU::cull: stage.mmap(ubo) failed\n");
+    return 1;
+  }
+  auto* ubo = reinterpret_cast<comp::UBO*>(uboflight->mmap());
+  if (!ubo) {
+    logE("CullGPU::cull: uboflight->mmap failed\n");
+    return 1;
+  }
+  memset(ubo, 0, sizeof(*ubo));
+  for (size_t i = 0; i < frustumPlanes; i++) {
+    ubo->plane[i] = f.plane[i];
+    ubo->negLen[i >> 2][i & 3] = -f.planeLen[i];
+  }
+  ubo->count = count;
+  ubo->drawCount = cmd.size();
+  if (enqueue(uboflight)) {
+    return 1;
+  }
+
+  // Reset every instanceCount to 0. This is the only part of block->o the
+  // CPU writes: it is just cmd.size() words, no matter how many instances.
+  if (!cmd.empty()) {
+    std::shared_ptr<memory::Flight> cmdflight;
+    if (stage.mmap(block->o, 0, visibleOffset(), cmdflight)) {
+      logE("CullGPU::cull: stage.mmap(cmd) failed\n");
+      return 1;
+    }
+    auto* dst = reinterpret_cast<VkDrawIndexedIndirectCommand*>(
+        cmdflight->mmap());
+    if (!dst) {
+      logE("CullGPU::cull: cmdflight->mmap failed\n");
+      return 1;
+    }
+    for (size_t d = 0; d < cmd.size(); d++) {
+      dst[d] = cmd[d];
+      dst[d].instanceCount = 0;
+    }
+    if (enqueue(cmdflight)) {
+      return 1;
+    }
+  }
+
+  block->work.x = (count + localWorkSize - 1) / localWorkSize;
+  block->work.y = 1;
+  block->work.z = 1;
+  if (!block->work.x) {
+    // Nothing to cull. The cmd upload is all that is needed, but
+    // ComputePipeline needs at least one work group.
+    block->work.x = 1;
+  }
+  science::ComputePipeline::BlockVec v{block};
+  if (compute.enqueueBlocks(v, info)) {
+    logE("CullGPU::cull: enqueueBlocks failed\n");
+    return 1;
+  }
+  info = command::SubmitInfo();
+  running = true;
+  return 0;
+}
+
+int CullGPU::poll(bool& done) {
+  done = !running;
+  if (!running) {
+    return 0;
+  }
+  if (compute.poll()) {
+    logE("CullGPU::poll: compute.poll failed\n");
+    return 1;
+  }
+  for (size_t i = 0; i < compute.doneBlocks.size(); i++) {
+    if (compute.doneBlocks.at(i) == block) {
+      // block is reused by the next cull: remove it without deleting it.
+      compute.doneBlocks.erase(compute.doneBlocks.begin() + i);
+      upload.clear();
+      running = false;
+      done = true;
+      break;
+    }
+  }
+  return 0;
+}
+
+int CullGPU::wait() {
+  for (bool done = false; !done;) {
+    if (poll(done)) {
+      logE("CullGPU::wait: poll failed\n");
+      return 1;
+    }
+    bool timeout;
+    if (!done && compute.wait(10u /*10ms*/ * 1000000lu, timeout)) {
+      logE("CullGPU::wait: compute.wait failed\n");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int CullGPU::read(std::vector<VkDrawIndexedIndirectCommand>& outCmd,
+                  std::vector<uint32_t>& visible) {
+  if (wait()) {
+    logE("CullGPU::read: wait failed\n");
+    return 1;
+  }
+  outCmd.resize(cmd.size());
+  visible.resize(count);
+  size_t size = visibleOffset() + count * sizeof(uint32_t);
+  char* dst = reinterpret_cast<char*>(outCmd.data());
+  for (size_t off = 0; off < size;) {
+    size_t n = std::min(stage.mmapMax(), size - off);
+    std::shared_ptr<memory::Flight> readf;
+    if (stage.read(block->o, off, n, readf) || !readf) {
+      logE("CullGPU::read: stage.read failed\n");
+      return 1;
+    }
+    if (stage.flushButNotSubmit(readf)) {
+      logE("CullGPU::read: stage.flushButNotSubmit failed\n");
+      return 1;
+    }
+    if (readf->canSubmit()) {
+      std::shared_ptr<command::Fence> fence{compute.cpool.borrowFence()};
+      science::ComputePipeline::lock_guard_t lock(compute.lockmutex);
+      command::SubmitInfo readInfo;
+      if (readf->end() || readf->enqueue(lock, readInfo)) {
+        logE("CullGPU::read: readf end or enqueue failed\n");
+        return 1;
+      }
+      if (compute.cpool.submit(lock, compute.poolQindex, {readInfo},
+                               fence->vk)) {
+        logE("CullGPU::read: cpool.submit failed\n");
+        (void)compute.cpool.unborrowFence(fence);
+        return 1;
+      }
+      VkResult v = fence->waitMs(1000);
+      if (v != VK_SUCCESS) {
+        return explainVkResult("CullGPU::read: fence->waitMs", v);
+      }
+      if (compute.cpool.unborrowFence(fence)) {
+        logE("CullGPU::read: unborrowFence failed\n");
+        return 1;
+      }
+    }
+    const char* src = reinterpret_cast<const char*>(readf->mmap());
+    if (!src) {
+      logE("CullGPU::read: readf->mmap failed\n");
+      return 1;
+    }
+    // Copy src to outCmd or visible (or both, if it crosses visibleOffset).
+    for (size_t k = 0; k < n;) {
+      size_t pos = off + k;
+      size_t len = n - k;
+      if (pos < visibleOffset()) {
+        len = std::min(len, visibleOffset() - pos);
+        memcpy(dst + pos, src + k, len);
+      } else {
+        memcpy(reinterpret_cast<char*>(visible.data()) + pos - visibleOffset(),
+               src + k, len);
+      }
+      k += len;
+    }
+    off += n;
+  }
+  return 0;
+}
+
+}  // namespace asset
@@ -0,0 +1,117 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#include "scene.h"
+
+#pragma once
+
+namespace asset {
+
+// CullGPU runs Frustum::cullIndirect in a compute shader (cullgpu.comp), so
+// the CPU cost of a frame does not grow with the number of instances:
+// 1. setInstances() uploads instance bounds and draw commands. Call it again
+//    only when instances are added or removed. moveInstances() only uploads
+//    new bounds for the same instances.
+// 2. cull() starts the GPU culling all instances against a Frustum. It only
+//    uploads the Frustum and draw commands.
+// 3. poll() until cull() is done, or wait(). Now block->o holds the draw
+//    commands, with each instanceCount set by the GPU, followed by the
+//    visible list.
+//
+// To draw the results without the CPU waiting, record() them into a
+// command buffer and call cull(f, frame) each frame instead. The draws then
+// read indirect: pass it to cmdBuffer.drawIndexedIndirect(). A vertex shader
+// finds which instance it is drawing at
+// word[visibleOffset() / 4 + gl_InstanceIndex]. 13instancing and 21physics
+// draw this way. They keep one CullGPU per framebuf, since a framebuf is not
+// reused until its frame is done.
+//
+// read() copies block->o back to the CPU, which is only useful to check
+// CullGPU against Frustum::cullIndirect (see cullgpucheck.cpp).
+typedef struct CullGPU {
+  // maxInstances and maxDraws set the size of the GPU buffers.
+  CullGPU(language::Device& dev, size_t maxInstances, size_t maxDraws);
+  ~CullGPU();
+
+  // ctorError loads cullgpu.comp and creates the GPU buffers.
+  WARN_UNUSED_RESULT int ctorError();
+
+  // record adds commands to cmdBuffer that copy block->o to indirect, then
+  // make indirect ready for drawIndexedIndirect and the vertex shader. Call
+  // it outside a render pass, before the draws.
+  WARN_UNUSED_RESULT int record(command::CommandBuffer& cmdBuffer);
+
+  // setInstances uploads sphere, which instance is drawn by which cmd
+  // (see Frustum::cullIndirect) and cmd. The firstInstance in each cmd must
+  // have been set by layoutIndirect.
+  WARN_UNUSED_RESULT int setInstances(
+      const SphereSoA& sphere, const std::vector<uint32_t>& draw,
+      const std::vector<VkDrawIndexedIndirectCommand>& cmd);
+
+  // moveInstances uploads sphere for the instances from the last
+  // setInstances. sphere.size() must be the same.
+  WARN_UNUSED_RESULT int moveInstances(const SphereSoA& sphere);
+
+  // size is the number of instances from the last setInstances.
+  size_t size() const { return count; }
+
+  // cull starts the GPU culling the instances against f.
+  //
+  // setInstances, moveInstances and cull first wait for the last cull to be
+  // done. That does not block if the frame that drew it is done.
+  WARN_UNUSED_RESULT int cull(const Frustum& f);
+
+  // cull also makes 'frame' wait for the cull on the GPU: the CPU does not
+  // wait. 'frame' must then be submitted with the commands from record().
+  WARN_UNUSED_RESULT int cull(const Frustum& f, command::SubmitInfo& frame);
+
+  // poll sets done to true if the last cull is done.
+  WARN_UNUSED_RESULT int poll(bool& done);
+
+  // wait waits for the last cull to be done. Call it before submitting a
+  // frame that draws from block->o.
+  WARN_UNUSED_RESULT int wait();
+
+  // read waits for the last cull to be done and copies the results from the
+  // GPU into outCmd and visible, laid out like Frustum::cullIndirect.
+  WARN_UNUSED_RESULT int read(std::vector<VkDrawIndexedIndirectCommand>& outCmd,
+                              std::vector<uint32_t>& visible);
+
+  // visibleOffset is where in block->o the visible list starts, in bytes.
+  size_t visibleOffset() const {
+    return cmd.size() * sizeof(VkDrawIndexedIndirectCommand);
+  }
+
+  const size_t maxInstances;
+  const size_t maxDraws;
+  science::ComputePipeline compute;
+  memory::Stage stage;
+  std::shared_ptr<science::ComputeBlock> block;
+  // indirect is a copy of block->o made by record(). ctorError sets
+  // VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT on it.
+  memory::Buffer indirect;
+  // done is signalled when cull(f, frame) is done.
+  command::Semaphore done;
+
+ protected:
+  // cmd is the last cmd passed to setInstances. count is the number of
+  // instances.
+  std::vector<VkDrawIndexedIndirectCommand> cmd;
+  size_t count{0};
+  // draw is the last draw passed to setInstances, for moveInstances.
+  std::vector<uint32_t> draw;
+  bool running{false};
+  // upload holds every Flight submitted with the last cull, until it is done.
+  std::vector<std::shared_ptr<memory::Flight>> upload;
+  // info collects the uploads for the next cull.
+  command::SubmitInfo info;
+
+  // enqueue flushes f and adds it to info.
+  WARN_UNUSED_RESULT int enqueue(std::shared_ptr<memory::Flight>& f);
+  // retire waits for the last cull to be done.
+  WARN_UNUSED_RESULT int retire();
+  // uploadInstances writes sphere and draw to block->i.
+  WARN_UNUSED_RESULT int uploadInstances(const SphereSoA& sphere);
+} CullGPU;
+
+}  // namespace asset
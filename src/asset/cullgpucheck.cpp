@@ -0,0 +1,145 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ * This tool runs CullGPU and checks it against Frustum::cullIndirect. It is
+ * headless, so it runs on a software Vulkan driver such as lavapipe:
+ * VK_ICD_FILENAMES=.../lvp_icd.x86_64.json cullgpucheck
+ */
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#endif
+#include <algorithm>
+#include <random>
+#include <string.h>
+
+#include "../base_application.h"
+#include "cullgpu.h"
+
+namespace example {
+
+struct CullCheck : public BaseApplication {
+  CullCheck(language::Instance& inst) : BaseApplication(inst) {}
+
+  // check runs one scene of n instances drawn by nDraws commands.
+  int check(asset::CullGPU& gpu, size_t n, size_t nDraws, std::mt19937& rng) {
+    std::uniform_real_distribution<float> pos(-100.f, 100.f), rad(0.f, 8.f);
+    asset::SphereSoA soa;
+    std::vector<uint32_t> draw;
+    std::vector<VkDrawIndexedIndirectCommand> cmd(nDraws);
+    for (uint32_t d = 0; d < cmd.size(); d++) {
+      cmd[d] = VkDrawIndexedIndirectCommand{36, 0, d * 36, int32_t(d), 0};
+    }
+    for (size_t i = 0; i < n; i++) {
+      soa.push_back(glm::vec3(pos(rng), pos(rng), pos(rng)), rad(rng));
+      draw.push_back(rng() % cmd.size());
+    }
+    std::vector<uint32_t> want;
+    if (asset::layoutIndirect(draw, cmd, want) ||
+        gpu.setInstances(soa, draw, cmd)) {
+      logE("check(%zu): layoutIndirect or setInstances failed\n", n);
+      return 1;
+    }
+
+    // Look from a few places, so some frames see nothing and some see a lot.
+    for (int frame = 0; frame < 8; frame++) {
+      if (frame == 4) {
+        // Move every instance. Only the spheres are uploaded again.
+        for (size_t i = 0; i < n; i++) {
+          soa.set(i, glm::vec3(pos(rng), pos(rng), pos(rng)), rad(rng));
+        }
+        if (gpu.moveInstances(soa)) {
+          logE("check(%zu): moveInstances failed\n", n);
+          return 1;
+        }
+      }
+      float a = frame * .8f;
+      glm::vec3 eye(cosf(a) * 120.f, frame * 10.f - 40.f, sinf(a) * 120.f);
+      asset::Frustum f(
+          glm::perspective(glm::radians(60.f), 1.5f, 1.f, 200.f) *
+          glm::lookAt(eye, glm::vec3(0.f), glm::vec3(0.f, 1.f, 0.f)));
+      std::vector<VkDrawIndexedIndirectCommand> wantCmd(cmd), gotCmd;
+      std::vector<uint32_t> got;
+      if (f.cullIndirect(soa, draw, wantCmd, want) || gpu.cull(f) ||
+          gpu.read(gotCmd, got)) {
+        logE("check(%zu): frame %d cull failed\n", n, frame);
+        return 1;
+      }
+      size_t total = 0;
+      for (size_t d = 0; d < cmd.size(); d++) {
+        auto& w = wantCmd[d];
+        auto& g = gotCmd.at(d);
+        if (memcmp(&w, &g, sizeof(w))) {
+          logE("check(%zu): frame %d cmd[%zu] got {%u %u %u %d %u}\n", n,
+               frame, d, g.indexCount, g.instanceCount, g.firstIndex,
+               g.vertexOffset, g.firstInstance);
+          logE("    want {%u %u %u %d %u}\n", w.indexCount, w.instanceCount,
+               w.firstIndex, w.vertexOffset, w.firstInstance);
+          return 1;
+        }
+        // The GPU writes each cmd's visible list in any order.
+        auto first = got.begin() + g.firstInstance;
+        std::sort(first, first + g.instanceCount);
+        if (!std::equal(first, first + g.instanceCount,
+                        want.begin() + w.firstInstance)) {
+          logE("check(%zu): frame %d cmd[%zu] visible list differs\n", n,
+               frame, d);
+          return 1;
+        }
+        total += w.instanceCount;
+      }
+      logI("check(%zu): frame %d: %zu visible in %zu cmd\n", n, frame, total,
+           cmd.size());
+    }
+    return 0;
+  }
+
+  int run() {
+    if (cpool.ctorError()) {
+      return 1;
+    }
+    static constexpr size_t maxInstances = 200000, maxDraws = 64;
+    asset::CullGPU gpu{cpool.vk.dev, maxInstances, maxDraws};
+    if (gpu.ctorError()) {
+      return 1;
+    }
+    std::mt19937 rng(1);
+    // Include sizes that are not a multiple of the work group size.
+    if (check(gpu, 1, 1, rng) || check(gpu, 1003, 7, rng) ||
+        check(gpu, 65536, 64, rng) || check(gpu, maxInstances, 3, rng)) {
+      return 1;
+    }
+    logI("CullGPU matches Frustum::cullIndirect\n");
+    return 0;
+  }
+};
+
+int headlessMain() {
+  language::Instance instance;
+  if (!instance.minSurfaceSupport.erase(language::PRESENT)) {
+    logE("removing PRESENT from minSurfaceSupport: not found\n");
+    return 1;
+  }
+  if (instance.ctorError(
+          [](language::Instance&, void*) -> VkResult { return VK_SUCCESS; },
+          nullptr) ||
+      instance.open({64, 64})) {
+    logE("instance.ctorError or open failed\n");
+    return 1;
+  }
+  if (!instance.devs.size()) {
+    logE("No devices found. Does your device support Vulkan?\n");
+    return 1;
+  }
+
+  // Remove auto-selected presentModes to prevent VK_KHR_swapchain being used
+  // and device framebuffers being auto-created.
+  auto& dev = *instance.devs.at(0);
+  dev.presentModes.clear();
+
+  return std::make_shared<CullCheck>(instance)->run();
+}
+
+}  // namespace example
+
+int main() { return example::headlessMain(); }
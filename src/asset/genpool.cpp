@@ -0,0 +1,86 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#include "genpool.h"
+
+namespace asset {
+
+int GenPool::start(size_t nThreads) {
+  if (busy()) {
+    logE("GenPool::start: there are still jobs\n");
+    return 1;
+  }
+  stop();
+  stopping = false;
+  th.reserve(nThreads);
+  for (size_t i = 0; i < nThreads; i++) {
+    th.emplace_back(&GenPool::worker, this);
+  }
+  return 0;
+}
+
+void GenPool::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto& t : th) {
+    t.join();
+  }
+  th.clear();
+  job.clear();
+  firstSeq = runSeq = 0;
+}
+
+void GenPool::push(std::shared_ptr<BaseAsset> a) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job.emplace_back();
+    job.back().asset = a;
+  }
+  wake.notify_one();
+}
+
+GenPool::Job* GenPool::peek() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (job.empty() || !job.front().done) {
+    return nullptr;
+  }
+  return &job.front();
+}
+
+GenPool::Job* GenPool::wait() {
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [this] { return job.empty() || job.front().done; });
+  return job.empty() ? nullptr : &job.front();
+}
+
+void GenPool::pop() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (job.empty() || !job.front().done) {
+    logF("BUG: GenPool::pop without peek\n");
+  }
+  job.pop_front();
+  firstSeq++;
+}
+
+void GenPool::worker() {
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    wake.wait(lock,
+              [this] { return stopping || runSeq < firstSeq + job.size(); });
+    if (stopping) {
+      return;
+    }
+    Job& j = job[runSeq - firstSeq];
+    runSeq++;
+    lock.unlock();
+    j.result = j.asset->toOptimizedVertices(j.out);
+    lock.lock();
+    j.done = true;
+    done.notify_all();
+  }
+}
+
+}  // namespace asset
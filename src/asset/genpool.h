@@ -0,0 +1,78 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "asset.h"
+
+#pragma once
+
+namespace asset {
+
+// GenPool runs BaseAsset::toOptimizedVertices on worker threads. Jobs finish
+// in any order, but peek() only hands them back in the order they were
+// pushed. That makes the result independent of thread timing.
+//
+// WARNING: toVertices and your VertexEvalFn run on a worker thread. Your app
+// must not modify the asset until it leaves the ADDED state.
+typedef struct GenPool {
+  ~GenPool() { stop(); }
+
+  typedef struct Job {
+    std::shared_ptr<BaseAsset> asset;
+    VertexIndex out;
+    int result{0};
+    bool done{false};
+  } Job;
+
+  // start creates nThreads worker threads. It is an error to call start if
+  // there are still jobs.
+  WARN_UNUSED_RESULT int start(size_t nThreads);
+
+  // stop joins the worker threads and discards any jobs.
+  void stop();
+
+  size_t threads() const { return th.size(); }
+
+  // busy returns true if there are jobs that have not been popped.
+  bool busy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return !job.empty();
+  }
+
+  // push queues a.toOptimizedVertices() to run on a worker thread.
+  void push(std::shared_ptr<BaseAsset> a);
+
+  // peek returns the oldest job if it is done, or nullptr if it is not done
+  // yet or there are no jobs. The job is valid until pop().
+  Job* peek();
+
+  // pop removes the job returned by peek().
+  void pop();
+
+  // wait blocks until the oldest job is done. It returns nullptr if there are
+  // no jobs.
+  Job* wait();
+
+ protected:
+  std::vector<std::thread> th;
+  std::mutex mutex;
+  // wake tells worker threads there is a new job or it is time to stop.
+  std::condition_variable wake;
+  // done tells wait() a job is done.
+  std::condition_variable done;
+  bool stopping{false};
+  // job holds the jobs in push order. std::deque does not move elements on
+  // push_back or pop_front, so a worker can hold a Job* without the lock.
+  std::deque<Job> job;
+  // firstSeq is the sequence number of job.front(). runSeq is the sequence
+  // number of the next job a worker should start.
+  size_t firstSeq{0}, runSeq{0};
+
+  void worker();
+} GenPool;
+
+}  // namespace asset
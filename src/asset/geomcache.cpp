@@ -0,0 +1,190 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <direct.h>
+#else /*_WIN32*/
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif /*_WIN32*/
+#include "geomcache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace asset {
+
+static constexpr int dbg = 0;
+
+constexpr uint32_t GeomCache::version;
+
+static const char geomMagic[8] = {'V', 'O', 'L', 'G', 'E', 'O', '1', 0};
+
+// GeomLayout is where each part of a GeomCache file starts.
+typedef struct GeomLayout {
+  size_t lod, meshlet, vert, order, size;
+
+  GeomLayout(const GeomHeader& h) {
+    lod = sizeof(GeomHeader);
+    meshlet = lod + sizeof(Lod) * h.lods;
+    vert = align(meshlet + sizeof(Meshlet) * h.meshlets, 16);
+    order = align(vert + size_t(h.vertexSize) * h.verts,
+                  sizeof(indicesType));
+    size = order + sizeof(indicesType) * h.indices;
+  }
+  static size_t align(size_t n, size_t a) { return (n + a - 1) & ~(a - 1); }
+} GeomLayout;
+
+GeomEntry::~GeomEntry() {
+#ifndef _WIN32
+  if (map) {
+    munmap(map, mapSize);
+  }
+#endif /*_WIN32*/
+}
+
+int GeomCache::ctorError(const std::string& dir_) {
+  if (dir_.empty()) {
+    logE("GeomCache: dir is empty\n");
+    return 1;
+  }
+#ifdef _WIN32
+  if (_mkdir(dir_.c_str()) && errno != EEXIST) {
+#else  /*_WIN32*/
+  if (mkdir(dir_.c_str(), 0777) && errno != EEXIST) {
+#endif /*_WIN32*/
+    logE("GeomCache: mkdir(%s) failed: %s\n", dir_.c_str(), strerror(errno));
+    return 1;
+  }
+  dir = dir_;
+  return 0;
+}
+
+std::string GeomCache::path(uint64_t key) const {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.geo", (unsigned long long)key);
+  return dir + name;
+}
+
+std::shared_ptr<GeomEntry> GeomCache::find(uint64_t key, size_t vertexSize) {
+  auto e = std::make_shared<GeomEntry>();
+  std::string p = path(key);
+  const char* data = nullptr;
+  size_t size = 0;
+#ifdef _WIN32
+  FILE* f = fopen(p.c_str(), "rb");
+  if (f) {
+    if (!fseek(f, 0, SEEK_END)) {
+      long n = ftell(f);
+      if (n > 0 && !fseek(f, 0, SEEK_SET)) {
+        e->buf.resize((size_t(n) + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+        if (fread(e->buf.data(), 1, size_t(n), f) == size_t(n)) {
+          data = reinterpret_cast<const char*>(e->buf.data());
+          size = size_t(n);
+        }
+      }
+    }
+    fclose(f);
+  }
+#else  /*_WIN32*/
+  int fd = open(p.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    struct stat st;
+    if (!fstat(fd, &st) && st.st_size > 0) {
+      void* m = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd,
+                     0);
+      if (m != MAP_FAILED) {
+        e->map = m;
+        e->mapSize = size_t(st.st_size);
+        data = reinterpret_cast<const char*>(m);
+        size = e->mapSize;
+      }
+    }
+    close(fd);
+  }
+#endif /*_WIN32*/
+  if (!data) {
+    misses++;
+    return nullptr;
+  }
+  e->head = reinterpret_cast<const GeomHeader*>(data);
+  if (size < sizeof(GeomHeader) ||
+      memcmp(e->head->magic, geomMagic, sizeof(geomMagic)) ||
+      e->head->key != key || GeomLayout(*e->head).size != size) {
+    logW("GeomCache: %s is not valid, ignoring it\n", p.c_str());
+    misses++;
+    return nullptr;
+  }
+  if (e->head->vertexSize != vertexSize) {
+    misses++;
+    return nullptr;
+  }
+  GeomLayout l(*e->head);
+  e->lod = reinterpret_cast<const Lod*>(data + l.lod);
+  e->meshlet = reinterpret_cast<const Meshlet*>(data + l.meshlet);
+  e->vert = data + l.vert;
+  e->order = reinterpret_cast<const indicesType*>(data + l.order);
+  hits++;
+  if (dbg) logI("GeomCache: hit %s\n", p.c_str());
+  return e;
+}
+
+int GeomCache::store(uint64_t key, const BaseAsset& a, size_t vertexSize,
+                     const char* vert, size_t verts, const indicesType* order,
+                     size_t indices) {
+  if (dir.empty()) {
+    logE("GeomCache::store: call ctorError first\n");
+    return 1;
+  }
+  GeomHeader h = GeomHeader();
+  memcpy(h.magic, geomMagic, sizeof(geomMagic));
+  h.key = key;
+  h.vertexSize = vertexSize;
+  h.verts = verts;
+  h.indices = indices;
+  h.lods = a.lod.size();
+  h.meshlets = a.meshlet.size();
+  h.bounds = a.bounds;
+  GeomLayout l(h);
+  std::vector<char> file(l.size, 0);
+  memcpy(file.data(), &h, sizeof(h));
+  if (h.lods) {
+    memcpy(&file[l.lod], a.lod.data(), sizeof(Lod) * h.lods);
+  }
+  if (h.meshlets) {
+    memcpy(&file[l.meshlet], a.meshlet.data(), sizeof(Meshlet) * h.meshlets);
+  }
+  memcpy(&file[l.vert], vert, vertexSize * verts);
+  memcpy(&file[l.order], order, sizeof(indicesType) * indices);
+
+  // Write to a temporary file, then rename it so find() never sees a
+  // partial file.
+  std::string p = path(key);
+  std::string tmp = p + ".tmp";
+  FILE* f = fopen(tmp.c_str(), "wb");
+  if (!f) {
+    logE("GeomCache::store: fopen(%s) failed: %s\n", tmp.c_str(),
+         strerror(errno));
+    return 1;
+  }
+  bool fail = fwrite(file.data(), 1, file.size(), f) != file.size();
+  fail |= fclose(f) != 0;
+#ifdef _WIN32
+  remove(p.c_str());  // rename fails on Windows if p exists.
+#endif /*_WIN32*/
+  if (fail || rename(tmp.c_str(), p.c_str())) {
+    logE("GeomCache::store: write %s failed\n", p.c_str());
+    remove(tmp.c_str());
+    return 1;
+  }
+  stores++;
+  return 0;
+}
+
+}  // namespace asset
@@ -0,0 +1,87 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#include <string>
+
+#include "asset.h"
+
+#pragma once
+
+namespace asset {
+
+// GeomHeader starts each GeomCache file. After it come 'lods' Lod structs,
+// 'meshlets' Meshlet structs, the vertices (starting at a multiple of 16
+// bytes) and the indices. The file is only read on the machine that wrote
+// it, so everything is in the native byte order.
+typedef struct GeomHeader {
+  char magic[8];
+  uint64_t key;
+  uint32_t vertexSize;
+  uint32_t verts;
+  uint32_t indices;
+  uint32_t lods;
+  uint32_t meshlets;
+  uint32_t reserved;
+  Bounds bounds;
+} GeomHeader;
+
+// GeomEntry is one GeomCache file, mapped into memory. The pointers are
+// valid until the GeomEntry is destroyed.
+typedef struct GeomEntry {
+  ~GeomEntry();
+
+  const GeomHeader* head{nullptr};
+  const Lod* lod{nullptr};
+  const Meshlet* meshlet{nullptr};
+  // vert holds head->verts vertices of head->vertexSize bytes, exactly as
+  // Library::write() wrote them to upload.
+  const char* vert{nullptr};
+  const indicesType* order{nullptr};
+
+  size_t vertBytes() const { return size_t(head->vertexSize) * head->verts; }
+
+ protected:
+  friend struct GeomCache;
+  void* map{nullptr};
+  size_t mapSize{0};
+  // buf holds the file if it could not be mapped.
+  std::vector<uint64_t> buf;
+} GeomEntry;
+
+// GeomCache stores generated assets in a directory, one file per asset. The
+// file name is the asset's key: a hash of everything that went into it (see
+// BaseAsset::hash). The same key always means the same bytes, so a file is
+// never changed once it is written. Delete the directory to clear it.
+//
+// Library::cache uses a GeomCache to skip toVertices and writeFn for assets
+// that were already generated by an earlier run.
+typedef struct GeomCache {
+  // version is part of every key. Change it when toVertices changes what it
+  // writes, so files from older builds are not used.
+  static constexpr uint32_t version = 1;
+
+  // ctorError sets the directory, creating it if needed.
+  WARN_UNUSED_RESULT int ctorError(const std::string& dir);
+
+  // find maps the file for key, or returns nullptr if there is none or it
+  // does not have vertexSize-byte vertices.
+  std::shared_ptr<GeomEntry> find(uint64_t key, size_t vertexSize);
+
+  // store writes a file for key. 'vert' holds verts vertices of vertexSize
+  // bytes. a.bounds, a.lod and a.meshlet are also saved.
+  WARN_UNUSED_RESULT int store(uint64_t key, const BaseAsset& a,
+                               size_t vertexSize, const char* vert,
+                               size_t verts, const indicesType* order,
+                               size_t indices);
+
+  const std::string& getDir() const { return dir; }
+
+  // hits, misses and stores count the calls to find and store.
+  size_t hits{0}, misses{0}, stores{0};
+
+ protected:
+  std::string dir;
+  std::string path(uint64_t key) const;
+} GeomCache;
+
+}  // namespace asset
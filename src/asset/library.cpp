@@ -7,11 +7,16 @@
 #endif
 #endif
 #include "asset.h"
+#include "compact.h"
+#include "genpool.h"
+#include "geomcache.h"
 
 namespace asset {
 
 static constexpr int dbg = 0;
 
+constexpr VkDeviceSize Library::directCapacity;
+
 int Library::ctorError(
     size_t vertexSize_, size_t instSize_, size_t maxIndices_,
     size_t bindingIndexOfInstanceBuf_) {
@@ -23,217 +28,617 @@ int Library::ctorError(
   }
   vertexSize = vertexSize_ - instSize_;
   instSize = instSize_;
+  if (layout == LAYOUT_COMPACT && vertexSize != sizeof(CompactVertex)) {
+    logE("Library::ctorError: LAYOUT_COMPACT vertexSize %zu, want %zu\n",
+         vertexSize, sizeof(CompactVertex));
+    return 1;
+  }
   bindingIndexOfInstanceBuf = bindingIndexOfInstanceBuf_;
-  maxVertices = uglue.stage.mmapMax() / vertexSize;
+  if (!maxVertices) {
+    maxVertices = uglue.stage.mmapMax() / vertexSize;
+  }
   maxIndices = maxIndices_;
-  order.reserve(maxIndices_);
-  vertexBuf.info.size = vertexSize * maxVertices;
-  indexBuf.info.size = sizeof(indicesType) * maxIndices;
-  if (vertexBuf.reset() || vertexBuf.ctorAndBindDeviceLocal() ||
-      indexBuf.reset() || indexBuf.ctorAndBindDeviceLocal() ||
-      vertexBuf.setName("Library::vertexBuf") ||
-      indexBuf.setName("Library::indexBuf")) {
-    logE("Library::ctorError: vertexBuf.ctorAndBindDeviceLocal failed\n");
-    return 1;
-  }
-
-  FreeBlock f;
-  f.base = 0;
-  f.use = maxVertices;
-  freeV.push_front(f);
-  f.use = maxIndices;
-  freeO.push_front(f);
-  if (dbg) logI("init free v0 + %zu o0 + %zu\n", maxVertices, maxIndices);
+  direct = uglue.useDirectWrite();
+  page.clear();
+  if (addPage(maxVertices, maxIndices, indexTypeFor(0, index16))) {
+    logE("Library::ctorError: addPage failed\n");
+    return 1;
+  }
+  page.at(0)->order.reserve(maxIndices);
+
+  if (uploadMmap) {
+    upload.mem.munmap();
+    uploadMmap = nullptr;
+  }
+  if (direct) {
+    if (dbg) logI("Library: writing directly to pages\n");
+    return 0;
+  }
+  if (!uploadSize) {
+    uploadSize = uglue.stage.mmapMax();
+  }
+  if (uploadSize < vertexSize + sizeof(indicesType) + 2 * Scatter::align) {
+    logE("Library::ctorError: uploadSize %zu is too small\n", uploadSize);
+    return 1;
+  }
+  upload.info.size = uploadSize;
+  if (upload.reset() || upload.ctorAndBindHostCoherent() ||
+      upload.setName("Library::upload")) {
+    logE("Library::ctorError: upload.ctorAndBindHostCoherent failed\n");
+    return 1;
+  }
+  void* voidMmap;
+#ifdef VOLCANO_DISABLE_VULKANMEMORYALLOCATOR
+  if (upload.mem.mmap(&voidMmap, 0, upload.info.size)) {
+#else  /*VOLCANO_DISABLE_VULKANMEMORYALLOCATOR*/
+  if (upload.mem.mmap(&voidMmap)) {
+#endif /*VOLCANO_DISABLE_VULKANMEMORYALLOCATOR*/
+    logE("Library::ctorError: upload.mem.mmap failed\n");
+    return 1;
+  }
+  uploadMmap = reinterpret_cast<char*>(voidMmap);
+  if (!uploadCmd.vk) {
+    std::vector<VkCommandBuffer> vk(1);
+    if (uglue.stage.pool.alloc(vk)) {
+      logE("Library::ctorError: stage.pool.alloc failed\n");
+      return 1;
+    }
+    uploadCmd.vk = vk.at(0);
+  }
   return 0;
 }
 
-int Library::alloc(size_t& firstV, size_t& firstO, VertexIndex& batch,
-                   VertexIndex& out, BaseAsset& a) {
-  // Find a freeV. Still need to find a freeO.
-  auto prevFv = freeV.end();
-  for (auto fv = freeV.begin(); fv != freeV.end(); prevFv = fv++) {
-    if (fv->use >= out.vert.size()) {
-      // Now find a freeO.
-      auto prevFo = freeO.end();
-      for (auto fo = freeO.begin(); fo != freeO.end(); prevFo = fo++) {
-        if (fo->use >= out.order.size()) {
-          // Copy block location to firstV, firstO
-          if (!batch.vert.empty()) {
-            if (firstV >= fv->base) {
-              logE("alloc: took %zu first, then %zu (they are not sorted!)\n",
-                   firstV, fv->base);
-              return 1;
-            }
-            if (firstO >= fo->base) {
-              logE("alloc: took %zu first, then %zu (they are not sorted!)\n",
-                   firstO, fo->base);
-              return 1;
-            }
-            if (firstV + batch.vert.size() != fv->base) {
-              // No split writes to vertex buffer (data the middle is on GPU,
-              // no way to know what the contents are at this point.)
-              // Instead, stay in state == ADDED until write() is called again.
-              // NOTE: no infinite loop - already know !batch.vert.empty()
-              return 0;
-            }
-            // Copy indices between firstO + batch.order.size() and g->order0.
-            batch.order.insert(batch.order.end(),
-                               order.begin() + (firstO + batch.order.size()),
-                               order.begin() + fo->base);
-          } else {
-            firstV = fv->base;  // Set up the first use in the batch.
-            firstO = fo->base;
-          }
-          a.vblk.base = fv->base;
-          a.vblk.use = out.vert.size();
-          a.oblk.base = fo->base;
-          a.oblk.use = out.order.size();
-          a.inst.cmd.indexCount = out.order.size();
-          a.inst.cmd.instanceCount = 0;
-          a.inst.cmd.firstIndex = fo->base;
-          a.inst.cmd.vertexOffset = fv->base;
-          a.inst.cmd.firstInstance = 0;
-
-          // Update fv and fo, removing the allocated part.
-          if (dbg) logI("alloc v%zu + %zu o%zu + %zu\n", fv->base, fv->use,
-               fo->base, fo->use);
-          size_t n = std::min(fv->use, out.vert.size());
-          fv->base += n;
-          fv->use -= n;
-          if (!fv->use) {
-            if (dbg) logI("  - del freeV\n");
-            if (prevFv == freeV.end()) {
-              freeV.pop_front();
-            } else {
-              freeV.erase_after(prevFv);
-            }
-          }
-          else if (dbg) logI("  - now freeV %zu + %zu\n", fv->base, fv->use);
-          // fv is invalid after this point.
-          n = std::min(fo->use, out.order.size());
-          fo->base += n;
-          fo->use -= n;
-          if (!fo->use) {
-            if (dbg) logI("  - del freeO\n");
-            if (prevFo == freeO.end()) {
-              freeO.pop_front();
-            } else {
-              freeO.erase_after(prevFo);
-            }
-          }
-          else if (dbg) logI("  - now freeO %zu + %zu\n", fo->base, fo->use);
-          // fo is invalid after this point.
-
-          batch.vert.insert(batch.vert.end(), out.vert.begin(),
-                            out.vert.end());
-          batch.order.insert(batch.order.end(), out.order.begin(),
-                             out.order.end());
-          totalVertUse += out.vert.size();
-          totalOrderUse += out.order.size();
-          a.state_ = ADD_WAIT;
-          return 0;
-        }
-      }
+// mapDirect allocates buf in memory that is DEVICE_LOCAL and HOST_VISIBLE
+// and maps it.
+static int mapDirect(memory::Buffer& buf, char*& out) {
+  if (buf.reset() ||
+      buf.ctorError(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ||
+      buf.bindMemory()) {
+    logE("mapDirect: ctorError or bindMemory failed\n");
+    return 1;
+  }
+  void* voidMmap;
+#ifdef VOLCANO_DISABLE_VULKANMEMORYALLOCATOR
+  if (buf.mem.mmap(&voidMmap, 0, buf.info.size)) {
+#else  /*VOLCANO_DISABLE_VULKANMEMORYALLOCATOR*/
+  if (buf.mem.mmap(&voidMmap)) {
+#endif /*VOLCANO_DISABLE_VULKANMEMORYALLOCATOR*/
+    logE("mapDirect: mmap failed\n");
+    return 1;
+  }
+  out = reinterpret_cast<char*>(voidMmap);
+  return 0;
+}
 
-      // Could not find a freeO.
-      logE("write: %zu/%zu %s add %zu more\n",
-           totalOrderUse + batch.order.size(), maxIndices,
-           "indices used, cannot", out.order.size());
-      logE("write: %zu/%zu %s add %zu more\n",
-           totalVertUse + batch.vert.size(), maxVertices, "verts used,",
-           out.vert.size());
-      logE("write: out of memory. Maybe create another Library?\n");
+// flushDirect flushes the host writes to buf. The memory may not be
+// HOST_COHERENT.
+static int flushDirect(memory::Buffer& buf) {
+#ifdef VOLCANO_DISABLE_VULKANMEMORYALLOCATOR
+  VkMappedMemoryRange VkInit(range);
+  range.offset = 0;
+  range.size = VK_WHOLE_SIZE;
+  return buf.mem.flush(std::vector<VkMappedMemoryRange>{range});
+#else  /*VOLCANO_DISABLE_VULKANMEMORYALLOCATOR*/
+  return buf.mem.flush();
+#endif /*VOLCANO_DISABLE_VULKANMEMORYALLOCATOR*/
+}
+
+int Library::addPage(size_t nVerts, size_t nIndices, VkIndexType indexType) {
+  if (maxPages && page.size() >= maxPages) {
+    logE("write: maxPages %zu reached\n", maxPages);
+    return 1;
+  }
+  page.emplace_back(std::make_shared<LibraryPage>(uglue.shaders.dev));
+  auto& p = *page.back();
+  p.indexType = indexType;
+  p.vertexBuf.info.size = vertexSize * nVerts;
+  p.indexBuf.info.size = p.indexSize() * nIndices;
+  char vname[64], oname[64];
+  snprintf(vname, sizeof(vname), "Library::page[%zu].vertexBuf",
+           page.size() - 1);
+  snprintf(oname, sizeof(oname), "Library::page[%zu].indexBuf",
+           page.size() - 1);
+  if (direct) {
+    if (mapDirect(p.vertexBuf, p.vertMmap) ||
+        mapDirect(p.indexBuf, p.indexMmap) || p.vertexBuf.setName(vname) ||
+        p.indexBuf.setName(oname)) {
+      logE("addPage: mapDirect failed\n");
+      page.pop_back();
       return 1;
     }
+  } else if (p.vertexBuf.reset() || p.vertexBuf.ctorAndBindDeviceLocal() ||
+             p.indexBuf.reset() || p.indexBuf.ctorAndBindDeviceLocal() ||
+             p.vertexBuf.setName(vname) || p.indexBuf.setName(oname)) {
+    logE("addPage: vertexBuf.ctorAndBindDeviceLocal failed\n");
+    page.pop_back();
+    return 1;
+  }
+  p.vAlloc.reset(nVerts);
+  p.oAlloc.reset(nIndices);
+  // pack has a vertexBuf and an indexBuf destination for each page. A page
+  // added in the middle of write() gets its destinations right away.
+  pack.region.resize(2 * page.size());
+  if (page.size() > 1) {
+    // Command buffers must be rebuilt to bind the new page.
+    uglue.needRebuild = true;
   }
+  if (dbg) logI("page[%zu] v0 + %zu o0 + %zu (%zu-byte)\n", page.size() - 1,
+                nVerts, nIndices, p.indexSize());
+  return 0;
+}
 
-  // Could not find a freeV.
-  logE("write: %zu/%zu %s add %zu more\n",
-       totalVertUse + batch.vert.size(), maxVertices, "verts used, cannot",
-       out.vert.size());
-  logE("write: %zu/%zu %s add %zu more\n",
-       totalOrderUse + batch.order.size(), maxIndices, "indices used,",
-       out.order.size());
-  logE("write: out of memory. Maybe create another Library?\n");
-  return 1;
+// logOutOfMemory explains why alloc failed.
+static void logOutOfMemory(const char* which, const Suballoc& s, size_t want,
+                           const char* units) {
+  Suballoc::Stats st;
+  s.getStats(st);
+  logE("write: %zu/%zu %s used, cannot add %zu more\n", st.used, st.total,
+       units, want);
+  logE("write: %s largest free block %zu, %zu free blocks (%.0f%% frag)\n",
+       which, st.largestFree, st.freeBlocks, st.fragmentation() * 100.f);
 }
 
-int Library::free(BaseAsset& a) {
-  // Add a.vblk back to freeV; a.oblk back to freeO
-  auto prevFv = freeV.end();
-  for (auto fv = freeV.begin(); fv != freeV.end(); prevFv = fv++) {
-    if (fv->base + fv->use <= a.vblk.base) {
-      continue;
-    } else if ((fv->base <= a.vblk.base && fv->base + fv->use > a.vblk.base) ||
-               (fv->base < a.vblk.base + a.vblk.use)) {
-      logE("BUG: free(v=%zu + %zu) is already a freeblock %zu + %zu\n",
-           a.vblk.base, a.vblk.use, fv->base, fv->use);
+int PageHeap::alloc(size_t nVerts, size_t nIndices, FreeBlock& v,
+                    FreeBlock& o) {
+  size_t vbase, obase;
+  uint32_t vid, oid;
+  if (vAlloc.alloc(nVerts, vbase, vid)) {
+    return 1;
+  }
+  if (oAlloc.alloc(nIndices, obase, oid)) {
+    if (vAlloc.free(vid)) {
+      logE("BUG: PageHeap::alloc: vAlloc.free failed\n");
+    }
+    return 1;
+  }
+  v.base = vbase;
+  v.use = v.cap = nVerts;
+  v.id = vid;
+  o.base = obase;
+  o.use = o.cap = nIndices;
+  o.id = oid;
+  return 0;
+}
+
+int PageHeap::free(FreeBlock& v, FreeBlock& o) {
+  if (v.id != Suballoc::none) {
+    if (vAlloc.free(v.id)) {
+      logE("BUG: PageHeap::free(v=%zu + %zu) failed\n", v.base, v.cap);
       return 1;
     }
-    // a.vblk gets inserted before fv
-    if (prevFv == freeV.end()) {
-      if (a.vblk.base + a.vblk.use > fv->base) {
-        logE("BUG: free(v=%zu + %zu) but head %zu + %zu\n", a.vblk.base,
-             a.vblk.use, fv->base, fv->use);
-        return 1;
-      }
-      if (dbg) logI("  - add freeV %zu + %zu before %zu + %zu at head\n", a.vblk.base, a.vblk.use, fv->base, fv->use);
-      freeV.push_front(a.vblk);
-      prevFv = freeV.begin();
-    } else {
-      if (dbg) logI("  - add freeV %zu + %zu after %zu + %zu\n", a.vblk.base, a.vblk.use, prevFv->base, prevFv->use);
-      freeV.insert_after(prevFv, a.vblk);
+    v.id = Suballoc::none;
+  }
+  if (o.id != Suballoc::none) {
+    if (oAlloc.free(o.id)) {
+      logE("BUG: PageHeap::free(o=%zu + %zu) failed\n", o.base, o.cap);
+      return 1;
     }
-    // Merge blocks - should only ever merge up to 2 times
-    fv = prevFv;
-    for (fv++; fv != freeV.end() && prevFv->base + prevFv->use == fv->base; ) {
-      if (dbg) logI("  - mergfreeV %zu + %zu with %zu + %zu\n", prevFv->base, prevFv->use, fv->base, fv->use);
-      prevFv->use += fv->use;
-      fv = freeV.erase_after(prevFv);
+    o.id = Suballoc::none;
+  }
+  return 0;
+}
+
+int PageHeap::reuse(size_t nVerts, size_t nIndices, FreeBlock& v,
+                    FreeBlock& o) {
+  if (v.id == Suballoc::none || o.id == Suballoc::none || v.cap < nVerts ||
+      o.cap < nIndices) {
+    if (free(v, o) || alloc(nVerts, nIndices, v, o)) {
+      return 1;
     }
-    break;
-  }
-  auto prevFo = freeO.end();
-  for (auto fo = freeO.begin(); fo != freeO.end(); prevFo = fo++) {
-    if (fo->base + fo->use <= a.oblk.base) {
-      continue;
-    } else if ((fo->base <= a.oblk.base && fo->base + fo->use > a.oblk.base) ||
-               (fo->base < a.oblk.base + a.oblk.use)) {
-      logE("BUG: free(o=%zu + %zu) is already a freeblock %zu + %zu\n",
-           a.oblk.base, a.oblk.use, fo->base, fo->use);
+  }
+  v.use = nVerts;
+  o.use = nIndices;
+  return 0;
+}
+
+void PageHeap::setOrder(size_t base, const indicesType* src, size_t n) {
+  if (base + n > order.size()) {
+    order.resize(base + n);
+  }
+  memcpy(&order.at(base), src, sizeof(indicesType) * n);
+}
+
+void PageHeap::copyIndices(char* dst, const indicesType* src,
+                           size_t n) const {
+  if (indexSize() == sizeof(indicesType)) {
+    memcpy(dst, src, sizeof(indicesType) * n);
+    return;
+  }
+  uint16_t* d = reinterpret_cast<uint16_t*>(dst);
+  for (size_t i = 0; i < n; i++) {
+    d[i] = uint16_t(src[i]);
+  }
+}
+
+int Library::dest(size_t dst, VkDeviceSize dstOffset, VkDeviceSize size,
+                  char*& out) {
+  VkDeviceSize src;
+  if (pack.add(dst, dstOffset, size, src)) {
+    return 1;
+  }
+  if (!direct) {
+    out = uploadMmap + src;
+    return 0;
+  }
+  auto& p = *page.at(dst / 2);
+  out = ((dst & 1) ? p.indexMmap : p.vertMmap) + dstOffset;
+  return 0;
+}
+
+int Library::place(BaseAsset& a, size_t nVerts, const indicesType* src,
+                   size_t nIndices) {
+  size_t pi = PageHeap::allocIn(page, nVerts, nIndices, a.vblk, a.oblk);
+  if (pi >= page.size()) {
+    // No page has room. Add a page big enough for this asset.
+    auto& last = *page.back();
+    size_t nv = std::max(pageVertices ? pageVertices : maxVertices, nVerts);
+    size_t no = std::max(pageIndices ? pageIndices : maxIndices, nIndices);
+    if (addPage(nv, no, indexTypeFor(nVerts, index16))) {
+      logOutOfMemory("vertexBuf", last.vAlloc, nVerts, "verts");
+      logOutOfMemory("indexBuf", last.oAlloc, nIndices, "indices");
+      logE("write: out of memory in %zu pages\n", page.size());
       return 1;
     }
-    // a.oblk gets inserted before fo
-    if (prevFo == freeO.end()) {
-      if (a.oblk.base + a.oblk.use > fo->base) {
-        logE("BUG: free(o=%zu + %zu) but head %zu + %zu\n", a.oblk.base,
-             a.oblk.use, fo->base, fo->use);
-        return 1;
-      }
-      if (dbg) logI("  - add freeO %zu + %zu before %zu + %zu at head\n", a.oblk.base, a.oblk.use, fo->base, fo->use);
-      freeO.push_front(a.oblk);
-      prevFo = freeO.begin();
-    } else {
-      if (dbg) logI("  - add freeO %zu + %zu after %zu + %zu\n", a.oblk.base, a.oblk.use, prevFo->base, prevFo->use);
-      freeO.insert_after(prevFo, a.oblk);
+    pi = page.size() - 1;
+    if (page.at(pi)->alloc(nVerts, nIndices, a.vblk, a.oblk)) {
+      logE("BUG: alloc: new page is too small\n");
+      return 1;
+    }
+  }
+  if (dbg) logI("alloc page[%zu] v%zu + %zu o%zu + %zu\n", pi, a.vblk.base,
+                nVerts, a.oblk.base, nIndices);
+  a.page_ = pi;
+  // Draw lod[0] until the app calls useLod.
+  a.inst.cmd.indexCount = a.lod.empty() ? nIndices : a.lod[0].indexCount;
+  a.inst.cmd.instanceCount = 0;
+  a.inst.cmd.firstIndex = a.oblk.base;
+  a.inst.cmd.vertexOffset = a.vblk.base;
+  a.inst.cmd.firstInstance = 0;
+  a.state_ = ADD_WAIT;
+  page.at(pi)->setOrder(a.oblk.base, src, nIndices);
+  return 0;
+}
+
+int Library::alloc(VertexIndex& out, BaseAsset& a, const Writer& w) {
+  if (page.empty()) {
+    logE("write: no pages. Call ctorError first.\n");
+    return 1;
+  }
+  VkDeviceSize vBytes = vertexSize * out.vert.size();
+  // oBytes assumes 32-bit indices until a page is chosen.
+  VkDeviceSize oBytes = sizeof(indicesType) * out.order.size();
+  bool fits = vBytes + oBytes + Scatter::align <= pack.avail();
+  if (!fits && (stream.asset ||
+                vBytes + oBytes + Scatter::align <= pack.getCapacity())) {
+    // Stay in state == ADDED until write() is called again. (Only assets
+    // that would never fit in upload are streamed.)
+    return 0;
+  }
+  if (place(a, out.vert.size(), out.order.data(), out.order.size())) {
+    return 1;
+  }
+
+  if (!fits) {
+    stream.asset = &a;
+    stream.out.vert.swap(out.vert);
+    stream.out.order.swap(out.order);
+    stream.page = a.page_;
+    stream.vbase = a.vblk.base;
+    stream.obase = a.oblk.base;
+    stream.vertexSize = vertexSize;
+    stream.indexSize = page.at(a.page_)->indexSize();
+    stream.v = 0;
+    stream.o = 0;
+    return streamChunk(w);
+  }
+
+  size_t pi = a.page_;
+  auto& p = *page.at(pi);
+  char* vdst;
+  char* odst;
+  if (dest(2 * pi, vertexSize * a.vblk.base, vBytes, vdst) ||
+      dest(2 * pi + 1, p.indexSize() * a.oblk.base,
+           p.indexSize() * out.order.size(), odst)) {
+    logE("BUG: alloc: pack.add failed after pack.avail\n");
+    return 1;
+  }
+
+  if (!cache || !a.cacheKey_) {
+    if (writeVerts(a, out.vert.data(), out.vert.size(), vdst, w)) {
+      return 1;
+    }
+  } else {
+    // vdst may be slow to read back, so write the vertices to buf first.
+    std::vector<char> buf(vBytes);
+    if (writeVerts(a, out.vert.data(), out.vert.size(), buf.data(), w)) {
+      return 1;
     }
-    // Merge blocks - should only ever merge up to 2 times
-    fo = prevFo;
-    for (fo++; fo != freeO.end() && prevFo->base + prevFo->use == fo->base; ) {
-      if (dbg) logI("  - mergfreeO %zu + %zu with %zu + %zu\n", prevFo->base, prevFo->use, fo->base, fo->use);
-      prevFo->use += fo->use;
-      fo = freeO.erase_after(prevFo);
+    memcpy(vdst, buf.data(), vBytes);
+    if (cache->store(a.cacheKey_, a, vertexSize, buf.data(),
+                     out.vert.size(), out.order.data(), out.order.size())) {
+      logW("write: cache->store failed, continuing without it\n");
     }
-    break;
   }
-  a.state_ = INVALID;
+  p.copyIndices(odst, out.order.data(), out.order.size());
+  return 0;
+}
+
+int Library::allocCached(GeomEntry& e, BaseAsset& a) {
+  size_t nVerts = e.head->verts, nIndices = e.head->indices;
+  VkDeviceSize vBytes = e.vertBytes();
+  if (vBytes + sizeof(indicesType) * nIndices + Scatter::align >
+      pack.avail()) {
+    return 0;  // Stay in state == ADDED. add() checked that it fits.
+  }
+  a.bounds = e.head->bounds;
+  a.lod.assign(e.lod, e.lod + e.head->lods);
+  a.meshlet.assign(e.meshlet, e.meshlet + e.head->meshlets);
+  if (place(a, nVerts, e.order, nIndices)) {
+    return 1;
+  }
+  size_t pi = a.page_;
+  auto& p = *page.at(pi);
+  char* vdst;
+  char* odst;
+  if (dest(2 * pi, vertexSize * a.vblk.base, vBytes, vdst) ||
+      dest(2 * pi + 1, p.indexSize() * a.oblk.base, p.indexSize() * nIndices,
+           odst)) {
+    logE("BUG: allocCached: pack.add failed after pack.avail\n");
+    return 1;
+  }
+  memcpy(vdst, e.vert, vBytes);
+  p.copyIndices(odst, e.order, nIndices);
   return 0;
 }
 
+int Library::writeVerts(VertexLayout layout, size_t vertexSize,
+                        const Bounds& bounds, const Vertex* v, size_t n,
+                        char* dst, const Writer& w) {
+  if (layout == LAYOUT_COMPACT) {
+    encodeCompact(bounds, v, n, reinterpret_cast<CompactVertex*>(dst));
+  }
+  if (w.batch) {
+    if (w.batch(w.userData, v, n, dst)) {
+      logE("write: batchFn failed\n");
+      return 1;
+    }
+    return 0;
+  }
+  if (!w.fn) {
+    return 0;
+  }
+  for (size_t i = 0; i < n; i++, dst += vertexSize) {
+    if (w.fn(w.userData, v[i], dst)) {
+      logE("write: writeFn failed\n");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int Library::Stream::next(Scatter& pack, Chunk& c) {
+  c.v = v;
+  c.o = o;
+  c.nv = std::min(out.vert.size() - v, (size_t)(pack.avail() / vertexSize));
+  c.no = 0;
+  if (c.nv) {
+    if (pack.add(2 * page, vertexSize * (vbase + v), vertexSize * c.nv,
+                 c.vsrc)) {
+      logE("BUG: Stream::next: pack.add(v) failed after pack.avail\n");
+      return 1;
+    }
+    v += c.nv;
+  }
+  if (v < out.vert.size()) {
+    return 0;
+  }
+  c.no = std::min(out.order.size() - o, (size_t)(pack.avail() / indexSize));
+  if (c.no) {
+    if (pack.add(2 * page + 1, indexSize * (obase + o), indexSize * c.no,
+                 c.osrc)) {
+      logE("BUG: Stream::next: pack.add(o) failed after pack.avail\n");
+      return 1;
+    }
+    o += c.no;
+  }
+  return 0;
+}
+
+int Library::streamChunk(const Writer& w) {
+  VertexIndex& out = stream.out;
+  Stream::Chunk c;
+  if (stream.next(pack, c)) {
+    return 1;
+  }
+  if (c.nv && writeVerts(*stream.asset, &out.vert.at(c.v), c.nv,
+                         uploadMmap + c.vsrc, w)) {
+    return 1;
+  }
+  if (c.no) {
+    page.at(stream.page)->copyIndices(uploadMmap + c.osrc, &out.order.at(c.o),
+                                      c.no);
+  }
+  if (dbg) logI("streamChunk v%zu/%zu o%zu/%zu\n", stream.v,
+                out.vert.size(), stream.o, out.order.size());
+  if (!stream.done()) {
+    return 0;
+  }
+  // The last chunk is in upload. The asset becomes READY after this write().
+  stream.asset = nullptr;
+  out.vert.clear();
+  out.vert.shrink_to_fit();
+  out.order.clear();
+  out.order.shrink_to_fit();
+  return 0;
+}
+
+int Library::free(BaseAsset& a) {
+  if (dbg) logI("free v%zu + %zu o%zu + %zu\n", a.vblk.base, a.vblk.use,
+                a.oblk.base, a.oblk.use);
+  if (a.page_ >= page.size()) {
+    logE("BUG: free: page %u of %zu\n", a.page_, page.size());
+    return 1;
+  }
+  auto& p = *page.at(a.page_);
+  if (p.free(a.vblk, a.oblk) || p.free(a.vspare, a.ospare)) {
+    return 1;
+  }
+  return 0;
+}
+
+// checkVertices confirms toVertices generated something.
+static int checkVertices(const VertexIndex& out) {
+  if (out.vert.size() < 1) {
+    // No asset is allowed to only produce indices.
+    logE("write: toVertices did not generate vertices\n");
+    return 1;
+  }
+  if (out.order.size() < 1) {
+    logE("write: toVertices did not generate indices\n");
+    return 1;
+  }
+  return 0;
+}
+
+int Library::writeUpdate(VertexIndex& out, BaseAsset& a, const Writer& w) {
+  auto& p = *page.at(a.page_);
+  size_t indexSize = p.indexSize();
+  // Do not regenerate the asset if it will probably not fit in upload.
+  VkDeviceSize need = vertexSize * a.vblk.use + indexSize * a.oblk.use;
+  if (need + Scatter::align > pack.avail() &&
+      need + Scatter::align <= pack.getCapacity()) {
+    return 0;
+  }
+
+  // toOptimizedVertices sets bounds, lod and meshlet. They must describe
+  // vblk and oblk until swapSpare, so save them.
+  a.nextBounds_ = a.bounds;
+  a.nextLod_.swap(a.lod);
+  a.nextMeshlet_.swap(a.meshlet);
+  out.vert.clear();
+  out.order.clear();
+  if (a.toOptimizedVertices(out) || checkVertices(out)) {
+    logE("update: toVertices failed\n");
+    return 1;
+  }
+  std::swap(a.bounds, a.nextBounds_);
+  a.nextLod_.swap(a.lod);
+  a.nextMeshlet_.swap(a.meshlet);
+  if (out.vert.size() > maxVertices16 &&
+      p.indexType != VK_INDEX_TYPE_UINT32) {
+    logE("update: %zu verts need 32-bit indices. Use del() and add().\n",
+         out.vert.size());
+    return 1;
+  }
+  VkDeviceSize vBytes = vertexSize * out.vert.size();
+  VkDeviceSize oBytes = indexSize * out.order.size();
+  if (vBytes + oBytes + Scatter::align > pack.avail()) {
+    if (vBytes + oBytes + Scatter::align > pack.getCapacity()) {
+      logE("update: %zu verts do not fit in upload. Use del() and add().\n",
+           out.vert.size());
+      return 1;
+    }
+    return 0;  // Try again in the next write().
+  }
+
+  // Reuse the spare unless the asset grew.
+  if (p.reuse(out.vert.size(), out.order.size(), a.vspare, a.ospare)) {
+    logOutOfMemory("vertexBuf", p.vAlloc, out.vert.size(), "verts");
+    logOutOfMemory("indexBuf", p.oAlloc, out.order.size(), "indices");
+    logE("update: page %u is full. Use del() and add().\n", a.page_);
+    return 1;
+  }
+  if (dbg) logI("update page[%u] v%zu + %zu o%zu + %zu\n", a.page_,
+                a.vspare.base, a.vspare.use, a.ospare.base, a.ospare.use);
+
+  char* vdst;
+  char* odst;
+  if (dest(2 * a.page_, vertexSize * a.vspare.base, vBytes, vdst) ||
+      dest(2 * a.page_ + 1, indexSize * a.ospare.base, oBytes, odst)) {
+    logE("BUG: update: pack.add failed after pack.avail\n");
+    return 1;
+  }
+  // writeVerts needs the new bounds.
+  std::swap(a.bounds, a.nextBounds_);
+  int r = writeVerts(a, out.vert.data(), out.vert.size(), vdst, w);
+  std::swap(a.bounds, a.nextBounds_);
+  if (r) {
+    return 1;
+  }
+  p.copyIndices(odst, out.order.data(), out.order.size());
+  p.setOrder(a.ospare.base, out.order.data(), out.order.size());
+  a.updQueued_ = false;
+  a.updUploading_ = true;
+  return 0;
+}
+
+void Library::swapSpare(BaseAsset& a) {
+  std::swap(a.vblk, a.vspare);
+  std::swap(a.oblk, a.ospare);
+  std::swap(a.bounds, a.nextBounds_);
+  a.lod.swap(a.nextLod_);
+  a.meshlet.swap(a.nextMeshlet_);
+  a.inst.cmd.indexCount = a.lod.empty() ? a.oblk.use : a.lod[0].indexCount;
+  a.inst.cmd.firstIndex = a.oblk.base;
+  a.inst.cmd.vertexOffset = a.vblk.base;
+  // Frames before this one may still draw the old block.
+  a.spareFrame = uglue.frameNumber;
+}
+
 int Library::write(command::SubmitInfo& info, VertexWriteFn writeFn,
                    void* userData) {
+  if (!writeFn && layout != LAYOUT_COMPACT) {
+    logE("write: writeFn is null\n");
+    return 1;
+  }
+  return writeWith(info, Writer{writeFn, nullptr, userData});
+}
+
+int Library::writeBatch(command::SubmitInfo& info, VertexBatchFn batchFn,
+                        void* userData) {
+  if (!batchFn && layout != LAYOUT_COMPACT) {
+    logE("writeBatch: batchFn is null\n");
+    return 1;
+  }
+  return writeWith(info, Writer{nullptr, batchFn, userData});
+}
+
+int Library::allocAdded(VertexIndex& out, BaseAsset& a, const Writer& w) {
+  auto hit = cached.find(&a);
+  if (hit != cached.end()) {
+    if (allocCached(*hit->second, a)) {
+      logE("write: allocCached failed\n");
+      return 1;
+    }
+    if (a.state() != ADDED) {  // Unless upload is full.
+      cached.erase(hit);
+    }
+    return 0;
+  }
+  out.vert.clear();
+  out.order.clear();
+  if (a.toOptimizedVertices(out) || checkVertices(out)) {
+    logE("write: toVertices failed\n");
+    return 1;
+  }
+  if (alloc(out, a, w)) {
+    logE("write: alloc failed\n");
+    return 1;
+  }
+  return 0;
+}
+
+int Library::writeWith(command::SubmitInfo& info, const Writer& w) {
+  now = uglue.frameNumber;
+  swapImages = uglue.shaders.dev.framebufs.size();
+  framesInFlight = uglue.framesInFlight;
   if (vFence) {
-    // vFlight or iFlight still in progress.
+    // uploadCmd still in progress.
+    if (!isDone(flightFrameNumber)) {
+      // The frame that did the copy may still be in flight.
+      return 0;
+    }
 #ifdef INTERNAL_SUBMIT_AND_FENCE
     VkResult v = vFence->getStatus();
     if (v != VK_SUCCESS) {
@@ -250,165 +655,120 @@ int Library::write(command::SubmitInfo& info, VertexWriteFn writeFn,
       return 1;
     }
     vFence.reset();
-    vFlight.reset();
-    iFlight.reset();
-    for (auto i = child.begin(); i != child.end(); i++) {
-      if (!*i) {
-        logE("vFlight or iFlight: found null asset in set\n");
-        return 1;
-      }
-      auto& a = **i;
-      if (a.state() == ADD_WAIT) {
-        a.state_ = READY;
-      }
-    }
+    // stream.asset is still waiting for more chunks.
+    uploadDone(stream.asset, [this](BaseAsset& a) { swapSpare(a); });
   }
 
-  size_t firstV{0}, firstO{0};
-  VertexIndex batch;
+  // Every asset that fits in upload is packed into it, wherever it is in
+  // any page. Once upload is full, the rest wait for the next write().
+  // If direct, there is no upload and everything is written now.
+  pack.reset(direct ? directCapacity : upload.info.size,
+             2 * page.size() /*vertexBuf and indexBuf*/);
+  if (stream.asset && streamChunk(w)) {
+    logE("write: streamChunk failed\n");
+    return 1;
+  }
+  if (retire([this](BaseAsset& a) { return free(a); })) {
+    return 1;
+  }
   VertexIndex out;
-  for (auto i = child.begin(); i != child.end(); ) {
-    if (!*i) {
-      logE("write: found null asset in set\n");
-      return 1;
-    }
-    auto fbSize = uglue.shaders.dev.framebufs.size();
-    auto& a = **i;
-    if (a.state() == ADDED) {
-      out.vert.clear();
-      out.order.clear();
-      if (a.toVertices(out)) {
-        logE("write: toVertices failed\n");
-        return 1;
-      }
-      if (out.vert.size() < 1) {
-        // No asset is allowed to only produce indices. Also assets only get
-        // toVertices() called once. There is not "update in place" of an
-        // asset.
-        logE("write: toVertices did not generate vertices\n");
+  if (takeAdded([&](BaseAsset& a) { return allocAdded(out, a, w); })) {
+    return 1;
+  }
+  if (gen) {
+    // Take finished assets in the order they were added. Stop at the first
+    // one that is not done, or that does not fit in upload.
+    for (GenPool::Job* j; (j = gen->peek()) != nullptr; gen->pop()) {
+      auto& a = *j->asset;
+      if (a.state() != ADDED) {
+        logE("BUG: write: gen asset state=%d\n", (int)a.state());
         return 1;
       }
-      if (out.order.size() < 1) {
-        logE("write: toVertices did not generate indices\n");
+      if (j->result || checkVertices(j->out)) {
+        logE("write: toVertices failed\n");
         return 1;
       }
-      if (alloc(firstV, firstO, batch, out, a)) {
+      if (alloc(j->out, a, w)) {
         logE("write: alloc failed\n");
         return 1;
       }
-    } else if (a.state() == DELETED) {
-      a.inst.cmd.indexCount = 0;  // First tell the GPU to stop drawing it.
-      a.state_ = DEL_WAIT;
-      a.frameNumber = uglue.frameNumber;
-    } else if (a.state() == DEL_WAIT &&
-               // If all in-flight GPU frames have stopped drawing
-               uglue.frameNumber >= a.frameNumber + fbSize - 1) {
-      if (free(a)) {  // Now it is safe to free the vertices
-        logE("write: free failed\n");
-        return 1;
+      if (a.state() == ADDED) {
+        break;
       }
-      i = child.erase(i);
-      continue;  // Do not perform i++ below
+      uploading.emplace_back(&a);
     }
-    i++;
-  }
-  if (batch.vert.empty()) {
-    return 0;
   }
-
-  if (uglue.stage.mmap(vertexBuf, vertexSize * firstV,
-                       vertexSize * batch.vert.size(), vFlight)) {
-    logE("write: stage.mmap(vertexBuf) failed\n");
+  if (takeUpdates([&](BaseAsset& a) { return writeUpdate(out, a, w); })) {
     return 1;
   }
-  char* dst = reinterpret_cast<char*>(vFlight->mmap());
-  if (!dst) {
-    logE("write: vFlight->mmap failed\n");
-    return 1;
-  }
-  for (size_t i = 0; i < batch.vert.size(); i++, dst += vertexSize) {
-    if (writeFn(userData, batch.vert.at(i), dst)) {
-      logE("write: writeFn failed\n");
-      return 1;
-    }
-  }
-
-  if (firstO + batch.order.size() > order.size()) {
-    order.resize(firstO + batch.order.size());
-    if (order.size() > maxIndices) {
-      logE("BUG: order.size = %zu maxIndices = %zu\n", order.size(),
-           maxIndices);
-      return 1;
-    }
-  }
-  memcpy(&order.at(firstO), batch.order.data(),
-         sizeof(indicesType) * batch.order.size());
-  if (uglue.stage.mmap(indexBuf, sizeof(indicesType) * firstO,
-                       sizeof(indicesType) * batch.order.size(), iFlight)) {
-    logE("write: stage.mmap(indexBuf) failed\n");
-    return 1;
+  if (pack.empty()) {
+    return 0;
   }
-  auto* idst = reinterpret_cast<indicesType*>(iFlight->mmap());
-  if (!idst) {
-    logE("write: iFlight->mmap failed\n");
-    return 1;
+  if (dbg) logI("write: %zu bytes in %zu regions\n", (size_t)pack.getUsed(),
+                pack.regionCount());
+  if (direct) {
+    return finishDirect();
   }
-  memcpy(idst, &order.at(firstO), sizeof(indicesType) * batch.order.size());
 
   vFence = uglue.stage.pool.borrowFence();
   if (!vFence) {
     logE("write: uglue.stage.pool.borrowFence failed\n");
     return 1;
   }
-  if (uglue.stage.flushButNotSubmit(vFlight)) {
-    logE("write: uglue.stage.flushflushButNotSubmit(vFlight) failed\n");
-    (void)uglue.stage.pool.unborrowFence(vFence);
-    vFence.reset();
-    return 1;
+  command::CommandPool::lock_guard_t lock(uglue.stage.pool.lockmutex);
+  bool fail = uploadCmd.reset() || uploadCmd.beginOneTimeUse();
+  for (size_t pi = 0; !fail && pi < page.size(); pi++) {
+    auto& p = *page.at(pi);
+    auto& vr = pack.region.at(2 * pi);
+    auto& ir = pack.region.at(2 * pi + 1);
+    fail = (!vr.empty() &&
+            uploadCmd.copyBuffer(upload.vk, p.vertexBuf.vk, vr)) ||
+           (!ir.empty() && uploadCmd.copyBuffer(upload.vk, p.indexBuf.vk, ir));
   }
-  if (uglue.stage.flushButNotSubmit(iFlight)) {
-    logE("write: uglue.stage.flushflushButNotSubmit(iFlight) failed\n");
+  if (fail || uploadCmd.end() || uploadCmd.enqueue(lock, info)) {
+    logE("write: uploadCmd failed\n");
     (void)uglue.stage.pool.unborrowFence(vFence);
     vFence.reset();
     return 1;
   }
-  if (vFlight->canSubmit() || iFlight->canSubmit()) {
-    command::CommandPool::lock_guard_t lock(uglue.stage.pool.lockmutex);
-    if (vFlight->canSubmit()) {
-      if (vFlight->end() || vFlight->enqueue(lock, info)) {
-        logE("write: vFlight end or enqueue failed\n");
-        return 1;
-      }
-    }
-    if (iFlight->canSubmit()) {
-      if (iFlight->end() || iFlight->enqueue(lock, info)) {
-        logE("write: iFlight end or enqueue failed\n");
-        return 1;
-      }
-    }
 #ifdef INTERNAL_SUBMIT_AND_FENCE
-    if (uglue.stage.pool.submit(lock, uglue.stage.poolQindex, {info},
-                                vFence->vk)) {
-      logE("write: submit failed\n");
-      return 1;
-    }
+  if (uglue.stage.pool.submit(lock, uglue.stage.poolQindex, {info},
+                              vFence->vk)) {
+    logE("write: submit failed\n");
+    return 1;
+  }
 #endif /*INTERNAL_SUBMIT_AND_FENCE*/
 
-    // vFence, vFlight, and iFlight are in progress until the next write().
-    return 0;
-  }
+  // vFence and uploadCmd are in progress until the frame is done.
+  flightFrameNumber = uglue.frameNumber;
+  return 0;
+}
 
-  if (uglue.stage.pool.unborrowFence(vFence)) {
-    logE("write: did not need it, uglue.stage.pool.unborrowFence failed\n");
-    return 1;
+int Library::finishDirect() {
+  for (size_t pi = 0; pi < page.size(); pi++) {
+    auto& p = *page.at(pi);
+    if ((!pack.region.at(2 * pi).empty() && flushDirect(p.vertexBuf)) ||
+        (!pack.region.at(2 * pi + 1).empty() && flushDirect(p.indexBuf))) {
+      logE("write: page[%zu] flush failed\n", pi);
+      return 1;
+    }
   }
-  vFence.reset();
-  vFlight.reset();
-  iFlight.reset();
+  // vkQueueSubmit makes host writes visible to the GPU, so the next frame
+  // can draw them.
+  uploadDone(nullptr, [this](BaseAsset& a) { swapSpare(a); });
   return 0;
 }
 
-int Library::add(std::shared_ptr<BaseAsset> asset) {
+int Library::hashFor(const BaseAsset& a, size_t vertexSize,
+                     VertexLayout layout, uint64_t cacheLayout, Hasher& h) {
+  h.add(GeomCache::version);
+  h.add(vertexSize);
+  h.add(layout);
+  h.add(cacheLayout);
+  return a.hash(h);
+}
+
+int AssetQueue::addChild(std::shared_ptr<BaseAsset> asset) {
   if (!asset) {
     logE("Library:add(null) invalid asset\n");
     return 1;
@@ -420,10 +780,79 @@ int Library::add(std::shared_ptr<BaseAsset> asset) {
   }
   // set state to ADDED, then write() will update the vertex and index bufs.
   asset->state_ = ADDED;
+  asset->cacheKey_ = 0;
+  return 0;
+}
+
+int Library::add(std::shared_ptr<BaseAsset> asset) {
+  if (addChild(asset)) {
+    return 1;
+  }
+  Hasher h;
+  if (cache && !hashFor(*asset, h)) {
+    auto e = cache->find(h.h, vertexSize);
+    // A hit is not streamed, so it must fit in upload.
+    size_t need = e ? e->vertBytes() + Scatter::align +
+                          sizeof(indicesType) * e->head->indices
+                    : 0;
+    if (e && (direct || need <= uploadSize)) {
+      cached[asset.get()] = e;
+      addQ.emplace_back(asset);
+      return 0;
+    }
+    asset->cacheKey_ = h.h;
+  }
+  if (gen) {
+    gen->push(asset);
+  } else {
+    addQ.emplace_back(asset);
+  }
   return 0;
 }
 
-int Library::del(std::shared_ptr<BaseAsset> asset) {
+int AssetQueue::update(std::shared_ptr<BaseAsset> asset) {
+  if (!asset) {
+    logE("Library::update(null) invalid asset\n");
+    return 1;
+  }
+  if (!child.count(asset)) {
+    logE("Library::update(): asset not found\n");
+    return 1;
+  }
+  if (asset->state() != READY) {
+    logE("Library::update(): state=%d not READY(%d) - cannot update\n",
+         (int)asset->state(), (int)READY);
+    return 1;
+  }
+  if (!asset->updQueued_) {
+    asset->updQueued_ = true;
+    updQ.emplace_back(asset);
+  }
+  return 0;
+}
+
+int Library::setWorkers(size_t n) {
+  if (!addQ.empty() || genBusy()) {
+    logE("Library::setWorkers: cannot change while assets are ADDED\n");
+    return 1;
+  }
+  if (!n) {
+    gen.reset();
+    return 0;
+  }
+  if (!gen) {
+    gen = std::make_shared<GenPool>();
+  }
+  if (gen->start(n)) {
+    logE("Library::setWorkers: start(%zu) failed\n", n);
+    return 1;
+  }
+  return 0;
+}
+
+bool Library::genBusy() { return gen && gen->busy(); }
+
+int AssetQueue::del(std::shared_ptr<BaseAsset> asset) {
   if (!asset) {
     logE("Library:del(null) invalid asset\n");
     return 1;
@@ -443,6 +872,7 @@ int Library::del(std::shared_ptr<BaseAsset> asset) {
     return 1;
   }
   (*r)->state_ = DELETED;
+  delQ.emplace_back(*r);
   return 0;
 }
 
@@ -0,0 +1,161 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#endif
+#include "meshlet.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+namespace asset {
+
+bool Meshlet::backfacing(glm::vec3 eye) const {
+  if (coneCos <= 0.f) {
+    return false;
+  }
+  glm::vec3 d = center - eye;
+  float dist = glm::length(d);
+  if (dist <= radius) {
+    return false;
+  }
+  // Every tri faces away if the angle from the view direction to coneAxis,
+  // plus the cone's half angle, plus the angle the sphere covers, is less
+  // than 90 degrees.
+  float sinCone = sqrtf(1.f - coneCos * coneCos);
+  float sinSphere = radius / dist;
+  float cosSphere = sqrtf(1.f - sinSphere * sinSphere);
+  if (coneCos * cosSphere - sinCone * sinSphere <= 0.f) {
+    return false;  // cone + sphere is already 90 degrees or more.
+  }
+  float cosView = glm::dot(d, coneAxis) / dist;
+  return cosView > sinCone * cosSphere + coneCos * sinSphere;
+}
+
+// finishMeshlet computes the bounding sphere and normal cone of m.
+static void finishMeshlet(const VertexIndex& out,
+                          const std::vector<indicesType>& order,
+                          const std::vector<indicesType>& mverts,
+                          Meshlet& m) {
+  glm::vec3 lo = out.vert[mverts[0]].P, hi = lo;
+  for (auto v : mverts) {
+    lo = glm::min(lo, out.vert[v].P);
+    hi = glm::max(hi, out.vert[v].P);
+  }
+  m.center = (lo + hi) * .5f;
+  m.radius = 0.f;
+  for (auto v : mverts) {
+    m.radius = std::max(m.radius, glm::length(out.vert[v].P - m.center));
+  }
+
+  // Use the same face normal as BaseAsset::doTri.
+  glm::vec3 sum(0.f);
+  size_t end = m.firstIndex + m.indexCount;
+  for (size_t i = m.firstIndex; i < end; i += 3) {
+    auto& a = out.vert[order[i]].P;
+    auto& b = out.vert[order[i + 1]].P;
+    auto& c = out.vert[order[i + 2]].P;
+    glm::vec3 N = glm::cross(b - a, c - b);
+    float len = glm::length(N);
+    if (len > 0.f) {
+      sum += N / len;
+    }
+  }
+  float len = glm::length(sum);
+  m.coneCos = -1.f;
+  if (len < 1e-6f) {
+    return;
+  }
+  m.coneAxis = sum / len;
+  float minDot = 1.f;
+  for (size_t i = m.firstIndex; i < end; i += 3) {
+    auto& a = out.vert[order[i]].P;
+    auto& b = out.vert[order[i + 1]].P;
+    auto& c = out.vert[order[i + 2]].P;
+    glm::vec3 N = glm::cross(b - a, c - b);
+    float nlen = glm::length(N);
+    if (nlen > 0.f) {
+      minDot = std::min(minDot, glm::dot(N / nlen, m.coneAxis));
+    }
+  }
+  if (minDot > 0.f) {
+    m.coneCos = minDot;
+  }
+}
+
+int buildMeshlets(const VertexIndex& out, std::vector<Meshlet>& meshlet,
+                  size_t maxVerts, size_t maxTris, MeshletStats* stats) {
+  meshlet.clear();
+  if (maxVerts < 3 || !maxTris) {
+    logE("buildMeshlets: maxVerts=%zu maxTris=%zu\n", maxVerts, maxTris);
+    return 1;
+  }
+  if (out.order.size() % 3) {
+    logE("buildMeshlets: %zu indices is not a whole number of tris\n",
+         out.order.size());
+    return 1;
+  }
+  const auto& order = out.order;
+  size_t nVerts = out.vert.size();
+  for (auto i : order) {
+    if (i >= nVerts) {
+      logE("buildMeshlets: index %zu out of range (%zu verts)\n", (size_t)i,
+           nVerts);
+      return 1;
+    }
+  }
+  // mark[v] is the number of the meshlet v was last added to, plus 1.
+  std::vector<uint32_t> mark(nVerts, 0);
+  std::vector<indicesType> mverts;
+  auto finish = [&](size_t end) {
+    Meshlet& m = meshlet.back();
+    m.indexCount = end - m.firstIndex;
+    m.vertexCount = mverts.size();
+    finishMeshlet(out, order, mverts, m);
+  };
+  for (size_t i = 0; i < order.size(); i += 3) {
+    uint32_t cur = meshlet.size();
+    size_t n = (mark[order[i]] != cur) + (mark[order[i + 1]] != cur) +
+               (mark[order[i + 2]] != cur);
+    if (meshlet.empty() || mverts.size() + n > maxVerts ||
+        i - meshlet.back().firstIndex >= maxTris * 3) {
+      if (!meshlet.empty()) {
+        finish(i);
+      }
+      meshlet.emplace_back();
+      meshlet.back().firstIndex = i;
+      mverts.clear();
+      cur++;
+    }
+    for (size_t j = 0; j < 3; j++) {
+      if (mark[order[i + j]] != cur) {
+        mark[order[i + j]] = cur;
+        mverts.emplace_back(order[i + j]);
+      }
+    }
+  }
+  if (!meshlet.empty()) {
+    finish(order.size());
+  }
+
+  if (stats) {
+    stats->meshlets = meshlet.size();
+    stats->vertFill = 0.f;
+    stats->triFill = 0.f;
+    for (auto& m : meshlet) {
+      stats->vertFill += float(m.vertexCount) / maxVerts;
+      stats->triFill += float(m.indexCount / 3) / maxTris;
+    }
+    if (!meshlet.empty()) {
+      stats->vertFill /= meshlet.size();
+      stats->triFill /= meshlet.size();
+    }
+  }
+  return 0;
+}
+
+}  // namespace asset
@@ -0,0 +1,22 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#include "asset.h"
+
+#pragma once
+
+namespace asset {
+
+// buildMeshlets splits out.order into meshlets of at most maxVerts unique
+// vertices and maxTris tris. Each meshlet is a contiguous range of out.order.
+//
+// The tris are not reordered: a new meshlet starts when the next tri does not
+// fit. Run optimizeCache first, since it keeps the tris that share vertices
+// together, which fills the meshlets and keeps them compact.
+WARN_UNUSED_RESULT int buildMeshlets(const VertexIndex& out,
+                                     std::vector<Meshlet>& meshlet,
+                                     size_t maxVerts = 64,
+                                     size_t maxTris = 124,
+                                     MeshletStats* stats = nullptr);
+
+}  // namespace asset
@@ -0,0 +1,370 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#endif
+#include "meshopt.h"
+#include "meshlet.h"
+
+#include <algorithm>
+
+namespace asset {
+
+constexpr size_t CacheStats::size;
+
+static constexpr size_t none = ~size_t(0);
+
+void triAdjacency(const std::vector<indicesType>& order, size_t nVerts,
+                  std::vector<uint32_t>& offset, std::vector<uint32_t>& adj) {
+  offset.assign(nVerts + 1, 0);
+  for (auto i : order) {
+    offset[i + 1]++;
+  }
+  for (size_t v = 0; v < nVerts; v++) {
+    offset[v + 1] += offset[v];
+  }
+  adj.resize(order.size());
+  std::vector<uint32_t> fill(offset.begin(), offset.end() - 1);
+  for (size_t i = 0; i < order.size(); i++) {
+    adj[fill[order[i]]++] = i / 3;
+  }
+}
+
+void analyzeCache(const std::vector<indicesType>& order, size_t nVerts,
+                  CacheStats& stats, size_t cacheSize) {
+  // stamp is the value of stats.misses just after the vertex was put in the
+  // cache, or 0 if it never was. With a FIFO, a vertex is still in the cache
+  // if fewer than cacheSize misses happened since then.
+  std::vector<size_t> stamp(nVerts, 0);
+  stats.misses = 0;
+  for (auto i : order) {
+    if (i >= stamp.size()) {
+      stamp.resize(i + 1, 0);
+    }
+    if (!stamp[i] || stats.misses - stamp[i] >= cacheSize) {
+      stats.misses++;
+      stamp[i] = stats.misses;
+    }
+  }
+  size_t tris = order.size() / 3;
+  stats.acmr = tris ? float(stats.misses) / tris : 0.f;
+  stats.atvr = nVerts ? float(stats.misses) / nVerts : 0.f;
+}
+
+// checkOrder confirms 'out' is a valid triangle list.
+static int checkOrder(const char* why, const VertexIndex& out) {
+  if (out.order.size() % 3) {
+    logE("%s: %zu indices is not a whole number of tris\n", why,
+         out.order.size());
+    return 1;
+  }
+  for (auto i : out.order) {
+    if (i >= out.vert.size()) {
+      logE("%s: index %zu out of range (%zu verts)\n", why, (size_t)i,
+           out.vert.size());
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int optimizeCache(VertexIndex& out, std::vector<size_t>* cluster,
+                  size_t cacheSize) {
+  if (checkOrder("optimizeCache", out)) {
+    return 1;
+  }
+  if (cluster) {
+    cluster->clear();
+  }
+  const auto& order = out.order;
+  size_t nVerts = out.vert.size();
+  size_t nTris = order.size() / 3;
+  if (!nTris) {
+    return 0;
+  }
+
+  std::vector<uint32_t> offset, adj;
+  triAdjacency(order, nVerts, offset, adj);
+  // live is the number of tris not yet emitted that use each vertex.
+  std::vector<uint32_t> live(nVerts);
+  for (size_t v = 0; v < nVerts; v++) {
+    live[v] = offset[v + 1] - offset[v];
+  }
+
+  // stamp is when each vertex entered the cache. s is the clock.
+  std::vector<size_t> stamp(nVerts, 0);
+  size_t s = cacheSize + 1;
+  std::vector<char> emitted(nTris, 0);
+  // deadEnd is a stack of recently used vertices to go back to if no vertex
+  // in the cache has any tris left.
+  std::vector<indicesType> deadEnd;
+  deadEnd.reserve(order.size());
+  std::vector<indicesType> cand;
+  std::vector<indicesType> result;
+  result.reserve(order.size());
+  size_t cursor = 0;
+  bool newCluster = true;
+  for (size_t f = order[0]; f != none;) {
+    // Emit all the tris that use f (the "fan" around f).
+    cand.clear();
+    for (uint32_t k = offset[f]; k < offset[f + 1]; k++) {
+      uint32_t t = adj[k];
+      if (emitted[t]) {
+        continue;
+      }
+      if (newCluster) {
+        if (cluster) {
+          cluster->emplace_back(result.size());
+        }
+        newCluster = false;
+      }
+      for (size_t j = 0; j < 3; j++) {
+        indicesType v = order[t * 3 + j];
+        result.emplace_back(v);
+        deadEnd.emplace_back(v);
+        cand.emplace_back(v);
+        live[v]--;
+        if (s - stamp[v] > cacheSize) {
+          stamp[v] = s++;
+        }
+      }
+      emitted[t] = 1;
+    }
+
+    // Pick the next f: the vertex that has been in the cache the longest, if
+    // all its tris can be emitted before it leaves the cache.
+    f = none;
+    long best = -1;
+    for (auto v : cand) {
+      if (!live[v]) {
+        continue;
+      }
+      long p = 0;
+      if (s - stamp[v] + 2 * live[v] <= cacheSize) {
+        p = long(s - stamp[v]);
+      }
+      if (p > best) {
+        best = p;
+        f = v;
+      }
+    }
+    if (f != none) {
+      continue;
+    }
+    // Dead end. Go back to a recent vertex, or else find any vertex with
+    // tris left.
+    newCluster = true;
+    while (!deadEnd.empty() && f == none) {
+      indicesType d = deadEnd.back();
+      deadEnd.pop_back();
+      if (live[d]) {
+        f = d;
+      }
+    }
+    for (; f == none && cursor < nVerts; cursor++) {
+      if (live[cursor]) {
+        f = cursor;
+      }
+    }
+  }
+  if (result.size() != order.size()) {
+    logE("BUG: optimizeCache: %zu indices, want %zu\n", result.size(),
+         order.size());
+    return 1;
+  }
+  out.order.swap(result);
+  return 0;
+}
+
+int optimizeOverdraw(VertexIndex& out, const std::vector<size_t>& cluster,
+                     float threshold) {
+  if (checkOrder("optimizeOverdraw", out)) {
+    return 1;
+  }
+  if (cluster.size() < 2) {
+    return 0;
+  }
+  typedef struct Cluster {
+    size_t start, end;
+    glm::vec3 center;  // area-weighted sum of tri centers.
+    glm::vec3 N;       // sum of tri normals, weighted by area.
+    float area;
+    float key;
+  } Cluster;
+  std::vector<Cluster> c(cluster.size());
+  glm::vec3 meshCenter(0.f);
+  float meshArea = 0.f;
+  for (size_t i = 0; i < c.size(); i++) {
+    c[i].start = cluster[i];
+    c[i].end = (i + 1 < c.size()) ? cluster[i + 1] : out.order.size();
+    if (c[i].start >= c[i].end || c[i].start % 3 || c[i].end % 3) {
+      logE("optimizeOverdraw: invalid cluster[%zu] %zu - %zu\n", i,
+           c[i].start, c[i].end);
+      return 1;
+    }
+    c[i].center = glm::vec3(0.f);
+    c[i].N = glm::vec3(0.f);
+    c[i].area = 0.f;
+    for (size_t j = c[i].start; j < c[i].end; j += 3) {
+      auto& a = out.vert[out.order[j]].P;
+      auto& b = out.vert[out.order[j + 1]].P;
+      auto& d = out.vert[out.order[j + 2]].P;
+      glm::vec3 N = glm::cross(b - a, d - a);
+      float area = glm::length(N);
+      c[i].center += (a + b + d) * (area / 3.f);
+      c[i].N += N;
+      c[i].area += area;
+    }
+    meshCenter += c[i].center;
+    meshArea += c[i].area;
+  }
+  if (meshArea > 0.f) {
+    meshCenter /= meshArea;
+  }
+  for (auto& ci : c) {
+    ci.key = 0.f;
+    float len = glm::length(ci.N);
+    if (ci.area > 0.f && len > 0.f) {
+      ci.key = glm::dot(ci.center / ci.area - meshCenter, ci.N / len);
+    }
+  }
+  // Clusters facing away from the center are most likely to hide others.
+  std::stable_sort(c.begin(), c.end(), [](const Cluster& a, const Cluster& b) {
+    return a.key > b.key;
+  });
+  std::vector<indicesType> result;
+  result.reserve(out.order.size());
+  for (auto& ci : c) {
+    result.insert(result.end(), out.order.begin() + ci.start,
+                  out.order.begin() + ci.end);
+  }
+
+  CacheStats before, after;
+  analyzeCache(out.order, out.vert.size(), before);
+  analyzeCache(result, out.vert.size(), after);
+  if (after.acmr > before.acmr * threshold) {
+    return 0;
+  }
+  out.order.swap(result);
+  return 0;
+}
+
+int optimizeFetch(VertexIndex& out) {
+  if (checkOrder("optimizeFetch", out)) {
+    return 1;
+  }
+  static constexpr indicesType unused = ~indicesType(0);
+  std::vector<indicesType> remap(out.vert.size(), unused);
+  std::vector<Vertex> vert;
+  vert.reserve(out.vert.size());
+  for (auto& i : out.order) {
+    if (remap[i] == unused) {
+      remap[i] = vert.size();
+      vert.emplace_back(out.vert[i]);
+    }
+    i = remap[i];
+  }
+  for (size_t i = 0; i < out.vert.size(); i++) {
+    if (remap[i] == unused) {
+      vert.emplace_back(out.vert[i]);
+    }
+  }
+  out.vert.swap(vert);
+  return 0;
+}
+
+int optimizeMesh(VertexIndex& out, uint32_t flags, OptimizeStats* stats,
+                 std::vector<Meshlet>* meshlet, MeshletStats* meshletStats) {
+  if (stats) {
+    analyzeCache(out.order, out.vert.size(), stats->before);
+  }
+  std::vector<size_t> cluster;
+  bool overdraw = flags & BaseAsset::OPTIMIZE_OVERDRAW;
+  if ((flags & BaseAsset::OPTIMIZE_CACHE) || overdraw) {
+    if (optimizeCache(out, overdraw ? &cluster : nullptr)) {
+      logE("optimizeMesh: optimizeCache failed\n");
+      return 1;
+    }
+  }
+  if (overdraw && optimizeOverdraw(out, cluster)) {
+    logE("optimizeMesh: optimizeOverdraw failed\n");
+    return 1;
+  }
+  if (flags & BaseAsset::OPTIMIZE_MESHLETS) {
+    if (!meshlet) {
+      logE("optimizeMesh: OPTIMIZE_MESHLETS with meshlet == nullptr\n");
+      return 1;
+    }
+    if (buildMeshlets(out, *meshlet, 64, 124, meshletStats)) {
+      logE("optimizeMesh: buildMeshlets failed\n");
+      return 1;
+    }
+  }
+  if ((flags & BaseAsset::OPTIMIZE_FETCH) && optimizeFetch(out)) {
+    logE("optimizeMesh: optimizeFetch failed\n");
+    return 1;
+  }
+  if (stats) {
+    analyzeCache(out.order, out.vert.size(), stats->after);
+  }
+  return 0;
+}
+
+int BaseAsset::toOptimizedVertices(VertexIndex& out) {
+  if (!lods) {
+    logE("toOptimizedVertices: lods must be at least 1\n");
+    return 1;
+  }
+  if (toVertices(out)) {
+    return 1;
+  }
+  bounds.set(out.vert);
+  if (!(optimize & OPTIMIZE_MESHLETS)) {
+    meshlet.clear();
+    meshletStats = MeshletStats();
+  }
+  if (optimize &&
+      optimizeMesh(out, optimize, &optStats, &meshlet, &meshletStats)) {
+    return 1;
+  }
+  lod.resize(1);
+  lod[0].firstIndex = 0;
+  lod[0].indexCount = out.order.size();
+  lod[0].error = 0.f;
+
+  // Append each level to out. The levels share inst.cmd.vertexOffset, so
+  // their indices are offset by the vertices before them.
+  VertexIndex l;
+  for (uint32_t level = 1; level < lods; level++) {
+    l.vert.clear();
+    l.order.clear();
+    float error;
+    if (toLodVertices(level, l, error)) {
+      logE("toOptimizedVertices: toLodVertices(%u) failed\n", level);
+      return 1;
+    }
+    if (l.order.size() >= lod.back().indexCount) {
+      break;  // This level is no coarser than the one before it.
+    }
+    if (optimize && optimizeMesh(l, optimize & ~OPTIMIZE_MESHLETS)) {
+      return 1;
+    }
+    lod.emplace_back();
+    lod.back().firstIndex = out.order.size();
+    lod.back().indexCount = l.order.size();
+    // A coarser level can not be more accurate than the one before it.
+    lod.back().error = std::max(error, lod[lod.size() - 2].error);
+    indicesType base = out.vert.size();
+    out.vert.insert(out.vert.end(), l.vert.begin(), l.vert.end());
+    out.order.reserve(out.order.size() + l.order.size());
+    for (auto i : l.order) {
+      out.order.push_back(i + base);
+    }
+  }
+  return 0;
+}
+
+}  // namespace asset
@@ -0,0 +1,53 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#include "asset.h"
+
+#pragma once
+
+namespace asset {
+
+// triAdjacency finds the tris that use each vertex: they are adj[offset[v]]
+// to adj[offset[v + 1] - 1]. Each index in order must be less than nVerts.
+void triAdjacency(const std::vector<indicesType>& order, size_t nVerts,
+                  std::vector<uint32_t>& offset, std::vector<uint32_t>& adj);
+
+// analyzeCache simulates a FIFO post-transform vertex cache of cacheSize
+// entries drawing 'order'. nVerts is the number of vertices 'order' uses.
+void analyzeCache(const std::vector<indicesType>& order, size_t nVerts,
+                  CacheStats& stats, size_t cacheSize = CacheStats::size);
+
+// optimizeCache reorders the triangles in out.order so vertices are reused
+// while they are still in the post-transform cache. It uses the Tipsify
+// algorithm from "Fast Triangle Reordering for Vertex Locality and Reduced
+// Overdraw" (Sander, Nehab, Barczak 2007), which runs in linear time.
+//
+// If 'cluster' is not null, it gets the index in out.order of the first
+// triangle of each cluster: a run of triangles that starts where Tipsify
+// had to jump to a vertex not in the cache.
+WARN_UNUSED_RESULT int optimizeCache(VertexIndex& out,
+                                     std::vector<size_t>* cluster = nullptr,
+                                     size_t cacheSize = CacheStats::size);
+
+// optimizeOverdraw sorts the clusters from optimizeCache so the ones facing
+// outward from the center of the mesh are drawn first. They are the most
+// likely to hide other faces. If that makes ACMR worse by more than
+// 'threshold', out.order is not changed.
+WARN_UNUSED_RESULT int optimizeOverdraw(VertexIndex& out,
+                                        const std::vector<size_t>& cluster,
+                                        float threshold = 1.05f);
+
+// optimizeFetch renumbers the vertices in the order out.order first uses
+// them, so the vertex fetch reads memory mostly in order. Vertices not used
+// by out.order are moved to the end.
+WARN_UNUSED_RESULT int optimizeFetch(VertexIndex& out);
+
+// optimizeMesh runs the stages selected by 'flags' (BaseAsset::OPTIMIZE_*).
+// If stats is not null, it gets the ACMR and ATVR before and after.
+// OPTIMIZE_MESHLETS writes to 'meshlet' and 'meshletStats'.
+WARN_UNUSED_RESULT int optimizeMesh(
+    VertexIndex& out, uint32_t flags, OptimizeStats* stats = nullptr,
+    std::vector<Meshlet>* meshlet = nullptr,
+    MeshletStats* meshletStats = nullptr);
+
+}  // namespace asset
@@ -0,0 +1,355 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#endif
+#include "occlusion.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "simd.h"
+
+namespace asset {
+
+static constexpr int dbg = 0;
+
+constexpr uint32_t Occlusion::tileW;
+constexpr uint32_t Occlusion::tileH;
+
+static_assert(Occlusion::tileW % simd::lanes == 0,
+              "tileW must be a multiple of simd::lanes");
+
+// minW is the smallest clip space w that is treated as in front of the
+// camera.
+static constexpr float minW = 1e-5f;
+
+int Occlusion::ctorError(uint32_t w_, uint32_t h_, size_t nThreads) {
+  if (!w_ || !h_ || w_ % tileW || h_ % tileH) {
+    logE("Occlusion::ctorError(%u, %u): must be a multiple of %u x %u\n", w_,
+         h_, tileW, tileH);
+    return 1;
+  }
+  stop();
+  stopping = false;
+  w = w_;
+  h = h_;
+  hiz.clear();
+  for (uint32_t lw = w, lh = h;; lw = (lw + 1) / 2, lh = (lh + 1) / 2) {
+    hiz.emplace_back(size_t(lw) * lh, 1.f);
+    if (lw == 1 && lh == 1) {
+      break;
+    }
+  }
+  bin.clear();
+  bin.resize(size_t(w / tileW) * (h / tileH));
+  th.reserve(nThreads);
+  for (size_t i = 0; i < nThreads; i++) {
+    th.emplace_back(&Occlusion::worker, this, gen);
+  }
+  return 0;
+}
+
+void Occlusion::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto& t : th) {
+    t.join();
+  }
+  th.clear();
+}
+
+int Occlusion::add(const VertexIndex& mesh, const glm::mat4& model) {
+  if (mesh.order.size() % 3) {
+    logE("Occlusion::add: %zu indices is not a whole number of tris\n",
+         mesh.order.size());
+    return 1;
+  }
+  for (auto i : mesh.order) {
+    if (i >= mesh.vert.size()) {
+      logE("Occlusion::add: index %u out of range (%zu verts)\n", i,
+           mesh.vert.size());
+      return 1;
+    }
+  }
+  uint32_t base = occVert.size();
+  for (auto& v : mesh.vert) {
+    occVert.emplace_back(model * glm::vec4(v.P, 1.f));
+  }
+  for (auto i : mesh.order) {
+    occTri.push_back(base + i);
+  }
+  return 0;
+}
+
+int Occlusion::render(const glm::mat4& viewProj_) {
+  if (hiz.empty()) {
+    logE("Occlusion::render: call ctorError first\n");
+    return 1;
+  }
+  viewProj = viewProj_;
+  stats = OcclusionStats();
+  stats.tris = occTri.size() / 3;
+
+  // Project every vertex to screen space: x and y in pixels, z is depth.
+  std::vector<glm::vec3> s(occVert.size());
+  std::vector<bool> front(occVert.size());
+  for (size_t i = 0; i < occVert.size(); i++) {
+    glm::vec4 c = viewProj * glm::vec4(occVert[i], 1.f);
+    front[i] = c.w > minW;
+    float inv = 1.f / c.w;
+    s[i] = glm::vec3((c.x * inv * .5f + .5f) * w, (c.y * inv * .5f + .5f) * h,
+                     c.z * inv);
+  }
+
+  tri.clear();
+  for (auto& b : bin) {
+    b.clear();
+  }
+  const uint32_t tilesX = w / tileW;
+  for (size_t t = 0; t < occTri.size(); t += 3) {
+    const uint32_t* v = &occTri[t];
+    if (!front[v[0]] || !front[v[1]] || !front[v[2]]) {
+      // Clipping would keep part of the tri, but dropping an occluder is
+      // always safe.
+      continue;
+    }
+    const glm::vec3& a = s[v[0]];
+    const glm::vec3& b = s[v[1]];
+    const glm::vec3& c = s[v[2]];
+    if (a.z >= 1.f && b.z >= 1.f && c.z >= 1.f) {
+      continue;  // Beyond the far plane.
+    }
+    float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    if (!(fabsf(area) > 1e-6f)) {
+      continue;
+    }
+    Tri r;
+    r.minX = std::max(0, int(floorf(std::min(a.x, std::min(b.x, c.x)))));
+    r.minY = std::max(0, int(floorf(std::min(a.y, std::min(b.y, c.y)))));
+    r.maxX = std::min(int(w) - 1,
+                      int(ceilf(std::max(a.x, std::max(b.x, c.x)))));
+    r.maxY = std::min(int(h) - 1,
+                      int(ceilf(std::max(a.y, std::max(b.y, c.y)))));
+    if (r.minX > r.maxX || r.minY > r.maxY) {
+      continue;
+    }
+    // Edge i goes from p[i] to p[i + 1]. Divided by area, it is the weight
+    // of the vertex opposite it.
+    const glm::vec3* p[4] = {&a, &b, &c, &a};
+    float zOpposite[3] = {c.z, a.z, b.z};
+    float sign = (area > 0.f) ? 1.f : -1.f;
+    r.zx = r.zy = r.z0 = 0.f;
+    for (int i = 0; i < 3; i++) {
+      const glm::vec3& e0 = *p[i];
+      const glm::vec3& e1 = *p[i + 1];
+      float A = e0.y - e1.y;
+      float B = e1.x - e0.x;
+      // Move C to sample at pixel centers.
+      float C = e0.x * e1.y - e0.y * e1.x + .5f * (A + B);
+      r.zx += A * zOpposite[i] / area;
+      r.zy += B * zOpposite[i] / area;
+      r.z0 += C * zOpposite[i] / area;
+      r.A[i] = A * sign;
+      r.B[i] = B * sign;
+      r.C[i] = C * sign;
+    }
+    uint32_t idx = tri.size();
+    tri.push_back(r);
+    stats.drawn++;
+    for (int ty = r.minY / tileH; ty <= r.maxY / int(tileH); ty++) {
+      for (int tx = r.minX / tileW; tx <= r.maxX / int(tileW); tx++) {
+        bin[ty * tilesX + tx].push_back(idx);
+        stats.binned++;
+      }
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    nextTile = 0;
+    gen++;
+    running = th.size();
+  }
+  wake.notify_all();
+  rasterTiles();
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return !running; });
+  }
+  buildHiz();
+  if (dbg) logI("Occlusion::render: %zu tris, %zu drawn, %zu binned\n",
+                stats.tris, stats.drawn, stats.binned);
+  return 0;
+}
+
+void Occlusion::worker(size_t seenGen) {
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    wake.wait(lock, [&] { return stopping || gen != seenGen; });
+    if (stopping) {
+      return;
+    }
+    seenGen = gen;
+    lock.unlock();
+    rasterTiles();
+    lock.lock();
+    if (!--running) {
+      done.notify_all();
+    }
+  }
+}
+
+void Occlusion::rasterTiles() {
+  for (size_t t = nextTile++; t < bin.size(); t = nextTile++) {
+    rasterTile(t);
+  }
+}
+
+// rasterRect rasterizes the part of a tri in x0 to x1 and y0 to y1 of depth,
+// which has 'stride' floats per row. x0 must be a multiple of simd::lanes.
+static void rasterRect(const float* A, const float* B, const float* C,
+                       float zx, float zy, float z0, int x0, int x1, int y0,
+                       int y1, float* depth, size_t stride) {
+  using namespace simd;
+  const Lanes zero = splat(0.f);
+  Lanes A0 = splat(A[0]), A1 = splat(A[1]), A2 = splat(A[2]);
+  Lanes zdx = splat(zx);
+  for (int y = y0; y <= y1; y++) {
+    float fy = float(y);
+    Lanes e0 = splat(B[0] * fy + C[0]);
+    Lanes e1 = splat(B[1] * fy + C[1]);
+    Lanes e2 = splat(B[2] * fy + C[2]);
+    Lanes zrow = splat(zy * fy + z0);
+    float* row = &depth[size_t(y) * stride];
+    for (int x = x0; x <= x1; x += lanes) {
+      Lanes fx = add(splat(float(x)), iota());
+      Mask in = both(both(greaterEq(add(mul(A0, fx), e0), zero),
+                          greaterEq(add(mul(A1, fx), e1), zero)),
+                     greaterEq(add(mul(A2, fx), e2), zero));
+      if (!bits(in)) {
+        continue;
+      }
+      Lanes d = load(&row[x]);
+      store(&row[x], select(in, min(d, add(mul(zdx, fx), zrow)), d));
+    }
+  }
+}
+
+void Occlusion::rasterTile(size_t t) {
+  const int tx0 = (t % (w / tileW)) * tileW;
+  const int ty0 = (t / (w / tileW)) * tileH;
+  float* depth = hiz[0].data();
+  for (int y = ty0; y < ty0 + int(tileH); y++) {
+    std::fill(&depth[size_t(y) * w + tx0], &depth[size_t(y) * w + tx0 + tileW],
+              1.f);
+  }
+  for (uint32_t i : bin[t]) {
+    const Tri& r = tri[i];
+    // x0 is aligned so that every simd::Lanes is inside the tile.
+    rasterRect(r.A, r.B, r.C, r.zx, r.zy, r.z0,
+               std::max(r.minX, tx0) & ~int(simd::lanes - 1),
+               std::min(r.maxX, tx0 + int(tileW) - 1), std::max(r.minY, ty0),
+               std::min(r.maxY, ty0 + int(tileH) - 1), depth, w);
+  }
+}
+
+void Occlusion::buildHiz() {
+  uint32_t pw = w, ph = h;
+  for (size_t lv = 1; lv < hiz.size(); lv++) {
+    const float* prev = hiz[lv - 1].data();
+    float* cur = hiz[lv].data();
+    uint32_t cw = (pw + 1) / 2, ch = (ph + 1) / 2;
+    for (uint32_t y = 0; y < ch; y++) {
+      uint32_t y0 = y * 2, y1 = std::min(y0 + 1, ph - 1);
+      for (uint32_t x = 0; x < cw; x++) {
+        uint32_t x0 = x * 2, x1 = std::min(x0 + 1, pw - 1);
+        cur[y * cw + x] =
+            std::max(std::max(prev[y0 * pw + x0], prev[y0 * pw + x1]),
+                     std::max(prev[y1 * pw + x0], prev[y1 * pw + x1]));
+      }
+    }
+    pw = cw;
+    ph = ch;
+  }
+}
+
+bool Occlusion::isVisible(const AABB& box) const {
+  if (hiz.empty()) {
+    return true;
+  }
+  // Transform one corner, then add the edges to get the other 7.
+  glm::vec3 ext = box.bound[1] - box.bound[0];
+  glm::vec4 c[8];
+  c[0] = viewProj * glm::vec4(box.bound[0], 1.f);
+  c[1] = c[0] + viewProj[0] * ext.x;
+  glm::vec4 dy = viewProj[1] * ext.y;
+  c[2] = c[0] + dy;
+  c[3] = c[1] + dy;
+  glm::vec4 dz = viewProj[2] * ext.z;
+  for (int i = 0; i < 4; i++) {
+    c[i + 4] = c[i] + dz;
+  }
+  float minX = INFINITY, minY = INFINITY, minZ = INFINITY;
+  float maxX = -INFINITY, maxY = -INFINITY;
+  for (int i = 0; i < 8; i++) {
+    if (!(c[i].w > minW)) {
+      return true;  // Crosses the near plane.
+    }
+    float inv = 1.f / c[i].w;
+    float x = c[i].x * inv, y = c[i].y * inv;
+    minX = std::min(minX, x);
+    maxX = std::max(maxX, x);
+    minY = std::min(minY, y);
+    maxY = std::max(maxY, y);
+    minZ = std::min(minZ, c[i].z * inv);
+  }
+  minX = (minX * .5f + .5f) * w;
+  maxX = (maxX * .5f + .5f) * w;
+  minY = (minY * .5f + .5f) * h;
+  maxY = (maxY * .5f + .5f) * h;
+  if (!(minZ >= 0.f) || maxX < 0.f || maxY < 0.f || minX >= float(w) ||
+      minY >= float(h)) {
+    return true;
+  }
+  uint32_t x0 = uint32_t(std::max(minX, 0.f));
+  uint32_t y0 = uint32_t(std::max(minY, 0.f));
+  uint32_t x1 = std::min(uint32_t(maxX), w - 1);
+  uint32_t y1 = std::min(uint32_t(maxY), h - 1);
+  // Use the finest level where box covers at most 4 x 4 texels.
+  size_t lv = 0;
+  while (lv + 1 < hiz.size() &&
+         ((x1 >> lv) - (x0 >> lv) > 3 || (y1 >> lv) - (y0 >> lv) > 3)) {
+    lv++;
+  }
+  uint32_t lw = ((w - 1) >> lv) + 1;
+  const float* d = hiz[lv].data();
+  for (uint32_t y = y0 >> lv; y <= y1 >> lv; y++) {
+    for (uint32_t x = x0 >> lv; x <= x1 >> lv; x++) {
+      if (minZ <= d[y * lw + x]) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void Occlusion::cull(const std::vector<AABB>& box,
+                     std::vector<uint32_t>& visible) const {
+  size_t out = 0;
+  for (auto i : visible) {
+    if (i >= box.size() || isVisible(box[i])) {
+      visible[out++] = i;
+    }
+  }
+  visible.resize(out);
+}
+
+}  // namespace asset
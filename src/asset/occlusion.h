@@ -0,0 +1,124 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "scene.h"
+
+#pragma once
+
+namespace asset {
+
+// OcclusionStats counts what the last Occlusion::render did.
+typedef struct OcclusionStats {
+  // tris is the number of occluder tris. drawn is how many of them were
+  // rasterized: the rest were behind the camera, off screen or too thin.
+  size_t tris{0};
+  size_t drawn{0};
+  // binned is the total number of (tri, tile) pairs rasterized.
+  size_t binned{0};
+} OcclusionStats;
+
+// Occlusion culls objects hidden behind occluders, entirely on the CPU. It is
+// meant to run after Frustum::cull or Bvh::query, before draw calls are
+// recorded:
+// 1. add() a few large, simple occluder meshes. An occluder must be inside
+//    the real geometry it stands for, or Occlusion will cull objects that
+//    should be visible. A building's walls without windows or doors work well.
+// 2. render() rasterizes the occluders into a small depth buffer, tile by
+//    tile on worker threads, then builds a hierarchical Z buffer (hiz).
+// 3. isVisible() or cull() tests object bounds against hiz.
+//
+// Depth is 0 at the near plane and 1 at the far plane, as with
+// GLM_FORCE_DEPTH_ZERO_TO_ONE.
+typedef struct Occlusion {
+  ~Occlusion() { stop(); }
+
+  // tileW and tileH are the size of a tile, the unit of work for a thread.
+  static constexpr uint32_t tileW = 32;
+  static constexpr uint32_t tileH = 16;
+
+  // ctorError sets the size of the depth buffer, which must be a multiple of
+  // tileW x tileH, and starts nThreads worker threads. render() also
+  // rasterizes on the calling thread, so nThreads can be 0.
+  WARN_UNUSED_RESULT int ctorError(uint32_t w, uint32_t h, size_t nThreads);
+
+  // stop joins the worker threads.
+  void stop();
+
+  uint32_t width() const { return w; }
+  uint32_t height() const { return h; }
+
+  // clear removes all occluders.
+  void clear() {
+    occVert.clear();
+    occTri.clear();
+  }
+
+  // add adds the tris of mesh as an occluder. model transforms mesh into
+  // world space.
+  WARN_UNUSED_RESULT int add(const VertexIndex& mesh, const glm::mat4& model);
+
+  // render rasterizes all occluders as seen by viewProj, which is
+  // presumably camera.proj * camera.view, and builds hiz.
+  WARN_UNUSED_RESULT int render(const glm::mat4& viewProj);
+
+  // isVisible returns false only if render() found box entirely behind
+  // occluders. It returns true if box is off screen or crosses the near
+  // plane: Frustum should cull those.
+  bool isVisible(const AABB& box) const;
+
+  // cull removes the index of each occluded object from 'visible', keeping
+  // the rest in order. box holds the bounds of every object.
+  void cull(const std::vector<AABB>& box,
+            std::vector<uint32_t>& visible) const;
+
+  // hiz[0] is the depth buffer, w x h floats in rows. Each level after that
+  // is half the size (rounded up), and each texel is the farthest depth of
+  // the 2 x 2 texels below it.
+  std::vector<std::vector<float>> hiz;
+
+  OcclusionStats stats;
+
+ protected:
+  uint32_t w{0}, h{0};
+  glm::mat4 viewProj;
+  std::vector<glm::vec3> occVert;
+  std::vector<uint32_t> occTri;
+
+  // Tri is an occluder tri set up for rasterizing: 3 edge functions that are
+  // >= 0 inside the tri, and depth as a plane in screen space. All are
+  // evaluated at pixel centers.
+  typedef struct Tri {
+    float A[3], B[3], C[3];
+    float zx, zy, z0;
+    int minX, minY, maxX, maxY;
+  } Tri;
+  std::vector<Tri> tri;
+  // bin holds the index in tri of each tri that touches a tile.
+  std::vector<std::vector<uint32_t>> bin;
+
+  std::vector<std::thread> th;
+  std::mutex mutex;
+  // wake tells worker threads to rasterize or stop.
+  std::condition_variable wake;
+  // done tells render() that all worker threads are done.
+  std::condition_variable done;
+  bool stopping{false};
+  // gen is incremented by each render(). running counts worker threads that
+  // have not finished this gen.
+  size_t gen{0}, running{0};
+  std::atomic<size_t> nextTile{0};
+
+  // worker rasterizes tiles each time gen is not seenGen.
+  void worker(size_t seenGen);
+  // rasterTiles rasterizes tiles until there are none left.
+  void rasterTiles();
+  void rasterTile(size_t tile);
+  void buildHiz();
+} Occlusion;
+
+}  // namespace asset
@@ -0,0 +1,816 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#endif
+#include "physics.h"
+
+#include <float.h>
+
+#include <algorithm>
+
+namespace asset {
+
+static constexpr int dbg = 0;
+
+// slop is how far contacts may sink into each other before the solver pushes
+// them apart. Without it, resting bodies jitter.
+static constexpr float slop = .005f;
+// baumgarte is the fraction of the depth the solver fixes in one step.
+static constexpr float baumgarte = .2f;
+// matchDist is how close a contact must be to a contact in the step before to
+// start with its impulse.
+static constexpr float matchDist = .05f;
+// angularDamping slows spinning bodies a little, so they can sleep.
+static constexpr float angularDamping = .1f;
+// margin is how far apart two bodies can be and still get a contact. The
+// solver lets them close the gap, but no more. Without it, contacts of
+// resting bodies come and go from step to step.
+static constexpr float margin = .02f;
+// maxPoints is the most contacts two boxes get.
+static constexpr size_t maxPoints = 4;
+
+uint32_t Physics::addSphere(glm::vec3 pos, float radius, float mass) {
+  body.emplace_back();
+  Body& b = body.back();
+  b.pos = pos;
+  b.half = glm::vec3(radius, radius, radius);
+  b.shape = SHAPE_SPHERE;
+  if (mass > 0.f) {
+    b.invMass = 1.f / mass;
+    float i = 2.5f / (mass * radius * radius);
+    b.invInertia = glm::vec3(i, i, i);
+  } else {
+    b.invMass = 0.f;
+    b.invInertia = glm::vec3(0.f, 0.f, 0.f);
+    b.awake = false;
+  }
+  return body.size() - 1;
+}
+
+uint32_t Physics::addBox(glm::vec3 pos, glm::vec3 half, float mass,
+                         glm::quat rot) {
+  body.emplace_back();
+  Body& b = body.back();
+  b.pos = pos;
+  b.rot = rot;
+  b.half = half;
+  b.shape = SHAPE_BOX;
+  if (mass > 0.f) {
+    b.invMass = 1.f / mass;
+    glm::vec3 h2 = half * half;
+    b.invInertia = glm::vec3(3.f / (mass * (h2.y + h2.z)),
+                             3.f / (mass * (h2.x + h2.z)),
+                             3.f / (mass * (h2.x + h2.y)));
+  } else {
+    b.invMass = 0.f;
+    b.invInertia = glm::vec3(0.f, 0.f, 0.f);
+    b.awake = false;
+  }
+  return body.size() - 1;
+}
+
+// cellKey packs the cell coordinates into one key, 21 bits each. Cells far
+// enough apart can get the same key, which only costs a few more distance
+// tests.
+static uint64_t cellKey(int32_t x, int32_t y, int32_t z) {
+  static constexpr uint64_t mask = (uint64_t(1) << 21) - 1;
+  return ((uint64_t(x) & mask) << 42) | ((uint64_t(y) & mask) << 21) |
+         (uint64_t(z) & mask);
+}
+
+// rowHash picks where a row of cells along x starts in the hash buckets.
+// Cells next to each other along x are in buckets next to each other, so
+// looking at a cell and its x neighbors reads memory in order.
+static uint32_t rowHash(int32_t y, int32_t z) {
+  return uint32_t(y) * 0x9E3779B1u ^ uint32_t(z) * 0x85EBCA77u;
+}
+
+void Physics::findPairs(std::vector<BodyPair>& out) {
+  out.clear();
+  size_t n = body.size();
+  // Each cell is as wide as the biggest body, so only bodies in neighboring
+  // cells can touch.
+  float cell = 0.f;
+  for (auto& b : body) {
+    cell = std::max(cell, b.radius());
+  }
+  cell *= 2.f;
+  if (!n || cell <= 0.f) {
+    return;
+  }
+  float inv = 1.f / cell;
+  size_t buckets = 2;
+  while (buckets < n * 2) {
+    buckets *= 2;
+  }
+  uint32_t mask = buckets - 1;
+
+  // Counting sort the bodies into buckets. After this, bucket h holds
+  // grid[cellStart[h]] to grid[cellStart[h + 1] - 1].
+  bucketOf.resize(n);
+  grid.resize(n);
+  cellStart.assign(buckets + 1, 0);
+  for (size_t i = 0; i < n; i++) {
+    glm::vec3 c = glm::floor(body[i].pos * inv);
+    bucketOf[i] = (rowHash(int32_t(c.y), int32_t(c.z)) + uint32_t(c.x)) & mask;
+    cellStart[bucketOf[i]]++;
+  }
+  uint32_t sum = 0;
+  for (size_t h = 0; h <= buckets; h++) {
+    sum += cellStart[h];
+    cellStart[h] = sum;
+  }
+  for (size_t i = n; i-- > 0;) {
+    const Body& b = body[i];
+    GridEntry& e = grid[--cellStart[bucketOf[i]]];
+    glm::vec3 c = glm::floor(b.pos * inv);
+    e.pos = b.pos;
+    e.r = b.radius();
+    e.key = cellKey(int32_t(c.x), int32_t(c.y), int32_t(c.z));
+    e.body = i;
+    e.awake = b.awake;
+  }
+
+  // Walk the grid in bucket order too: bodies in the same cell look at the
+  // same neighbors one after another. Each pair of cells is only looked at
+  // once, from the cell that comes first in z, then y, then x.
+  for (uint32_t i = 0; i < n; i++) {
+    const GridEntry& a = grid[i];
+    glm::vec3 c = glm::floor(a.pos * inv);
+    int32_t x = int32_t(c.x), y = int32_t(c.y), z = int32_t(c.z);
+    for (int32_t dz = 0; dz < 2; dz++) {
+      for (int32_t dy = dz ? -1 : 0; dy < 2; dy++) {
+        uint32_t row = rowHash(y + dy, z + dz);
+        for (int32_t dx = dz || dy ? -1 : 0; dx < 2; dx++) {
+          uint64_t key = cellKey(x + dx, y + dy, z + dz);
+          uint32_t h = (row + uint32_t(x + dx)) & mask;
+          // In a's own cell, only look at bodies after a.
+          uint32_t k = dz || dy || dx ? cellStart[h] : i + 1;
+          for (; k < cellStart[h + 1]; k++) {
+            const GridEntry& b = grid[k];
+            // Other cells may share bucket h.
+            if (b.key != key || !(a.awake | b.awake)) {
+              continue;
+            }
+            glm::vec3 d = b.pos - a.pos;
+            float r = a.r + b.r;
+            if (glm::dot(d, d) < r * r) {
+              out.emplace_back(a.body < b.body ? BodyPair{a.body, b.body}
+                                               : BodyPair{b.body, a.body});
+            }
+          }
+        }
+      }
+    }
+  }
+  std::sort(out.begin(), out.end());
+}
+
+void Physics::addContact(uint32_t a, uint32_t b, glm::vec3 n, glm::vec3 p,
+                         float depth) {
+  contact.emplace_back();
+  Contact& c = contact.back();
+  c.a = a;
+  c.b = b;
+  c.n = n;
+  c.p = p;
+  c.depth = depth;
+  c.local = glm::conjugate(body[a].rot) * (p - body[a].pos);
+  c.jn = c.jt1 = c.jt2 = 0.f;
+}
+
+// sphereBox finds where sphere s touches box b. n is from s to b.
+static bool sphereBox(const Body& s, const Body& b, glm::vec3& n,
+                      glm::vec3& p, float& depth) {
+  glm::mat3 R = glm::mat3_cast(b.rot);
+  glm::vec3 d = s.pos - b.pos;
+  glm::vec3 local(glm::dot(d, R[0]), glm::dot(d, R[1]), glm::dot(d, R[2]));
+  glm::vec3 q = glm::clamp(local, -b.half, b.half);
+  glm::vec3 diff = local - q;
+  float r = s.half.x;
+  float d2 = glm::dot(diff, diff);
+  if (d2 > (r + margin) * (r + margin)) {
+    return false;
+  }
+  if (d2 > 1e-12f) {
+    float len = sqrtf(d2);
+    n = -(R * (diff / len));
+    depth = r - len;
+  } else {
+    // The center of s is inside b: push it out the nearest face.
+    int k = 0;
+    float best = FLT_MAX;
+    for (int a = 0; a < 3; a++) {
+      float out = b.half[a] - fabsf(local[a]);
+      if (out < best) {
+        best = out;
+        k = a;
+      }
+    }
+    float sign = local[k] < 0.f ? -1.f : 1.f;
+    q[k] = b.half[k] * sign;
+    n = -R[k] * sign;
+    depth = r + best;
+  }
+  p = b.pos + R * q;
+  return true;
+}
+
+// reduce keeps the maxPoints of n points that cover the most area. The
+// deepest point is always kept.
+static size_t reduce(glm::vec3* pt, float* depth, size_t n, glm::vec3 normal) {
+  if (n <= maxPoints) {
+    return n;
+  }
+  size_t keep[maxPoints] = {0, 0, 0, 0};
+  keep[0] = std::max_element(depth, depth + n) - depth;
+  // keep[1] is the farthest from keep[0].
+  float best = -1.f;
+  for (size_t i = 0; i < n; i++) {
+    glm::vec3 d = pt[i] - pt[keep[0]];
+    if (glm::dot(d, d) > best) {
+      best = glm::dot(d, d);
+      keep[1] = i;
+    }
+  }
+  // keep[2] and keep[3] make the biggest triangles on either side of the
+  // line through keep[0] and keep[1].
+  float most = -FLT_MAX, least = FLT_MAX;
+  keep[2] = keep[3] = keep[0];
+  glm::vec3 edge = pt[keep[1]] - pt[keep[0]];
+  for (size_t i = 0; i < n; i++) {
+    float area = glm::dot(glm::cross(edge, pt[i] - pt[keep[0]]), normal);
+    if (area > most) {
+      most = area;
+      keep[2] = i;
+    }
+    if (area < least) {
+      least = area;
+      keep[3] = i;
+    }
+  }
+  glm::vec3 p[maxPoints];
+  float d[maxPoints];
+  size_t k = 0;
+  for (size_t i = 0; i < maxPoints; i++) {
+    if (std::find(keep, keep + i, keep[i]) != keep + i) {
+      continue;  // Already kept.
+    }
+    p[k] = pt[keep[i]];
+    d[k] = depth[keep[i]];
+    k++;
+  }
+  std::copy(p, p + k, pt);
+  std::copy(d, d + k, depth);
+  return k;
+}
+
+// clip keeps the part of polygon 'in' (n points) where dot(p - o, dir) <= h.
+// It returns how many points it wrote to 'out'.
+static size_t clip(const glm::vec3* in, size_t n, glm::vec3* out,
+                   glm::vec3 o, glm::vec3 dir, float h) {
+  size_t k = 0;
+  for (size_t i = 0; i < n; i++) {
+    const glm::vec3& p = in[i];
+    const glm::vec3& q = in[(i + 1) % n];
+    float dp = glm::dot(p - o, dir) - h;
+    float dq = glm::dot(q - o, dir) - h;
+    if (dp <= 0.f) {
+      out[k++] = p;
+    }
+    if ((dp <= 0.f) != (dq <= 0.f)) {
+      out[k++] = p + (q - p) * (dp / (dp - dq));
+    }
+  }
+  return k;
+}
+
+// boxBox finds where boxes a and b touch using the separating axis test.
+// n is from a to b. It returns how many points it wrote to pt and depth.
+static size_t boxBox(const Body& a, const Body& b, glm::vec3& n,
+                     glm::vec3* pt, float* depth) {
+  glm::mat3 Ra = glm::mat3_cast(a.rot), Rb = glm::mat3_cast(b.rot);
+  glm::vec3 d = b.pos - a.pos;
+  float ac[3][3];  // ac[i][j] is |dot(Ra[i], Rb[j])|.
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      ac[i][j] = fabsf(glm::dot(Ra[i], Rb[j])) + 1e-6f;
+    }
+  }
+
+  // Find the axis with the least overlap. Prefer face axes, which give
+  // stable contacts, unless another axis is clearly better.
+  float best = -FLT_MAX;
+  int axis = -1;
+  for (int i = 0; i < 3; i++) {
+    float dist = glm::dot(d, Ra[i]);
+    float s = fabsf(dist) - (a.half[i] + b.half[0] * ac[i][0] +
+                             b.half[1] * ac[i][1] + b.half[2] * ac[i][2]);
+    if (s > margin) {
+      return 0;
+    }
+    if (s > best) {
+      best = s;
+      axis = i;
+      n = dist < 0.f ? -Ra[i] : Ra[i];
+    }
+  }
+  for (int j = 0; j < 3; j++) {
+    float dist = glm::dot(d, Rb[j]);
+    float s = fabsf(dist) - (b.half[j] + a.half[0] * ac[0][j] +
+                             a.half[1] * ac[1][j] + a.half[2] * ac[2][j]);
+    if (s > margin) {
+      return 0;
+    }
+    if (s > .95f * best + .001f) {
+      best = s;
+      axis = 3 + j;
+      n = dist < 0.f ? -Rb[j] : Rb[j];
+    }
+  }
+  int edgeA = -1, edgeB = -1;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      glm::vec3 L = glm::cross(Ra[i], Rb[j]);
+      float len = glm::length(L);
+      if (len < 1e-4f) {
+        continue;  // Parallel edges: a face axis covers this.
+      }
+      L = L / len;
+      float ra = 0.f, rb = 0.f;
+      for (int k = 0; k < 3; k++) {
+        ra += a.half[k] * fabsf(glm::dot(Ra[k], L));
+        rb += b.half[k] * fabsf(glm::dot(Rb[k], L));
+      }
+      float dist = glm::dot(d, L);
+      float s = fabsf(dist) - (ra + rb);
+      if (s > margin) {
+        return 0;
+      }
+      if (s > .95f * best + .01f) {
+        best = s;
+        edgeA = i;
+        edgeB = j;
+        n = dist < 0.f ? -L : L;
+      }
+    }
+  }
+
+  if (edgeA >= 0) {
+    // Edge against edge: one contact between the closest points.
+    glm::vec3 pa = a.pos, pb = b.pos;
+    for (int k = 0; k < 3; k++) {
+      if (k != edgeA) {
+        pa += Ra[k] * (glm::dot(Ra[k], n) < 0.f ? -a.half[k] : a.half[k]);
+      }
+      if (k != edgeB) {
+        pb += Rb[k] * (glm::dot(Rb[k], n) > 0.f ? -b.half[k] : b.half[k]);
+      }
+    }
+    glm::vec3 u = Ra[edgeA], v = Rb[edgeB], w = pa - pb;
+    float uv = glm::dot(u, v), uw = glm::dot(u, w), vw = glm::dot(v, w);
+    float denom = 1.f - uv * uv;
+    float s = denom > 1e-6f ? (uv * vw - uw) / denom : 0.f;
+    s = glm::clamp(s, -a.half[edgeA], a.half[edgeA]);
+    float t = glm::clamp(vw + s * uv, -b.half[edgeB], b.half[edgeB]);
+    pt[0] = (pa + u * s + pb + v * t) * .5f;
+    depth[0] = -best;
+    return 1;
+  }
+
+  // Face against face (or edge, or corner). The reference face is the face
+  // of 'axis'. Clip the incident face, the face of the other box most
+  // facing it, to the sides of the reference face.
+  bool refIsA = axis < 3;
+  int k = refIsA ? axis : axis - 3;
+  const Body& ref = refIsA ? a : b;
+  const Body& inc = refIsA ? b : a;
+  const glm::mat3& Rr = refIsA ? Ra : Rb;
+  const glm::mat3& Ri = refIsA ? Rb : Ra;
+  glm::vec3 nRef = refIsA ? n : -n;  // Out of ref toward inc.
+  glm::vec3 center = ref.pos + nRef * ref.half[k];
+  int ku = (k + 1) % 3, kv = (k + 2) % 3;
+
+  int m = 0;
+  float most = -1.f;
+  for (int j = 0; j < 3; j++) {
+    float f = fabsf(glm::dot(Ri[j], nRef));
+    if (f > most) {
+      most = f;
+      m = j;
+    }
+  }
+  float sign = glm::dot(Ri[m], nRef) > 0.f ? -1.f : 1.f;
+  glm::vec3 ic = inc.pos + Ri[m] * (inc.half[m] * sign);
+  glm::vec3 iu = Ri[(m + 1) % 3] * inc.half[(m + 1) % 3];
+  glm::vec3 iv = Ri[(m + 2) % 3] * inc.half[(m + 2) % 3];
+  glm::vec3 poly[8] = {ic + iu + iv, ic - iu + iv, ic - iu - iv, ic + iu - iv};
+  glm::vec3 tmp[8];
+  size_t np = 4;
+  np = clip(poly, np, tmp, center, Rr[ku], ref.half[ku]);
+  np = clip(tmp, np, poly, center, -Rr[ku], ref.half[ku]);
+  np = clip(poly, np, tmp, center, Rr[kv], ref.half[kv]);
+  np = clip(tmp, np, poly, center, -Rr[kv], ref.half[kv]);
+
+  size_t found = 0;
+  glm::vec3 p[8];
+  float dp[8];
+  for (size_t i = 0; i < np; i++) {
+    float sep = glm::dot(poly[i] - center, nRef);
+    if (sep < margin) {
+      // Put the contact halfway between the two boxes.
+      p[found] = poly[i] - nRef * (sep * .5f);
+      dp[found] = -sep;
+      found++;
+    }
+  }
+  found = reduce(p, dp, found, nRef);
+  std::copy(p, p + found, pt);
+  std::copy(dp, dp + found, depth);
+  return found;
+}
+
+void Physics::collide(uint32_t ia, uint32_t ib) {
+  const Body& a = body[ia];
+  const Body& b = body[ib];
+  glm::vec3 n, p;
+  float depth;
+  if (a.shape == SHAPE_SPHERE && b.shape == SHAPE_SPHERE) {
+    glm::vec3 d = b.pos - a.pos;
+    float r = a.half.x + b.half.x;
+    float d2 = glm::dot(d, d);
+    if (d2 >= (r + margin) * (r + margin)) {
+      return;
+    }
+    float len = sqrtf(d2);
+    n = len > 1e-6f ? d / len : glm::vec3(0.f, 1.f, 0.f);
+    depth = r - len;
+    addContact(ia, ib, n, a.pos + n * (a.half.x - depth * .5f), depth);
+  } else if (a.shape == SHAPE_SPHERE) {
+    if (sphereBox(a, b, n, p, depth)) {
+      addContact(ia, ib, n, p, depth);
+    }
+  } else if (b.shape == SHAPE_SPHERE) {
+    if (sphereBox(b, a, n, p, depth)) {
+      addContact(ia, ib, -n, p, depth);
+    }
+  } else {
+    glm::vec3 pt[maxPoints];
+    float dp[maxPoints];
+    size_t found = boxBox(a, b, n, pt, dp);
+    for (size_t i = 0; i < found; i++) {
+      addContact(ia, ib, n, pt[i], dp[i]);
+    }
+  }
+}
+
+void Physics::collideWalls(uint32_t ia) {
+  const Body& a = body[ia];
+  float r = a.radius();
+  bool near = false;
+  for (int k = 0; k < 3; k++) {
+    near |= a.pos[k] - r - margin < room.bound[0][k] ||
+            a.pos[k] + r + margin > room.bound[1][k];
+  }
+  if (!near) {
+    return;
+  }
+  if (a.shape == SHAPE_SPHERE) {
+    for (int k = 0; k < 3; k++) {
+      for (int side = 0; side < 2; side++) {
+        float wall = room.bound[side][k];
+        float depth = side ? a.pos[k] + r - wall : wall - (a.pos[k] - r);
+        if (depth > -margin) {
+          glm::vec3 n(0.f, 0.f, 0.f);
+          n[k] = side ? 1.f : -1.f;
+          glm::vec3 p = a.pos;
+          p[k] = wall;
+          addContact(ia, noBody, n, p, depth);
+        }
+      }
+    }
+    return;
+  }
+  glm::mat3 R = glm::mat3_cast(a.rot);
+  glm::vec3 corner[8];
+  for (int i = 0; i < 8; i++) {
+    corner[i] = a.pos;
+    for (int k = 0; k < 3; k++) {
+      corner[i] += R[k] * ((i >> k) & 1 ? a.half[k] : -a.half[k]);
+    }
+  }
+  for (int k = 0; k < 3; k++) {
+    for (int side = 0; side < 2; side++) {
+      float wall = room.bound[side][k];
+      glm::vec3 n(0.f, 0.f, 0.f);
+      n[k] = side ? 1.f : -1.f;
+      glm::vec3 pt[8];
+      float dp[8];
+      size_t found = 0;
+      for (int i = 0; i < 8; i++) {
+        float depth = side ? corner[i][k] - wall : wall - corner[i][k];
+        if (depth > -margin) {
+          pt[found] = corner[i];
+          dp[found] = depth;
+          found++;
+        }
+      }
+      found = reduce(pt, dp, found, n);
+      for (size_t i = 0; i < found; i++) {
+        addContact(ia, noBody, n, pt[i], dp[i]);
+      }
+    }
+  }
+}
+
+void Physics::matchPrev() {
+  // contact and prev are both sorted by a, then b: walk them together.
+  float match2 = matchDist * matchDist;
+  size_t j = 0;
+  for (auto& c : contact) {
+    while (j < prev.size() &&
+           (prev[j].a < c.a || (prev[j].a == c.a && prev[j].b < c.b))) {
+      j++;
+    }
+    for (size_t k = j; k < prev.size() && prev[k].a == c.a && prev[k].b == c.b;
+         k++) {
+      glm::vec3 d = prev[k].local - c.local;
+      if (glm::dot(d, d) < match2) {
+        c.jn = prev[k].jn;
+        c.jt1 = prev[k].jt1;
+        c.jt2 = prev[k].jt2;
+        stats.warm++;
+        break;
+      }
+    }
+  }
+}
+
+// BodyRef is what the solver needs of one side of a contact. A wall is a
+// BodyRef with invMass 0 that never moves.
+typedef struct BodyRef {
+  glm::vec3* vel;
+  glm::vec3* angVel;
+  float invMass;
+  const glm::mat3* invI;
+} BodyRef;
+
+// Wall holds the velocity of a wall for one contact. applyImpulse writes to
+// it like any other body, so each contact gets its own, which starts at rest.
+typedef struct Wall {
+  glm::vec3 vel{0.f, 0.f, 0.f};
+  glm::vec3 angVel{0.f, 0.f, 0.f};
+} Wall;
+
+static const glm::mat3 wallInvI(0.f);
+
+static BodyRef wallRef(Wall& w) {
+  return BodyRef{&w.vel, &w.angVel, 0.f, &wallInvI};
+}
+
+static BodyRef bodyRef(Body& b, const glm::mat3& invI) {
+  return BodyRef{&b.vel, &b.angVel, b.invMass, &invI};
+}
+
+static glm::vec3 relVel(const BodyRef& a, const BodyRef& b, glm::vec3 ra,
+                        glm::vec3 rb) {
+  return *b.vel + glm::cross(*b.angVel, rb) - *a.vel -
+         glm::cross(*a.angVel, ra);
+}
+
+static void applyImpulse(BodyRef& a, BodyRef& b, glm::vec3 ra, glm::vec3 rb,
+                         glm::vec3 P) {
+  *a.vel -= P * a.invMass;
+  *a.angVel -= *a.invI * glm::cross(ra, P);
+  *b.vel += P * b.invMass;
+  *b.angVel += *b.invI * glm::cross(rb, P);
+}
+
+// effectiveMass is 1 / how fast the contact moves along dir per unit impulse.
+static float effectiveMass(const BodyRef& a, const BodyRef& b, glm::vec3 ra,
+                           glm::vec3 rb, glm::vec3 dir) {
+  glm::vec3 ca = glm::cross(*a.invI * glm::cross(ra, dir), ra);
+  glm::vec3 cb = glm::cross(*b.invI * glm::cross(rb, dir), rb);
+  float k = a.invMass + b.invMass + glm::dot(ca + cb, dir);
+  return k > 0.f ? 1.f / k : 0.f;
+}
+
+void Physics::prepareContacts(float dt) {
+  float invDt = 1.f / dt;
+  for (auto& c : contact) {
+    Wall wall;
+    BodyRef a = bodyRef(body[c.a], invI[c.a]);
+    BodyRef b = wallRef(wall);
+    c.ra = c.p - body[c.a].pos;
+    c.rb = glm::vec3(0.f, 0.f, 0.f);
+    if (c.b != noBody) {
+      b = bodyRef(body[c.b], invI[c.b]);
+      c.rb = c.p - body[c.b].pos;
+    }
+    glm::vec3 ref = fabsf(c.n.x) > .57f ? glm::vec3(0.f, 1.f, 0.f)
+                                        : glm::vec3(1.f, 0.f, 0.f);
+    c.t1 = glm::normalize(glm::cross(c.n, ref));
+    c.t2 = glm::cross(c.n, c.t1);
+    c.massN = effectiveMass(a, b, c.ra, c.rb, c.n);
+    c.massT1 = effectiveMass(a, b, c.ra, c.rb, c.t1);
+    c.massT2 = effectiveMass(a, b, c.ra, c.rb, c.t2);
+
+    if (c.depth < 0.f) {
+      // There is a gap: the bodies may move together just enough to close it.
+      c.bias = c.depth * invDt;
+    } else {
+      c.bias = baumgarte * invDt * std::max(c.depth - slop, 0.f);
+    }
+    float vn = glm::dot(relVel(a, b, c.ra, c.rb), c.n);
+    if (vn < -1.f) {
+      c.bias = std::max(c.bias, -restitution * vn);
+    }
+  }
+
+  // Warm start with the impulses from the step before. This must come after
+  // all of the above, or the warm start of one contact would change vn of
+  // the next.
+  for (auto& c : contact) {
+    Wall wall;
+    BodyRef a = bodyRef(body[c.a], invI[c.a]);
+    BodyRef b = c.b == noBody ? wallRef(wall) : bodyRef(body[c.b], invI[c.b]);
+    applyImpulse(a, b, c.ra, c.rb, c.n * c.jn + c.t1 * c.jt1 + c.t2 * c.jt2);
+  }
+}
+
+void Physics::solveContacts() {
+  for (auto& c : contact) {
+    Wall wall;
+    BodyRef a = bodyRef(body[c.a], invI[c.a]);
+    BodyRef b = c.b == noBody ? wallRef(wall) : bodyRef(body[c.b], invI[c.b]);
+
+    // Friction first, limited by the normal impulse.
+    float limit = friction * c.jn;
+    float j = -c.massT1 * glm::dot(relVel(a, b, c.ra, c.rb), c.t1);
+    float old = c.jt1;
+    c.jt1 = glm::clamp(old + j, -limit, limit);
+    applyImpulse(a, b, c.ra, c.rb, c.t1 * (c.jt1 - old));
+    j = -c.massT2 * glm::dot(relVel(a, b, c.ra, c.rb), c.t2);
+    old = c.jt2;
+    c.jt2 = glm::clamp(old + j, -limit, limit);
+    applyImpulse(a, b, c.ra, c.rb, c.t2 * (c.jt2 - old));
+
+    j = c.massN * (c.bias - glm::dot(relVel(a, b, c.ra, c.rb), c.n));
+    old = c.jn;
+    c.jn = std::max(old + j, 0.f);
+    applyImpulse(a, b, c.ra, c.rb, c.n * (c.jn - old));
+  }
+}
+
+uint32_t Physics::findRoot(uint32_t i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+void Physics::sleepIslands(float dt) {
+  float v2 = sleepVel * sleepVel;
+  size_t n = body.size();
+  parent.resize(n);
+  for (uint32_t i = 0; i < n; i++) {
+    parent[i] = i;
+    Body& b = body[i];
+    if (!b.awake) {
+      continue;
+    }
+    if (glm::dot(b.vel, b.vel) < v2 && glm::dot(b.angVel, b.angVel) < v2) {
+      b.still += dt;
+    } else {
+      b.still = 0.f;
+    }
+  }
+  // Bodies that touch form an island. Walls and bodies that never move do
+  // not join islands together.
+  for (auto& c : contact) {
+    if (c.b == noBody || !body[c.a].invMass || !body[c.b].invMass) {
+      continue;
+    }
+    uint32_t ra = findRoot(c.a), rb = findRoot(c.b);
+    if (ra != rb) {
+      parent[std::max(ra, rb)] = std::min(ra, rb);
+    }
+  }
+  // An island's still time is the least still time of its bodies.
+  // The root of an island is its lowest body, so one pass finds it.
+  std::vector<float>& still = islandStill;
+  still.assign(n, FLT_MAX);
+  for (uint32_t i = 0; i < n; i++) {
+    if (body[i].awake) {
+      uint32_t r = findRoot(i);
+      still[r] = std::min(still[r], body[i].still);
+    }
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    Body& b = body[i];
+    if (b.awake && still[findRoot(i)] >= sleepTime) {
+      b.awake = false;
+      b.vel = glm::vec3(0.f, 0.f, 0.f);
+      b.angVel = glm::vec3(0.f, 0.f, 0.f);
+    }
+  }
+}
+
+int Physics::step(float dt) {
+  if (dt <= 0.f) {
+    logE("Physics::step(%f): dt must be positive\n", dt);
+    return 1;
+  }
+  for (int k = 0; k < 3; k++) {
+    if (room.bound[0][k] >= room.bound[1][k]) {
+      logE("Physics::step: room is empty. Set room first.\n");
+      return 1;
+    }
+  }
+  stats = PhysicsStats();
+  size_t n = body.size();
+  for (auto& b : body) {
+    if (b.awake) {
+      b.vel += gravity * dt;
+    }
+  }
+
+  // Broadphase and narrowphase. Contacts come out sorted by a, then b, since
+  // pair is sorted and walls (noBody) sort last.
+  findPairs(pair);
+  stats.pairs = pair.size();
+  contact.clear();
+  size_t p = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    for (; p < pair.size() && pair[p].a == i; p++) {
+      collide(pair[p].a, pair[p].b);
+    }
+    if (body[i].awake) {
+      collideWalls(i);
+    }
+  }
+  stats.contacts = contact.size();
+
+  // An awake body wakes up any sleeping body it touches.
+  for (auto& c : contact) {
+    if (c.b == noBody) {
+      continue;
+    }
+    if (!body[c.a].awake && body[c.b].awake) {
+      wake(c.a);
+    } else if (body[c.a].awake && !body[c.b].awake) {
+      wake(c.b);
+    }
+  }
+
+  invI.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    Body& b = body[i];
+    if (!b.awake) {
+      invI[i] = glm::mat3(0.f);
+      continue;
+    }
+    // invI = R * diag(invInertia) * transpose(R)
+    glm::mat3 R = glm::mat3_cast(b.rot);
+    glm::mat3 RD = R;
+    for (int k = 0; k < 3; k++) {
+      RD[k] *= b.invInertia[k];
+    }
+    invI[i] = RD * glm::transpose(R);
+  }
+
+  matchPrev();
+  prepareContacts(dt);
+  for (size_t it = 0; it < iterations; it++) {
+    solveContacts();
+  }
+
+  float damp = 1.f / (1.f + dt * angularDamping);
+  for (auto& b : body) {
+    if (!b.awake) {
+      continue;
+    }
+    b.angVel *= damp;
+    b.pos += b.vel * dt;
+    glm::quat w(0.f, b.angVel.x, b.angVel.y, b.angVel.z);
+    b.rot = glm::normalize(b.rot + (w * b.rot) * (.5f * dt));
+  }
+
+  sleepIslands(dt);
+  for (auto& b : body) {
+    stats.awake += b.awake;
+  }
+  if (dbg) {
+    logI("Physics::step: %zu pairs %zu contacts %zu warm %zu awake\n",
+         stats.pairs, stats.contacts, stats.warm, stats.awake);
+  }
+  prev.swap(contact);
+  return 0;
+}
+
+}  // namespace asset
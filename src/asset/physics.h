@@ -0,0 +1,159 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#include "scene.h"
+
+#pragma once
+
+namespace asset {
+
+enum BodyShape {
+  SHAPE_SPHERE = 0,
+  SHAPE_BOX = 1,
+};
+
+// Body is one rigid body in a Physics world.
+typedef struct Body {
+  glm::vec3 pos{0.f, 0.f, 0.f};
+  glm::quat rot{1.f, 0.f, 0.f, 0.f};
+  glm::vec3 vel{0.f, 0.f, 0.f};
+  glm::vec3 angVel{0.f, 0.f, 0.f};
+  // half is the half extents of a box. A sphere only uses half.x, the radius.
+  glm::vec3 half{.5f, .5f, .5f};
+  // invMass is 1 / mass, or 0 for a body that never moves.
+  float invMass{1.f};
+  // invInertia is the inverse of the inertia tensor, a diagonal matrix in
+  // body space.
+  glm::vec3 invInertia{1.f, 1.f, 1.f};
+  BodyShape shape{SHAPE_SPHERE};
+  bool awake{true};
+  // still is how long the body has been moving slower than Physics::sleepVel.
+  float still{0.f};
+
+  // radius is the radius of a sphere around the body.
+  float radius() const {
+    return shape == SHAPE_SPHERE ? half.x : glm::length(half);
+  }
+} Body;
+
+// BodyPair is two bodies whose bounds overlap: a < b.
+typedef struct BodyPair {
+  uint32_t a, b;
+  bool operator<(const BodyPair& other) const {
+    return a < other.a || (a == other.a && b < other.b);
+  }
+  bool operator==(const BodyPair& other) const {
+    return a == other.a && b == other.b;
+  }
+} BodyPair;
+
+// PhysicsStats counts what the last Physics::step did.
+typedef struct PhysicsStats {
+  size_t pairs{0};
+  size_t contacts{0};
+  size_t awake{0};
+  // warm is how many contacts started with the impulse from the step before.
+  size_t warm{0};
+} PhysicsStats;
+
+// Physics simulates rigid spheres and boxes inside a box-shaped room:
+// 1. The broadphase puts the bodies in a uniform grid and finds pairs of
+//    bodies that are close enough to touch.
+// 2. The narrowphase generates contacts for each pair and for each body that
+//    touches a wall of the room.
+// 3. A sequential impulse solver resolves all contacts a few times over
+//    (iterations), starting with the impulses from the step before.
+// 4. Bodies that touch each other form islands. An island sleeps when all its
+//    bodies have been still for sleepTime, and wakes when an awake body hits
+//    it.
+typedef struct Physics {
+  // room is the inside of the walls.
+  AABB room;
+  glm::vec3 gravity{0.f, -9.8f, 0.f};
+  float friction{.5f};
+  float restitution{.1f};
+  size_t iterations{8};
+  // sleepVel is how slow a body must move (and spin) to count as still.
+  float sleepVel{.1f};
+  float sleepTime{.5f};
+
+  // body may be resized between steps, but only by adding or removing bodies
+  // at the end.
+  std::vector<Body> body;
+  PhysicsStats stats;
+
+  // addSphere adds a sphere. A mass of 0 makes a body that never moves.
+  uint32_t addSphere(glm::vec3 pos, float radius, float mass);
+  // addBox adds a box.
+  uint32_t addBox(glm::vec3 pos, glm::vec3 half, float mass,
+                  glm::quat rot = glm::quat(1.f, 0.f, 0.f, 0.f));
+
+  // wake wakes up body i and resets its still time.
+  void wake(uint32_t i) {
+    body[i].awake = body[i].invMass > 0.f;
+    body[i].still = 0.f;
+  }
+
+  // step moves the world forward dt seconds.
+  WARN_UNUSED_RESULT int step(float dt);
+
+  // findPairs is the broadphase. It replaces out with every pair of bodies
+  // whose spheres (Body::radius) overlap, where at least one body is awake,
+  // sorted.
+  void findPairs(std::vector<BodyPair>& out);
+
+ protected:
+  // Contact is one point where two bodies touch. b is noBody for a wall.
+  typedef struct Contact {
+    uint32_t a, b;
+    // n is the normal from a to b. p is the point in world space.
+    glm::vec3 n, p;
+    float depth;
+    // local is p in a's body space, used to match up contacts between steps.
+    glm::vec3 local;
+    // These are set up by the solver.
+    glm::vec3 ra, rb, t1, t2;
+    float massN, massT1, massT2, bias;
+    // jn, jt1 and jt2 are the accumulated impulses.
+    float jn, jt1, jt2;
+  } Contact;
+  static constexpr uint32_t noBody = ~0u;
+
+  std::vector<BodyPair> pair;
+  std::vector<Contact> contact;
+  // prev holds the contacts from the last step, to warm start the solver.
+  // Both contact and prev are sorted by a, then b.
+  std::vector<Contact> prev;
+  // invI is the world space inverse inertia of each body, for this step.
+  std::vector<glm::mat3> invI;
+
+  // GridEntry is a body in the broadphase grid. key is its cell.
+  typedef struct GridEntry {
+    glm::vec3 pos;
+    float r;
+    uint64_t key;
+    uint32_t body;
+    uint32_t awake;
+  } GridEntry;
+  // Broadphase grid: grid holds the bodies sorted by hash bucket. bucketOf is
+  // the bucket of each body. cellStart[h] is the first element of grid in
+  // bucket h.
+  std::vector<GridEntry> grid;
+  std::vector<uint32_t> bucketOf, cellStart;
+
+  // Island finding. islandStill is the still time of each island, at its root.
+  std::vector<uint32_t> parent;
+  std::vector<float> islandStill;
+  uint32_t findRoot(uint32_t i);
+
+  void collide(uint32_t a, uint32_t b);
+  void collideWalls(uint32_t a);
+  void addContact(uint32_t a, uint32_t b, glm::vec3 n, glm::vec3 p,
+                  float depth);
+  void matchPrev();
+  void prepareContacts(float dt);
+  void solveContacts();
+  void sleepIslands(float dt);
+} Physics;
+
+}  // namespace asset
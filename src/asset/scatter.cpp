@@ -0,0 +1,58 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#include "scatter.h"
+
+namespace asset {
+
+constexpr VkDeviceSize Scatter::align;
+
+void Scatter::reset(VkDeviceSize capacity_, size_t nDst) {
+  capacity = capacity_;
+  used = 0;
+  region.resize(nDst);
+  for (auto& r : region) {
+    r.clear();
+  }
+}
+
+int Scatter::add(size_t dst, VkDeviceSize dstOffset, VkDeviceSize size,
+                 VkDeviceSize& srcOffset) {
+  if (dst >= region.size()) {
+    logE("BUG: Scatter::add(%zu) with only %zu dst\n", dst, region.size());
+    return 1;
+  }
+  auto& r = region.at(dst);
+  if (!r.empty() && r.back().srcOffset + r.back().size == used &&
+      r.back().dstOffset + r.back().size == dstOffset) {
+    // Merge with the previous region.
+    if (size > capacity - used) {
+      return 1;
+    }
+    srcOffset = used;
+    r.back().size += size;
+    used += size;
+    return 0;
+  }
+  VkDeviceSize start = alignUp(used);
+  if (start > capacity || size > capacity - start) {
+    return 1;
+  }
+  r.emplace_back();
+  r.back().srcOffset = start;
+  r.back().dstOffset = dstOffset;
+  r.back().size = size;
+  srcOffset = start;
+  used = start + size;
+  return 0;
+}
+
+size_t Scatter::regionCount() const {
+  size_t n = 0;
+  for (auto& r : region) {
+    n += r.size();
+  }
+  return n;
+}
+
+}  // namespace asset
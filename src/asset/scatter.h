@@ -0,0 +1,59 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#include <src/command/command.h>
+
+#include <vector>
+
+#pragma once
+
+namespace asset {
+
+// Scatter packs many writes to scattered locations in one or more buffers
+// into a single staging buffer. Each write is one VkBufferCopy region, but
+// writes that are next to each other in both the staging buffer and the
+// destination are merged into one region.
+//
+// Scatter only does the bookkeeping on the CPU. The caller writes the data
+// at srcOffset and then records vkCmdCopyBuffer with region.at(dst).
+typedef struct Scatter {
+  // reset discards all regions. capacity is the size of the staging buffer in
+  // bytes. nDst is the number of destination buffers.
+  void reset(VkDeviceSize capacity, size_t nDst);
+
+  // add reserves 'size' bytes of staging for a write to 'dstOffset' in
+  // destination 'dst'. On success it sets srcOffset and returns 0. It returns
+  // 1 without logging anything if the staging buffer is full.
+  WARN_UNUSED_RESULT int add(size_t dst, VkDeviceSize dstOffset,
+                             VkDeviceSize size, VkDeviceSize& srcOffset);
+
+  // avail returns how many bytes could still be added, assuming none of them
+  // are merged into an existing region.
+  VkDeviceSize avail() const {
+    VkDeviceSize u = alignUp(used);
+    return u < capacity ? capacity - u : 0;
+  }
+
+  VkDeviceSize getUsed() const { return used; }
+  VkDeviceSize getCapacity() const { return capacity; }
+  bool empty() const { return !used; }
+
+  // regionCount returns the total number of regions for all destinations.
+  size_t regionCount() const;
+
+  // region holds the VkBufferCopy regions for each destination.
+  std::vector<std::vector<VkBufferCopy>> region;
+
+  // align is the alignment of the start of each region in the staging buffer.
+  static constexpr VkDeviceSize align = 16;
+
+ protected:
+  VkDeviceSize capacity{0};
+  VkDeviceSize used{0};
+
+  static VkDeviceSize alignUp(VkDeviceSize v) {
+    return (v + align - 1) & ~(align - 1);
+  }
+} Scatter;
+
+}  // namespace asset
@@ -31,6 +31,7 @@ Frustum::Frustum(glm::mat4 view) : view(view) {
     for (int s = 0; s < axis*2; s += axis) {
       auto n = glm::cross(invpt[s + a1] - invpt[s], invpt[s + a2] - invpt[s]);
       plane.push_back(glm::vec4(n, -glm::dot(invpt[s], n)));
+      planeLen.push_back(glm::length(n));
       // exchange a1 and a2 in place
       a1 ^= a2;
       a2 ^= a1;
@@ -50,16 +51,10 @@ bool Frustum::isVisible(glm::vec4 p) {
 
 bool Frustum::isVisible(AABB box) {
   for (size_t i = 0; i < plane.size(); i++) {
-    float test = -1.f;  // if test stays below 0, plane[i] rejects all corners
-    for (int x = 0; x < 2; x++) {
-      for (int y = 0; y < 2; y++) {
-        for (int z = 0; z < 2; z++) {
-          test = std::max(test, glm::dot(plane.at(i),
-              glm::vec4(box[x].x, box[y].y, box[z].z, 1.f)));  // test a corner
-        }
-      }
-    }
-    if (test < 0.f) {
+    // Only the corner farthest along the normal needs to be tested: if
+    // plane[i] rejects it, plane[i] rejects all corners.
+    const glm::vec4& p = plane[i];
+    if (dist(i, box[p.x > 0.f].x, box[p.y > 0.f].y, box[p.z > 0.f].z) < 0.f) {
       return false;
     }
   }
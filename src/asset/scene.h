@@ -54,7 +54,7 @@ typedef struct AABB {
   }
 
   const glm::vec3& operator[](size_t i) const {
-    return operator[](i);
+    return const_cast<AABB*>(this)->operator[](i);
   }
 
   void extend(glm::vec3 p) {
@@ -67,6 +67,50 @@ typedef struct AABB {
   }
 } AABB;
 
+// BoxSoA holds many AABBs for Frustum::cull. Each coordinate has its own
+// array so cull can load several boxes into one SIMD register. The arrays
+// are padded to a multiple of pad.
+typedef struct BoxSoA {
+  static constexpr size_t pad = 8;
+  // bound[0] is the min x, y, z and bound[1] the max x, y, z, like AABB.
+  std::vector<float> bound[2][3];
+  // plane is the plane that rejected each group of pad boxes the last time
+  // Frustum::cull ran. cull tests it first, since the same plane usually
+  // rejects the same boxes frame after frame.
+  std::vector<uint8_t> plane;
+
+  size_t size() const { return n; }
+  void resize(size_t n_);
+  void set(size_t i, const AABB& box);
+  void push_back(const AABB& box) {
+    resize(n + 1);
+    set(n - 1, box);
+  }
+
+ protected:
+  size_t n{0};
+} BoxSoA;
+
+// SphereSoA holds many bounding spheres for Frustum::cull, padded like
+// BoxSoA.
+typedef struct SphereSoA {
+  static constexpr size_t pad = BoxSoA::pad;
+  std::vector<float> center[3];
+  std::vector<float> radius;
+  std::vector<uint8_t> plane;  // Same as BoxSoA::plane.
+
+  size_t size() const { return n; }
+  void resize(size_t n_);
+  void set(size_t i, glm::vec3 c, float r);
+  void push_back(glm::vec3 c, float r) {
+    resize(n + 1);
+    set(n - 1, c, r);
+  }
+
+ protected:
+  size_t n{0};
+} SphereSoA;
+
 // Frustum takes a glm::mat4 (presumably camera.proj * camera.view) and inverts
 // it to define pt and plane in the world which would clip to the frustum in
 // camera space.
@@ -76,6 +120,8 @@ typedef struct Frustum {
   glm::mat4 viewInv;
   std::vector<glm::vec3> invpt;
   std::vector<glm::vec4> plane;
+  // planeLen is the length of the normal of each plane.
+  std::vector<float> planeLen;
 
   // isVisible returns true if p is visible in camera space.
   bool isVisible(glm::vec4 p);
@@ -85,12 +131,128 @@ typedef struct Frustum {
 
   // isVisible returns true if box is visible in camera space.
   bool isVisible(AABB box);
+
+  // isVisible returns true if the sphere at c with radius r is visible.
+  bool isVisible(glm::vec3 c, float r);
+
+  // cull replaces 'visible' with the index of each box that is visible, in
+  // order. It gives exactly the same answer as isVisible(AABB), but tests
+  // several boxes at once and updates box.plane.
+  WARN_UNUSED_RESULT int cull(BoxSoA& box, std::vector<uint32_t>& visible);
+  // cull does the same for bounding spheres.
+  WARN_UNUSED_RESULT int cull(SphereSoA& sphere,
+                              std::vector<uint32_t>& visible);
+
+  // cullIndirect is the CPU reference for CullGPU. sphere j is drawn by
+  // cmd[draw[j]]. First call layoutIndirect to set each cmd's firstInstance.
+  // cullIndirect then sets each cmd's instanceCount to how many of its
+  // spheres are visible and writes their indices, in order, to 'visible'
+  // starting at firstInstance. (CullGPU writes them in any order.)
+  WARN_UNUSED_RESULT int cullIndirect(
+      SphereSoA& sphere, const std::vector<uint32_t>& draw,
+      std::vector<VkDrawIndexedIndirectCommand>& cmd,
+      std::vector<uint32_t>& visible);
+
+  // dist is the distance from plane[i] to (x, y, z), times planeLen[i].
+  // isVisible and cull add in the same order so they always agree.
+  float dist(size_t i, float x, float y, float z) const {
+    const glm::vec4& p = plane[i];
+    return (p.x * x + p.y * y) + (p.z * z + p.w);
+  }
 } Frustum;
 
+// layoutIndirect sets each cmd's firstInstance so cmd[d] has room in a
+// visible list for every object drawn by it (every j where draw[j] == d).
+// It resizes visible to hold them all.
+WARN_UNUSED_RESULT int layoutIndirect(
+    const std::vector<uint32_t>& draw,
+    std::vector<VkDrawIndexedIndirectCommand>& cmd,
+    std::vector<uint32_t>& visible);
+
+// BvhStats measures the quality of a Bvh.
+typedef struct BvhStats {
+  size_t nodes{0};
+  size_t leaves{0};
+  size_t depth{0};
+  // sah is the surface area heuristic cost of the tree: the expected number
+  // of node and object tests for a random ray that hits the root. Lower is
+  // better. Refit makes it grow as objects move.
+  float sah{0};
+} BvhStats;
+
+// Bvh is a bounding volume hierarchy over the AABBs of objects. An object is
+// its index in the vector passed to build(). Queries return object indices.
+// When objects move, refit() is much cheaper than build() but the tree gets
+// worse; update() refits and only rebuilds when the tree is too far gone.
+typedef struct Bvh {
+  // Node is a box around all the objects under it. A leaf has count > 0 and
+  // holds obj[first] to obj[first + count - 1]. Otherwise its children are
+  // node[first] and node[first + 1].
+  typedef struct Node {
+    AABB box;
+    uint32_t first{0};
+    uint32_t count{0};
+  } Node;
+
+  // maxLeaf is the most objects a leaf may hold. A leaf holds fewer if it is
+  // cheaper to split it.
+  uint32_t maxLeaf{4};
+  // rebuildRatio is how much update() lets sah grow before rebuilding.
+  float rebuildRatio{1.5f};
+
+  std::vector<Node> node;  // node[0] is the root.
+  std::vector<uint32_t> obj;
+
+  // build discards the tree and builds a new one with a binned surface area
+  // heuristic.
+  WARN_UNUSED_RESULT int build(const std::vector<AABB>& box);
+  // refit updates every node's box after objects moved. box must be the
+  // same size as in build().
+  WARN_UNUSED_RESULT int refit(const std::vector<AABB>& box);
+  // update calls refit, then build if sah is over rebuildRatio times what it
+  // was after the last build.
+  WARN_UNUSED_RESULT int update(const std::vector<AABB>& box);
+
+  // stats computes the current BvhStats. sah is as of the last build or
+  // refit.
+  BvhStats stats() const;
+  // builds counts calls to build, including from update.
+  size_t builds{0};
+  // refits counts calls to refit, including from update.
+  size_t refits{0};
+
+  // query replaces out with every object that Frustum::isVisible says is
+  // visible. box must be the same as in the last build or refit.
+  void query(const Frustum& f, const std::vector<AABB>& box,
+             std::vector<uint32_t>& out) const;
+  // query replaces out with every object whose box overlaps 'b'.
+  void query(const AABB& b, const std::vector<AABB>& box,
+             std::vector<uint32_t>& out) const;
+  // pick finds the nearest object whose box is hit by the ray from orig in
+  // the direction dir. It returns false if none are hit. t is the distance
+  // along dir to the hit, or 0 if orig is inside the box.
+  bool pick(glm::vec3 orig, glm::vec3 dir, const std::vector<AABB>& box,
+            uint32_t& hit, float& t) const;
+
+ protected:
+  float builtSah{0};
+  float sah{0};
+  // split sets n.box and returns how many objects in n go in the left
+  // child, or 0 if n should be a leaf. It reorders obj.
+  uint32_t split(const std::vector<AABB>& box,
+                 const std::vector<glm::vec3>& center, Node& n);
+  // fit recomputes each node's box and returns the sah of the tree.
+  float fit(const std::vector<AABB>& box);
+} Bvh;
+
 typedef struct Scene {
   std::vector<std::shared_ptr<Library>> lib;
   std::vector<Camera> camera;
   std::vector<LightSpot> lightSpot;
+  // box is the bounds of each object in the scene, and bvh is built from
+  // box. The app decides what an object is (an instance, an asset, ...).
+  std::vector<AABB> box;
+  Bvh bvh;
 } Scene;
 
 // FullscreenQuad takes a vertex and fragment shader and renders a single
@@ -0,0 +1,108 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define ASSET_SIMD_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ASSET_SIMD_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define ASSET_SIMD_NEON
+#endif
+
+#pragma once
+
+namespace asset {
+namespace simd {
+
+// Lanes is the widest float vector available. It is a plain float if there
+// is none, so code written with it works everywhere. Mask is the result of
+// comparing two Lanes.
+#if defined(ASSET_SIMD_AVX)
+typedef __m256 Lanes;
+typedef __m256 Mask;
+static constexpr size_t lanes = 8;
+inline Lanes load(const float* p) { return _mm256_loadu_ps(p); }
+inline void store(float* p, Lanes a) { _mm256_storeu_ps(p, a); }
+inline Lanes splat(float f) { return _mm256_set1_ps(f); }
+inline Lanes iota() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+inline Lanes add(Lanes a, Lanes b) { return _mm256_add_ps(a, b); }
+inline Lanes mul(Lanes a, Lanes b) { return _mm256_mul_ps(a, b); }
+inline Lanes min(Lanes a, Lanes b) { return _mm256_min_ps(a, b); }
+inline Mask less(Lanes a, Lanes b) {
+  return _mm256_cmp_ps(a, b, _CMP_LT_OQ);
+}
+inline Mask greaterEq(Lanes a, Lanes b) {
+  return _mm256_cmp_ps(a, b, _CMP_GE_OQ);
+}
+inline Mask both(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+inline unsigned bits(Mask m) { return _mm256_movemask_ps(m); }
+inline Lanes select(Mask m, Lanes a, Lanes b) {
+  return _mm256_blendv_ps(b, a, m);
+}
+#elif defined(ASSET_SIMD_SSE2)
+typedef __m128 Lanes;
+typedef __m128 Mask;
+static constexpr size_t lanes = 4;
+inline Lanes load(const float* p) { return _mm_loadu_ps(p); }
+inline void store(float* p, Lanes a) { _mm_storeu_ps(p, a); }
+inline Lanes splat(float f) { return _mm_set1_ps(f); }
+inline Lanes iota() { return _mm_setr_ps(0, 1, 2, 3); }
+inline Lanes add(Lanes a, Lanes b) { return _mm_add_ps(a, b); }
+inline Lanes mul(Lanes a, Lanes b) { return _mm_mul_ps(a, b); }
+inline Lanes min(Lanes a, Lanes b) { return _mm_min_ps(a, b); }
+inline Mask less(Lanes a, Lanes b) { return _mm_cmplt_ps(a, b); }
+inline Mask greaterEq(Lanes a, Lanes b) { return _mm_cmpge_ps(a, b); }
+inline Mask both(Mask a, Mask b) { return _mm_and_ps(a, b); }
+inline unsigned bits(Mask m) { return _mm_movemask_ps(m); }
+inline Lanes select(Mask m, Lanes a, Lanes b) {
+  return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+}
+#elif defined(ASSET_SIMD_NEON)
+typedef float32x4_t Lanes;
+typedef uint32x4_t Mask;
+static constexpr size_t lanes = 4;
+inline Lanes load(const float* p) { return vld1q_f32(p); }
+inline void store(float* p, Lanes a) { vst1q_f32(p, a); }
+inline Lanes splat(float f) { return vdupq_n_f32(f); }
+inline Lanes iota() {
+  static const float i[4] = {0, 1, 2, 3};
+  return vld1q_f32(i);
+}
+inline Lanes add(Lanes a, Lanes b) { return vaddq_f32(a, b); }
+inline Lanes mul(Lanes a, Lanes b) { return vmulq_f32(a, b); }
+inline Lanes min(Lanes a, Lanes b) { return vminq_f32(a, b); }
+inline Mask less(Lanes a, Lanes b) { return vcltq_f32(a, b); }
+inline Mask greaterEq(Lanes a, Lanes b) { return vcgeq_f32(a, b); }
+inline Mask both(Mask a, Mask b) { return vandq_u32(a, b); }
+inline unsigned bits(Mask m) {
+  static const int32_t bit[4] = {0, 1, 2, 3};
+  return vaddvq_u32(vshlq_u32(vshrq_n_u32(m, 31), vld1q_s32(bit)));
+}
+inline Lanes select(Mask m, Lanes a, Lanes b) { return vbslq_f32(m, a, b); }
+#else
+typedef float Lanes;
+typedef bool Mask;
+static constexpr size_t lanes = 1;
+inline Lanes load(const float* p) { return *p; }
+inline void store(float* p, Lanes a) { *p = a; }
+inline Lanes splat(float f) { return f; }
+inline Lanes iota() { return 0.f; }
+inline Lanes add(Lanes a, Lanes b) { return a + b; }
+inline Lanes mul(Lanes a, Lanes b) { return a * b; }
+inline Lanes min(Lanes a, Lanes b) { return (b < a) ? b : a; }
+inline Mask less(Lanes a, Lanes b) { return a < b; }
+inline Mask greaterEq(Lanes a, Lanes b) { return a >= b; }
+inline Mask both(Mask a, Mask b) { return a && b; }
+inline unsigned bits(Mask m) { return m; }
+inline Lanes select(Mask m, Lanes a, Lanes b) { return m ? a : b; }
+#endif
+
+}  // namespace simd
+}  // namespace asset
@@ -0,0 +1,244 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#include "suballoc.h"
+
+#include <algorithm>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace asset {
+
+constexpr unsigned Suballoc::slLog2;
+constexpr unsigned Suballoc::slCount;
+constexpr unsigned Suballoc::flCount;
+constexpr uint32_t Suballoc::none;
+
+// msb returns the index of the highest set bit. x must not be 0.
+static inline unsigned msb(uint64_t x) {
+#ifdef _MSC_VER
+  unsigned long r;
+  _BitScanReverse64(&r, x);
+  return (unsigned)r;
+#else
+  return 63 - __builtin_clzll(x);
+#endif
+}
+
+// lsb returns the index of the lowest set bit. x must not be 0.
+static inline unsigned lsb(uint64_t x) {
+#ifdef _MSC_VER
+  unsigned long r;
+  _BitScanForward64(&r, x);
+  return (unsigned)r;
+#else
+  return __builtin_ctzll(x);
+#endif
+}
+
+// mapping finds the bin for a block of 'size'.
+static inline void mapping(size_t size, unsigned& fl, unsigned& sl) {
+  if (size < Suballoc::slCount) {
+    // The first level 0 is linear: one bin per size.
+    fl = 0;
+    sl = (unsigned)size;
+    return;
+  }
+  unsigned m = msb(size);
+  fl = m - Suballoc::slLog2 + 1;
+  sl = (unsigned)(size >> (m - Suballoc::slLog2)) - Suballoc::slCount;
+}
+
+void Suballoc::reset(size_t size) {
+  node.clear();
+  unusedNode.clear();
+  flBitmap = 0;
+  for (unsigned fl = 0; fl < flCount; fl++) {
+    slBitmap[fl] = 0;
+    for (unsigned sl = 0; sl < slCount; sl++) {
+      bin[fl][sl] = none;
+    }
+  }
+  total = size;
+  used = 0;
+  usedBlocks = 0;
+  freeBlocks = 0;
+  if (size) {
+    uint32_t id = newNode();
+    node.at(id).size = size;
+    insertFree(id);
+  }
+}
+
+uint32_t Suballoc::newNode() {
+  if (!unusedNode.empty()) {
+    uint32_t id = unusedNode.back();
+    unusedNode.pop_back();
+    return id;
+  }
+  node.emplace_back();
+  return node.size() - 1;
+}
+
+void Suballoc::insertFree(uint32_t id) {
+  Node& n = node[id];
+  unsigned fl, sl;
+  mapping(n.size, fl, sl);
+  uint32_t head = bin[fl][sl];
+  n.isFree = true;
+  n.prevFree = none;
+  n.nextFree = head;
+  if (head != none) {
+    node[head].prevFree = id;
+  }
+  bin[fl][sl] = id;
+  slBitmap[fl] |= 1u << sl;
+  flBitmap |= uint64_t(1) << fl;
+  freeBlocks++;
+}
+
+void Suballoc::removeFree(uint32_t id) {
+  Node& n = node[id];
+  unsigned fl, sl;
+  mapping(n.size, fl, sl);
+  if (n.prevFree != none) {
+    node[n.prevFree].nextFree = n.nextFree;
+  } else {
+    bin[fl][sl] = n.nextFree;
+    if (n.nextFree == none) {
+      slBitmap[fl] &= ~(1u << sl);
+      if (!slBitmap[fl]) {
+        flBitmap &= ~(uint64_t(1) << fl);
+      }
+    }
+  }
+  if (n.nextFree != none) {
+    node[n.nextFree].prevFree = n.prevFree;
+  }
+  n.isFree = false;
+  n.prevFree = none;
+  n.nextFree = none;
+  freeBlocks--;
+}
+
+void Suballoc::absorbNext(uint32_t id) {
+  uint32_t nx = node[id].nextPhys;
+  node[id].size += node[nx].size;
+  node[id].nextPhys = node[nx].nextPhys;
+  if (node[id].nextPhys != none) {
+    node[node[id].nextPhys].prevPhys = id;
+  }
+  node[nx] = Node();  // size = 0 marks nx as unused.
+  unusedNode.push_back(nx);
+}
+
+int Suballoc::alloc(size_t size, size_t& base, uint32_t& id) {
+  if (!size || size > total - used) {
+    return 1;
+  }
+
+  // Round size up to the next bin so any block found there is big enough.
+  size_t want = size;
+  if (want >= slCount) {
+    size_t round = (size_t(1) << (msb(want) - slLog2)) - 1;
+    want = (want + round < want) ? want : want + round;
+  }
+  unsigned fl, sl;
+  mapping(want, fl, sl);
+
+  uint32_t found = none;
+  uint32_t slMap = slBitmap[fl] & (~0u << sl);
+  if (!slMap) {
+    uint64_t flMap = (fl + 1 < flCount) ? flBitmap & (~uint64_t(0) << (fl + 1))
+                                        : 0;
+    if (flMap) {
+      fl = lsb(flMap);
+      slMap = slBitmap[fl];
+    }
+  }
+  if (slMap) {
+    found = bin[fl][lsb(slMap)];
+  } else {
+    // The rounding skipped the bin 'size' belongs in. Search it before
+    // giving up. This is only reached when the buffer is almost full.
+    mapping(size, fl, sl);
+    for (uint32_t i = bin[fl][sl]; i != none; i = node[i].nextFree) {
+      if (node[i].size >= size) {
+        found = i;
+        break;
+      }
+    }
+    if (found == none) {
+      return 1;
+    }
+  }
+
+  carve(found, size);
+  base = node[found].base;
+  id = found;
+  return 0;
+}
+
+void Suballoc::carve(uint32_t id, size_t size) {
+  removeFree(id);
+  if (node[id].size > size) {
+    // Split off the unused part of id. newNode may resize 'node'.
+    uint32_t rest = newNode();
+    Node& n = node[id];
+    Node& r = node[rest];
+    r.base = n.base + size;
+    r.size = n.size - size;
+    r.prevPhys = id;
+    r.nextPhys = n.nextPhys;
+    if (r.nextPhys != none) {
+      node[r.nextPhys].prevPhys = rest;
+    }
+    n.nextPhys = rest;
+    n.size = size;
+    insertFree(rest);
+  }
+  used += size;
+  usedBlocks++;
+}
+
+int Suballoc::free(uint32_t id) {
+  if (id >= node.size() || !node[id].size || node[id].isFree) {
+    logE("BUG: Suballoc::free(%zu) is not allocated\n", (size_t)id);
+    return 1;
+  }
+  used -= node[id].size;
+  usedBlocks--;
+  uint32_t prev = node[id].prevPhys;
+  if (prev != none && node[prev].isFree) {
+    removeFree(prev);
+    absorbNext(prev);
+    id = prev;
+  }
+  uint32_t next = node[id].nextPhys;
+  if (next != none && node[next].isFree) {
+    removeFree(next);
+    absorbNext(id);
+  }
+  insertFree(id);
+  return 0;
+}
+
+void Suballoc::getStats(Stats& out) const {
+  out.total = total;
+  out.used = used;
+  out.usedBlocks = usedBlocks;
+  out.freeBlocks = freeBlocks;
+  out.largestFree = 0;
+  if (!flBitmap) {
+    return;
+  }
+  unsigned fl = msb(flBitmap);
+  unsigned sl = msb(slBitmap[fl]);
+  for (uint32_t i = bin[fl][sl]; i != none; i = node[i].nextFree) {
+    out.largestFree = std::max(out.largestFree, node[i].size);
+  }
+}
+
+}  // namespace asset
@@ -0,0 +1,103 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#include <src/command/command.h>
+
+#include <vector>
+
+#pragma once
+
+namespace asset {
+
+// Suballoc tracks which ranges of a buffer are in use. It does not touch the
+// buffer itself, so it runs entirely on the CPU. The units are up to the
+// caller: Library uses one Suballoc counting vertices and one counting
+// indices.
+//
+// Suballoc is a two-level segregated fit (TLSF) allocator. Free blocks are
+// kept in bins: the first level is the power of two of the block size, the
+// second level splits each power of two into 2^slLog2 linear steps. A pair of
+// bitmaps finds a non-empty bin in O(1), so alloc() and free() are O(1) no
+// matter how many blocks there are. free() merges a block with its free
+// neighbors immediately ("eager coalescing"), so there are never two free
+// blocks side by side.
+typedef struct Suballoc {
+  Suballoc() { reset(0); }
+
+  // reset discards all allocations and makes [0, size) one free block.
+  void reset(size_t size);
+
+  // alloc finds a free block of at least 'size' units and carves 'size' units
+  // off the front of it. On success it sets 'base' and 'id' and returns 0.
+  // If no free block is big enough it returns 1 without logging anything -
+  // the caller decides whether that is an error.
+  WARN_UNUSED_RESULT int alloc(size_t size, size_t& base, uint32_t& id);
+
+  // free returns block 'id' (from alloc) to the free bins.
+  WARN_UNUSED_RESULT int free(uint32_t id);
+
+  // Stats describes the current state of the Suballoc.
+  typedef struct Stats {
+    size_t total{0};
+    size_t used{0};
+    size_t usedBlocks{0};
+    size_t freeBlocks{0};
+    size_t largestFree{0};
+
+    // fragmentation is 0 if all free space is in one block, and approaches 1
+    // as the free space is split into many small blocks.
+    float fragmentation() const {
+      size_t f = total - used;
+      return f ? 1.f - float(largestFree) / float(f) : 0.f;
+    }
+  } Stats;
+
+  // getStats fills in 'out'. It only has to scan the largest non-empty bin.
+  void getStats(Stats& out) const;
+
+  size_t getTotal() const { return total; }
+  size_t getUsed() const { return used; }
+
+  // slLog2 is log2 of the number of second level bins.
+  static constexpr unsigned slLog2 = 4;
+  static constexpr unsigned slCount = 1u << slLog2;
+  static constexpr unsigned flCount = 64;
+  static constexpr uint32_t none = (uint32_t)-1;
+
+ protected:
+  typedef struct Node {
+    size_t base{0};
+    size_t size{0};
+    // prevPhys and nextPhys are the neighbors in the buffer.
+    uint32_t prevPhys{none};
+    uint32_t nextPhys{none};
+    // prevFree and nextFree link the nodes in one bin.
+    uint32_t prevFree{none};
+    uint32_t nextFree{none};
+    bool isFree{false};
+  } Node;
+
+  // node holds all blocks, both used and free. An id is an index in node.
+  std::vector<Node> node;
+  // unusedNode lists the ids in node that can be recycled.
+  std::vector<uint32_t> unusedNode;
+
+  uint64_t flBitmap{0};
+  uint32_t slBitmap[flCount];
+  uint32_t bin[flCount][slCount];
+
+  size_t total{0};
+  size_t used{0};
+  size_t usedBlocks{0};
+  size_t freeBlocks{0};
+
+  uint32_t newNode();
+  // carve marks the free node 'id' used, splitting off anything past 'size'.
+  void carve(uint32_t id, size_t size);
+  void insertFree(uint32_t id);
+  void removeFree(uint32_t id);
+  // absorbNext merges node 'id' with the node after it, which must be free.
+  void absorbNext(uint32_t id);
+} Suballoc;
+
+}  // namespace asset
@@ -0,0 +1,198 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#endif
+#include "terrain.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+namespace asset {
+
+static constexpr int dbg = 0;
+
+int HeightMapTile::toVertices(VertexIndex& out) {
+  return grid(x0, z0, x1, z1, step, skirt, out);
+}
+
+int HeightMapTile::toLodVertices(uint32_t level, VertexIndex& out,
+                                 float& error) {
+  size_t s = step << std::min(level, 31u);
+  if (grid(x0, z0, x1, z1, s, skirt, out)) {
+    return 1;
+  }
+  error = gridError(x0, z0, x1, z1, s);
+  return 0;
+}
+
+int HeightMapTile::hash(Hasher& h) const {
+  size_t height;
+  if (!pt || hashBase(h, "HeightMapTile") || checkSize(height) ||
+      x1 >= width || z1 >= height) {
+    return 1;
+  }
+  h.add(width);
+  h.add(scaleX);
+  h.add(aspect);
+  h.add(x0);
+  h.add(z0);
+  h.add(x1);
+  h.add(z1);
+  h.add(step);
+  h.add(skirt);
+  // grid() reads one step outside the tile, and each level of detail
+  // doubles step.
+  size_t s = step << std::min(lods ? lods - 1 : 0, 31u);
+  size_t lx = x0 > s ? x0 - s : 0, hx = std::min(x1 + s, width - 1);
+  size_t lz = z0 > s ? z0 - s : 0, hz = std::min(z1 + s, height - 1);
+  for (size_t z = lz; z <= hz; z++) {
+    h.add(&pt->at(z * width + lx), sizeof(HeightMapPoint) * (hx - lx + 1));
+  }
+  return 0;
+}
+
+int HeightMapTiles::ctorError() {
+  if (!pt || width < 2 || pt->size() % width || pt->size() / width < 2 ||
+      !tileSize) {
+    logE("HeightMapTiles: invalid pt=%zu width=%zu tileSize=%zu\n",
+         pt ? pt->size() : 0, width, tileSize);
+    return 1;
+  }
+  height_ = pt->size() / width;
+  tilesX = (width - 2) / tileSize + 1;
+  tilesZ = (height_ - 2) / tileSize + 1;
+  tile.clear();
+  tile.resize(tilesX * tilesZ);
+  dirty_.assign(tile.size(), 1);
+  return 0;
+}
+
+void HeightMapTiles::setDirty(size_t x0, size_t z0, size_t x1, size_t z1) {
+  if (tile.empty()) {
+    return;
+  }
+  // A tile also uses the points one step outside it to compute the normals.
+  // step is at most tileSize, so only the tiles next to the rect can use it.
+  size_t txLo = x0 / tileSize, tzLo = z0 / tileSize;
+  txLo -= txLo > 0;
+  tzLo -= tzLo > 0;
+  size_t txHi = std::min(x1 / tileSize + 1, tilesX - 1);
+  size_t tzHi = std::min(z1 / tileSize + 1, tilesZ - 1);
+  for (size_t tz = tzLo; tz <= tzHi; tz++) {
+    for (size_t tx = txLo; tx <= txHi; tx++) {
+      size_t t = tz * tilesX + tx;
+      size_t s = tile[t] ? tile[t]->step : 1;
+      size_t lx = tx * tileSize, lz = tz * tileSize;
+      size_t hx = std::min(lx + tileSize, width - 1);
+      size_t hz = std::min(lz + tileSize, height_ - 1);
+      if (x1 + s >= lx && x0 <= hx + s && z1 + s >= lz && z0 <= hz + s) {
+        dirty_[t] = 1;
+      }
+    }
+  }
+}
+
+size_t HeightMapTiles::stepAt(size_t t, glm::vec3 eye) const {
+  if (lodDist <= 0.f) {
+    return 1;
+  }
+  // Find the horizontal distance from eye to the tile.
+  size_t tx = t % tilesX, tz = t / tilesX;
+  float lx = tx * tileSize * scaleX;
+  float hx = std::min((tx + 1) * tileSize, width - 1) * scaleX;
+  float lz = tz * tileSize * scaleX * aspect;
+  float hz = std::min((tz + 1) * tileSize, height_ - 1) * scaleX * aspect;
+  float dx = std::max(std::max(lx - eye.x, eye.x - hx), 0.f);
+  float dz = std::max(std::max(lz - eye.z, eye.z - hz), 0.f);
+  float d = sqrtf(dx * dx + dz * dz);
+  size_t step = 1;
+  for (float far = lodDist; d >= far && step * 2 <= tileSize; far *= 2) {
+    step *= 2;
+  }
+  return step;
+}
+
+std::shared_ptr<HeightMapTile> HeightMapTiles::makeTile(size_t t,
+                                                       size_t step) const {
+  auto a = std::make_shared<HeightMapTile>();
+  a->pt = pt;
+  a->width = width;
+  a->scaleX = scaleX;
+  a->aspect = aspect;
+  a->optimize = optimize;
+  a->eval = eval;
+  a->x0 = (t % tilesX) * tileSize;
+  a->z0 = (t / tilesX) * tileSize;
+  a->x1 = std::min(a->x0 + tileSize, width - 1);
+  a->z1 = std::min(a->z0 + tileSize, height_ - 1);
+  a->step = step;
+  a->skirt = skirt;
+  return a;
+}
+
+int HeightMapTiles::update(glm::vec3 eye,
+                           std::vector<std::shared_ptr<BaseAsset>>& added,
+                           std::vector<std::shared_ptr<BaseAsset>>& deleted) {
+  if (tile.empty()) {
+    logE("HeightMapTiles::update: call ctorError first\n");
+    return 1;
+  }
+  for (size_t t = 0; t < tile.size(); t++) {
+    size_t step = stepAt(t, eye);
+    if (!dirty_[t] && tile[t] && tile[t]->step == step) {
+      continue;
+    }
+    dirty_[t] = 0;
+    if (tile[t]) {
+      deleted.emplace_back(tile[t]);
+    }
+    tile[t] = makeTile(t, step);
+    added.emplace_back(tile[t]);
+  }
+  if (dbg) logI("HeightMapTiles: %zu added %zu deleted\n", added.size(),
+                deleted.size());
+  return 0;
+}
+
+int HeightMapTiles::update(glm::vec3 eye, Library& lib) {
+  if (tile.empty()) {
+    logE("HeightMapTiles::update: call ctorError first\n");
+    return 1;
+  }
+  for (size_t t = 0; t < tile.size(); t++) {
+    size_t step = stepAt(t, eye);
+    auto& a = tile[t];
+    if (!dirty_[t] && a && a->step == step) {
+      continue;
+    }
+    if (a && a->state() != READY) {
+      continue;  // Try again after it is READY.
+    }
+    dirty_[t] = 0;
+    if (a && a->step == step) {
+      // Only the heights changed: regenerate it in place.
+      if (lib.update(a)) {
+        logE("HeightMapTiles::update: update failed\n");
+        return 1;
+      }
+      continue;
+    }
+    if (a && lib.del(a)) {
+      logE("HeightMapTiles::update: del failed\n");
+      return 1;
+    }
+    a = makeTile(t, step);
+    if (lib.add(a)) {
+      logE("HeightMapTiles::update: add failed\n");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+}  // namespace asset
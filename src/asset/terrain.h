@@ -0,0 +1,90 @@
+/* Copyright (c) 2017-2018 the Volcano Authors. Licensed under the GPLv3.
+ */
+
+#include "asset.h"
+
+#pragma once
+
+namespace asset {
+
+// HeightMapTile is the part of a HeightMap from (x0, z0) to (x1, z1),
+// inclusive. Its vertices are in the same place as the HeightMap's, so a tile
+// is drawn with the same instance transform as the whole HeightMap would be.
+// Tiles that share an edge also share the normals on it.
+typedef struct HeightMapTile : public HeightMap {
+  size_t x0{0}, z0{0}, x1{1}, z1{1};
+  // step samples every step'th row and column of the tile.
+  size_t step{1};
+  // skirt is how far down the skirt on each edge hangs. 0 means no skirt.
+  float skirt{0};
+
+  // toVertices validates the asset, calls eval and writes the result to 'out'.
+  virtual int toVertices(VertexIndex& out);
+  // toLodVertices doubles step for each level.
+  virtual int toLodVertices(uint32_t level, VertexIndex& out, float& error);
+  // hash only reads the part of pt the tile uses.
+  virtual int hash(Hasher& h) const;
+} HeightMapTile;
+
+// HeightMapTiles splits a large HeightMap into tiles of tileSize x tileSize
+// quads. Each tile is its own asset, so changing a height only regenerates
+// and uploads the tiles that use it, instead of the whole HeightMap.
+//
+// Tiles far from the eye use a larger step (fewer tris). Tiles with
+// different steps do not share all the vertices on their edge. The skirts
+// hide the cracks.
+typedef struct HeightMapTiles {
+  // pt, width, scaleX and aspect are the same as in HeightMap. Tiles hold a
+  // reference to pt. Change the heights in pt, then call setDirty().
+  std::shared_ptr<std::vector<HeightMapPoint>> pt;
+  size_t width{2};
+  float scaleX{1.0f};
+  float aspect{1.0f};
+  // tileSize is the number of quads along each side of a tile.
+  size_t tileSize{64};
+  // skirt is copied to HeightMapTile::skirt.
+  float skirt{1.0f};
+  // lodDist is the distance at which a tile switches to step = 2. At 2 *
+  // lodDist, step = 4, and so on, up to tileSize. If 0, step is always 1.
+  float lodDist{0.f};
+  // optimize and eval are copied to each tile.
+  uint32_t optimize{0};
+  std::pair<VertexEvalFn, void*> eval{nullptr, nullptr};
+
+  // tile holds the current asset of each tile. tile[tz * tilesX + tx] starts
+  // at (tx * tileSize, tz * tileSize). update() replaces the assets.
+  std::vector<std::shared_ptr<HeightMapTile>> tile;
+  size_t tilesX{0}, tilesZ{0};
+
+  // ctorError validates pt and width and sets up the tiles. All the tiles
+  // are dirty.
+  WARN_UNUSED_RESULT int ctorError();
+
+  // setDirty marks the tiles that use any point from (x0, z0) to (x1, z1),
+  // inclusive.
+  void setDirty(size_t x0, size_t z0, size_t x1, size_t z1);
+  void setDirty(size_t x, size_t z) { setDirty(x, z, x, z); }
+
+  // update makes a new asset for each tile that is dirty or that should
+  // have a different step at 'eye'. The new assets are appended to 'added'
+  // and the old ones to 'deleted'.
+  WARN_UNUSED_RESULT int update(
+      glm::vec3 eye, std::vector<std::shared_ptr<BaseAsset>>& added,
+      std::vector<std::shared_ptr<BaseAsset>>& deleted);
+
+  // update does the same as update, above, in 'lib'. A dirty tile with the
+  // same step is regenerated in place with Library::update(). A tile that is
+  // not READY yet stays dirty until the next update(). Call this before
+  // Library::write().
+  WARN_UNUSED_RESULT int update(glm::vec3 eye, Library& lib);
+
+  // stepAt returns the step tile t should have at 'eye'.
+  size_t stepAt(size_t t, glm::vec3 eye) const;
+
+ protected:
+  std::shared_ptr<HeightMapTile> makeTile(size_t t, size_t step) const;
+  std::vector<char> dirty_;
+  size_t height_{0};
+} HeightMapTiles;
+
+}  // namespace asset
@@ -79,6 +79,15 @@ int UniformGlue::updateVertexIndexBuffer(const void* vertices,
   indexBuffer.info.size = sizeof(indices[0]) * indices.size();
   indexBuffer.info.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
 
+  if (useDirectWrite()) {
+    if (writeDirect(vertexBuffer, vertices, verticesSize) ||
+        writeDirect(indexBuffer, indices.data(), indexBuffer.info.size)) {
+      logE("UniformGlue::updateVertexBuffer: writeDirect failed\n");
+      return 1;
+    }
+    return 0;
+  }
+
   std::shared_ptr<memory::Flight> flight;
   if (vertexBuffer.ctorAndBindDeviceLocal() ||
       indexBuffer.ctorAndBindDeviceLocal() ||
@@ -95,14 +104,181 @@ int UniformGlue::updateVertexIndexBuffer(const void* vertices,
   return 0;
 }
 
+bool UniformGlue::useDirectWrite() {
+  if (directWrite != DIRECT_AUTO) {
+    return directWrite == DIRECT_ALWAYS;
+  }
+  VkPhysicalDeviceMemoryProperties props;
+  vkGetPhysicalDeviceMemoryProperties(app.cpool.vk.dev.phys, &props);
+  VkDeviceSize biggest = 0;
+  for (uint32_t i = 0; i < props.memoryHeapCount; i++) {
+    if (props.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+      biggest = std::max(biggest, props.memoryHeaps[i].size);
+    }
+  }
+  const VkMemoryPropertyFlags want =
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+  for (uint32_t i = 0; i < props.memoryTypeCount; i++) {
+    auto& t = props.memoryTypes[i];
+    if ((t.propertyFlags & want) == want &&
+        props.memoryHeaps[t.heapIndex].size >= biggest) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int UniformGlue::writeDirect(memory::Buffer& buf, const void* src,
+                             size_t size) {
+  if (buf.ctorError(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ||
+      buf.bindMemory()) {
+    logE("UniformGlue::writeDirect: ctorError or bindMemory failed\n");
+    return 1;
+  }
+  void* dst;
+#ifdef VOLCANO_DISABLE_VULKANMEMORYALLOCATOR
+  if (buf.mem.mmap(&dst, 0, size)) {
+#else  /*VOLCANO_DISABLE_VULKANMEMORYALLOCATOR*/
+  if (buf.mem.mmap(&dst)) {
+#endif /*VOLCANO_DISABLE_VULKANMEMORYALLOCATOR*/
+    logE("UniformGlue::writeDirect: mmap failed\n");
+    return 1;
+  }
+  memcpy(dst, src, size);
+  // The memory may not be HOST_COHERENT, so flush it.
+#ifdef VOLCANO_DISABLE_VULKANMEMORYALLOCATOR
+  VkMappedMemoryRange VkInit(range);
+  range.offset = 0;
+  range.size = VK_WHOLE_SIZE;
+  int r = buf.mem.flush(std::vector<VkMappedMemoryRange>{range});
+#else  /*VOLCANO_DISABLE_VULKANMEMORYALLOCATOR*/
+  int r = buf.mem.flush();
+#endif /*VOLCANO_DISABLE_VULKANMEMORYALLOCATOR*/
+  buf.mem.munmap();
+  if (r) {
+    logE("UniformGlue::writeDirect: flush failed\n");
+    return 1;
+  }
+  return 0;
+}
+
 void UniformGlue::abortFrame() {
   nextImage = (uint32_t)-1;
   stillHaveAcquiredImage = true;
 }
 
+int UniformGlue::initFramesInFlight() {
+  if (!framesInFlight) {
+    logW("UniformGlue: framesInFlight = 0 is not valid, using 1\n");
+    framesInFlight = 1;
+  }
+  if (inFlight.size() == framesInFlight ||
+      // Do not destroy the semaphore an acquired image is still waiting on.
+      (stillHaveAcquiredImage && !inFlight.empty())) {
+    return 0;
+  }
+  if (waitAllFrames()) {
+    logE("initFramesInFlight: waitAllFrames failed\n");
+    return 1;
+  }
+  auto& dev = app.cpool.vk.dev;
+  inFlight.resize(framesInFlight);
+  for (size_t i = 0; i < inFlight.size(); i++) {
+    auto& frame = inFlight.at(i);
+    if (frame.imageAvailable) {
+      continue;
+    }
+    if (i == 0) {
+      // Frame 0 uses the objects your app may have already set up.
+      frame.imageAvailable = &imageAvailableSemaphore;
+      frame.render = &renderSemaphore;
+      frame.done = &renderDoneFence;
+      continue;
+    }
+    frame.ownImageAvailable = std::make_shared<command::Semaphore>(dev);
+    frame.ownRender = std::make_shared<command::Semaphore>(dev);
+    frame.ownDone = std::make_shared<command::Fence>(dev);
+    char name[3][256];
+    snprintf(name[0], sizeof(name[0]), "uglue.inFlight[%zu].imageAvailable", i);
+    snprintf(name[1], sizeof(name[1]), "uglue.inFlight[%zu].render", i);
+    snprintf(name[2], sizeof(name[2]), "uglue.inFlight[%zu].done", i);
+    if (frame.ownImageAvailable->ctorError() || frame.ownRender->ctorError() ||
+        frame.ownDone->ctorError() ||
+        frame.ownImageAvailable->setName(name[0]) ||
+        frame.ownRender->setName(name[1]) || frame.ownDone->setName(name[2])) {
+      logE("initFramesInFlight[%zu]: semaphore or fence failed\n", i);
+      return 1;
+    }
+    frame.imageAvailable = &*frame.ownImageAvailable;
+    frame.render = &*frame.ownRender;
+    frame.done = &*frame.ownDone;
+  }
+  curFrame = 0;
+  imageFrame.clear();
+
+  // Each frame in flight holds a Flight from stage, and asset::Library may
+  // hold two more.
+  while (stage.sources.size() < framesInFlight + 2) {
+    stage.sources.emplace_back(app.cpool);
+  }
+  return 0;
+}
+
+int UniformGlue::waitFrame(size_t i) {
+  auto& frame = inFlight.at(i);
+  if (!frame.pending) {
+    return 0;
+  }
+  float t0 = Timer::now();
+  for (uint32_t count = 0;;) {
+    VkResult v = frame.done->waitMs(100);
+    if (v == VK_SUCCESS) {
+      break;
+    }
+    if (v == VK_TIMEOUT && count < 10) {
+      // Warn but continue to wait
+      count++;
+      logW("%s[%zu] after %ums still waiting\n", "renderDoneFence", i,
+           count * 100);
+      continue;
+    }
+    logE("%s[%zu] failed: %d (%s)\n", "renderDoneFence", i, v,
+         string_VkResult(v));
+    return 1;
+  }
+  if (frame.done->reset()) {
+    logE("waitFrame[%zu]: renderDoneFence.reset failed\n", i);
+    return 1;
+  }
+  frame.pending = false;
+  frame.flight.reset();
+  waitTime += Timer::now() - t0;
+  return 0;
+}
+
+int UniformGlue::waitAllFrames() {
+  for (size_t i = 0; i < inFlight.size(); i++) {
+    if (waitFrame(i)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 int UniformGlue::acquire() {
   auto& dev = app.cpool.vk.dev;
+  waitTime = 0.f;
+  if (initFramesInFlight()) {
+    logE("UniformGlue::acquire: initFramesInFlight failed\n");
+    return 1;
+  }
   if (needRebuild) {
+    // Command buffers cannot be rebuilt while the GPU is still using them.
+    if (waitAllFrames()) {
+      logE("UniformGlue::acquire: waitAllFrames failed\n");
+      return 1;
+    }
     if (app.onResized(dev.swapChainInfo.imageExtent,
                       memory::ASSUME_POOL_QINDEX)) {
       logE("UniformGlue::acquire: onResized failed\n");
@@ -121,13 +297,22 @@ int UniformGlue::acquire() {
     nextImage = lastAcquiredImage;
     return 0;
   }
+  // The oldest frame in flight must be done before its semaphores are reused.
+  if (waitFrame(curFrame)) {
+    logE("UniformGlue::acquire: waitFrame(%zu) failed\n", curFrame);
+    return 1;
+  }
   dev.setFrameNumber(frameNumber);
   nextImage = 0;
   VkResult result = vkAcquireNextImageKHR(
       dev.dev, dev.swapChain, std::numeric_limits<uint64_t>::max(),
-      imageAvailableSemaphore.vk, VK_NULL_HANDLE, &nextImage);
+      inFlight.at(curFrame).imageAvailable->vk, VK_NULL_HANDLE, &nextImage);
   if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
     if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+      if (waitAllFrames()) {
+        logE("vkAcquireNextImageKHR: OUT_OF_DATE, waitAllFrames failed\n");
+        return 1;
+      }
       if (
 #ifdef __ANDROID__ /* surface being destroyed may return OUT_OF_DATE */
           dev.getSurface() &&
@@ -149,6 +334,16 @@ int UniformGlue::acquire() {
     return 1;
   }
   lastAcquiredImage = nextImage;
+
+  // cmdBuffers, uniform and the ImGui buffers are per-framebuf. If an older
+  // frame still in flight rendered to nextImage, it must finish first.
+  if (imageFrame.size() < dev.framebufs.size()) {
+    imageFrame.resize(dev.framebufs.size(), curFrame);
+  }
+  if (nextImage < imageFrame.size() && waitFrame(imageFrame.at(nextImage))) {
+    logE("UniformGlue::acquire: waitFrame(image %u) failed\n", nextImage);
+    return 1;
+  }
   return 0;
 }
 
@@ -193,9 +388,10 @@ int UniformGlue::submit(std::shared_ptr<memory::Flight>& flight,
     stillHaveAcquiredImage = false;
     lastAcquiredImage = (uint32_t)-1;
   }
-  sub.waitFor.emplace_back(imageAvailableSemaphore,
+  auto& frame = inFlight.at(curFrame);
+  sub.waitFor.emplace_back(*frame.imageAvailable,
                            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
-  sub.toSignal.emplace_back(renderSemaphore.vk);
+  sub.toSignal.emplace_back(frame.render->vk);
 
   {
     command::CommandPool::lock_guard_t lock(app.cpool.lockmutex);
@@ -208,17 +404,24 @@ int UniformGlue::submit(std::shared_ptr<memory::Flight>& flight,
       return 1;
     }
     if (cmdBuffers.at(nextImage).enqueue(lock, sub) ||
-        app.cpool.submit(lock, stage.poolQindex, {sub}, renderDoneFence.vk)) {
+        app.cpool.submit(lock, stage.poolQindex, {sub}, frame.done->vk)) {
       logE("UniformGlue::submit: app.cpool.submit failed\n");
       return 1;
     }
   }
+  // The GPU may read from flight until frame.done signals.
+  frame.pending = true;
+  frame.flight = flight;
+  flight.reset();
+  if (nextImage < imageFrame.size()) {
+    imageFrame.at(nextImage) = curFrame;
+  }
 
   if (app.cpool.vk.dev.framebufs.at(nextImage).dirty) {
     logW("framebuf[%u] dirty and has not been rebuilt before present\n",
          nextImage);
   }
-  VkSemaphore semaphores[] = {renderSemaphore.vk};
+  VkSemaphore semaphores[] = {frame.render->vk};
   VkSwapchainKHR swapChains[] = {app.cpool.vk.dev.swapChain};
 
   VkPresentInfoKHR presentInfo;
@@ -232,8 +435,10 @@ int UniformGlue::submit(std::shared_ptr<memory::Flight>& flight,
 
   VkResult result = vkQueuePresentKHR(presentQueue, &presentInfo);
   if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+    // frame was submitted even if present failed: frame.done will signal.
     if (result == VK_ERROR_OUT_OF_DATE_KHR) {
-      if (app.onResized(app.cpool.vk.dev.swapChainInfo.imageExtent,
+      if (waitAllFrames() ||
+          app.onResized(app.cpool.vk.dev.swapChainInfo.imageExtent,
                         memory::ASSUME_POOL_QINDEX)) {
         logE("present: OUT_OF_DATE, but onResized failed\n");
         return 1;
@@ -245,40 +450,33 @@ int UniformGlue::submit(std::shared_ptr<memory::Flight>& flight,
            string_VkResult(result));
       return 1;
     }
-    if (renderDoneFence.reset()) {
-      logE("present incomplete, renderDoneFence.reset failed\n");
-      return 1;
-    }
     return 0;
   }
-  // vkQueueWaitIdle() cleans up resource leaks from validation layers.
-  if ((frameNumber % 64) == 63) {
-    result = vkQueueWaitIdle(presentQueue);
-    if (result != VK_SUCCESS) {
-      logE("%s failed: %d (%s)\n", "vkQueueWaitIdle", result,
-           string_VkResult(result));
-      return 1;
-    }
+
+  float now = Timer::now();
+  if (lastSubmitTime > 0.f) {
+    frameTime = now - lastSubmitTime;
+    frameTimeAvg += (frameTime - frameTimeAvg) * (1.f / 32.f);
   }
-  for (uint32_t count = 0;;) {
-    VkResult v = renderDoneFence.waitMs(100);
-    if (v == VK_SUCCESS) {
-      break;
+  lastSubmitTime = now;
+
+  if (inFlight.size() < 2) {
+    // vkQueueWaitIdle() cleans up resource leaks from validation layers.
+    // This is skipped if framesInFlight > 1 because it drains the queue.
+    if ((frameNumber % 64) == 63) {
+      result = vkQueueWaitIdle(presentQueue);
+      if (result != VK_SUCCESS) {
+        logE("%s failed: %d (%s)\n", "vkQueueWaitIdle", result,
+             string_VkResult(result));
+        return 1;
+      }
     }
-    if (v == VK_TIMEOUT && count < 10) {
-      // Warn but continue to wait
-      count++;
-      logW("%s after %ums still waiting\n", "renderDoneFence", count * 100);
-      continue;
+    if (waitFrame(curFrame)) {
+      logE("UniformGlue::submit: waitFrame failed\n");
+      return 1;
     }
-    logE("%s failed: %d (%s)\n", "renderDoneFence", v, string_VkResult(v));
-    return 1;
   }
-  if (renderDoneFence.reset()) {
-    logE("UniformGlue::submit: renderDoneFence.reset failed\n");
-    return 1;
-  }
-  flight.reset();
+  curFrame = (curFrame + 1) % inFlight.size();
   frameNumber++;
   return 0;
 }
@@ -98,11 +98,50 @@ class UniformGlue {
   memory::Buffer vertexBuffer{app.cpool.vk.dev};
   memory::Buffer indexBuffer{app.cpool.vk.dev};
   std::vector<uint32_t> indices;
+  // directWrite chooses how vertexBuffer, indexBuffer and the pages of an
+  // asset::Library are written:
+  // * DIRECT_AUTO: write directly if useDirectWrite() finds the memory for
+  //   it, otherwise copy through stage.
+  // * DIRECT_NEVER: always copy through stage.
+  // * DIRECT_ALWAYS: always write directly. Allocating the buffers fails if
+  //   the device does not have the memory for it. Use this to test the
+  //   direct path, such as on lavapipe where all memory is host-visible.
+  // Writing directly means the buffers are allocated in memory that is both
+  // DEVICE_LOCAL and HOST_VISIBLE, mapped, and written with memcpy. No copy
+  // commands are needed. Most mobile and integrated GPUs work best this way.
+  enum DirectWrite {
+    DIRECT_AUTO = 0,
+    DIRECT_NEVER,
+    DIRECT_ALWAYS,
+  };
+  DirectWrite directWrite{DIRECT_AUTO};
+  // useDirectWrite returns true if buffers should be written directly. For
+  // DIRECT_AUTO it looks for a memory type that is DEVICE_LOCAL and
+  // HOST_VISIBLE in a heap at least as big as the largest DEVICE_LOCAL heap.
+  // (Discrete GPUs often have a small host-visible window into device-local
+  // memory. That is not used.)
+  bool useDirectWrite();
   command::Semaphore imageAvailableSemaphore{app.cpool.vk.dev};
   command::Semaphore renderSemaphore{app.cpool.vk.dev};
   VkQueue presentQueue{VK_NULL_HANDLE};
   command::Fence renderDoneFence{app.cpool.vk.dev};
   std::vector<science::SmartCommandBuffer> cmdBuffers;
+  // framesInFlight is how many frames the CPU can submit before it must wait
+  // for the GPU. The default of 1 waits on renderDoneFence after each present,
+  // so the CPU and GPU never overlap. Set it to 2 or 3 to let
+  // redrawListeners record frame N+1 while the GPU is still rendering frame N.
+  // It can be changed between frames; acquire() waits for the GPU to go idle
+  // and then switches.
+  //
+  // Frame 0 uses imageAvailableSemaphore, renderSemaphore and renderDoneFence.
+  // The other frames get their own semaphores and fence. cmdBuffers, uniform
+  // and descriptorSet are already one per framebuf: a framebuf is not reused
+  // until the frame that last rendered to it is done.
+  //
+  // NOTE: Any buffer your app writes directly through an mmap (not through
+  // the memory::Flight passed to redrawListeners) may still be in use by the
+  // GPU when framesInFlight > 1.
+  size_t framesInFlight{1};
   // frameNumber is incremented each time submit() successfully returns.
   // frameNumber is passed to app.acquireNextImage() for vulkanmemoryallocator.
   // FIXME: ImGui also provides a GetFrameCount() method which does this too.
@@ -122,6 +161,14 @@ class UniformGlue {
   // elapsed can be used to measure time since the app started.
   Timer elapsed;
 
+  // frameTime is the time in seconds between the last two calls to submit().
+  // frameTimeAvg is a moving average of frameTime. waitTime is how long the
+  // last frame spent blocked waiting for the GPU. If waitTime is most of
+  // frameTime, the app is GPU bound.
+  float frameTime{0.f};
+  float frameTimeAvg{0.f};
+  float waitTime{0.f};
+
   // window is the GLFWwindow object. Hopefully your app no longer cares about
   // the window object once it has a UniformGlue object to handle things.
   GLFWwindow* window;
@@ -187,6 +234,9 @@ class UniformGlue {
   // flight.reset() or no flight was created), it is not an error - this still
   // does vkQueueSubmit and renderSemaphore.present.
   //
+  // If framesInFlight > 1, submit does not wait for the GPU. The flight is
+  // held until the frame is done and flight.reset() is still called.
+  //
   // If isAborted() is true coming in, submit cleans up flight without
   // submitting anything.
   //
@@ -276,8 +326,13 @@ class UniformGlue {
 
   // updateVertexIndexBuffer will update both vertexBuffer and indexBuffer,
   // destroying and re-allocating them to fit vertices and this->indices.
+  // If useDirectWrite() it writes them directly instead of using stage.
   int updateVertexIndexBuffer(const void* vertices, size_t verticesSize);
 
+  // writeDirect allocates buf in memory that is DEVICE_LOCAL and
+  // HOST_VISIBLE, then copies 'size' bytes from src into it.
+  int writeDirect(memory::Buffer& buf, const void* src, size_t size);
+
   int internalImguiInit();
 
   // checkImGuiBufSize is called by acquire.
@@ -303,6 +358,37 @@ class UniformGlue {
   // the main loop.
   int acquire();
 
+  // FrameInFlight has the objects that cannot be reused until the GPU is done
+  // with a frame.
+  typedef struct FrameInFlight {
+    command::Semaphore* imageAvailable{nullptr};
+    command::Semaphore* render{nullptr};
+    command::Fence* done{nullptr};
+    // own* hold the objects for all frames except frame 0.
+    std::shared_ptr<command::Semaphore> ownImageAvailable;
+    std::shared_ptr<command::Semaphore> ownRender;
+    std::shared_ptr<command::Fence> ownDone;
+    // flight is held until done signals, since the GPU reads from the stage.
+    std::shared_ptr<memory::Flight> flight;
+    // pending is true after submit() until waitFrame() sees done signal.
+    bool pending{false};
+  } FrameInFlight;
+  std::vector<FrameInFlight> inFlight;
+  // curFrame is the index in inFlight for the frame being recorded.
+  size_t curFrame{0};
+  // imageFrame is the index in inFlight that last rendered to each framebuf.
+  std::vector<size_t> imageFrame;
+  float lastSubmitTime{0.f};
+
+  // initFramesInFlight resizes inFlight if framesInFlight has changed.
+  int initFramesInFlight();
+
+  // waitFrame waits for inFlight.at(i) to be done on the GPU.
+  int waitFrame(size_t i);
+
+  // waitAllFrames waits for all of inFlight to be done on the GPU.
+  int waitAllFrames();
+
   uint32_t nextImage{(uint32_t)-1};
   uint32_t fastButtons{0};
   uint32_t curFrameButtons{0};